@@ -232,7 +232,7 @@ static int __init pcidriver_init(void)
 	mod_info("Major %d allocated to nodename '%s'\n", MAJOR(pcidriver_devt), NODENAME);
 
 	/* Register driver class */
-	pcidriver_class = class_create(THIS_MODULE, NODENAME);
+	pcidriver_class = compat_class_create(THIS_MODULE, NODENAME);
 
 	if (IS_ERR(pcidriver_class)) {
 		mod_info("No sysfs support. Module not loaded.\n");
@@ -341,9 +341,9 @@ static int pcidriver_probe(struct pci_dev *pdev, const struct pci_device_id *id)
     /* Set bus master */
     pci_set_master(pdev);
 
-    err = pci_set_consistent_dma_mask(pdev, DMA_BIT_MASK(64));
+    err = dma_set_coherent_mask(&pdev->dev, DMA_BIT_MASK(64));
     if (err) {
-        err = pci_set_consistent_dma_mask(pdev, DMA_BIT_MASK(32));
+        err = dma_set_coherent_mask(&pdev->dev, DMA_BIT_MASK(32));
     }
     if (err) {
         dev_err(&pdev->dev, "No suitable DMA available");
@@ -405,6 +405,7 @@ static int pcidriver_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 	sysfs_attr(kmem_alloc);
 	sysfs_attr(kmem_free);
 	sysfs_attr(kbuffers);
+	sysfs_attr(kmem_max_contig);
 	sysfs_attr(umappings);
 	sysfs_attr(umem_unmap);
 	#undef sysfs_attr
@@ -463,6 +464,7 @@ static void pcidriver_remove(struct pci_dev *pdev)
 	sysfs_attr(kmem_alloc);
 	sysfs_attr(kmem_free);
 	sysfs_attr(kbuffers);
+	sysfs_attr(kmem_max_contig);
 	sysfs_attr(umappings);
 	sysfs_attr(umem_unmap);
 	#undef sysfs_attr
@@ -520,27 +522,34 @@ static struct file_operations pcidriver_fops = {
  */
 int pcidriver_open(struct inode *inode, struct file *filp)
 {
-	pcidriver_privdata_t *privdata;
+	pcidriver_file_t *file;
+
+	/* The device, and what the next mmap of this file maps */
+	if ((file = kmalloc(sizeof(*file), GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+
+	file->privdata = container_of( inode->i_cdev, pcidriver_privdata_t, cdev);
+	file->kmem_mmap_id = -1;
+	file->mmap_cache = PCIDRIVER_CACHE_DEFAULT;
 
 	/* Set the private data area for the file */
-	privdata = container_of( inode->i_cdev, pcidriver_privdata_t, cdev);
-	filp->private_data = privdata;
+	filp->private_data = file;
 
 	return 0;
 }
 
 /**
  *
- * Called when the application close()s the file descriptor. Does nothing at
- * the moment.
+ * Called when the application close()s the file descriptor. Frees the kernel
+ * memory the file still owns; persistent buffers stay for the next attach.
  *
  */
 int pcidriver_release(struct inode *inode, struct file *filp)
 {
-	pcidriver_privdata_t *privdata;
+	pcidriver_file_t *file = filp->private_data;
 
-	/* Get the private data area */
-	privdata = filp->private_data;
+	pcidriver_kmem_release_file(file->privdata, filp);
+	kfree(file);
 
 	return 0;
 }
@@ -556,13 +565,14 @@ int pcidriver_release(struct inode *inode, struct file *filp)
  */
 int pcidriver_mmap(struct file *filp, struct vm_area_struct *vma)
 {
+	pcidriver_file_t *file = filp->private_data;
 	pcidriver_privdata_t *privdata;
 	int ret = 0, bar;
 
 	mod_info_dbg("Entering mmap\n");
 
 	/* Get the private data area */
-	privdata = filp->private_data;
+	privdata = file->privdata;
 
 	/* Check the current mmap mode */
 	switch (privdata->mmap_mode) {
@@ -580,11 +590,14 @@ int pcidriver_mmap(struct file *filp, struct vm_area_struct *vma)
 					return -EINVAL;			/* invalid parameter */
 					break;
 			}
-			ret = pcidriver_mmap_pci(privdata, vma, bar);
+			ret = pcidriver_mmap_pci(privdata, vma, bar, file->mmap_cache);
+
+			/* The caching mode only applies to the mmap it was set for */
+			file->mmap_cache = PCIDRIVER_CACHE_DEFAULT;
 			break;
 		case PCIDRIVER_MMAP_KMEM:
 			/* mmap a Kernel buffer */
-			ret = pcidriver_mmap_kmem(privdata, vma);
+			ret = pcidriver_mmap_kmem(privdata, filp, vma);
 			break;
 		default:
 			mod_info( "Invalid mmap_mode value (%d)\n",privdata->mmap_mode );
@@ -596,7 +609,43 @@ int pcidriver_mmap(struct file *filp, struct vm_area_struct *vma)
 
 /*************************************************************************/
 /* Internal driver functions */
-int pcidriver_mmap_pci(pcidriver_privdata_t *privdata, struct vm_area_struct *vmap, int bar)
+
+/**
+ *
+ * Gets the caching mode a BAR mapping really gets for a requested mode.
+ * Only prefetchable memory BARs may combine or cache writes, everything
+ * else falls back to uncached.
+ *
+ */
+int pcidriver_mmap_cache(pcidriver_privdata_t *privdata, int bar, int mode)
+{
+	unsigned long bar_flags = pci_resource_flags(privdata->pdev, bar);
+
+	if (mode == PCIDRIVER_CACHE_DEFAULT)
+		return PCIDRIVER_CACHE_DEFAULT;
+
+	if ((bar_flags & IORESOURCE_IO) || !(bar_flags & IORESOURCE_PREFETCH))
+		return PCIDRIVER_CACHE_UC;
+
+	switch (mode) {
+		case PCIDRIVER_CACHE_WC:
+#ifdef pgprot_writecombine
+			return PCIDRIVER_CACHE_WC;
+#else
+			return PCIDRIVER_CACHE_UC;
+#endif
+		case PCIDRIVER_CACHE_WT:
+#ifdef pgprot_writethrough
+			return PCIDRIVER_CACHE_WT;
+#else
+			return PCIDRIVER_CACHE_UC;
+#endif
+		default:
+			return PCIDRIVER_CACHE_UC;
+	}
+}
+
+int pcidriver_mmap_pci(pcidriver_privdata_t *privdata, struct vm_area_struct *vmap, int bar, int cache)
 {
 	int ret = 0;
 	unsigned long bar_addr;
@@ -649,6 +698,27 @@ int pcidriver_mmap_pci(pcidriver_privdata_t *privdata, struct vm_area_struct *vm
 //			vmap->vm_page_prot = pgprot_noncached(vmap->vm_page_prot);
 #endif
 
+		/* Unless the user asked for a mode with PCIDRIVER_IOC_MMAP_CACHE */
+		switch (pcidriver_mmap_cache(privdata, bar, cache)) {
+			case PCIDRIVER_CACHE_UC:
+#ifdef pgprot_noncached
+				vmap->vm_page_prot = pgprot_noncached(vmap->vm_page_prot);
+#endif
+				break;
+#ifdef pgprot_writecombine
+			case PCIDRIVER_CACHE_WC:
+				vmap->vm_page_prot = pgprot_writecombine(vmap->vm_page_prot);
+				break;
+#endif
+#ifdef pgprot_writethrough
+			case PCIDRIVER_CACHE_WT:
+				vmap->vm_page_prot = pgprot_writethrough(vmap->vm_page_prot);
+				break;
+#endif
+			default:
+				break;
+		}
+
 		/* Map the BAR */
 		ret = remap_pfn_range(
 					vmap,
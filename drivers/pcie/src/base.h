@@ -50,8 +50,8 @@ int pcidriver_pci_read( pcidriver_privdata_t *privdata, pci_cfg_cmd *pci_cmd );
 int pcidriver_pci_write( pcidriver_privdata_t *privdata, pci_cfg_cmd *pci_cmd );
 int pcidriver_pci_info( pcidriver_privdata_t *privdata, pci_board_info *pci_info );
 
-int pcidriver_mmap_pci( pcidriver_privdata_t *privdata, struct vm_area_struct *vmap , int bar );
-int pcidriver_mmap_kmem( pcidriver_privdata_t *privdata, struct vm_area_struct *vmap );
+int pcidriver_mmap_pci( pcidriver_privdata_t *privdata, struct vm_area_struct *vmap , int bar, int cache );
+int pcidriver_mmap_kmem( pcidriver_privdata_t *privdata, struct file *filp, struct vm_area_struct *vmap );
 
 /*************************************************************************/
 /* Static data */
@@ -66,6 +66,7 @@ static DEVICE_ATTR(mmap_mode, (S_IRUGO | S_IWUSR | S_IWGRP), pcidriver_show_mmap
 static DEVICE_ATTR(mmap_area, (S_IRUGO | S_IWUSR | S_IWGRP), pcidriver_show_mmap_area, pcidriver_store_mmap_area);
 static DEVICE_ATTR(kmem_count, S_IRUGO, pcidriver_show_kmem_count, NULL);
 static DEVICE_ATTR(kbuffers, S_IRUGO, pcidriver_show_kbuffers, NULL);
+static DEVICE_ATTR(kmem_max_contig, S_IRUSR, pcidriver_show_kmem_max_contig, NULL);	/* the probe drains CMA */
 static DEVICE_ATTR(kmem_alloc, S_IWUSR | S_IWGRP, NULL, pcidriver_store_kmem_alloc);
 static DEVICE_ATTR(kmem_free, S_IWUSR | S_IWGRP, NULL, pcidriver_store_kmem_free);
 static DEVICE_ATTR(umappings, S_IRUGO, pcidriver_show_umappings, NULL);
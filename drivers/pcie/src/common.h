@@ -12,14 +12,32 @@ typedef struct {
 	dma_addr_t dma_handle;
 	unsigned long cpua;
 	unsigned long size;
+	struct file *owner;					/* file that allocated or attached it, NULL if none */
+	unsigned int flags;					/* PCIDRIVER_KMEM_FLAG_* */
+	char name[PCIDRIVER_KMEM_NAME_MAX];	/* empty if unnamed */
+	__u64 key;							/* to import it by, 0 until exported */
+	kuid_t uid;							/* allocating user */
+	unsigned int export_flags;			/* PCIDRIVER_KMEM_EXPORT_* */
+	struct list_head imports;			/* pcidriver_kmem_import_t of the importing files */
+	int orphan;							/* freed by its owner, waits for the importers */
+	int node;							/* NUMA node of the memory */
+	int pages;							/* streaming mapping of alloc_pages_node() memory, not coherent */
+	int refs;							/* user mappings and ioctls using it, the memory stays until they are gone */
 	struct device_attribute sysfs_attr;	/* initialized when adding the entry */
 } pcidriver_kmem_entry_t;
 
+/* One import of a kmem entry by an open file */
+typedef struct {
+	struct list_head list;
+	struct file *filp;
+} pcidriver_kmem_import_t;
+
 /* Define an entry in the umem list (this list is per device) */
 /* This list keeps references to the SG lists for each mapped userspace region */
 typedef struct {
 	int id;
 	struct list_head list;
+	unsigned long vma;			/* user address the area was mapped at */
 	unsigned int nr_pages;		/* number of pages for this user memeory area */
 	struct page **pages;		/* list of pointers to the pages */
 	unsigned int nents;			/* actual entries in the scatter/gatter list (NOT nents for the map function, but the result) */
@@ -39,6 +57,7 @@ typedef struct  {
 #ifdef ENABLE_IRQ
 	int irq_enabled;					/* Non-zero if IRQ is enabled */
 	int irq_count;						/* Just an IRQ counter */
+	spinlock_t irq_lock;				/* Serializes the interrupt enable register */
 
 	wait_queue_head_t irq_queues[ PCIDRIVER_INT_MAXSOURCES ];
 										/* One queue per interrupt source */
@@ -59,6 +78,16 @@ typedef struct  {
 
 } pcidriver_privdata_t;
 
+/* Per open file data, filp->private_data */
+typedef struct {
+	pcidriver_privdata_t *privdata;		/* device the file was opened for */
+	int kmem_mmap_id;					/* kmem entry the next kmem mmap maps, -1: the latest of the file */
+	int mmap_cache;						/* caching of the next PCI mmap, PCIDRIVER_CACHE_* */
+} pcidriver_file_t;
+
+/* Caching mode a PCI mmap of the given BAR gets, implemented in base.c */
+int pcidriver_mmap_cache(pcidriver_privdata_t *privdata, int bar, int mode);
+
 #define PCIE_XILINX_VENDOR_ID 0x10ee
 
 /* Identifies the PCI-E Xilinx ML605 */
@@ -23,6 +23,10 @@ static inline const char *dev_name(struct device *dev) {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,27)
 	#define compat_lock_page SetPageLocked
 	#define compat_unlock_page ClearPageLocked
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0)
+	/* and in v4.5 they were renamed to __SetPageLocked and __ClearPageLocked */
+	#define compat_lock_page __SetPageLocked
+	#define compat_unlock_page __ClearPageLocked
 #else
 	/* in v2.6.28, __set_page_locked and __clear_page_locked was introduced */
 	#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
@@ -53,6 +57,67 @@ static inline const char *dev_name(struct device *dev) {
 		device_create(type, parent, devno, nameformat, minor)
 #endif
 
+/* class_create lost its module argument in v6.4 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,4,0)
+	#define compat_class_create(owner, name) class_create(name)
+#else
+	#define compat_class_create(owner, name) class_create(owner, name)
+#endif
+
+/* ioremap is uncached, ioremap_nocache went away in v5.6 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+	#define ioremap_nocache ioremap
+#endif
+
+/* get_user_pages works on current->mm since v4.6, takes FOLL_* flags since
+ * v4.9 and no longer returns the vmas since v6.5 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+	#define compat_get_user_pages(start, nr_pages, write, pages) \
+		get_user_pages(start, nr_pages, (write) ? FOLL_WRITE : 0, pages)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,9,0)
+	#define compat_get_user_pages(start, nr_pages, write, pages) \
+		get_user_pages(start, nr_pages, (write) ? FOLL_WRITE : 0, pages, NULL)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0)
+	#define compat_get_user_pages(start, nr_pages, write, pages) \
+		get_user_pages(start, nr_pages, write, 0, pages, NULL)
+#else
+	#define compat_get_user_pages(start, nr_pages, write, pages) \
+		get_user_pages(current, current->mm, start, nr_pages, write, 0, pages, NULL)
+#endif
+
+/* mmap_sem was wrapped into the mmap_lock API in v5.8 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
+	#define mmap_read_lock(mm) down_read(&(mm)->mmap_sem)
+	#define mmap_read_unlock(mm) up_read(&(mm)->mmap_sem)
+#endif
+
+/* vm_flags may only be changed through helpers since v6.3 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+	#define vm_flags_set(vma, flags) ((vma)->vm_flags |= (flags))
+#endif
+
+/* User ids got their own type in v3.5 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,5,0)
+	typedef uid_t kuid_t;
+	#define uid_eq(left, right) ((left) == (right))
+#else
+	#include <linux/uidgid.h>
+#endif
+
+/* PMD sized entries in PFN mappings that are not DAX can be inserted from a
+ * huge_fault handler, and torn down again, since v5.8. vmf_insert_pfn_pmd
+ * takes a pfn_t up to v6.16, later kernels map with remap_pfn_range. */
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && (LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)) && \
+		(LINUX_VERSION_CODE < KERNEL_VERSION(6,17,0))
+	#define PCIDRIVER_KMEM_HUGE_MAP
+#endif
+
+/* huge_fault gets the order of the entry instead of enum page_entry_size
+ * since v6.6 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,6,0)
+	#define PCIDRIVER_HUGE_FAULT_ORDER
+#endif
+
 	#define sysfs_attr_def_name(name) dev_attr_##name
 	#define SYSFS_GET_FUNCTION(name) ssize_t name(struct device *dev, struct device_attribute *attr, char *buf)
 	#define SYSFS_SET_FUNCTION(name) ssize_t name(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
@@ -138,6 +138,8 @@ int pcidriver_probe_irq(pcidriver_privdata_t *privdata)
 	}
 
 	/* Initialize the interrupt handler for this device */
+	spin_lock_init(&(privdata->irq_lock));
+
 	/* Initialize the wait queues */
 	for (i = 0; i < PCIDRIVER_INT_MAXSOURCES; i++) {
 		init_waitqueue_head(&(privdata->irq_queues[i]));
@@ -216,10 +218,12 @@ void pcidriver_irq_unmap_bars(pcidriver_privdata_t *privdata)
 static bool check_acknowlegde_channel(pcidriver_privdata_t *privdata, int interrupt,
 				      int channel, volatile unsigned int *bar)
 {
-	if (!(bar[ABB_INT_STAT] & interrupt))
+	/* Only sources enabled by the engine are ours, the line may be shared */
+	if (!(bar[ABB_INT_STAT] & bar[ABB_INT_ENABLE] & interrupt))
 		return false;
 
-	bar[ABB_INT_ENABLE] &= !interrupt;
+	/* pcidriver_irq_arm enables the source again for the next transfer */
+	bar[ABB_INT_ENABLE] &= ~interrupt;
 	if (interrupt == ABB_INT_IG)
 		bar[ABB_IG_CTRL] = ABB_IG_ACK;
 
@@ -241,22 +245,14 @@ static bool check_acknowlegde_channel(pcidriver_privdata_t *privdata, int interr
  */
 static bool pcidriver_irq_acknowledge(pcidriver_privdata_t *privdata)
 {
-  /* Disable this thing, as it is irrelevant in our case
 	volatile unsigned int *bar;
-  */
-	/* TODO: add subvendor / subsystem ids */
-	/* FIXME: guillermo: which ones? all? */
 
-	/* Test if we have to handle this interrupt */
-  /*	if ((privdata->pdev->vendor != PCIEABB_VENDOR_ID) ||
-	    (privdata->pdev->device != PCIEABB_DEVICE_ID))
-		return false;
-  */
 	/* Acknowledge the device */
 	/* this is for ABB / wenxue DMA engine */
-  /*
 	bar = privdata->bars_kmapped[0];
-	
+	if (bar == NULL)
+		return false;
+
 	mod_info_dbg("interrupt registers. ISR: %x, IER: %x\n", bar[ABB_INT_STAT], bar[ABB_INT_ENABLE]);
 
 	if (check_acknowlegde_channel(privdata, ABB_INT_CH0, ABB_IRQ_CH0, bar))
@@ -274,9 +270,6 @@ static bool pcidriver_irq_acknowledge(pcidriver_privdata_t *privdata)
         if (check_acknowlegde_channel(privdata, ABB_INT_CH1_TIMEOUT, ABB_IRQ_CH1, bar))
                 return true;
 
-	mod_info_dbg("err: interrupt registers. ISR: %x, IER: %x\n", bar[ ABB_INT_STAT ], bar[ ABB_INT_ENABLE ] );
-  */
-
 	return false;
 }
 
@@ -291,10 +284,55 @@ static bool pcidriver_irq_acknowledge(pcidriver_privdata_t *privdata)
 irqreturn_t pcidriver_irq_handler(int irq, void *dev_id)
 {
 	pcidriver_privdata_t *privdata = (pcidriver_privdata_t *)dev_id;
+	bool ours;
 
-	if (!pcidriver_irq_acknowledge(privdata))
+	spin_lock(&(privdata->irq_lock));
+	ours = pcidriver_irq_acknowledge(privdata);
+	spin_unlock(&(privdata->irq_lock));
+
+	if (!ours)
 		return IRQ_NONE;
 
 	privdata->irq_count++;
 	return IRQ_HANDLED;
 }
+
+/**
+ *
+ * Clears the queue of an interrupt source and enables the source on the
+ * card. The enable register is shared by the channels and changed by the
+ * handler, so only the driver writes it, under irq_lock.
+ *
+ * @returns -ENODEV if interrupts are not set up, -EINVAL for unknown sources
+ *
+ */
+int pcidriver_irq_arm(pcidriver_privdata_t *privdata, unsigned int source)
+{
+	volatile unsigned int *bar = privdata->bars_kmapped[0];
+	unsigned long flags;
+	unsigned int mask;
+
+	switch (source) {
+		case ABB_IRQ_CH0:
+			mask = ABB_INT_CH0 | ABB_INT_CH0_TIMEOUT;
+			break;
+		case ABB_IRQ_CH1:
+			mask = ABB_INT_CH1 | ABB_INT_CH1_TIMEOUT;
+			break;
+		case ABB_IRQ_IG:
+			mask = ABB_INT_IG;
+			break;
+		default:
+			return -EINVAL;
+	}
+
+	if (!privdata->irq_enabled || (bar == NULL))
+		return -ENODEV;
+
+	spin_lock_irqsave(&(privdata->irq_lock), flags);
+	atomic_set(&(privdata->irq_outstanding[source]), 0);
+	bar[ABB_INT_ENABLE] |= mask;
+	spin_unlock_irqrestore(&(privdata->irq_lock), flags);
+
+	return 0;
+}
@@ -5,5 +5,6 @@ int pcidriver_probe_irq(pcidriver_privdata_t *privdata);
 void pcidriver_remove_irq(pcidriver_privdata_t *privdata);
 void pcidriver_irq_unmap_bars(pcidriver_privdata_t *privdata);
 irqreturn_t pcidriver_irq_handler(int irq, void *dev_id);
+int pcidriver_irq_arm(pcidriver_privdata_t *privdata, unsigned int source);
 
 #endif
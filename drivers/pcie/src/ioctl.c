@@ -40,6 +40,7 @@
 #include "kmem.h" 			/* Internal definitions for kernel memory */
 #include "umem.h" 			/* Internal definitions for user space memory */
 #include "ioctl.h"			/* Internal definitions for the ioctl part */
+#include "int.h"			/* Internal definitions for interrupts */
 
 /** Declares a variable of the given type with the given name and copies it from userspace */
 #define READ_FROM_USER(type, name) \
@@ -87,6 +88,28 @@ static int ioctl_mmap_area(pcidriver_privdata_t *privdata, unsigned long arg)
 	return 0;
 }
 
+/**
+ *
+ * Sets the caching mode for the next PCI mmap() of the file, and reports
+ * the mode the currently selected area will get.
+ *
+ */
+static int ioctl_mmap_cache(pcidriver_privdata_t *privdata, struct file *filp, unsigned long arg)
+{
+	int ret;
+	READ_FROM_USER(mmap_cache_t, mcache);
+
+	if (mcache.mode > PCIDRIVER_CACHE_WT)
+		return -EINVAL;
+
+	((pcidriver_file_t *)filp->private_data)->mmap_cache = mcache.mode;
+	mcache.effective = pcidriver_mmap_cache(privdata, privdata->mmap_area, mcache.mode);
+
+	WRITE_TO_USER(mmap_cache_t, mcache);
+
+	return 0;
+}
+
 /**
  *
  * Reads/writes a byte/word/dword of the device's PCI config.
@@ -131,11 +154,157 @@ static int ioctl_pci_config_read_write(pcidriver_privdata_t *privdata, unsigned
 		}
 	}
 
+	if (ret != 0)
+		return pcibios_err_to_errno(ret);
+
 	WRITE_TO_USER(pci_cfg_cmd, pci_cmd);
 
 	return 0;
 }
 
+/**
+ *
+ * Reads a range of the device's PCI config into a user buffer. The range
+ * is cut at the end of the config space of the device (256 bytes, or
+ * 4 KB for PCIe), the number of bytes read is returned in size.
+ *
+ */
+static int ioctl_pci_config_range(pcidriver_privdata_t *privdata, unsigned long arg)
+{
+	int ret;
+	unsigned int i, end;
+	u32 *buf;
+	READ_FROM_USER(pci_cfg_range_t, range);
+
+	if ((range.addr | range.size) & 0x3)
+		return -EINVAL;
+
+	if (range.addr >= privdata->pdev->cfg_size)
+		return -EINVAL;
+
+	end = privdata->pdev->cfg_size;
+	if (range.size < end - range.addr)
+		end = range.addr + range.size;
+
+	buf = kmalloc(end - range.addr, GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	for (i = range.addr; i < end; i += 4) {
+		ret = pci_read_config_dword( privdata->pdev, i, &buf[(i - range.addr) >> 2] );
+		if (ret != 0) {
+			kfree(buf);
+			return pcibios_err_to_errno(ret);
+		}
+	}
+
+	if (copy_to_user((void __user *)range.data, buf, end - range.addr) != 0) {
+		kfree(buf);
+		return -EFAULT;
+	}
+	kfree(buf);
+
+	range.size = end - range.addr;
+	WRITE_TO_USER(pci_cfg_range_t, range);
+
+	return 0;
+}
+
+/**
+ *
+ * Reports the version of the ioctl structures, PCIDRIVER_ABI_VERSION.
+ *
+ */
+static int ioctl_version(pcidriver_privdata_t *privdata, unsigned long arg)
+{
+	int ret;
+	unsigned int version = PCIDRIVER_ABI_VERSION;
+
+	WRITE_TO_USER(unsigned int, version);
+
+	return 0;
+}
+
+/**
+ *
+ * Queries and changes MRRS, MPS, relaxed ordering and no snoop of a PCIe
+ * device. Every change is checked against the upstream port: MPS must
+ * not exceed its MPS, and relaxed ordering is refused below a root port
+ * that is known to mishandle it. The current settings are returned.
+ *
+ */
+static int ioctl_pcie_tune(pcidriver_privdata_t *privdata, unsigned long arg)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0)
+	int ret;
+	u16 devctl;
+	struct pci_dev *pdev = privdata->pdev;
+	struct pci_dev *parent = pdev->bus->self;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+	struct pci_dev *br;
+#endif
+	READ_FROM_USER(pcie_tune_t, tune);
+
+	if (!pci_is_pcie(pdev))
+		return -ENODEV;
+
+	if (tune.set & PCIDRIVER_TUNE_MPS) {
+		if (tune.mps > (128 << pdev->pcie_mpss))
+			return -EINVAL;
+		if ((parent != NULL) && pci_is_pcie(parent) && (tune.mps > pcie_get_mps(parent)))
+			return -EINVAL;
+		if ((ret = pcie_set_mps(pdev, tune.mps)) != 0)
+			return ret;
+	}
+
+	if (tune.set & PCIDRIVER_TUNE_MRRS) {
+		if ((ret = pcie_set_readrq(pdev, tune.mrrs)) != 0)
+			return ret;
+	}
+
+	if (tune.set & PCIDRIVER_TUNE_RELAXED) {
+		if (tune.relaxed) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+			for (br = parent; br != NULL; br = br->bus->self)
+				if (br->dev_flags & PCI_DEV_FLAGS_NO_RELAXED_ORDERING)
+					return -EINVAL;
+#endif
+			ret = pcie_capability_set_word(pdev, PCI_EXP_DEVCTL, PCI_EXP_DEVCTL_RELAX_EN);
+		} else
+			ret = pcie_capability_clear_word(pdev, PCI_EXP_DEVCTL, PCI_EXP_DEVCTL_RELAX_EN);
+		if (ret != 0)
+			return pcibios_err_to_errno(ret);
+	}
+
+	if (tune.set & PCIDRIVER_TUNE_NOSNOOP) {
+		if (tune.nosnoop)
+			ret = pcie_capability_set_word(pdev, PCI_EXP_DEVCTL, PCI_EXP_DEVCTL_NOSNOOP_EN);
+		else
+			ret = pcie_capability_clear_word(pdev, PCI_EXP_DEVCTL, PCI_EXP_DEVCTL_NOSNOOP_EN);
+		if (ret != 0)
+			return pcibios_err_to_errno(ret);
+	}
+
+	/* Report what the device uses now */
+	if ((ret = pcie_capability_read_word(pdev, PCI_EXP_DEVCTL, &devctl)) != 0)
+		return pcibios_err_to_errno(ret);
+
+	tune.mrrs = pcie_get_readrq(pdev);
+	tune.mps = pcie_get_mps(pdev);
+	tune.mps_supported = 128 << pdev->pcie_mpss;
+	tune.parent_mps = ((parent != NULL) && pci_is_pcie(parent)) ? pcie_get_mps(parent) : 0;
+	tune.relaxed = (devctl & PCI_EXP_DEVCTL_RELAX_EN) ? 1 : 0;
+	tune.nosnoop = (devctl & PCI_EXP_DEVCTL_NOSNOOP_EN) ? 1 : 0;
+
+	WRITE_TO_USER(pcie_tune_t, tune);
+
+	return 0;
+#else
+	mod_info("PCIe tuning needs kernel 3.7 or later\n");
+	return -EINVAL;
+#endif
+}
+
 /**
  *
  * Gets the PCI information for the device.
@@ -173,17 +342,17 @@ static int ioctl_pci_info(pcidriver_privdata_t *privdata, unsigned long arg)
 
 /**
  *
- * Allocates kernel memory.
+ * Allocates kernel memory, freed at the latest when filp is closed.
  *
- * @see pcidriver_kmem_alloc
+ * @see pcidriver_kmem_alloc_entry
  *
  */
-static int ioctl_kmem_alloc(pcidriver_privdata_t *privdata, unsigned long arg)
+static int ioctl_kmem_alloc(pcidriver_privdata_t *privdata, struct file *filp, unsigned long arg)
 {
 	int ret;
 	READ_FROM_USER(kmem_handle_t, khandle);
 
-	if ((ret = pcidriver_kmem_alloc(privdata, &khandle)) != 0)
+	if ((ret = pcidriver_kmem_alloc_entry(privdata, &khandle, filp, 0, NULL)) != 0)
 		return ret;
 
 	WRITE_TO_USER(kmem_handle_t, khandle);
@@ -193,22 +362,129 @@ static int ioctl_kmem_alloc(pcidriver_privdata_t *privdata, unsigned long arg)
 
 /**
  *
- * Frees kernel memory.
+ * Allocates kernel memory with flags, optionally named and kept when filp
+ * is closed.
+ *
+ * @see pcidriver_kmem_alloc_entry
+ *
+ */
+static int ioctl_kmem_alloc_named(pcidriver_privdata_t *privdata, struct file *filp, unsigned long arg)
+{
+	int ret;
+	READ_FROM_USER(kmem_named_t, knamed);
+
+	knamed.name[PCIDRIVER_KMEM_NAME_MAX - 1] = '\0';
+	if (knamed.flags & ~(PCIDRIVER_KMEM_FLAG_PERSIST | PCIDRIVER_KMEM_FLAG_CONTIG | PCIDRIVER_KMEM_FLAG_NODE))
+		return -EINVAL;
+	if ((knamed.flags & PCIDRIVER_KMEM_FLAG_PERSIST) && (knamed.name[0] == '\0'))
+		return -EINVAL;				/* nothing to attach to it by */
+
+	if ((ret = pcidriver_kmem_alloc_entry(privdata, &(knamed.handle), filp, knamed.flags, knamed.name)) != 0)
+		return ret;
+
+	WRITE_TO_USER(kmem_named_t, knamed);
+
+	return 0;
+}
+
+/**
+ *
+ * Attaches to named kernel memory.
+ *
+ * @see pcidriver_kmem_attach
+ *
+ */
+static int ioctl_kmem_attach(pcidriver_privdata_t *privdata, struct file *filp, unsigned long arg)
+{
+	int ret;
+	READ_FROM_USER(kmem_named_t, knamed);
+
+	if ((ret = pcidriver_kmem_attach(privdata, &knamed, filp)) != 0)
+		return ret;
+
+	WRITE_TO_USER(kmem_named_t, knamed);
+
+	return 0;
+}
+
+/**
+ *
+ * Frees kernel memory, or drops the import of filp.
  *
- * @see pcidriver_kmem_free
+ * @see pcidriver_kmem_put
  *
  */
-static int ioctl_kmem_free(pcidriver_privdata_t *privdata, unsigned long arg)
+static int ioctl_kmem_free(pcidriver_privdata_t *privdata, struct file *filp, unsigned long arg)
 {
 	int ret;
 	READ_FROM_USER(kmem_handle_t, khandle);
 
-	if ((ret = pcidriver_kmem_free(privdata, &khandle)) != 0)
+	if ((ret = pcidriver_kmem_put(privdata, &khandle, filp)) != 0)
 		return ret;
 
 	return 0;
 }
 
+/**
+ *
+ * Reports the mapping granularity of kernel memory.
+ *
+ * @see pcidriver_kmem_info
+ *
+ */
+static int ioctl_kmem_info(pcidriver_privdata_t *privdata, unsigned long arg)
+{
+	int ret;
+	READ_FROM_USER(kmem_info_t, kinfo);
+
+	if ((ret = pcidriver_kmem_info(privdata, &kinfo)) != 0)
+		return ret;
+
+	WRITE_TO_USER(kmem_info_t, kinfo);
+
+	return 0;
+}
+
+/**
+ *
+ * Exports kernel memory to other processes.
+ *
+ * @see pcidriver_kmem_export
+ *
+ */
+static int ioctl_kmem_export(pcidriver_privdata_t *privdata, struct file *filp, unsigned long arg)
+{
+	int ret;
+	READ_FROM_USER(kmem_export_t, kexport);
+
+	if ((ret = pcidriver_kmem_export(privdata, &kexport, filp)) != 0)
+		return ret;
+
+	WRITE_TO_USER(kmem_export_t, kexport);
+
+	return 0;
+}
+
+/**
+ *
+ * Imports kernel memory exported by another process.
+ *
+ * @see pcidriver_kmem_import
+ *
+ */
+static int ioctl_kmem_import(pcidriver_privdata_t *privdata, struct file *filp, unsigned long arg)
+{
+	int ret;
+	READ_FROM_USER(kmem_export_t, kexport);
+
+	if ((ret = pcidriver_kmem_import(privdata, &kexport, filp)) != 0)
+		return ret;
+
+	WRITE_TO_USER(kmem_export_t, kexport);
+
+	return 0;
+}
+
 /**
  *
  * Syncs kernel memory.
@@ -224,6 +500,21 @@ static int ioctl_kmem_sync(pcidriver_privdata_t *privdata, unsigned long arg)
 	return pcidriver_kmem_sync(privdata, &ksync);
 }
 
+/**
+ *
+ * Syncs part of a kernel memory buffer.
+ *
+ * @see pcidriver_kmem_sync_range
+ *
+ */
+static int ioctl_kmem_sync_range(pcidriver_privdata_t *privdata, unsigned long arg)
+{
+	int ret;
+	READ_FROM_USER(kmem_sync_range_t, ksync);
+
+	return pcidriver_kmem_sync_range(privdata, &ksync);
+}
+
 /*
  *
  * Maps the given scatter/gather list from memory to PCI bus addresses.
@@ -283,19 +574,29 @@ static int ioctl_umem_sgget(pcidriver_privdata_t *privdata, unsigned long arg)
 	/* The umem_sglist_t has a pointer to the scatter/gather list itself which
 	 * needs to be copied separately. The number of elements is stored in ->nents.
 	 * As the list can get very big, we need to use vmalloc. */
-	if ((usglist.sg = vmalloc(usglist.nents * sizeof(umem_sgentry_t))) == NULL)
+	if (usglist.nents <= 0)
+		return -EINVAL;
+	if ((usglist.sg = vmalloc((unsigned long)usglist.nents * sizeof(umem_sgentry_t))) == NULL)
 		return -ENOMEM;
 
 	/* copy array to kernel structure */
 	ret = copy_from_user(usglist.sg, ((umem_sglist_t *)arg)->sg, (usglist.nents)*sizeof(umem_sgentry_t));
-	if (ret) return -EFAULT;
+	if (ret) {
+		vfree(usglist.sg);
+		return -EFAULT;
+	}
 
-	if ((ret = pcidriver_umem_sgget(privdata, &usglist)) != 0)
+	if ((ret = pcidriver_umem_sgget(privdata, &usglist)) != 0) {
+		vfree(usglist.sg);
 		return ret;
+	}
 
 	/* write data to user space */
 	ret = copy_to_user(((umem_sglist_t *)arg)->sg, usglist.sg, (usglist.nents)*sizeof(umem_sgentry_t));
-	if (ret) return -EFAULT;
+	if (ret) {
+		vfree(usglist.sg);
+		return -EFAULT;
+	}
 
 	/* free array memory */
 	vfree(usglist.sg);
@@ -323,6 +624,21 @@ static int ioctl_umem_sync(pcidriver_privdata_t *privdata, unsigned long arg)
 	return pcidriver_umem_sync( privdata, &uhandle );
 }
 
+/**
+ *
+ * Checks that user memory is still mapped at its address.
+ *
+ * @see pcidriver_umem_check
+ *
+ */
+static int ioctl_umem_check(pcidriver_privdata_t *privdata, unsigned long arg)
+{
+	int ret;
+	READ_FROM_USER(umem_handle_t, uhandle);
+
+	return pcidriver_umem_check( privdata, &uhandle );
+}
+
 /**
  *
  * Waits for an interrupt
@@ -365,6 +681,39 @@ static int ioctl_wait_interrupt(pcidriver_privdata_t *privdata, unsigned long ar
 #endif
 }
 
+/**
+ *
+ * Waits for an interrupt, giving up after the timeout.
+ *
+ * @returns -ETIMEDOUT if no interrupt arrived in time
+ *
+ */
+static int ioctl_wait_interrupt_timeout(pcidriver_privdata_t *privdata, unsigned long arg)
+{
+#ifdef ENABLE_IRQ
+	int ret;
+	long left;
+	READ_FROM_USER(irq_wait_t, iwait);
+
+	if (iwait.source >= PCIDRIVER_INT_MAXSOURCES)
+		return -EFAULT;		 /* User tried to overrun the IRQ_SOURCES array */
+
+	/* Consume one outstanding interrupt as soon as there is one */
+	left = wait_event_interruptible_timeout( (privdata->irq_queues[iwait.source]),
+						 atomic_add_unless(&(privdata->irq_outstanding[iwait.source]), -1, 0),
+						 usecs_to_jiffies(iwait.timeout) );
+	if (left < 0)
+		return left;		/* interrupted by a signal */
+	if (left == 0)
+		return -ETIMEDOUT;
+
+	return 0;
+#else
+	mod_info("Asked to wait for interrupt but interrupts are not enabled in the driver\n");
+	return -EFAULT;
+#endif
+}
+
 /**
  *
  * Clears the interrupt wait queue.
@@ -391,6 +740,27 @@ static int ioctl_clear_ioq(pcidriver_privdata_t *privdata, unsigned long arg)
 #endif
 }
 
+/**
+ *
+ * Clears the interrupt wait queue and enables the source on the card.
+ *
+ * @param arg Not a pointer, but the irq source (unsigned int)
+ * @see pcidriver_irq_arm
+ *
+ */
+static int ioctl_arm_irq(pcidriver_privdata_t *privdata, unsigned long arg)
+{
+#ifdef ENABLE_IRQ
+	if (arg >= PCIDRIVER_INT_MAXSOURCES)
+		return -EFAULT;
+
+	return pcidriver_irq_arm(privdata, arg);
+#else
+	mod_info("Asked to arm an interrupt but interrupts are not enabled in the driver\n");
+	return -ENODEV;
+#endif
+}
+
 /**
  *
  * This function handles all ioctl file operations.
@@ -402,7 +772,7 @@ static int ioctl_clear_ioq(pcidriver_privdata_t *privdata, unsigned long arg)
  */
 long pcidriver_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	pcidriver_privdata_t *privdata = filp->private_data;
+	pcidriver_privdata_t *privdata = ((pcidriver_file_t *)filp->private_data)->privdata;
 
 	/* Select the appropiate command */
 	switch (cmd) {
@@ -412,22 +782,52 @@ long pcidriver_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		case PCIDRIVER_IOC_MMAP_AREA:
 			return ioctl_mmap_area(privdata, arg);
 
+		case PCIDRIVER_IOC_MMAP_CACHE:
+			return ioctl_mmap_cache(privdata, filp, arg);
+
 		case PCIDRIVER_IOC_PCI_CFG_RD:
 		case PCIDRIVER_IOC_PCI_CFG_WR:
 			return ioctl_pci_config_read_write(privdata, cmd, arg);
 
+		case PCIDRIVER_IOC_PCI_CFG_RANGE:
+			return ioctl_pci_config_range(privdata, arg);
+
+		case PCIDRIVER_IOC_PCIE_TUNE:
+			return ioctl_pcie_tune(privdata, arg);
+
 		case PCIDRIVER_IOC_PCI_INFO:
 			return ioctl_pci_info(privdata, arg);
 
+		case PCIDRIVER_IOC_VERSION:
+			return ioctl_version(privdata, arg);
+
 		case PCIDRIVER_IOC_KMEM_ALLOC:
-			return ioctl_kmem_alloc(privdata, arg);
+			return ioctl_kmem_alloc(privdata, filp, arg);
+
+		case PCIDRIVER_IOC_KMEM_ALLOC_NAMED:
+			return ioctl_kmem_alloc_named(privdata, filp, arg);
+
+		case PCIDRIVER_IOC_KMEM_ATTACH:
+			return ioctl_kmem_attach(privdata, filp, arg);
 
 		case PCIDRIVER_IOC_KMEM_FREE:
-			return ioctl_kmem_free(privdata, arg);
+			return ioctl_kmem_free(privdata, filp, arg);
+
+		case PCIDRIVER_IOC_KMEM_EXPORT:
+			return ioctl_kmem_export(privdata, filp, arg);
+
+		case PCIDRIVER_IOC_KMEM_IMPORT:
+			return ioctl_kmem_import(privdata, filp, arg);
+
+		case PCIDRIVER_IOC_KMEM_INFO:
+			return ioctl_kmem_info(privdata, arg);
 
 		case PCIDRIVER_IOC_KMEM_SYNC:
 			return ioctl_kmem_sync(privdata, arg);
 
+		case PCIDRIVER_IOC_KMEM_SYNC_RANGE:
+			return ioctl_kmem_sync_range(privdata, arg);
+
 		case PCIDRIVER_IOC_UMEM_SGMAP:
 			return ioctl_umem_sgmap(privdata, arg);
 
@@ -440,12 +840,21 @@ long pcidriver_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		case PCIDRIVER_IOC_UMEM_SYNC:
 			return ioctl_umem_sync(privdata, arg);
 
+		case PCIDRIVER_IOC_UMEM_CHECK:
+			return ioctl_umem_check(privdata, arg);
+
 		case PCIDRIVER_IOC_WAITI:
 			return ioctl_wait_interrupt(privdata, arg);
 
 		case PCIDRIVER_IOC_CLEAR_IOQ:
 			return ioctl_clear_ioq(privdata, arg);
 
+		case PCIDRIVER_IOC_WAITI_TIMEOUT:
+			return ioctl_wait_interrupt_timeout(privdata, arg);
+
+		case PCIDRIVER_IOC_ARM_IRQ:
+			return ioctl_arm_irq(privdata, arg);
+
 		default:
 			return -EINVAL;
 	}
@@ -16,9 +16,20 @@
 #include <linux/wait.h>
 #include <linux/mm.h>
 #include <linux/pagemap.h>
+#include <linux/gfp.h>
+#include <linux/nodemask.h>
+#include <linux/dma-mapping.h>
+#include <linux/random.h>
+#include <linux/cred.h>
+#include <linux/capability.h>
+#include <linux/slab.h>
 
 #include "config.h"			/* compile-time configuration */
 #include "compat.h"			/* compatibility definitions for older linux */
+#ifdef PCIDRIVER_KMEM_HUGE_MAP
+#include <linux/huge_mm.h>
+#include <linux/pfn_t.h>
+#endif
 #include "pciDriver.h"			/* external interface for the driver */
 #include "common.h"			/* internal definitions for all parts */
 #include "kmem.h"			/* prototypes for kernel memory */
@@ -28,6 +39,113 @@
 #define VM_RESERVED (VM_DONTEXPAND | VM_DONTDUMP)
 #endif
 
+/* Largest contiguous buffer pcidriver_kmem_max_contig tries */
+#define KMEM_MAX_CONTIG_PROBE (1UL << ((BITS_PER_LONG > 32) ? 32 : 30))
+
+/* Makes an entry the one the next kmem mmap of filp maps */
+static inline void pcidriver_kmem_select(struct file *filp, int id)
+{
+	if (filp != NULL)
+		((pcidriver_file_t *)filp->private_data)->kmem_mmap_id = id;
+}
+
+/**
+ *
+ * Whether filp owns or imported an entry. Called with the kmemlist lock held.
+ *
+ */
+static int pcidriver_kmem_used_by_locked(pcidriver_kmem_entry_t *kmem_entry, struct file *filp)
+{
+	struct list_head *ptr;
+
+	if (kmem_entry->owner == filp)
+		return 1;
+
+	list_for_each(ptr, &(kmem_entry->imports)) {
+		if (list_entry(ptr, pcidriver_kmem_import_t, list)->filp == filp)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ *
+ * Takes an entry off the kmem list once it was freed and nobody imports,
+ * maps or otherwise uses it any more. Called with the kmemlist lock held.
+ *
+ * @returns 1 if the caller must destroy the entry after dropping the lock
+ *
+ */
+static int pcidriver_kmem_unlink_unused_locked(pcidriver_kmem_entry_t *kmem_entry)
+{
+	if (!kmem_entry->orphan || !list_empty(&(kmem_entry->imports)) || (kmem_entry->refs > 0))
+		return 0;
+
+	list_del(&(kmem_entry->list));
+	return 1;
+}
+
+/**
+ *
+ * Find the corresponding kmem_entry for the given kmem_handle. Called with
+ * the kmemlist lock held, the entry may be freed once it is dropped.
+ *
+ */
+static pcidriver_kmem_entry_t *pcidriver_kmem_find_entry_locked(pcidriver_privdata_t *privdata, kmem_handle_t *kmem_handle)
+{
+	struct list_head *ptr;
+	pcidriver_kmem_entry_t *entry;
+
+	list_for_each(ptr, &(privdata->kmem_list)) {
+		entry = list_entry(ptr, pcidriver_kmem_entry_t, list);
+
+		if (entry->dma_handle == kmem_handle->pa)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/**
+ *
+ * Finds the kmem_entry for the given kmem_handle and holds it, for work
+ * that cannot be done under the kmemlist lock.
+ *
+ * @returns the entry, to drop with pcidriver_kmem_unref, or NULL
+ *
+ */
+static pcidriver_kmem_entry_t *pcidriver_kmem_get(pcidriver_privdata_t *privdata, kmem_handle_t *kmem_handle)
+{
+	pcidriver_kmem_entry_t *kmem_entry;
+
+	spin_lock(&(privdata->kmemlist_lock));
+	if ((kmem_entry = pcidriver_kmem_find_entry_locked(privdata, kmem_handle)) != NULL)
+		kmem_entry->refs++;
+	spin_unlock(&(privdata->kmemlist_lock));
+
+	return kmem_entry;
+}
+
+/**
+ *
+ * Drops a reference of a user mapping or pcidriver_kmem_get, freeing the
+ * entry if it was the last thing keeping it.
+ *
+ */
+static void pcidriver_kmem_unref(pcidriver_privdata_t *privdata, pcidriver_kmem_entry_t *kmem_entry)
+{
+	int release;
+
+	spin_lock(&(privdata->kmemlist_lock));
+	kmem_entry->refs--;
+	release = pcidriver_kmem_unlink_unused_locked(kmem_entry);
+	spin_unlock(&(privdata->kmemlist_lock));
+
+	if (release)
+		pcidriver_kmem_destroy_entry(privdata, kmem_entry);
+}
+
 /**
  *
  * Allocates new kernel memory including the corresponding management structure, makes
@@ -35,9 +153,81 @@
  *
  */
 int pcidriver_kmem_alloc(pcidriver_privdata_t *privdata, kmem_handle_t *kmem_handle)
+{
+	return pcidriver_kmem_alloc_entry(privdata, kmem_handle, NULL, 0, NULL);
+}
+
+/**
+ *
+ * Allocates the memory of an entry on a NUMA node other than the one of the
+ * device, which the coherent DMA allocator does not offer, and maps it for
+ * streaming DMA in both directions.
+ *
+ */
+static void *pcidriver_kmem_alloc_node(pcidriver_privdata_t *privdata, pcidriver_kmem_entry_t *kmem_entry, int node)
+{
+	struct device *dev = &(privdata->pdev->dev);
+	unsigned int order = get_order(kmem_entry->size);
+	gfp_t gfp = GFP_KERNEL | __GFP_ZERO | __GFP_THISNODE;
+	struct page *page;
+
+	/* Stay in reach of the device instead of bouncing every transfer */
+	if (dma_get_mask(dev) <= DMA_BIT_MASK(32))
+		gfp |= GFP_DMA32;
+
+	if ((page = alloc_pages_node(node, gfp, order)) == NULL)
+		return NULL;
+
+	kmem_entry->dma_handle = dma_map_page(dev, page, 0, PAGE_SIZE << order, DMA_BIDIRECTIONAL);
+	if (dma_mapping_error(dev, kmem_entry->dma_handle)) {
+		__free_pages(page, order);
+		return NULL;
+	}
+
+	kmem_entry->pages = 1;
+
+	return page_address(page);
+}
+
+/**
+ *
+ * Frees the memory of an entry, however it was allocated.
+ *
+ */
+static void pcidriver_kmem_free_memory(pcidriver_privdata_t *privdata, pcidriver_kmem_entry_t *kmem_entry)
+{
+	unsigned int order;
+
+	if (kmem_entry->pages) {
+		order = get_order(kmem_entry->size);
+		dma_unmap_page(&(privdata->pdev->dev), kmem_entry->dma_handle, PAGE_SIZE << order, DMA_BIDIRECTIONAL);
+		free_pages(kmem_entry->cpua, order);
+	} else {
+		dma_free_coherent( &(privdata->pdev->dev), kmem_entry->size, (void *)(kmem_entry->cpua), kmem_entry->dma_handle );
+	}
+}
+
+/**
+ *
+ * Allocates new kernel memory for an open file, optionally with a name that
+ * identifies it later. Entries owned by a file are freed when the file is
+ * closed, unless they are persistent.
+ *
+ */
+int pcidriver_kmem_alloc_entry(pcidriver_privdata_t *privdata, kmem_handle_t *kmem_handle,
+		struct file *owner, unsigned int flags, const char *name)
 {
 	pcidriver_kmem_entry_t *kmem_entry;
 	void *retptr;
+	int node = (flags & PCIDRIVER_KMEM_FLAG_NODE) ? kmem_handle->node : PCIDRIVER_KMEM_NODE_DEVICE;
+
+	if ((node != PCIDRIVER_KMEM_NODE_DEVICE) && ((node < 0) || (node >= MAX_NUMNODES) || !node_online(node)))
+		return -EINVAL;
+
+	/* CMA areas belong to the device, or are global, not per node */
+	if ((flags & PCIDRIVER_KMEM_FLAG_CONTIG) && (node != PCIDRIVER_KMEM_NODE_DEVICE) &&
+			(node != dev_to_node(&(privdata->pdev->dev))))
+		return -EINVAL;
 
 	/* First, allocate zeroed memory for the kmem_entry */
 	if ((kmem_entry = kcalloc(1, sizeof(pcidriver_kmem_entry_t), GFP_KERNEL)) == NULL)
@@ -46,6 +236,14 @@ int pcidriver_kmem_alloc(pcidriver_privdata_t *privdata, kmem_handle_t *kmem_han
 	/* Initialize the kmem_entry */
 	kmem_entry->id = atomic_inc_return(&privdata->kmem_count) - 1;
 	kmem_entry->size = kmem_handle->size;
+	kmem_entry->owner = owner;
+	kmem_entry->uid = current_euid();
+	kmem_entry->flags = flags & ~PCIDRIVER_KMEM_FLAG_NODE;
+	INIT_LIST_HEAD(&(kmem_entry->imports));
+	if (name != NULL) {
+		strncpy(kmem_entry->name, name, PCIDRIVER_KMEM_NAME_MAX - 1);
+		kmem_entry->name[PCIDRIVER_KMEM_NAME_MAX - 1] = '\0';
+	}
 	kmem_handle->handle_id = kmem_entry->id;
 
 	/* Initialize sysfs if possible */
@@ -58,26 +256,349 @@ int pcidriver_kmem_alloc(pcidriver_privdata_t *privdata, kmem_handle_t *kmem_han
 	 * The CPU sees only CPU addresses, while the device sees only PCI addresses.
 	 * CPU address is used for the mmap (internal to the driver), and
 	 * PCI address is the address passed to the DMA Controller in the device.
+	 * The coherent allocator takes memory from the node of the device.
+	 * dma_alloc_coherent with GFP_ATOMIC does not sleep, which keeps it to
+	 * the page allocator; with GFP_KERNEL the DMA layer may take large
+	 * buffers from the CMA area of the device, or the global one.
 	 */
-	retptr = pci_alloc_consistent( privdata->pdev, kmem_handle->size, &(kmem_entry->dma_handle) );
+	if (flags & PCIDRIVER_KMEM_FLAG_CONTIG)
+		retptr = dma_alloc_coherent( &(privdata->pdev->dev), kmem_handle->size, &(kmem_entry->dma_handle), GFP_KERNEL | __GFP_NOWARN );
+	else if ((node == PCIDRIVER_KMEM_NODE_DEVICE) || (node == dev_to_node(&(privdata->pdev->dev))))
+		retptr = dma_alloc_coherent( &(privdata->pdev->dev), kmem_handle->size, &(kmem_entry->dma_handle), GFP_ATOMIC );
+	else
+		retptr = pcidriver_kmem_alloc_node(privdata, kmem_entry, node);
 	if (retptr == NULL)
-		goto kmem_alloc_mem_fail;
+		goto kmem_alloc_sysfs_fail;
 	kmem_entry->cpua = (unsigned long)retptr;
-	kmem_handle->pa = (unsigned long)(kmem_entry->dma_handle);
+	kmem_entry->node = page_to_nid(virt_to_page(retptr));
+	kmem_handle->pa = (__u64)(kmem_entry->dma_handle);
+	kmem_handle->node = kmem_entry->node;
 
-	/* Add the kmem_entry to the list of the device */
+	/* Add the kmem_entry to the list of the device, unless the name was
+	 * taken in the meantime */
 	spin_lock( &(privdata->kmemlist_lock) );
+	if ((kmem_entry->name[0] != '\0') && (pcidriver_kmem_find_name_locked(privdata, kmem_entry->name) != NULL)) {
+		spin_unlock( &(privdata->kmemlist_lock) );
+		pcidriver_kmem_free_memory(privdata, kmem_entry);
+		pcidriver_sysfs_remove(privdata, &(kmem_entry->sysfs_attr));
+		kfree(kmem_entry);
+		return -EEXIST;
+	}
 	list_add_tail( &(kmem_entry->list), &(privdata->kmem_list) );
+	pcidriver_kmem_select(owner, kmem_entry->id);
 	spin_unlock( &(privdata->kmemlist_lock) );
 
 	return 0;
 
+kmem_alloc_sysfs_fail:
+		pcidriver_sysfs_remove(privdata, &(kmem_entry->sysfs_attr));
 kmem_alloc_mem_fail:
 		kfree(kmem_entry);
 kmem_alloc_entry_fail:
 		return -ENOMEM;
 }
 
+/**
+ *
+ * Attaches an open file to named kernel memory, e.g. kept persistent by a
+ * previous process, and makes it the one the next kmem mmap maps. Only the
+ * user who allocated it may attach, or an admin.
+ *
+ */
+int pcidriver_kmem_attach(pcidriver_privdata_t *privdata, kmem_named_t *kmem_named, struct file *owner)
+{
+	pcidriver_kmem_entry_t *kmem_entry;
+	int admin = capable(CAP_SYS_ADMIN);
+
+	kmem_named->name[PCIDRIVER_KMEM_NAME_MAX - 1] = '\0';
+	if (kmem_named->name[0] == '\0')
+		return -EINVAL;
+
+	spin_lock(&(privdata->kmemlist_lock));
+	kmem_entry = pcidriver_kmem_find_name_locked(privdata, kmem_named->name);
+	if ((kmem_entry == NULL) || kmem_entry->orphan) {
+		spin_unlock(&(privdata->kmemlist_lock));
+		return -ENOENT;
+	}
+	if ((kmem_entry->owner != NULL) && (kmem_entry->owner != owner)) {
+		spin_unlock(&(privdata->kmemlist_lock));
+		return -EBUSY;
+	}
+	if (!uid_eq(current_euid(), kmem_entry->uid) && !admin) {
+		spin_unlock(&(privdata->kmemlist_lock));
+		return -EACCES;
+	}
+
+	kmem_entry->owner = owner;
+	pcidriver_kmem_select(owner, kmem_entry->id);
+
+	kmem_named->handle.handle_id = kmem_entry->id;
+	kmem_named->handle.pa = (__u64)(kmem_entry->dma_handle);
+	kmem_named->handle.size = kmem_entry->size;
+	kmem_named->handle.node = kmem_entry->node;
+	kmem_named->flags = kmem_entry->flags;
+	spin_unlock(&(privdata->kmemlist_lock));
+
+	return 0;
+}
+
+/**
+ *
+ * Gets the key another process imports kernel memory with, see
+ * pcidriver_kmem_import. Only the open file owning the memory may export
+ * it, or an admin. Only the allocating user may import it, unless
+ * PCIDRIVER_KMEM_EXPORT_ALL_USERS is set. Exporting again returns the same
+ * key, and fails with -EEXIST for other flags.
+ *
+ */
+int pcidriver_kmem_export(pcidriver_privdata_t *privdata, kmem_export_t *kmem_export, struct file *filp)
+{
+	pcidriver_kmem_entry_t *kmem_entry;
+	int admin = capable(CAP_SYS_ADMIN);
+	__u64 key;
+
+	if (kmem_export->flags & ~PCIDRIVER_KMEM_EXPORT_ALL_USERS)
+		return -EINVAL;
+
+	/* Keys are not guessable, 0 means not exported */
+	do {
+		get_random_bytes(&key, sizeof(key));
+	} while (key == 0);
+
+	/* Find the associated kmem_entry for this buffer */
+	spin_lock(&(privdata->kmemlist_lock));
+	if ((kmem_entry = pcidriver_kmem_find_entry_locked(privdata, &(kmem_export->handle))) == NULL) {
+		spin_unlock(&(privdata->kmemlist_lock));
+		return -EINVAL;					/* kmem_handle is not valid */
+	}
+	if (kmem_entry->orphan) {
+		spin_unlock(&(privdata->kmemlist_lock));
+		return -EINVAL;
+	}
+	if ((kmem_entry->owner != filp) && !admin) {
+		spin_unlock(&(privdata->kmemlist_lock));
+		return -EPERM;
+	}
+	if (kmem_entry->key == 0) {
+		kmem_entry->key = key;
+		kmem_entry->export_flags = kmem_export->flags;
+	} else if (kmem_entry->export_flags != kmem_export->flags) {
+		spin_unlock(&(privdata->kmemlist_lock));
+		return -EEXIST;
+	}
+	kmem_export->key = kmem_entry->key;
+	spin_unlock(&(privdata->kmemlist_lock));
+
+	return 0;
+}
+
+/**
+ *
+ * Imports exported kernel memory into an open file and makes it the one the
+ * next kmem mmap maps. The memory stays until every importer and the owner
+ * freed it or closed their file.
+ *
+ */
+int pcidriver_kmem_import(pcidriver_privdata_t *privdata, kmem_export_t *kmem_export, struct file *filp)
+{
+	struct list_head *ptr;
+	pcidriver_kmem_entry_t *entry, *kmem_entry = NULL;
+	pcidriver_kmem_import_t *import;
+	int admin = capable(CAP_SYS_ADMIN);
+
+	if (kmem_export->key == 0)
+		return -ENOENT;
+
+	if ((import = kmalloc(sizeof(pcidriver_kmem_import_t), GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+	import->filp = filp;
+
+	spin_lock(&(privdata->kmemlist_lock));
+	list_for_each(ptr, &(privdata->kmem_list)) {
+		entry = list_entry(ptr, pcidriver_kmem_entry_t, list);
+
+		if ((entry->key == kmem_export->key) && !entry->orphan) {
+			kmem_entry = entry;
+			break;
+		}
+	}
+	if (kmem_entry == NULL) {
+		spin_unlock(&(privdata->kmemlist_lock));
+		kfree(import);
+		return -ENOENT;
+	}
+	if (!(kmem_entry->export_flags & PCIDRIVER_KMEM_EXPORT_ALL_USERS) &&
+			!uid_eq(current_euid(), kmem_entry->uid) && !admin) {
+		spin_unlock(&(privdata->kmemlist_lock));
+		kfree(import);
+		return -EACCES;
+	}
+
+	list_add_tail(&(import->list), &(kmem_entry->imports));
+	pcidriver_kmem_select(filp, kmem_entry->id);
+
+	kmem_export->handle.handle_id = kmem_entry->id;
+	kmem_export->handle.pa = (__u64)(kmem_entry->dma_handle);
+	kmem_export->handle.size = kmem_entry->size;
+	kmem_export->handle.node = kmem_entry->node;
+	spin_unlock(&(privdata->kmemlist_lock));
+
+	return 0;
+}
+
+/**
+ *
+ * Removes one import of the entry by filp. Called with the kmemlist lock held.
+ *
+ * @returns the removed import to kfree() outside the lock, NULL if filp has none
+ *
+ */
+static pcidriver_kmem_import_t *pcidriver_kmem_unimport_locked(pcidriver_kmem_entry_t *kmem_entry, struct file *filp)
+{
+	struct list_head *ptr;
+	pcidriver_kmem_import_t *import;
+
+	list_for_each(ptr, &(kmem_entry->imports)) {
+		import = list_entry(ptr, pcidriver_kmem_import_t, list);
+
+		if (import->filp == filp) {
+			list_del(&(import->list));
+			return import;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ *
+ * Called via ioctl, frees kernel memory for an open file. An importer only
+ * drops its import; memory freed by its owner while imported elsewhere
+ * stays until the last importer is gone. Only the owning file, an
+ * importer or an admin may free it.
+ *
+ */
+int pcidriver_kmem_put(pcidriver_privdata_t *privdata, kmem_handle_t *kmem_handle, struct file *filp)
+{
+	pcidriver_kmem_entry_t *kmem_entry;
+	pcidriver_kmem_import_t *import;
+	int admin = capable(CAP_SYS_ADMIN);
+	int release;
+
+	/* Find the associated kmem_entry for this buffer */
+	spin_lock(&(privdata->kmemlist_lock));
+	if ((kmem_entry = pcidriver_kmem_find_entry_locked(privdata, kmem_handle)) == NULL) {
+		spin_unlock(&(privdata->kmemlist_lock));
+		return -EINVAL;					/* kmem_handle is not valid */
+	}
+	if ((import = pcidriver_kmem_unimport_locked(kmem_entry, filp)) == NULL) {
+		if (kmem_entry->orphan) {
+			spin_unlock(&(privdata->kmemlist_lock));
+			return -EINVAL;				/* freed already */
+		}
+		if ((kmem_entry->owner != filp) && !admin) {
+			spin_unlock(&(privdata->kmemlist_lock));
+			return -EPERM;
+		}
+		kmem_entry->owner = NULL;
+		kmem_entry->orphan = 1;
+	}
+	release = pcidriver_kmem_unlink_unused_locked(kmem_entry);
+	spin_unlock(&(privdata->kmemlist_lock));
+
+	kfree(import);
+
+	if (release)
+		pcidriver_kmem_destroy_entry(privdata, kmem_entry);
+
+	return 0;
+}
+
+/**
+ *
+ * Called via sysfs, frees kernel memory by its id. Files that imported or
+ * mapped it keep it until they are done.
+ *
+ */
+int pcidriver_kmem_free_id(pcidriver_privdata_t *privdata, int id)
+{
+	struct list_head *ptr;
+	pcidriver_kmem_entry_t *entry, *kmem_entry = NULL;
+	int release;
+
+	spin_lock(&(privdata->kmemlist_lock));
+	list_for_each(ptr, &(privdata->kmem_list)) {
+		entry = list_entry(ptr, pcidriver_kmem_entry_t, list);
+
+		if ((entry->id == id) && !entry->orphan) {
+			kmem_entry = entry;
+			break;
+		}
+	}
+	if (kmem_entry == NULL) {
+		spin_unlock(&(privdata->kmemlist_lock));
+		return -EINVAL;
+	}
+
+	kmem_entry->owner = NULL;
+	kmem_entry->orphan = 1;
+	release = pcidriver_kmem_unlink_unused_locked(kmem_entry);
+	spin_unlock(&(privdata->kmemlist_lock));
+
+	if (release)
+		pcidriver_kmem_destroy_entry(privdata, kmem_entry);
+
+	return 0;
+}
+
+/**
+ *
+ * Called when a file is closed. Drops its imports, frees the kernel memory
+ * it still owns and detaches it from the persistent one, which stays for
+ * the next attach.
+ *
+ */
+int pcidriver_kmem_release_file(pcidriver_privdata_t *privdata, struct file *owner)
+{
+	struct list_head *ptr, *next;
+	pcidriver_kmem_entry_t *kmem_entry;
+	pcidriver_kmem_import_t *import;
+	LIST_HEAD(release_list);
+	LIST_HEAD(import_list);
+
+	spin_lock(&(privdata->kmemlist_lock));
+	list_for_each_safe(ptr, next, &(privdata->kmem_list)) {
+		kmem_entry = list_entry(ptr, pcidriver_kmem_entry_t, list);
+
+		while ((import = pcidriver_kmem_unimport_locked(kmem_entry, owner)) != NULL)
+			list_add(&(import->list), &import_list);
+
+		if (kmem_entry->owner == owner) {
+			kmem_entry->owner = NULL;
+			if (!(kmem_entry->flags & PCIDRIVER_KMEM_FLAG_PERSIST))
+				kmem_entry->orphan = 1;
+		}
+
+		if (pcidriver_kmem_unlink_unused_locked(kmem_entry))
+			list_add_tail(&(kmem_entry->list), &release_list);
+	}
+	spin_unlock(&(privdata->kmemlist_lock));
+
+	list_for_each_safe(ptr, next, &import_list) {
+		import = list_entry(ptr, pcidriver_kmem_import_t, list);
+		kfree(import);
+	}
+
+	/* Free outside the lock, dma_free_coherent may sleep. The entries are
+	 * off the kmem list, nobody else finds them any more */
+	list_for_each_safe(ptr, next, &release_list) {
+		kmem_entry = list_entry(ptr, pcidriver_kmem_entry_t, list);
+		pcidriver_kmem_destroy_entry(privdata, kmem_entry);
+	}
+
+	return 0;
+}
+
 /**
  *
  * Called via sysfs, frees kernel memory and the corresponding management structure
@@ -86,12 +607,24 @@ kmem_alloc_entry_fail:
 int pcidriver_kmem_free( pcidriver_privdata_t *privdata, kmem_handle_t *kmem_handle )
 {
 	pcidriver_kmem_entry_t *kmem_entry;
+	int release;
 
 	/* Find the associated kmem_entry for this buffer */
-	if ((kmem_entry = pcidriver_kmem_find_entry(privdata, kmem_handle)) == NULL)
+	spin_lock(&(privdata->kmemlist_lock));
+	if (((kmem_entry = pcidriver_kmem_find_entry_locked(privdata, kmem_handle)) == NULL) || kmem_entry->orphan) {
+		spin_unlock(&(privdata->kmemlist_lock));
 		return -EINVAL;					/* kmem_handle is not valid */
+	}
 
-	return pcidriver_kmem_free_entry(privdata, kmem_entry);
+	kmem_entry->owner = NULL;
+	kmem_entry->orphan = 1;
+	release = pcidriver_kmem_unlink_unused_locked(kmem_entry);
+	spin_unlock(&(privdata->kmemlist_lock));
+
+	if (release)
+		pcidriver_kmem_destroy_entry(privdata, kmem_entry);
+
+	return 0;
 }
 
 /**
@@ -121,69 +654,128 @@ int pcidriver_kmem_free_all(pcidriver_privdata_t *privdata)
 int pcidriver_kmem_sync( pcidriver_privdata_t *privdata, kmem_sync_t *kmem_sync )
 {
 	pcidriver_kmem_entry_t *kmem_entry;
+	int ret = 0;
 
 	/* Find the associated kmem_entry for this buffer */
-	if ((kmem_entry = pcidriver_kmem_find_entry(privdata, &(kmem_sync->handle))) == NULL)
+	if ((kmem_entry = pcidriver_kmem_get(privdata, &(kmem_sync->handle))) == NULL)
 		return -EINVAL;					/* kmem_handle is not valid */
 
 	switch (kmem_sync->dir) {
 		case PCIDRIVER_DMA_TODEVICE:
-			pci_dma_sync_single_for_device( privdata->pdev, kmem_entry->dma_handle, kmem_entry->size, PCI_DMA_TODEVICE );
+			dma_sync_single_for_device( &(privdata->pdev->dev), kmem_entry->dma_handle, kmem_entry->size, DMA_TO_DEVICE );
 			break;
 		case PCIDRIVER_DMA_FROMDEVICE:
-			pci_dma_sync_single_for_cpu( privdata->pdev, kmem_entry->dma_handle, kmem_entry->size, PCI_DMA_FROMDEVICE );
+			dma_sync_single_for_cpu( &(privdata->pdev->dev), kmem_entry->dma_handle, kmem_entry->size, DMA_FROM_DEVICE );
 			break;
 		case PCIDRIVER_DMA_BIDIRECTIONAL:
-			pci_dma_sync_single_for_device( privdata->pdev, kmem_entry->dma_handle, kmem_entry->size, PCI_DMA_BIDIRECTIONAL );
-			pci_dma_sync_single_for_cpu( privdata->pdev, kmem_entry->dma_handle, kmem_entry->size, PCI_DMA_BIDIRECTIONAL );
+			dma_sync_single_for_device( &(privdata->pdev->dev), kmem_entry->dma_handle, kmem_entry->size, DMA_BIDIRECTIONAL );
+			dma_sync_single_for_cpu( &(privdata->pdev->dev), kmem_entry->dma_handle, kmem_entry->size, DMA_BIDIRECTIONAL );
 			break;
 		default:
-			return -EINVAL;				/* wrong direction parameter */
+			ret = -EINVAL;				/* wrong direction parameter */
 	}
 
-	return 0;	/* success */
+	pcidriver_kmem_unref(privdata, kmem_entry);
+
+	return ret;
 }
 
 /**
  *
- * Free the given kmem_entry and its memory.
+ * Synchronize part of a buffer, e.g. one of many small buffers carved
+ * out of it by user space.
  *
  */
-int pcidriver_kmem_free_entry(pcidriver_privdata_t *privdata, pcidriver_kmem_entry_t *kmem_entry)
+int pcidriver_kmem_sync_range( pcidriver_privdata_t *privdata, kmem_sync_range_t *kmem_sync )
+{
+	pcidriver_kmem_entry_t *kmem_entry;
+	struct device *dev = &(privdata->pdev->dev);
+	int ret = 0;
+
+	/* Find the associated kmem_entry for this buffer */
+	if ((kmem_entry = pcidriver_kmem_get(privdata, &(kmem_sync->handle))) == NULL)
+		return -EINVAL;					/* kmem_handle is not valid */
+
+	if ((kmem_sync->size == 0) || (kmem_sync->offset >= kmem_entry->size) ||
+			(kmem_sync->size > kmem_entry->size - kmem_sync->offset)) {
+		pcidriver_kmem_unref(privdata, kmem_entry);
+		return -EINVAL;					/* range outside of the buffer */
+	}
+
+	switch (kmem_sync->dir) {
+		case PCIDRIVER_DMA_TODEVICE:
+			dma_sync_single_range_for_device( dev, kmem_entry->dma_handle, kmem_sync->offset, kmem_sync->size, DMA_TO_DEVICE );
+			break;
+		case PCIDRIVER_DMA_FROMDEVICE:
+			dma_sync_single_range_for_cpu( dev, kmem_entry->dma_handle, kmem_sync->offset, kmem_sync->size, DMA_FROM_DEVICE );
+			break;
+		case PCIDRIVER_DMA_BIDIRECTIONAL:
+			dma_sync_single_range_for_device( dev, kmem_entry->dma_handle, kmem_sync->offset, kmem_sync->size, DMA_BIDIRECTIONAL );
+			dma_sync_single_range_for_cpu( dev, kmem_entry->dma_handle, kmem_sync->offset, kmem_sync->size, DMA_BIDIRECTIONAL );
+			break;
+		default:
+			ret = -EINVAL;				/* wrong direction parameter */
+	}
+
+	pcidriver_kmem_unref(privdata, kmem_entry);
+
+	return ret;
+}
+
+/**
+ *
+ * Free a kmem_entry that is no longer on the kmem list, and its memory.
+ *
+ */
+void pcidriver_kmem_destroy_entry(pcidriver_privdata_t *privdata, pcidriver_kmem_entry_t *kmem_entry)
 {
+	struct list_head *ptr, *next;
+
 	pcidriver_sysfs_remove(privdata, &(kmem_entry->sysfs_attr));
 
 	/* Release DMA memory */
-	pci_free_consistent( privdata->pdev, kmem_entry->size, (void *)(kmem_entry->cpua), kmem_entry->dma_handle );
+	pcidriver_kmem_free_memory(privdata, kmem_entry);
+
+	/* Release the imports left when cleaning up */
+	list_for_each_safe(ptr, next, &(kmem_entry->imports))
+		kfree(list_entry(ptr, pcidriver_kmem_import_t, list));
 
+	/* Release kmem_entry memory */
+	kfree(kmem_entry);
+}
+
+/**
+ *
+ * Free the given kmem_entry and its memory.
+ *
+ */
+int pcidriver_kmem_free_entry(pcidriver_privdata_t *privdata, pcidriver_kmem_entry_t *kmem_entry)
+{
 	/* Remove the kmem list entry */
 	spin_lock( &(privdata->kmemlist_lock) );
 	list_del( &(kmem_entry->list) );
 	spin_unlock( &(privdata->kmemlist_lock) );
 
-	/* Release kmem_entry memory */
-	kfree(kmem_entry);
+	pcidriver_kmem_destroy_entry(privdata, kmem_entry);
 
 	return 0;
 }
 
 /**
  *
- * Find the corresponding kmem_entry for the given kmem_handle.
+ * find the corresponding kmem_entry for the given id.
  *
  */
-pcidriver_kmem_entry_t *pcidriver_kmem_find_entry(pcidriver_privdata_t *privdata, kmem_handle_t *kmem_handle)
+pcidriver_kmem_entry_t *pcidriver_kmem_find_entry_id(pcidriver_privdata_t *privdata, int id)
 {
 	struct list_head *ptr;
 	pcidriver_kmem_entry_t *entry, *result = NULL;
 
-	/* should I implement it better using the handle_id? */
-
 	spin_lock(&(privdata->kmemlist_lock));
 	list_for_each(ptr, &(privdata->kmem_list)) {
 		entry = list_entry(ptr, pcidriver_kmem_entry_t, list);
 
-		if (entry->dma_handle == kmem_handle->pa) {
+		if (entry->id == id) {
 			result = entry;
 			break;
 		}
@@ -195,63 +787,235 @@ pcidriver_kmem_entry_t *pcidriver_kmem_find_entry(pcidriver_privdata_t *privdata
 
 /**
  *
- * find the corresponding kmem_entry for the given id.
+ * Finds the largest power of two a PCIDRIVER_KMEM_FLAG_CONTIG allocation
+ * gets at the moment, by allocating and freeing again. Sizes beyond the
+ * page allocator and CMA fail quickly, CMA may have to migrate pages for
+ * the others.
  *
  */
-pcidriver_kmem_entry_t *pcidriver_kmem_find_entry_id(pcidriver_privdata_t *privdata, int id)
+unsigned long pcidriver_kmem_max_contig(pcidriver_privdata_t *privdata)
+{
+	struct device *dev = &(privdata->pdev->dev);
+	unsigned long size;
+	dma_addr_t dma_handle;
+	void *ptr;
+
+	for (size = KMEM_MAX_CONTIG_PROBE; size > PAGE_SIZE; size >>= 1) {
+		ptr = dma_alloc_coherent(dev, size, &dma_handle, GFP_KERNEL | __GFP_NOWARN);
+		if (ptr != NULL) {
+			dma_free_coherent(dev, size, ptr, dma_handle);
+			return size;
+		}
+	}
+
+	return PAGE_SIZE;
+}
+
+/**
+ *
+ * Find the kmem_entry with the given name. Called with the kmemlist lock held.
+ *
+ */
+pcidriver_kmem_entry_t *pcidriver_kmem_find_name_locked(pcidriver_privdata_t *privdata, const char *name)
 {
 	struct list_head *ptr;
-	pcidriver_kmem_entry_t *entry, *result = NULL;
+	pcidriver_kmem_entry_t *entry;
 
-	spin_lock(&(privdata->kmemlist_lock));
 	list_for_each(ptr, &(privdata->kmem_list)) {
 		entry = list_entry(ptr, pcidriver_kmem_entry_t, list);
 
-		if (entry->id == id) {
-			result = entry;
-			break;
-		}
+		if (strncmp(entry->name, name, PCIDRIVER_KMEM_NAME_MAX) == 0)
+			return entry;
 	}
 
+	return NULL;
+}
+
+/**
+ *
+ * Page size an entry is mapped to userspace with: PMD sized pages for large
+ * buffers that start on one, if the kernel can map them.
+ *
+ */
+static unsigned long pcidriver_kmem_map_size(pcidriver_kmem_entry_t *kmem_entry)
+{
+#ifdef PCIDRIVER_KMEM_HUGE_MAP
+	if ((kmem_entry->size >= PMD_SIZE) && IS_ALIGNED(virt_to_phys((void *)kmem_entry->cpua), PMD_SIZE))
+		return PMD_SIZE;
+#endif
+	return PAGE_SIZE;
+}
+
+/**
+ *
+ * Reports how an entry is mapped, see pcidriver_mmap_kmem.
+ *
+ */
+int pcidriver_kmem_info(pcidriver_privdata_t *privdata, kmem_info_t *kmem_info)
+{
+	pcidriver_kmem_entry_t *kmem_entry;
+
+	/* Find the associated kmem_entry for this buffer */
+	spin_lock(&(privdata->kmemlist_lock));
+	if ((kmem_entry = pcidriver_kmem_find_entry_locked(privdata, &(kmem_info->handle))) == NULL) {
+		spin_unlock(&(privdata->kmemlist_lock));
+		return -EINVAL;					/* kmem_handle is not valid */
+	}
+	kmem_info->map_size = pcidriver_kmem_map_size(kmem_entry);
 	spin_unlock(&(privdata->kmemlist_lock));
-	return result;
+
+	return 0;
 }
 
+/*
+ * Every vma of a kmem mapping, including copies made by fork() or split by
+ * a partial munmap(), holds the entry. vm_private_data points to it.
+ */
+static void pcidriver_kmem_vm_open(struct vm_area_struct *vma)
+{
+	pcidriver_privdata_t *privdata = ((pcidriver_file_t *)vma->vm_file->private_data)->privdata;
+	pcidriver_kmem_entry_t *kmem_entry = vma->vm_private_data;
+
+	spin_lock(&(privdata->kmemlist_lock));
+	kmem_entry->refs++;
+	spin_unlock(&(privdata->kmemlist_lock));
+}
+
+static void pcidriver_kmem_vm_close(struct vm_area_struct *vma)
+{
+	pcidriver_privdata_t *privdata = ((pcidriver_file_t *)vma->vm_file->private_data)->privdata;
+
+	pcidriver_kmem_unref(privdata, vma->vm_private_data);
+}
+
+static const struct vm_operations_struct pcidriver_kmem_vm_ops = {
+	.open = pcidriver_kmem_vm_open,
+	.close = pcidriver_kmem_vm_close,
+};
+
+#ifdef PCIDRIVER_KMEM_HUGE_MAP
+/*
+ * Large buffers are mapped on demand instead of with remap_pfn_range, which
+ * only creates 4 KB entries. Faults past the end of the buffer get SIGBUS.
+ */
+static vm_fault_t pcidriver_kmem_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	pcidriver_kmem_entry_t *kmem_entry = vma->vm_private_data;
+	unsigned long pgoff = vma->vm_pgoff + ((vmf->address - vma->vm_start) >> PAGE_SHIFT);
+
+	if (pgoff >= (PAGE_ALIGN(kmem_entry->size) >> PAGE_SHIFT))
+		return VM_FAULT_SIGBUS;
+
+	return vmf_insert_pfn(vma, vmf->address & PAGE_MASK,
+			page_to_pfn(virt_to_page((void *)kmem_entry->cpua)) + pgoff);
+}
+
+static vm_fault_t pcidriver_kmem_fault_pmd(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	pcidriver_kmem_entry_t *kmem_entry = vma->vm_private_data;
+	unsigned long addr = vmf->address & PMD_MASK;
+	unsigned long pgoff, pfn;
+
+	/* Whole PMDs inside the mapping only, the rest falls back to 4 KB */
+	if ((addr < vma->vm_start) || (addr + PMD_SIZE > vma->vm_end))
+		return VM_FAULT_FALLBACK;
+
+	pgoff = vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT);
+	if (pgoff + (PMD_SIZE >> PAGE_SHIFT) > (PAGE_ALIGN(kmem_entry->size) >> PAGE_SHIFT))
+		return VM_FAULT_FALLBACK;
+
+	pfn = page_to_pfn(virt_to_page((void *)kmem_entry->cpua)) + pgoff;
+	if (!IS_ALIGNED(pfn, PMD_SIZE >> PAGE_SHIFT))
+		return VM_FAULT_FALLBACK;
+
+	return vmf_insert_pfn_pmd(vmf, __pfn_to_pfn_t(pfn, PFN_DEV), vmf->flags & FAULT_FLAG_WRITE);
+}
+
+#ifdef PCIDRIVER_HUGE_FAULT_ORDER
+static vm_fault_t pcidriver_kmem_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+	if (order != (PMD_SHIFT - PAGE_SHIFT))
+		return VM_FAULT_FALLBACK;
+
+	return pcidriver_kmem_fault_pmd(vmf);
+}
+#else
+static vm_fault_t pcidriver_kmem_huge_fault(struct vm_fault *vmf, enum page_entry_size pe_size)
+{
+	if (pe_size != PE_SIZE_PMD)
+		return VM_FAULT_FALLBACK;
+
+	return pcidriver_kmem_fault_pmd(vmf);
+}
+#endif
+
+static const struct vm_operations_struct pcidriver_kmem_huge_vm_ops = {
+	.open = pcidriver_kmem_vm_open,
+	.close = pcidriver_kmem_vm_close,
+	.fault = pcidriver_kmem_fault,
+	.huge_fault = pcidriver_kmem_huge_fault,
+};
+#endif
+
 /**
  *
- * mmap() kernel memory to userspace.
+ * mmap() kernel memory to userspace: the entry last allocated, attached or
+ * imported through this file, else the latest the file uses. Files only
+ * map kernel memory they own or imported.
  *
  */
-int pcidriver_mmap_kmem(pcidriver_privdata_t *privdata, struct vm_area_struct *vma)
+int pcidriver_mmap_kmem(pcidriver_privdata_t *privdata, struct file *filp, struct vm_area_struct *vma)
 {
+	int mmap_id = ((pcidriver_file_t *)filp->private_data)->kmem_mmap_id;
 	unsigned long vma_size;
-	pcidriver_kmem_entry_t *kmem_entry;
+	struct list_head *ptr;
+	pcidriver_kmem_entry_t *entry, *kmem_entry = NULL;
 	int ret;
 
 	mod_info_dbg("Entering mmap_kmem\n");
 
-	/* FIXME: Is this really right? Always just the latest one? Can't we identify one? */
-	/* Get latest entry on the kmem_list */
+	vma_size = (vma->vm_end - vma->vm_start);
+
+	/* Hold the entry for the mapping before the lock is dropped, the
+	 * owner may free it any time */
 	spin_lock(&(privdata->kmemlist_lock));
-	if (list_empty(&(privdata->kmem_list))) {
+	list_for_each(ptr, &(privdata->kmem_list)) {
+		entry = list_entry(ptr, pcidriver_kmem_entry_t, list);
+
+		if (((mmap_id == -1) || (entry->id == mmap_id)) && pcidriver_kmem_used_by_locked(entry, filp))
+			kmem_entry = entry;
+	}
+	if (kmem_entry == NULL) {
 		spin_unlock(&(privdata->kmemlist_lock));
 		mod_info("Trying to mmap a kernel memory buffer without creating it first!\n");
 		return -EFAULT;
 	}
-	kmem_entry = list_entry(privdata->kmem_list.prev, pcidriver_kmem_entry_t, list);
-	spin_unlock(&(privdata->kmemlist_lock));
 
 	mod_info_dbg("Got kmem_entry with id: %d\n", kmem_entry->id);
 
-	/* Check sizes */
-	vma_size = (vma->vm_end - vma->vm_start);
-	if ((vma_size != kmem_entry->size) &&
-		((kmem_entry->size < PAGE_SIZE) && (vma_size != PAGE_SIZE))) {
+	/* Check sizes, the mapping must not reach past the buffer */
+	if ((vma->vm_pgoff != 0) || (vma_size > PAGE_ALIGN(kmem_entry->size))) {
+		spin_unlock(&(privdata->kmemlist_lock));
 		mod_info("kem_entry size(%lu) and vma size do not match(%lu)\n", kmem_entry->size, vma_size);
 		return -EINVAL;
 	}
 
-	vma->vm_flags |= (VM_RESERVED);
+	kmem_entry->refs++;
+	spin_unlock(&(privdata->kmemlist_lock));
+
+	vm_flags_set(vma, VM_RESERVED);
+	vma->vm_private_data = kmem_entry;
+
+#ifdef PCIDRIVER_KMEM_HUGE_MAP
+	/* Map on demand, with huge pages wherever the user address allows */
+	if (pcidriver_kmem_map_size(kmem_entry) == PMD_SIZE) {
+		vm_flags_set(vma, VM_IO | VM_PFNMAP | VM_HUGEPAGE);
+		vma->vm_ops = &pcidriver_kmem_huge_vm_ops;
+		return 0;
+	}
+#endif
 
 #ifdef pgprot_noncached
 	// This is coherent memory, so it must not be cached.
@@ -266,13 +1030,17 @@ int pcidriver_mmap_kmem(pcidriver_privdata_t *privdata, struct vm_area_struct *v
 					vma,
 					vma->vm_start,
 					page_to_pfn(virt_to_page((void*)kmem_entry->cpua)),
-					kmem_entry->size,
+					vma_size,
 					vma->vm_page_prot );
 
 	if (ret) {
 		mod_info("kmem remap failed: %d (%lx)\n", ret,kmem_entry->cpua);
+		pcidriver_kmem_unref(privdata, kmem_entry);
 		return -EAGAIN;
 	}
 
+	/* close() releases the entry from here on */
+	vma->vm_ops = &pcidriver_kmem_vm_ops;
+
 	return ret;
 }
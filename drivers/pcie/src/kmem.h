@@ -1,7 +1,18 @@
 int pcidriver_kmem_alloc( pcidriver_privdata_t *privdata, kmem_handle_t *kmem_handle );
+int pcidriver_kmem_alloc_entry( pcidriver_privdata_t *privdata, kmem_handle_t *kmem_handle, struct file *owner, unsigned int flags, const char *name );
+int pcidriver_kmem_attach( pcidriver_privdata_t *privdata, kmem_named_t *kmem_named, struct file *owner );
+int pcidriver_kmem_release_file( pcidriver_privdata_t *privdata, struct file *owner );
+int pcidriver_kmem_export( pcidriver_privdata_t *privdata, kmem_export_t *kmem_export, struct file *filp );
+int pcidriver_kmem_import( pcidriver_privdata_t *privdata, kmem_export_t *kmem_export, struct file *filp );
+int pcidriver_kmem_put( pcidriver_privdata_t *privdata, kmem_handle_t *kmem_handle, struct file *filp );
+int pcidriver_kmem_info( pcidriver_privdata_t *privdata, kmem_info_t *kmem_info );
+unsigned long pcidriver_kmem_max_contig( pcidriver_privdata_t *privdata );
 int pcidriver_kmem_free(  pcidriver_privdata_t *privdata, kmem_handle_t *kmem_handle );
+int pcidriver_kmem_free_id( pcidriver_privdata_t *privdata, int id );
 int pcidriver_kmem_sync(  pcidriver_privdata_t *privdata, kmem_sync_t *kmem_sync );
+int pcidriver_kmem_sync_range(  pcidriver_privdata_t *privdata, kmem_sync_range_t *kmem_sync );
 int pcidriver_kmem_free_all(  pcidriver_privdata_t *privdata );
-pcidriver_kmem_entry_t *pcidriver_kmem_find_entry( pcidriver_privdata_t *privdata, kmem_handle_t *kmem_handle );
 pcidriver_kmem_entry_t *pcidriver_kmem_find_entry_id( pcidriver_privdata_t *privdata, int id );
+pcidriver_kmem_entry_t *pcidriver_kmem_find_name_locked( pcidriver_privdata_t *privdata, const char *name );
 int pcidriver_kmem_free_entry( pcidriver_privdata_t *privdata, pcidriver_kmem_entry_t *kmem_entry );
+void pcidriver_kmem_destroy_entry( pcidriver_privdata_t *privdata, pcidriver_kmem_entry_t *kmem_entry );
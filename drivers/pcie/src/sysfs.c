@@ -175,13 +175,20 @@ SYSFS_GET_FUNCTION(pcidriver_show_kmem_count)
 	return snprintf(buf, PAGE_SIZE, "%d\n", atomic_read(&(privdata->kmem_count)));
 }
 
+SYSFS_GET_FUNCTION(pcidriver_show_kmem_max_contig)
+{
+	pcidriver_privdata_t *privdata = dev_get_drvdata(dev);
+
+	return snprintf(buf, PAGE_SIZE, "%lu\n", pcidriver_kmem_max_contig(privdata));
+}
+
 SYSFS_SET_FUNCTION(pcidriver_store_kmem_alloc)
 {
 	pcidriver_privdata_t *privdata = dev_get_drvdata(dev);
 	kmem_handle_t kmem_handle;
 
 	/* FIXME: guillermo: is validation of parsing an unsigned int enough? */
-	if (sscanf(buf, "%lu", &kmem_handle.size) == 1)
+	if (sscanf(buf, "%llu", &kmem_handle.size) == 1)
 		pcidriver_kmem_alloc(privdata, &kmem_handle);
 
 	return strlen(buf);
@@ -191,17 +198,14 @@ SYSFS_SET_FUNCTION(pcidriver_store_kmem_free)
 {
 	pcidriver_privdata_t *privdata = dev_get_drvdata(dev);
 	unsigned int id;
-	pcidriver_kmem_entry_t *kmem_entry;
 
 	/* Parse the ID of the kernel memory to be freed, check bounds */
 	if (sscanf(buf, "%u", &id) != 1 ||
 	    (id >= atomic_read(&(privdata->kmem_count))))
 		goto err;
 
-	if ((kmem_entry = pcidriver_kmem_find_entry_id(privdata,id)) == NULL)
-		goto err;
-
-	pcidriver_kmem_free_entry(privdata, kmem_entry );
+	/* Mappings and imports keep it until they are gone */
+	pcidriver_kmem_free_id(privdata, id);
 err:
 	return strlen(buf);
 }
@@ -214,7 +218,7 @@ SYSFS_GET_FUNCTION(pcidriver_show_kbuffers)
 	pcidriver_kmem_entry_t *entry;
 
 	/* print the header */
-	offset += snprintf(buf, PAGE_SIZE, "kbuf#\tcpu addr\tsize\n");
+	offset += snprintf(buf, PAGE_SIZE, "kbuf#\tcpu addr\tsize\tnode\tpersist\tname\n");
 
 	spin_lock(&(privdata->kmemlist_lock));
 	list_for_each(ptr, &(privdata->kmem_list)) {
@@ -226,7 +230,8 @@ SYSFS_GET_FUNCTION(pcidriver_show_kbuffers)
 			return PAGE_SIZE;
 		}
 
-		offset += snprintf(buf+offset, PAGE_SIZE-offset, "%3d\t%08lx\t%lu\n", entry->id, (unsigned long)(entry->dma_handle), entry->size );
+		offset += snprintf(buf+offset, PAGE_SIZE-offset, "%3d\t%08lx\t%lu\t%d\t%d\t%s\n", entry->id, (unsigned long)(entry->dma_handle), entry->size,
+			entry->node, (entry->flags & PCIDRIVER_KMEM_FLAG_PERSIST) ? 1 : 0, entry->name );
 	}
 
 	spin_unlock(&(privdata->kmemlist_lock));
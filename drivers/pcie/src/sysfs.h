@@ -16,6 +16,7 @@ SYSFS_GET_FUNCTION(pcidriver_show_mmap_area);
 SYSFS_SET_FUNCTION(pcidriver_store_mmap_area);
 SYSFS_GET_FUNCTION(pcidriver_show_kmem_count);
 SYSFS_GET_FUNCTION(pcidriver_show_kbuffers);
+SYSFS_GET_FUNCTION(pcidriver_show_kmem_max_contig);
 SYSFS_SET_FUNCTION(pcidriver_store_kmem_alloc);
 SYSFS_SET_FUNCTION(pcidriver_store_kmem_free);
 SYSFS_GET_FUNCTION(pcidriver_show_umappings);
@@ -26,6 +26,9 @@
 #include "umem.h"		/* prototypes for kernel memory */
 #include "sysfs.h"		/* prototypes for sysfs */
 
+/* Pages pcidriver_umem_check looks up per get_user_pages call */
+#define UMEM_CHECK_BATCH 16
+
 /**
  *
  * Reserve a new scatter/gather list and map it from memory to PCI bus addresses.
@@ -58,6 +61,11 @@ int pcidriver_umem_sgmap(pcidriver_privdata_t *privdata, umem_handle_t *umem_han
 	if (umem_handle->size == 0)
 		return -EINVAL;
 
+	/* The page count must fit nr_pages, and the range the address space */
+	if ((umem_handle->size > ((__u64)INT_MAX << PAGE_SHIFT) - PAGE_SIZE) ||
+			(umem_handle->vma + umem_handle->size < umem_handle->vma))
+		return -EINVAL;
+
 	/* Direction is better ignoring during mapping. */
 	/* We assume bidirectional buffers always, except when sync'ing */
 
@@ -84,17 +92,9 @@ int pcidriver_umem_sgmap(pcidriver_privdata_t *privdata, umem_handle_t *umem_han
 	mod_info_dbg("allocated space for the SG list.\n");
 
 	/* Get the page information */
-	down_read(&current->mm->mmap_sem);
-	res = get_user_pages(
-				current,
-				current->mm,
-				umem_handle->vma,
-				nr_pages,
-				1,
-				0,  /* do not force, FIXME: shall I? */
-				pages,
-				NULL );
-	up_read(&current->mm->mmap_sem);
+	mmap_read_lock(current->mm);
+	res = compat_get_user_pages(umem_handle->vma, nr_pages, 1, pages);
+	mmap_read_unlock(current->mm);
 
 	/* Error, not all pages mapped */
 	if (res < (int)nr_pages) {
@@ -131,7 +131,7 @@ int pcidriver_umem_sgmap(pcidriver_privdata_t *privdata, umem_handle_t *umem_han
 	/* Use the page list to populate the SG list */
 	/* SG entries may be merged, res is the number of used entries */
 	/* We have originally nr_pages entries in the sg list */
-	if ((nents = pci_map_sg(privdata->pdev, sg, nr_pages, PCI_DMA_BIDIRECTIONAL)) == 0)
+	if ((nents = dma_map_sg(&(privdata->pdev->dev), sg, nr_pages, DMA_BIDIRECTIONAL)) == 0)
 		goto umem_sgmap_unmap;
 
 	mod_info_dbg("Mapped SG list (%d entries).\n", nents);
@@ -143,6 +143,7 @@ int pcidriver_umem_sgmap(pcidriver_privdata_t *privdata, umem_handle_t *umem_han
 
 	/* Fill entry to be added to the umem list */
 	umem_entry->id = atomic_inc_return(&privdata->umem_count) - 1;
+	umem_entry->vma = umem_handle->vma;
 	umem_entry->nr_pages = nr_pages;	/* Will be needed when unmapping */
 	umem_entry->pages = pages;
 	umem_entry->nents = nents;
@@ -164,7 +165,7 @@ int pcidriver_umem_sgmap(pcidriver_privdata_t *privdata, umem_handle_t *umem_han
 umem_sgmap_name_fail:
 	kfree(umem_entry);
 umem_sgmap_entry:
-	pci_unmap_sg( privdata->pdev, sg, nr_pages, PCI_DMA_BIDIRECTIONAL );
+	dma_unmap_sg( &(privdata->pdev->dev), sg, nr_pages, DMA_BIDIRECTIONAL );
 umem_sgmap_unmap:
 	/* release pages */
 	if (nr_pages > 0) {
@@ -173,7 +174,7 @@ umem_sgmap_unmap:
 				compat_unlock_page(pages[i]);
 			if (!PageReserved(pages[i]))
 				set_page_dirty(pages[i]);
-			page_cache_release(pages[i]);
+			put_page(pages[i]);
 		}
 	}
 	vfree(sg);
@@ -194,7 +195,7 @@ int pcidriver_umem_sgunmap(pcidriver_privdata_t *privdata, pcidriver_umem_entry_
 	pcidriver_sysfs_remove(privdata, &(umem_entry->sysfs_attr));
 
 	/* Unmap user memory */
-	pci_unmap_sg( privdata->pdev, umem_entry->sg, umem_entry->nr_pages, PCI_DMA_BIDIRECTIONAL );
+	dma_unmap_sg( &(privdata->pdev->dev), umem_entry->sg, umem_entry->nr_pages, DMA_BIDIRECTIONAL );
 
 	/* Release the pages */
 	if (umem_entry->nr_pages > 0) {
@@ -205,7 +206,7 @@ int pcidriver_umem_sgunmap(pcidriver_privdata_t *privdata, pcidriver_umem_entry_
 				compat_unlock_page(umem_entry->pages[i]);
 			}
 			/* and release it from the cache */
-			page_cache_release( umem_entry->pages[i] );
+			put_page( umem_entry->pages[i] );
 		}
 	}
 
@@ -331,14 +332,14 @@ int pcidriver_umem_sync( pcidriver_privdata_t *privdata, umem_handle_t *umem_han
 
 	switch (umem_handle->dir) {
 		case PCIDRIVER_DMA_TODEVICE:
-			pci_dma_sync_sg_for_device( privdata->pdev, umem_entry->sg, umem_entry->nents, PCI_DMA_TODEVICE );
+			dma_sync_sg_for_device( &(privdata->pdev->dev), umem_entry->sg, umem_entry->nents, DMA_TO_DEVICE );
 			break;
 		case PCIDRIVER_DMA_FROMDEVICE:
-			pci_dma_sync_sg_for_cpu( privdata->pdev, umem_entry->sg, umem_entry->nents, PCI_DMA_FROMDEVICE );
+			dma_sync_sg_for_cpu( &(privdata->pdev->dev), umem_entry->sg, umem_entry->nents, DMA_FROM_DEVICE );
 			break;
 		case PCIDRIVER_DMA_BIDIRECTIONAL:
-			pci_dma_sync_sg_for_device( privdata->pdev, umem_entry->sg, umem_entry->nents, PCI_DMA_BIDIRECTIONAL );
-			pci_dma_sync_sg_for_cpu( privdata->pdev, umem_entry->sg, umem_entry->nents, PCI_DMA_BIDIRECTIONAL );
+			dma_sync_sg_for_device( &(privdata->pdev->dev), umem_entry->sg, umem_entry->nents, DMA_BIDIRECTIONAL );
+			dma_sync_sg_for_cpu( &(privdata->pdev->dev), umem_entry->sg, umem_entry->nents, DMA_BIDIRECTIONAL );
 			break;
 		default:
 			return -EINVAL;				/* wrong direction parameter */
@@ -347,6 +348,59 @@ int pcidriver_umem_sync( pcidriver_privdata_t *privdata, umem_handle_t *umem_han
 	return 0;
 }
 
+/**
+ *
+ * Check that part of mapped user memory is still backed by the pinned
+ * pages. munmap(), mremap() or MADV_DONTNEED leave the pages pinned but
+ * put others, or none, at the user address; DMA through the old SG list
+ * would then miss the application's data.
+ *
+ * @returns 0 if every page matches, -ESTALE if not
+ *
+ */
+int pcidriver_umem_check( pcidriver_privdata_t *privdata, umem_handle_t *umem_handle )
+{
+	pcidriver_umem_entry_t *umem_entry;
+	struct page *pages[UMEM_CHECK_BATCH];
+	unsigned long addr, first, nr_pages, i;
+	int res, j, ret = 0;
+
+	/* Find the associated umem_entry for this buffer */
+	umem_entry = pcidriver_umem_find_entry_id( privdata, umem_handle->handle_id );
+	if (umem_entry == NULL)
+		return -EINVAL;					/* umem_handle is not valid */
+
+	/* The range must lie inside the mapped area */
+	if ((umem_handle->size == 0) || (umem_handle->vma < umem_entry->vma) ||
+			(umem_handle->vma + umem_handle->size < umem_handle->vma))
+		return -EINVAL;
+
+	addr = umem_handle->vma & PAGE_MASK;
+	first = (addr - (umem_entry->vma & PAGE_MASK)) >> PAGE_SHIFT;
+	nr_pages = ((umem_handle->vma + umem_handle->size + ~PAGE_MASK) >> PAGE_SHIFT) - (addr >> PAGE_SHIFT);
+	if (first + nr_pages > umem_entry->nr_pages)
+		return -EINVAL;
+
+	mmap_read_lock(current->mm);
+	for (i = 0; (i < nr_pages) && (ret == 0); i += res) {
+		res = compat_get_user_pages(addr + (i << PAGE_SHIFT),
+					min_t(unsigned long, nr_pages - i, UMEM_CHECK_BATCH), 1, pages);
+		if (res <= 0) {
+			ret = -ESTALE;
+			break;
+		}
+
+		for (j = 0; j < res; j++) {
+			if (pages[j] != umem_entry->pages[first + i + j])
+				ret = -ESTALE;
+			put_page(pages[j]);
+		}
+	}
+	mmap_read_unlock(current->mm);
+
+	return ret;
+}
+
 /*
  *
  * Get the pcidriver_umem_entry_t structure for the given id.
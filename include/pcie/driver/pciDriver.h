@@ -57,6 +57,23 @@
  */
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Version of the ioctl structures, reported by PCIDRIVER_IOC_VERSION.
+ *  1: sizes and addresses as unsigned long, no VERSION ioctl
+ *  2: sizes, offsets and addresses of kmem/umem as 64-bit fields
+ *  3: named and persistent kernel memory
+ *  4: kernel memory shared with other processes
+ *  5: NUMA node of kernel memory in kmem_handle_t
+ *  6: mapping granularity of kernel memory
+ *  7: contiguous kernel memory beyond the page allocator, unnamed KMEM_ALLOC_NAMED
+ *  8: UMEM_CHECK
+ *  9: NUMA node of KMEM_ALLOC_NAMED only with PCIDRIVER_KMEM_FLAG_NODE,
+ *     KMEM_ALLOC always on the node of the device
+ * 10: ARM_IRQ
+ */
+#define PCIDRIVER_ABI_VERSION 10
 
 /* Possible values for ioctl commands */
 
@@ -72,6 +89,12 @@
 #define PCIDRIVER_MMAP_PCI	0
 #define PCIDRIVER_MMAP_KMEM 1
 
+/* Caching mode of a PCI mmap */
+#define PCIDRIVER_CACHE_DEFAULT	0	/* leave the page protection alone, MTRRs decide */
+#define PCIDRIVER_CACHE_UC		1	/* uncached */
+#define PCIDRIVER_CACHE_WC		2	/* write-combining, prefetchable BARs only */
+#define PCIDRIVER_CACHE_WT		3	/* write-through, prefetchable BARs only */
+
 /* Direction of a DMA operation */
 #define PCIDRIVER_DMA_BIDIRECTIONAL 0
 #define	PCIDRIVER_DMA_TODEVICE		1
@@ -89,16 +112,32 @@
 /* Maximum number of interrupt sources */
 #define PCIDRIVER_INT_MAXSOURCES 16
 
+/* Named kernel memory */
+#define PCIDRIVER_KMEM_NAME_MAX		32		/* including the terminating NUL */
+#define PCIDRIVER_KMEM_FLAG_PERSIST	0x1		/* kept by the driver when the file is closed */
+#define PCIDRIVER_KMEM_FLAG_CONTIG	0x2		/* may come from CMA, for buffers beyond the page allocator's largest block */
+#define PCIDRIVER_KMEM_FLAG_NODE	0x4		/* allocate on handle.node, not only on the node of the device */
+
+/* NUMA node of kernel memory: the one the device is attached to. The node
+ * field of kmem_handle_t fills what used to be padding, which binaries before
+ * ABI 5 left zeroed or uninitialized, so it is only read with
+ * PCIDRIVER_KMEM_FLAG_NODE. */
+#define PCIDRIVER_KMEM_NODE_DEVICE	(-1)
+
+/* Shared kernel memory */
+#define PCIDRIVER_KMEM_EXPORT_ALL_USERS	0x1		/* any user may import, not only the exporting one */
+
 /* Types */
 typedef struct {
-	unsigned long pa;
-	unsigned long size;
+	__u64 pa;
+	__u64 size;
 	int handle_id;
+	int node;			/* NUMA node, out; in for ALLOC_NAMED with PCIDRIVER_KMEM_FLAG_NODE */
 } kmem_handle_t;
 
 typedef struct {
-	unsigned long addr;
-	unsigned long size;
+	__u64 addr;
+	__u64 size;
 } umem_sgentry_t;
 
 typedef struct {
@@ -109,17 +148,41 @@ typedef struct {
 } umem_sglist_t;
 
 typedef struct {
-	unsigned long vma;
-	unsigned long size;
+	__u64 vma;
+	__u64 size;
 	int handle_id;
 	int dir;
 } umem_handle_t;
 
+typedef struct {
+	kmem_handle_t handle;		/* size in; pa and handle_id out */
+	unsigned int flags;			/* PCIDRIVER_KMEM_FLAG_*, out for ATTACH */
+	char name[PCIDRIVER_KMEM_NAME_MAX];	/* may be empty for ALLOC_NAMED without PERSIST */
+} kmem_named_t;
+
+typedef struct {
+	kmem_handle_t handle;		/* in for EXPORT, out for IMPORT */
+	__u64 key;					/* out for EXPORT, in for IMPORT */
+	unsigned int flags;			/* PCIDRIVER_KMEM_EXPORT_*, in for EXPORT */
+} kmem_export_t;
+
+typedef struct {
+	kmem_handle_t handle;
+	__u64 map_size;				/* out: bytes per page table entry when mmap()ed */
+} kmem_info_t;
+
 typedef struct {
 	kmem_handle_t handle;
 	int dir;
 } kmem_sync_t;
 
+typedef struct {
+	kmem_handle_t handle;
+	__u64 offset;				/* first byte to sync, relative to the buffer */
+	__u64 size;					/* bytes to sync */
+	int dir;
+} kmem_sync_range_t;
+
 
 typedef struct {
 	int size;
@@ -131,6 +194,38 @@ typedef struct {
 	} val;
 } pci_cfg_cmd;
 
+typedef struct {
+	unsigned int addr;			/* first byte, multiple of 4 */
+	unsigned int size;			/* bytes to read, multiple of 4; bytes read on return */
+	unsigned long data;			/* user buffer */
+} pci_cfg_range_t;
+
+/* Settings of pcie_tune_t to change, the others are only reported */
+#define PCIDRIVER_TUNE_MRRS		0x1
+#define PCIDRIVER_TUNE_MPS		0x2
+#define PCIDRIVER_TUNE_RELAXED	0x4
+#define PCIDRIVER_TUNE_NOSNOOP	0x8
+
+typedef struct {
+	unsigned int set;			/* PCIDRIVER_TUNE_* flags */
+	unsigned int mrrs;			/* max read request size, bytes */
+	unsigned int mps;			/* max payload size, bytes */
+	unsigned int mps_supported;	/* largest max payload size of the device */
+	unsigned int parent_mps;	/* max payload size of the upstream port, 0 if none */
+	unsigned int relaxed;		/* relaxed ordering enabled */
+	unsigned int nosnoop;		/* no snoop enabled */
+} pcie_tune_t;
+
+typedef struct {
+	unsigned int mode;			/* requested PCIDRIVER_CACHE_* mode */
+	unsigned int effective;		/* mode the next mmap of the current area will get */
+} mmap_cache_t;
+
+typedef struct {
+	unsigned int source;		/* interrupt source to wait for */
+	unsigned int timeout;		/* in microseconds */
+} irq_wait_t;
+
 typedef struct {
 	unsigned short vendor_id;
 	unsigned short device_id;
@@ -177,4 +272,56 @@ typedef struct {
 /* Clear interrupt queues */
 #define PCIDRIVER_IOC_CLEAR_IOQ   _IO(   PCIDRIVER_IOC_MAGIC, PCIDRIVER_IOC_BASE + 13 )
 
+/* Wait for an interrupt with a timeout, fails with ETIMEDOUT */
+#define PCIDRIVER_IOC_WAITI_TIMEOUT _IOW( PCIDRIVER_IOC_MAGIC, PCIDRIVER_IOC_BASE + 14, irq_wait_t * )
+
+/* Set the caching mode for the next PCI mmap() of this file, after MMAP_AREA.
+ * Later mmap() calls get PCIDRIVER_CACHE_DEFAULT again. */
+#define PCIDRIVER_IOC_MMAP_CACHE  _IOWR( PCIDRIVER_IOC_MAGIC, PCIDRIVER_IOC_BASE + 15, mmap_cache_t * )
+
+/* Read a range of the PCI config space (up to the extended 4 KB) in one call */
+#define PCIDRIVER_IOC_PCI_CFG_RANGE _IOWR( PCIDRIVER_IOC_MAGIC, PCIDRIVER_IOC_BASE + 16, pci_cfg_range_t * )
+
+/* Query and change the PCIe transport settings of the device */
+#define PCIDRIVER_IOC_PCIE_TUNE   _IOWR( PCIDRIVER_IOC_MAGIC, PCIDRIVER_IOC_BASE + 17, pcie_tune_t * )
+
+/* Sync part of a kernel memory buffer */
+#define PCIDRIVER_IOC_KMEM_SYNC_RANGE _IOW( PCIDRIVER_IOC_MAGIC, PCIDRIVER_IOC_BASE + 18, kmem_sync_range_t * )
+
+/* Get PCIDRIVER_ABI_VERSION of the driver, drivers without it fail with EINVAL */
+#define PCIDRIVER_IOC_VERSION     _IOR( PCIDRIVER_IOC_MAGIC, PCIDRIVER_IOC_BASE + 19, unsigned int * )
+
+/* Allocate kernel memory with a name and flags, fails with EEXIST if the name is taken */
+#define PCIDRIVER_IOC_KMEM_ALLOC_NAMED _IOWR( PCIDRIVER_IOC_MAGIC, PCIDRIVER_IOC_BASE + 20, kmem_named_t * )
+
+/* Attach to named kernel memory, e.g. kept from a previous process. Fails
+ * with ENOENT if there is none, EBUSY if another open file holds it, EACCES
+ * if another user allocated it. The next kmem mmap() of this file maps it. */
+#define PCIDRIVER_IOC_KMEM_ATTACH _IOWR( PCIDRIVER_IOC_MAGIC, PCIDRIVER_IOC_BASE + 21, kmem_named_t * )
+
+/* Get the key other processes import kernel memory with. Only the open file
+ * owning the memory may export it, else EPERM. The key stays the same for
+ * the life of the buffer; exporting again with other flags fails with
+ * EEXIST. */
+#define PCIDRIVER_IOC_KMEM_EXPORT _IOWR( PCIDRIVER_IOC_MAGIC, PCIDRIVER_IOC_BASE + 22, kmem_export_t * )
+
+/* Import exported kernel memory by its key. Fails with ENOENT for unknown
+ * keys, EACCES for another user's buffer. The next kmem mmap() of this file
+ * maps it, and the memory is freed after the last importer frees it or
+ * closes the file. */
+#define PCIDRIVER_IOC_KMEM_IMPORT _IOWR( PCIDRIVER_IOC_MAGIC, PCIDRIVER_IOC_BASE + 23, kmem_export_t * )
+
+/* Page size kernel memory is mapped with. Huge pages need the mapping to
+ * be aligned to them in user space too. */
+#define PCIDRIVER_IOC_KMEM_INFO   _IOWR( PCIDRIVER_IOC_MAGIC, PCIDRIVER_IOC_BASE + 24, kmem_info_t * )
+
+/* Check that vma..vma+size of mapped user memory is still backed by the
+ * pinned pages. Fails with ESTALE if the range was unmapped or remapped. */
+#define PCIDRIVER_IOC_UMEM_CHECK  _IOW( PCIDRIVER_IOC_MAGIC, PCIDRIVER_IOC_BASE + 25, umem_handle_t * )
+
+/* Clear the queue of an interrupt source and enable it on the device. The
+ * interrupt handler disables it again when it arrives. Fails with ENODEV if
+ * the driver has no interrupt, EINVAL for sources the device lacks. */
+#define PCIDRIVER_IOC_ARM_IRQ     _IO(  PCIDRIVER_IOC_MAGIC, PCIDRIVER_IOC_BASE + 26 )
+
 #endif
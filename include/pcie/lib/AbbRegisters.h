@@ -0,0 +1,94 @@
+#ifndef PD_ABBREGISTERS_H_
+#define PD_ABBREGISTERS_H_
+
+/* Generated by tools/regmap/regmap_gen.py from abb.regs, do not edit. */
+
+#include "Register.h"
+
+namespace pciDriver {
+
+namespace abb {
+
+/* Buffer descriptor of a DMA channel */
+template <uint32_t Base>
+struct BDA {
+	/* Device address */
+	typedef regs::Register<Base + 0x00, regs::RW> PA_H;
+	typedef regs::Register<Base + 0x04, regs::RW> PA_L;
+	/* Host (bus) address */
+	typedef regs::Register<Base + 0x08, regs::RW> HA_H;
+	typedef regs::Register<Base + 0x0C, regs::RW> HA_L;
+	/* Next descriptor in host memory, 0 for none */
+	typedef regs::Register<Base + 0x10, regs::RW> NEXT_H;
+	typedef regs::Register<Base + 0x14, regs::RW> NEXT_L;
+	/* Transfer length in bytes */
+	typedef regs::Register<Base + 0x18, regs::RW> LENGTH;
+	/* Written last, starts the transfer */
+	struct CONTROL : regs::Register<Base + 0x1C, regs::RW> {
+		typedef regs::Field<CONTROL, 0, 4> CMD;	/* 0xA resets the channel */
+		typedef regs::Field<CONTROL, 15, 1> AINC;	/* Increment the device address */
+		typedef regs::Field<CONTROL, 16, 3> BAR;	/* Device BAR of the transfer */
+		typedef regs::Field<CONTROL, 24, 1> LAST;	/* Last descriptor of a chain */
+		typedef regs::Field<CONTROL, 25, 1> VALID;	/* Descriptor is valid */
+	};
+	struct STATUS : regs::Register<Base + 0x20, regs::RO> {
+		typedef regs::Field<STATUS, 0, 1> DONE;	/* Transfer finished */
+		typedef regs::Field<STATUS, 4, 1> TIMEOUT;	/* Transfer timed out */
+	};
+	typedef regs::RegisterBlock<Base + 0x00, 7> DESCRIPTOR;
+};
+
+/* Interrupt status */
+struct INT_STAT : regs::Register<0x0008, regs::RW> {
+	typedef regs::Field<INT_STAT, 0, 1> CH1;	/* Upstream channel done */
+	typedef regs::Field<INT_STAT, 1, 1> CH0;	/* Downstream channel done */
+	typedef regs::Field<INT_STAT, 2, 1> IG;	/* Interrupt generator */
+	typedef regs::Field<INT_STAT, 4, 1> CH1_TIMEOUT;	/* Upstream channel timeout */
+	typedef regs::Field<INT_STAT, 5, 1> CH0_TIMEOUT;	/* Downstream channel timeout */
+};
+
+/* Interrupt enable, same bits as INT_STAT */
+struct INT_ENABLE : regs::Register<0x0010, regs::RW> {
+	typedef regs::Field<INT_ENABLE, 0, 1> CH1;
+	typedef regs::Field<INT_ENABLE, 1, 1> CH0;
+	typedef regs::Field<INT_ENABLE, 2, 1> IG;
+	typedef regs::Field<INT_ENABLE, 4, 1> CH1_TIMEOUT;
+	typedef regs::Field<INT_ENABLE, 5, 1> CH0_TIMEOUT;
+};
+
+/* Page of the DDR memory seen through BAR2 */
+typedef regs::Register<0x001C, regs::RW> SDRAM_PG;
+
+/* General status */
+struct GSR : regs::Register<0x0020, regs::RO> {
+	typedef regs::Field<GSR, 7, 1> DDR_RDY;	/* DDR memory calibrated */
+};
+
+/* Page of the Wishbone bus seen through BAR4 */
+typedef regs::Register<0x0024, regs::RW> WB_PG;
+
+/* Interrupt generator control */
+typedef regs::Register<0x0080, regs::RW> IG_CTRL;
+
+/* Written to IG_CTRL to acknowledge the generator interrupt */
+static const uint32_t IG_ACK = 0xF0;
+
+/* Completion writeback address, upstream channel */
+typedef regs::Register<0x0090, regs::RW> WB_ADDR_UP_H;
+typedef regs::Register<0x0094, regs::RW> WB_ADDR_UP_L;
+
+/* Completion writeback address, downstream channel */
+typedef regs::Register<0x0098, regs::RW> WB_ADDR_DOWN_H;
+typedef regs::Register<0x009C, regs::RW> WB_ADDR_DOWN_L;
+
+/* Upstream channel, device to host */
+typedef BDA<0x002C> DMA_UP;
+
+/* Downstream channel, host to device */
+typedef BDA<0x0050> DMA_DOWN;
+
+}
+
+}
+
+#endif /*PD_ABBREGISTERS_H_*/
@@ -0,0 +1,45 @@
+#ifndef PD_BARCOPY_H_
+#define PD_BARCOPY_H_
+
+/********************************************************************
+ *
+ * Copy kernels between host memory and a mapped BAR.
+ *
+ * memcpy() to device memory issues whatever the libc picks: byte or
+ * dword accesses, misaligned vector moves, or "rep movsb". The kernels
+ * here only issue aligned dword accesses up to the vector alignment,
+ * then aligned 16/32/64 byte accesses. Writes use non-temporal stores
+ * and end with sfence, so they combine in write-combined mappings and
+ * are ordered before anything the caller does next.
+ *
+ * Offsets and lengths must be multiples of 4 bytes.
+ *
+ *******************************************************************/
+
+#include <stddef.h>
+
+namespace pciDriver {
+
+class BarCopy {
+public:
+	enum kernel {
+		KERNEL_AUTO = 0,	/* best one supported by the CPU */
+		KERNEL_MEMCPY,		/* plain memcpy(), for reference */
+		KERNEL_DWORD,		/* volatile 32 bit accesses */
+		KERNEL_SSE2,		/* 16 byte accesses */
+		KERNEL_AVX2,		/* 32 byte accesses */
+		KERNEL_AVX512,		/* 64 byte accesses */
+		KERNELS
+	};
+
+	static bool isSupported(kernel k);
+	static kernel getBest();
+	static const char *getName(kernel k);
+
+	static void write(volatile void *dst, const void *src, size_t len, kernel k = KERNEL_AUTO);
+	static void read(void *dst, const volatile void *src, size_t len, kernel k = KERNEL_AUTO);
+};
+
+}
+
+#endif /*PD_BARCOPY_H_*/
@@ -0,0 +1,102 @@
+#ifndef PD_CONFIGSPACE_H_
+#define PD_CONFIGSPACE_H_
+
+/********************************************************************
+ *
+ * Snapshot of the PCI configuration space of a device.
+ *
+ * The whole config space (256 bytes, 4 KB for PCIe) is read in one
+ * call and the capability lists are indexed once, so the accessors do
+ * not go to the driver. Call refresh() to take a new snapshot, e.g.
+ * after the link was retrained or to see new AER status bits.
+ *
+ *******************************************************************/
+
+#include <stdint.h>
+#include "PciDevice.h"
+
+namespace pciDriver {
+
+class ConfigSpace {
+public:
+	/* Standard capability IDs */
+	enum cap_id {
+		CAP_PM = 0x01,
+		CAP_MSI = 0x05,
+		CAP_PCIE = 0x10,
+		CAP_MSIX = 0x11
+	};
+
+	/* Extended capability IDs */
+	enum ext_cap_id {
+		EXT_CAP_AER = 0x0001,
+		EXT_CAP_DSN = 0x0003
+	};
+
+	static const unsigned int SIZE = 4096;
+	static const unsigned int LEGACY_SIZE = 256;
+
+	/* Bytes of one TLP besides its payload: framing, sequence number, 4 DW header, LCRC */
+	static const unsigned int TLP_OVERHEAD = 24;
+
+	ConfigSpace(PciDevice& dev);
+
+	void refresh();
+	inline unsigned int getSize() { return size; }
+
+	uint8_t readByte(unsigned int addr);
+	uint16_t readWord(unsigned int addr);
+	uint32_t readDWord(unsigned int addr);
+
+	inline uint16_t getVendorId() { return readWord(0x00); }
+	inline uint16_t getDeviceId() { return readWord(0x02); }
+
+	/* Offset of a capability, 0 if the device does not have it */
+	unsigned int findCapability(unsigned int id);
+	unsigned int findExtCapability(unsigned int id);
+
+	inline bool isExpress() { return (findCapability(CAP_PCIE) != 0); }
+	inline bool hasMSI() { return (findCapability(CAP_MSI) != 0); }
+	inline bool hasMSIX() { return (findCapability(CAP_MSIX) != 0); }
+	inline bool hasAER() { return (findExtCapability(EXT_CAP_AER) != 0); }
+
+	/* PCIe link, 0 if the device is not PCIe */
+	unsigned int getLinkSpeed();			/* generation, 1 = 2.5 GT/s ... 5 = 32 GT/s */
+	unsigned int getLinkWidth();			/* lanes */
+	unsigned int getMaxLinkSpeed();
+	unsigned int getMaxLinkWidth();
+	static double getTransferRate(unsigned int speed);	/* GT/s per lane */
+
+	/* PCIe device control, in bytes */
+	unsigned int getMaxPayloadSize();
+	unsigned int getMaxReadRequestSize();
+	unsigned int getMaxPayloadSupported();
+
+	/* Data rate of the link after line encoding, bytes per second */
+	double getLinkBandwidth();
+	/* Payload rate with TLPs of the configured max payload size */
+	double getMaxThroughput();
+
+	/* MSI-X vectors, 0 without MSI-X */
+	unsigned int getMSIXTableSize();
+
+	/* AER status registers, 0 without AER */
+	uint32_t getAERUncorrectable();
+	uint32_t getAERCorrectable();
+
+protected:
+	PciDevice *device;
+	unsigned int size;
+	uint8_t data[SIZE];
+
+	/* First offset of each standard (8 bit ID) and extended (16 bit ID) capability */
+	uint16_t cap[256];
+	uint16_t ext_cap[64];
+
+	void parse();
+	unsigned int pcie(unsigned int reg);
+};
+
+}
+
+#endif /*PD_CONFIGSPACE_H_*/
@@ -0,0 +1,89 @@
+#ifndef PD_DMAALLOCATOR_H_
+#define PD_DMAALLOCATOR_H_
+
+/********************************************************************
+ *
+ * Allocator for standard containers whose storage the device can reach.
+ *
+ * DmaAllocator meets the Allocator requirements and takes its memory
+ * from a DmaArena, by default the one of the device, so the data of a
+ * vector can be handed to the DMA engine in place instead of being
+ * copied into a KernelMemory buffer first:
+ *
+ *   DmaAllocator<uint32_t> alloc(dev);
+ *   std::vector<uint32_t, DmaAllocator<uint32_t> > v(1024, 0, alloc);
+ *   ...
+ *   DmaEngine engine(dev, DmaEngine::TO_DEVICE);
+ *   engine.transfer(alloc.getBusAddress(v.data()), 0x0, 4096, 2);	// into BAR2
+ *
+ * Every allocation is a block of the arena, so a container can hold at
+ * most DmaArena::getMaxBlockSize() bytes at once; beyond that, and when
+ * the arena is full, allocate() throws std::bad_alloc like any other
+ * allocator. Node based containers take a block of at least 64 bytes
+ * per node.
+ *
+ * Copies and rebound copies share the arena and compare equal. The arena
+ * must outlive the containers; the one of the device lives until the
+ * device is closed.
+ *
+ *******************************************************************/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include "PciDevice.h"
+#include "DmaArena.h"
+#include "Exception.h"
+
+namespace pciDriver {
+
+template <class T>
+class DmaAllocator {
+	template <class U> friend class DmaAllocator;
+public:
+	typedef T value_type;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+	template <class U> struct rebind { typedef DmaAllocator<U> other; };
+
+	explicit DmaAllocator(DmaArena& a) : arena(&a) {}
+	explicit DmaAllocator(PciDevice& dev) : arena(&dev.getDmaArena()) {}
+	template <class U> DmaAllocator(const DmaAllocator<U>& other) : arena(other.arena) {}
+
+	T *allocate(size_t n)
+	{
+		if (n > arena->getMaxBlockSize() / sizeof(T))
+			throw std::bad_alloc();
+
+		try {
+			return static_cast<T *>(arena->alloc(n * sizeof(T)).ptr);
+		} catch (Exception& e) {
+			throw std::bad_alloc();
+		}
+	}
+
+	void deallocate(T *p, size_t n)
+	{
+		(void)n;
+		arena->free(p);
+	}
+
+	/* Bus address of any element, e.g. v.data() + i */
+	inline uint64_t getBusAddress(const T *p) const { return arena->getBusAddress(p); }
+	inline void sync(const T *p, size_t n, KernelMemory::sync_dir dir) const
+		{ arena->sync(p, n * sizeof(T), dir); }
+	inline DmaArena& getArena() const { return *arena; }
+
+	template <class U> inline bool operator==(const DmaAllocator<U>& other) const
+		{ return arena == other.arena; }
+	template <class U> inline bool operator!=(const DmaAllocator<U>& other) const
+		{ return arena != other.arena; }
+
+private:
+	DmaArena *arena;
+};
+
+}
+
+#endif /*PD_DMAALLOCATOR_H_*/
@@ -0,0 +1,118 @@
+#ifndef PD_DMAARENA_H_
+#define PD_DMAARENA_H_
+
+/********************************************************************
+ *
+ * Small DMA buffers carved out of one large registration.
+ *
+ * Every KernelMemory is at least a page, an entry in the kmem list of
+ * the driver and a sysfs file; every UserMemory pins its own pages.
+ * A DmaArena registers one region and hands out blocks of 64 bytes and
+ * up with a buddy allocator: sizes are rounded up to a power of two,
+ * blocks are aligned to their size relative to the start of the region
+ * and merged again when freed. KernelMemory regions start on a page, so
+ * blocks up to a page are aligned to their size in bus addresses too.
+ *
+ * A block never crosses a discontinuity of the bus addresses, so with
+ * UserMemory the largest block is bounded by the scatter/gather layout,
+ * usually one page. The allocator bookkeeping lives in host memory, the
+ * blocks are free for the device to write.
+ *
+ * Syncs go through the parent registration: KernelMemory syncs just the
+ * block, UserMemory syncs the whole region.
+ *
+ * Thread-safe.
+ *
+ *******************************************************************/
+
+#include <stdint.h>
+#include <pthread.h>
+#include "PciDevice.h"
+#include "KernelMemory.h"
+#include "UserMemory.h"
+
+namespace pciDriver {
+
+class DmaArena {
+public:
+	struct block {
+		void *ptr;				/* CPU address */
+		uint64_t bus;			/* bus address for the device */
+		unsigned long offset;	/* inside the arena */
+		unsigned long size;		/* rounded up to a power of two */
+	};
+
+	static const unsigned int DEFAULT_MIN_SHIFT = 6;	/* 64 bytes */
+
+	DmaArena(PciDevice& dev, unsigned long size, unsigned int min_shift = DEFAULT_MIN_SHIFT);
+	DmaArena(KernelMemory& km, unsigned int min_shift = DEFAULT_MIN_SHIFT);
+	DmaArena(UserMemory& um, unsigned int min_shift = DEFAULT_MIN_SHIFT);
+	~DmaArena();
+
+	block alloc(unsigned long size);
+	void free(const block& b);
+	void free(void *ptr);
+	void sync(const block& b, KernelMemory::sync_dir dir);
+	void sync(const void *ptr, unsigned long len, KernelMemory::sync_dir dir);
+
+	/* Lookups for any address inside the region, e.g. a vector element */
+	inline bool contains(const void *ptr)
+		{ return (static_cast<const uint8_t *>(ptr) >= base) && (static_cast<const uint8_t *>(ptr) < base + size); }
+	uint64_t getBusAddress(const void *ptr);
+
+	inline unsigned long getSize() { return size; }
+	inline unsigned long getMinBlockSize() { return 1UL << min_shift; }
+	inline unsigned long getMaxBlockSize() { return 1UL << max_shift; }
+	inline unsigned long getUsed() { return used; }
+	inline unsigned long getBlocks() { return blocks; }
+
+protected:
+	/* Contiguous bus address range of the region */
+	struct segment {
+		unsigned long offset;
+		uint64_t bus;
+	};
+
+	/* State of a minimum sized unit: head of a free or allocated block */
+	static const uint8_t UNIT_NONE = 0x00;
+	static const uint8_t UNIT_FREE = 0x40;
+	static const uint8_t UNIT_USED = 0x80;
+	static const uint8_t UNIT_SHIFT = 0x3F;
+	static const uint32_t NONE = 0xFFFFFFFF;
+	static const unsigned int MAX_SHIFT = 32;
+
+	KernelMemory *kmem;
+	UserMemory *umem;
+	bool owned;
+
+	uint8_t *base;
+	unsigned long size;
+	unsigned int min_shift;
+	unsigned int max_shift;
+
+	segment *segs;
+	unsigned int nsegs;
+
+	/* Per unit: state, and links of the free list it is on */
+	unsigned long units;
+	uint8_t *state;
+	uint32_t *next;
+	uint32_t *prev;
+	uint32_t free_list[MAX_SHIFT + 1];
+
+	unsigned long used;
+	unsigned long blocks;
+	pthread_mutex_t lock;
+
+	void init(unsigned int min_shift);
+	void release();
+	uint64_t segmentAddress(unsigned long offset);
+	unsigned long getOffset(const void *ptr);
+	void freeUnit(unsigned long u);
+	void pushFree(uint32_t u, unsigned int shift);
+	void removeFree(uint32_t u, unsigned int shift);
+};
+
+}
+
+#endif /*PD_DMAARENA_H_*/
@@ -0,0 +1,151 @@
+#ifndef PD_DMAENGINE_H_
+#define PD_DMAENGINE_H_
+
+/********************************************************************
+ *
+ * Access to one channel of the ABB DMA engine found in BAR0.
+ *
+ * Each channel exposes a buffer descriptor (BDA) as a block of nine
+ * dwords: device address, host address, next descriptor, length,
+ * control and status. Writing the control dword starts the transfer.
+ *
+ *******************************************************************/
+
+#include <stdint.h>
+#include "PciDevice.h"
+
+namespace pciDriver {
+
+class KernelMemory;
+
+class DmaEngine {
+public:
+	/* Channel direction, as seen from the host */
+	enum direction {
+		TO_DEVICE = 0,		/* downstream channel, host -> device */
+		FROM_DEVICE = 1		/* upstream channel, device -> host */
+	};
+
+	/* Channel register blocks in BAR0 (byte offsets) */
+	static const unsigned int BASE_DMA_UP = 0x2C;
+	static const unsigned int BASE_DMA_DOWN = 0x50;
+
+	/* Completion writeback address registers in BAR0 (byte offsets, high dword first).
+	 * Optional: bitstreams without writeback read them back as zero. */
+	static const unsigned int WB_ADDR_UP = 0x90;
+	static const unsigned int WB_ADDR_DOWN = 0x98;
+
+	/* Dword offsets inside a channel register block */
+	enum bda_reg {
+		BDA_PA_H = 0,
+		BDA_PA_L = 1,
+		BDA_HA_H = 2,
+		BDA_HA_L = 3,
+		BDA_NEXT_H = 4,
+		BDA_NEXT_L = 5,
+		BDA_LENGTH = 6,
+		BDA_CONTROL = 7,
+		BDA_STATUS = 8
+	};
+
+	/* Control word bits */
+	static const uint32_t CTRL_VALID = 0x02000000;
+	static const uint32_t CTRL_LAST = 0x01000000;
+	static const uint32_t CTRL_AINC = 0x00008000;
+	static const uint32_t CTRL_RESET = 0x0000000A;
+	static const unsigned int CTRL_BAR_SHIFT = 16;
+
+	/* Status word bits */
+	static const uint32_t STAT_DONE = 0x1;
+	static const uint32_t STAT_TIMEOUT = (0x1 << 4);
+
+	/* The length register is 32 bits wide, keep chunks to a power of two below it */
+	static const uint32_t MAX_LENGTH = 0x80000000;
+
+	/* Interrupt sources of the channels, as numbered by the driver */
+	static const unsigned int IRQ_DOWN = 0;
+	static const unsigned int IRQ_UP = 1;
+
+	/* How wait() spends the time until the transfer completes */
+	enum wait_strategy {
+		WAIT_SPIN = 0,		/* poll the status without pause */
+		WAIT_PAUSE,			/* poll with pause and exponential backoff */
+		WAIT_YIELD,			/* spin, then poll between sched_yield() calls */
+		WAIT_INTERRUPT,		/* spin, then sleep on the channel interrupt,
+							 * in 1 ms slices if the driver has no IRQ */
+		WAIT_UMWAIT,		/* UMONITOR/UMWAIT on the writeback word */
+		WAIT_STRATEGIES
+	};
+
+	/* Per-strategy wait counters */
+	struct wait_stats {
+		unsigned long waits;		/* waits that saw the transfer finish */
+		unsigned long timeouts;		/* waits that hit the deadline */
+		unsigned long polls;		/* status reads */
+		uint64_t total_ns;			/* wall time spent waiting */
+		uint64_t max_ns;			/* longest single wait */
+		uint64_t cpu_ns;			/* CPU time spent waiting */
+	};
+
+	static const unsigned long DEFAULT_TIMEOUT = 1000000;	/* us */
+	static const unsigned long DEFAULT_SPIN = 20;			/* us */
+
+	DmaEngine(PciDevice& dev, direction dir);
+	~DmaEngine();
+
+	void reset();
+	void start(uint64_t ha, uint64_t pa, uint32_t length, unsigned int bar, uint64_t next = 0);
+	bool poll();
+	void wait();
+
+	void setWaitStrategy(wait_strategy s);
+	inline wait_strategy getWaitStrategy() { return strategy; }
+	inline void setTimeout(unsigned long usec) { timeout = usec; }
+	inline void setSpinTime(unsigned long usec) { spin = usec; }
+	inline const wait_stats& getWaitStats(wait_strategy s) { return stats[s]; }
+	void resetWaitStats();
+
+	static const char *getWaitStrategyName(wait_strategy s);
+	static bool hasUmwait();
+
+	void enableWriteback();
+	void disableWriteback();
+	inline bool hasWriteback() { return (wb != NULL); }
+
+	/**
+	 *
+	 * Starts a single transfer and waits for its completion.
+	 *
+	 */
+	inline void transfer(uint64_t ha, uint64_t pa, uint32_t length, unsigned int bar)
+		{ start(ha, pa, length, bar); wait(); }
+
+	inline direction getDirection() { return dir; }
+	inline uint32_t getStatus() { return status; }
+
+protected:
+	PciDevice *device;
+	direction dir;
+	volatile uint32_t *bar0;
+	volatile uint32_t *regs;
+	volatile uint32_t *wb_regs;
+	uint32_t status;
+
+	KernelMemory *wb_mem;
+	volatile uint32_t *wb;
+
+	wait_strategy strategy;
+	unsigned long timeout;
+	unsigned long spin;
+	wait_stats stats[WAIT_STRATEGIES];
+
+	bool waitSpin(uint64_t deadline, unsigned long& polls);
+	bool waitPause(uint64_t deadline, unsigned long& polls);
+	bool waitYield(uint64_t deadline, unsigned long& polls);
+	bool waitInterrupt(uint64_t deadline, unsigned long& polls);
+	bool waitUmwait(uint64_t deadline, unsigned long& polls);
+};
+
+}
+
+#endif /*PD_DMAENGINE_H_*/
@@ -0,0 +1,81 @@
+#ifndef PD_DMAPIPELINE_H_
+#define PD_DMAPIPELINE_H_
+
+/********************************************************************
+ *
+ * Transfers of arbitrary size between host memory and a device BAR.
+ *
+ * The range is split into chunks the engine can handle. While the DMA
+ * of one chunk is running, the host prepares the next one: either by
+ * copying it into a KernelMemory staging buffer (STAGED) or by pinning
+ * the next window of the user buffer (ZERO_COPY).
+ *
+ *******************************************************************/
+
+#include <stdint.h>
+#include "PciDevice.h"
+#include "DmaEngine.h"
+
+namespace pciDriver {
+
+class KernelMemory;
+class UserMemory;
+
+class DmaPipeline {
+public:
+	enum mode {
+		STAGED = 0,		/* copy through KernelMemory staging buffers */
+		ZERO_COPY = 1	/* DMA directly from/to the pinned user buffer */
+	};
+
+	static const unsigned long DEFAULT_CHUNK_SIZE = (4 << 20);
+	static const unsigned int DEFAULT_DEPTH = 2;
+
+	DmaPipeline(PciDevice& dev, unsigned int bar, mode m = STAGED);
+	~DmaPipeline();
+
+	void setChunkSize(unsigned long size);
+	void setDepth(unsigned int depth);
+	inline void setMode(mode m) { this->m = m; }
+
+	inline unsigned long getChunkSize() { return chunk_size; }
+	inline unsigned int getDepth() { return depth; }
+	inline mode getMode() { return m; }
+
+	void enableWriteback();
+	void setWaitStrategy(DmaEngine::wait_strategy s);
+	inline DmaEngine& getEngine(DmaEngine::direction dir)
+		{ return (dir == DmaEngine::TO_DEVICE) ? ds : us; }
+
+	void write(uint64_t devaddr, const void *src, uint64_t len);
+	void read(void *dst, uint64_t devaddr, uint64_t len);
+
+protected:
+	PciDevice *device;
+	unsigned int bar;
+	mode m;
+	unsigned long chunk_size;
+	unsigned int depth;
+
+	DmaEngine ds;
+	DmaEngine us;
+
+	KernelMemory **stage;
+	unsigned int nstage;
+	bool busy;
+
+	void allocStaging();
+	void freeStaging();
+	void kick(DmaEngine& engine, uint64_t ha, uint64_t pa, unsigned long len);
+	void finish(DmaEngine& engine);
+	void kickSG(DmaEngine& engine, UserMemory *um, uint64_t pa);
+
+	void writeStaged(uint64_t devaddr, const unsigned char *src, uint64_t len);
+	void readStaged(unsigned char *dst, uint64_t devaddr, uint64_t len);
+	void writeZeroCopy(uint64_t devaddr, unsigned char *src, uint64_t len);
+	void readZeroCopy(unsigned char *dst, uint64_t devaddr, uint64_t len);
+};
+
+}
+
+#endif /*PD_DMAPIPELINE_H_*/
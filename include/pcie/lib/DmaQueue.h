@@ -0,0 +1,161 @@
+#ifndef PD_DMAQUEUE_H_
+#define PD_DMAQUEUE_H_
+
+/********************************************************************
+ *
+ * Multi-producer submission queue for one DMA channel.
+ *
+ * Any number of threads submit requests without taking a lock. A
+ * single submitter thread owns the channel: it collects the queued
+ * requests into a descriptor chain in host memory, starts the chain
+ * with one write of the control register and, once the chain has
+ * finished, calls the completion callback of every request in it.
+ *
+ * While one chain runs, the next one is built in the other half of
+ * the descriptor ring.
+ *
+ * Requests belong to one of two priority classes. A chain takes every
+ * pending HIGH request first, then fills up with BULK data, split into
+ * chunks and limited per chain, so a HIGH request never waits for more
+ * than the chain in flight and the one already built.
+ *
+ *******************************************************************/
+
+#include <stdint.h>
+#include <pthread.h>
+#include "PciDevice.h"
+#include "DmaEngine.h"
+
+namespace pciDriver {
+
+class KernelMemory;
+
+class DmaQueue {
+public:
+	struct request;
+
+	enum priority {
+		HIGH = 0,		/* latency critical, never split */
+		BULK = 1,		/* split into chunks between HIGH requests */
+		PRIORITIES
+	};
+
+	/* Called from the submitter thread once the request has finished */
+	typedef void (*callback_t)(request *req);
+
+	struct request {
+		uint64_t ha;			/* host (bus) address */
+		uint64_t pa;			/* address inside the BAR */
+		uint32_t length;		/* bytes, multiple of 4 */
+		callback_t callback;	/* may be NULL */
+		void *arg;				/* free for the producer */
+		int result;				/* 0, or the Exception::Type of the failure */
+		uint64_t submit_ns;		/* CLOCK_MONOTONIC timestamps, set by the queue */
+		uint64_t complete_ns;
+
+		priority prio;			/* owned by the queue while submitted */
+		request *next;
+	};
+
+	/* Per-class counters. Depths are updated by the producers, the rest by
+	 * the submitter thread, read them once the traffic has stopped. */
+	struct class_stats {
+		unsigned long submitted;
+		unsigned long completed;
+		unsigned long depth;		/* queued, not yet in a chain */
+		unsigned long max_depth;
+		uint64_t total_ns;			/* submit to callback */
+		uint64_t max_ns;
+	};
+
+	/* Descriptor as read by the engine from host memory, same dword order
+	 * as the register block of a channel, padded to 64 bytes */
+	struct descriptor {
+		uint32_t pa_h;
+		uint32_t pa_l;
+		uint32_t ha_h;
+		uint32_t ha_l;
+		uint32_t next_h;
+		uint32_t next_l;
+		uint32_t length;
+		uint32_t control;
+		uint32_t status;
+		uint32_t reserved[7];
+	};
+
+	static const unsigned int DEFAULT_BATCH = 64;
+	static const uint32_t DEFAULT_CHUNK_SIZE = (64 << 10);
+	static const uint32_t DEFAULT_BULK_BUDGET = (256 << 10);
+
+	DmaQueue(PciDevice& dev, DmaEngine::direction dir, unsigned int bar,
+		unsigned int max_batch = DEFAULT_BATCH);
+	~DmaQueue();
+
+	void submit(request *req, priority prio = BULK);
+
+	void setChunkSize(uint32_t size);
+	void setBulkBudget(uint32_t bytes);
+
+	inline DmaEngine& getEngine() { return engine; }
+	inline unsigned long getBatches() { return batches; }
+	inline unsigned long getCompleted() { return completed; }
+	inline const class_stats& getStats(priority prio) { return stats[prio]; }
+	void resetStats();
+
+protected:
+	PciDevice *device;
+	unsigned int bar;
+	unsigned int max_batch;
+	uint32_t chunk_size;
+	uint32_t bulk_budget;
+	DmaEngine engine;
+
+	/* One descriptor of a chain, a whole request or a chunk of a BULK one */
+	struct slot {
+		request *req;
+		uint32_t offset;
+		uint32_t length;
+		bool last;
+	};
+
+	/* Descriptor ring, two halves of max_batch entries */
+	KernelMemory *ring;
+	descriptor *desc;
+
+	/* Intrusive MPSC lists per class: producers swap head, the submitter pops at tail */
+	request *head[PRIORITIES];
+	request *tail[PRIORITIES];
+	request stub[PRIORITIES];
+
+	/* BULK request being split, and how much of it is already chained */
+	request *bulk_cur;
+	uint32_t bulk_off;
+
+	/* Submitter thread and its idle wakeup */
+	pthread_t thread;
+	pthread_mutex_t idle_mutex;
+	pthread_cond_t idle_cond;
+	int idle;
+	int stop;
+
+	unsigned long batches;
+	unsigned long completed;
+	class_stats stats[PRIORITIES];
+
+	void push(priority prio, request *req);
+	request *pop(priority prio);
+	bool pending();
+
+	unsigned int collect(slot *batch);
+	void build(unsigned int half, slot *batch, unsigned int n);
+	void launch(unsigned int half);
+	void complete(slot *batch, unsigned int n, int result);
+	void sleep();
+	void run();
+
+	static void *submitter(void *arg);
+};
+
+}
+
+#endif /*PD_DMAQUEUE_H_*/
@@ -43,7 +43,9 @@ public:
 		MMAP_FAILED,
 		ALLOC_FAILED,
 		SGMAP_FAILED,
-		INTERRUPT_FAILED
+		INTERRUPT_FAILED,
+		INVALID_ARGUMENT,
+		DMA_TIMEOUT
 	};
 
 	static const char* descriptions[];
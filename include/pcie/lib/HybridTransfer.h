@@ -0,0 +1,95 @@
+#ifndef PD_HYBRIDTRANSFER_H_
+#define PD_HYBRIDTRANSFER_H_
+
+/********************************************************************
+ *
+ * Transfers that pick the fastest path by size.
+ *
+ * Small transfers are fastest as PIO through the mapped BAR, larger
+ * ones as DMA through KernelMemory staging buffers, the largest as DMA
+ * straight from the pinned user buffer. Where the paths cross depends
+ * on the board and the host, so the thresholds come from calibrate(),
+ * which measures all paths and can store the result per device. Later
+ * instances load it again.
+ *
+ * Calibration files live in $PCIDRIVER_CALIBRATION_DIR, or else in
+ * $HOME/.cache/pcidriver.
+ *
+ * Device addresses and lengths must be multiples of 4 bytes. Not
+ * thread-safe, like DmaPipeline.
+ *
+ *******************************************************************/
+
+#include <stdint.h>
+#include <stddef.h>
+#include "PciDevice.h"
+#include "DmaEngine.h"
+#include "DmaPipeline.h"
+
+namespace pciDriver {
+
+class HybridTransfer {
+public:
+	enum path {
+		PATH_PIO = 0,		/* copy through the mapped BAR */
+		PATH_STAGED,		/* DMA through KernelMemory */
+		PATH_ZERO_COPY,		/* DMA from/to the pinned user buffer */
+		PATHS
+	};
+
+	/* Per direction, indexed by DmaEngine::direction */
+	struct thresholds {
+		uint64_t pio_max[2];		/* largest PIO transfer */
+		uint64_t zero_copy_min[2];	/* smallest zero-copy transfer */
+	};
+
+	struct path_stats {
+		unsigned long count;
+		uint64_t bytes;
+		uint64_t ns;
+	};
+
+	static const uint64_t DEFAULT_PIO_WRITE = (4 << 10);
+	static const uint64_t DEFAULT_PIO_READ = 256;
+	static const uint64_t DEFAULT_ZERO_COPY = (1 << 20);
+
+	HybridTransfer(PciDevice& dev, unsigned int bar);
+	~HybridTransfer();
+
+	void write(uint64_t devaddr, const void *src, uint64_t len);
+	void read(void *dst, uint64_t devaddr, uint64_t len);
+
+	path choose(DmaEngine::direction dir, uint64_t devaddr, const void *buf, uint64_t len);
+
+	const thresholds& calibrate(uint64_t devaddr, uint64_t max_len, bool persist = true);
+	bool load();
+	bool save();
+	inline const thresholds& getThresholds() { return th; }
+	inline void setThresholds(const thresholds& t) { th = t; }
+	inline bool isCalibrated() { return calibrated; }
+
+	inline path getLastPath() { return last; }
+	inline const path_stats& getStats(path p) { return stats[p]; }
+	void resetStats();
+
+	static const char *getPathName(path p);
+
+protected:
+	PciDevice *device;
+	unsigned int bar;
+	uint64_t bar_size;
+	DmaPipeline pipe;
+
+	thresholds th;
+	bool calibrated;
+	path last;
+	path_stats stats[PATHS];
+
+	void run(path p, DmaEngine::direction dir, uint64_t devaddr, void *buf, uint64_t len);
+	double measure(path p, DmaEngine::direction dir, uint64_t devaddr, void *buf, uint64_t len);
+	bool getFileName(char *name, size_t size, bool create);
+};
+
+}
+
+#endif /*PD_HYBRIDTRANSFER_H_*/
@@ -18,35 +18,88 @@ namespace pciDriver {
 class KernelMemory {
 	friend class PciDevice;
 	
+public:
+	static const unsigned int NAME_MAX_LEN = 32;	/* PCIDRIVER_KMEM_NAME_MAX */
+	static const int NODE_DEVICE = -1;				/* PCIDRIVER_KMEM_NODE_DEVICE */
+
+	/* Allocation flags, PCIDRIVER_KMEM_FLAG_* */
+	static const unsigned int PERSIST = 0x1;		/* kept when deleted, requires a name */
+	static const unsigned int CONTIGUOUS = 0x2;		/* may come from CMA, beyond the page allocator */
+
 protected:
-	unsigned long pa;
-	unsigned long size;
+	uint64_t pa;
+	uint64_t size;
 	int handle_id;
 	void *mem;
 	PciDevice *device;
+	bool persistent;
+	char name[NAME_MAX_LEN];
+	int node;
+	uint64_t map_granularity;
 
-	KernelMemory(PciDevice& device, unsigned int size);
+	KernelMemory(PciDevice& device, uint64_t size, const char *name = NULL, unsigned int flags = 0,
+			int node = NODE_DEVICE);
+	KernelMemory(PciDevice& device, const char *name);
+	struct import_tag {};
+	KernelMemory(PciDevice& device, uint64_t key, import_tag);
+	bool mapBuffer();
 public:
 	~KernelMemory();
 
+	uint64_t exportHandle(bool all_users = false);
+	static KernelMemory& importHandle(PciDevice& device, uint64_t key);
+
 	/**
 	 *
 	 * @returns the physical address of the kernel memory.
 	 *
 	 */
-	inline unsigned long getPhysicalAddress() { return pa; }
+	inline uint64_t getPhysicalAddress() { return pa; }
 	/**
 	 *
 	 * @returns the size of the kernel memory.
 	 *
 	 */
-	inline unsigned long getSize() { return size; }
+	inline uint64_t getSize() { return size; }
 	/**
 	 *
 	 * @returns the pointer to the memory.
 	 *
 	 */
 	inline void *getBuffer() { return mem; }
+	/**
+	 *
+	 * @returns the name of the kernel memory, empty if unnamed.
+	 *
+	 */
+	inline const char *getName() { return name; }
+	/**
+	 *
+	 * @returns the NUMA node of the kernel memory, -1 if the driver does
+	 * not tell.
+	 *
+	 */
+	inline int getNode() { return node; }
+	/**
+	 *
+	 * @returns the page size the kernel memory is mapped with, e.g. 2 MB
+	 * for large buffers the driver maps with huge pages.
+	 *
+	 */
+	inline uint64_t getMapGranularity() { return map_granularity; }
+	/**
+	 *
+	 * @returns true if deleting the object keeps the kernel memory in the
+	 * driver, for the next process to attach.
+	 *
+	 */
+	inline bool isPersistent() { return persistent; }
+	/**
+	 *
+	 * Makes deleting the object free the kernel memory, also if persistent.
+	 *
+	 */
+	inline void freeOnDelete() { persistent = false; }
 
 	enum sync_dir {
 		BIDIRECTIONAL = 0,
@@ -55,6 +108,7 @@ public:
 	};
 
 	void sync(sync_dir dir);
+	void sync(sync_dir dir, uint64_t offset, uint64_t len);
 };
 	
 }
@@ -0,0 +1,155 @@
+#ifndef PD_KERNELMEMORYPOOL_H_
+#define PD_KERNELMEMORYPOOL_H_
+
+/********************************************************************
+ *
+ * Pool of KernelMemory buffers, for code that needs a DMA buffer per
+ * request.
+ *
+ * Allocating kernel memory takes two ioctls and an mmap, freeing it a
+ * munmap and another ioctl. The pool keeps released buffers instead and
+ * hands them out again. Sizes are rounded up to a power of two between
+ * 4 KB and 4 MB (size classes); larger requests bypass the pool.
+ *
+ * Each thread keeps a few buffers per class for itself, so most
+ * acquire/release pairs take no lock and touch no shared cache line.
+ * Beyond that, buffers go to a global free list per class, a lock-free
+ * stack. When the idle buffers on the global lists exceed the high
+ * watermark, they are freed down to the low one.
+ *
+ *   KernelMemoryPool pool(dev);
+ *   {
+ *       KernelMemoryPool::Lease buf = pool.acquire(65536);
+ *       engine.transfer(buf.getPhysicalAddress(), 0x0, 65536, 2);
+ *   }   // back to the pool
+ *
+ * Leases must not outlive their pool.
+ *
+ *******************************************************************/
+
+#include <stdint.h>
+#include <pthread.h>
+#include "PciDevice.h"
+#include "KernelMemory.h"
+
+namespace pciDriver {
+
+class KernelMemoryPool {
+public:
+	static const unsigned int MIN_SHIFT = 12;		/* 4 KB */
+	static const unsigned int CLASSES = 11;			/* up to 4 MB */
+	static const unsigned int CACHE_SIZE = 8;		/* buffers per class and thread */
+
+	static const unsigned int DEFAULT_MAX_BUFFERS = 1024;
+	static const uint64_t DEFAULT_LOW_WATERMARK = (32 << 20);
+	static const uint64_t DEFAULT_HIGH_WATERMARK = (64 << 20);
+
+	struct stats {
+		unsigned long local_hits;	/* served from the thread cache */
+		unsigned long global_hits;	/* served from a global free list */
+		unsigned long allocations;	/* new buffers for the pool */
+		unsigned long unpooled;		/* buffers that bypassed the pool */
+		unsigned long trimmed;		/* buffers freed by trimming */
+		uint64_t idle_bytes;		/* on the global free lists */
+		uint64_t pooled_bytes;		/* owned by the pool, idle or leased */
+	};
+
+	/* A buffer on loan from the pool, returned when it goes out of scope */
+	class Lease {
+		friend class KernelMemoryPool;
+	public:
+		Lease() : pool(NULL), slot(0), km(NULL), size(0) {}
+		Lease(Lease&& other);
+		Lease& operator=(Lease&& other);
+		~Lease() { release(); }
+
+		void release();
+
+		inline KernelMemory& get() { return *km; }
+		inline void *getBuffer() { return km->getBuffer(); }
+		inline unsigned long getPhysicalAddress() { return km->getPhysicalAddress(); }
+		/* The requested size, the buffer may be larger */
+		inline unsigned long getSize() { return size; }
+		inline bool isValid() { return (km != NULL); }
+
+	private:
+		KernelMemoryPool *pool;
+		uint32_t slot;
+		KernelMemory *km;
+		unsigned long size;
+
+		Lease(KernelMemoryPool *p, uint32_t s, KernelMemory *k, unsigned long len)
+			: pool(p), slot(s), km(k), size(len) {}
+		Lease(const Lease&);
+		Lease& operator=(const Lease&);
+	};
+
+	KernelMemoryPool(PciDevice& dev, unsigned int max_buffers = DEFAULT_MAX_BUFFERS);
+	~KernelMemoryPool();
+
+	Lease acquire(unsigned int size);
+	void reserve(unsigned int size, unsigned int count);
+
+	void setWatermarks(uint64_t low, uint64_t high);
+	void trim();
+	void flush();
+
+	stats getStats();
+
+	static unsigned int getClassSize(unsigned int size);
+
+protected:
+	static const uint32_t NONE = 0xFFFFFFFF;
+
+	/* Everything the pool owns has a slot. The free lists and the list of
+	 * unused slots are stacks of slot indices, tagged against ABA. */
+	struct slot {
+		KernelMemory *km;
+		uint32_t next;
+		uint8_t cls;
+	};
+
+	struct thread_cache {
+		thread_cache *next;
+		thread_cache *prev;
+		KernelMemoryPool *pool;
+		uint32_t slot[CLASSES][CACHE_SIZE];
+		unsigned int count[CLASSES];
+		unsigned long hits;
+	};
+
+	PciDevice *device;
+	slot *slots;
+	unsigned int max_buffers;
+	uint64_t free_list[CLASSES];
+	uint64_t unused;
+
+	uint64_t low;
+	uint64_t high;
+	uint64_t idle_bytes;
+	uint64_t pooled_bytes;
+	unsigned long global_hits;
+	unsigned long allocations;
+	unsigned long unpooled;
+	unsigned long trimmed;
+
+	pthread_key_t key;
+	pthread_mutex_t cache_lock;
+	thread_cache *caches;
+	unsigned long exited_hits;	/* local hits of threads that exited */
+
+	static int getClass(unsigned int size);
+	void push(uint64_t *head, uint32_t i);
+	uint32_t pop(uint64_t *head);
+
+	thread_cache *getCache();
+	void flushCache(thread_cache *c);
+	static void destroyCache(void *p);
+
+	void release(uint32_t i, KernelMemory *km);
+	void putGlobal(uint32_t i);
+};
+
+}
+
+#endif /*PD_KERNELMEMORYPOOL_H_*/
@@ -0,0 +1,107 @@
+#ifndef PD_MMIOTRACE_H_
+#define PD_MMIOTRACE_H_
+
+/********************************************************************
+ *
+ * Trace of the BAR accesses made by the library.
+ *
+ * When enabled, register accesses of DmaEngine, PagedWindow and
+ * ShadowRegisters, the copies of barWrite()/barRead() and the windows
+ * of PagedWindow, and every DMA descriptor submission are recorded as
+ * (timestamp, device, bar, offset, width, value). Each thread writes
+ * into its own ring buffer without locks; when a ring is full the
+ * oldest events are overwritten. dump() merges the rings by timestamp
+ * into a binary file, which tests/pcie/replayTrace prints or drives
+ * against a board again.
+ *
+ * Accesses through pointers returned by mapBAR() are not seen.
+ *
+ * Disabled, a hook is one load and a not-taken branch. Building the
+ * library with -DPD_NO_MMIO_TRACE removes the hooks altogether.
+ *
+ *******************************************************************/
+
+#include <stdint.h>
+
+namespace pciDriver {
+
+class MmioTrace {
+public:
+	enum type {
+		READ = 0,		/* register read, value as read */
+		WRITE,			/* register write */
+		COPY_TO,		/* bulk copy to the BAR, value is the length */
+		COPY_FROM,		/* bulk copy from the BAR, value is the length */
+		SUBMIT,			/* DMA descriptor: offset is the channel block, bar the
+						 * target BAR, value the length */
+		TYPES
+	};
+
+	/* One record, as stored in the file */
+	struct event {
+		uint64_t ns;			/* CLOCK_MONOTONIC */
+		uint64_t value;
+		uint32_t offset;		/* byte offset inside the BAR */
+		uint16_t device;		/* number of /dev/fpgaN */
+		uint16_t thread;		/* order of the first traced access of the thread */
+		uint8_t type;
+		uint8_t bar;
+		uint8_t width;			/* bytes, 0 for markers */
+		uint8_t reserved[5];
+	};
+
+	struct file_header {
+		char magic[8];			/* "PDTRACE\0" */
+		uint32_t version;
+		uint32_t event_size;
+		uint64_t events;
+		uint64_t dropped;		/* events overwritten before the dump */
+		uint32_t threads;
+		uint32_t reserved;
+	};
+
+	static const uint32_t VERSION = 1;
+	static const unsigned int DEFAULT_RING_SIZE = (64 << 10);	/* events per thread */
+
+	static void enable();
+	static void disable();
+	static inline bool isEnabled() { return __atomic_load_n(&active, __ATOMIC_RELAXED); }
+
+	/* Only affects threads that did not trace yet */
+	static void setRingSize(unsigned int events);
+
+	/* Both expect tracing to be disabled */
+	static void clear();
+	static uint64_t dump(const char *file);
+
+	/* Reads a file written by dump(), release the events with free() */
+	static event *load(const char *file, file_header *header);
+
+	static const char *getTypeName(type t);
+
+	/* Hooks for the library */
+#ifndef PD_NO_MMIO_TRACE
+	static inline void read32(int dev, unsigned int bar, uint32_t offset, uint32_t v)
+		{ if (__builtin_expect(isEnabled(), 0)) record(READ, dev, bar, offset, 4, v); }
+	static inline void write32(int dev, unsigned int bar, uint32_t offset, uint32_t v)
+		{ if (__builtin_expect(isEnabled(), 0)) record(WRITE, dev, bar, offset, 4, v); }
+	static inline void copy(bool to_device, int dev, unsigned int bar, uint64_t offset, uint64_t len)
+		{ if (__builtin_expect(isEnabled(), 0)) record(to_device ? COPY_TO : COPY_FROM, dev, bar, offset, 0, len); }
+	static inline void submit(int dev, unsigned int bar, uint32_t channel, uint32_t length)
+		{ if (__builtin_expect(isEnabled(), 0)) record(SUBMIT, dev, bar, channel, 0, length); }
+#else
+	static inline void read32(int, unsigned int, uint32_t, uint32_t) {}
+	static inline void write32(int, unsigned int, uint32_t, uint32_t) {}
+	static inline void copy(bool, int, unsigned int, uint64_t, uint64_t) {}
+	static inline void submit(int, unsigned int, uint32_t, uint32_t) {}
+#endif
+
+protected:
+	static bool active;
+
+	static void record(type t, int dev, unsigned int bar, uint64_t offset, unsigned int width, uint64_t value);
+};
+
+}
+
+#endif /*PD_MMIOTRACE_H_*/
@@ -0,0 +1,96 @@
+#ifndef PD_PAGEDWINDOW_H_
+#define PD_PAGEDWINDOW_H_
+
+/********************************************************************
+ *
+ * Flat access to device memory seen through a paged BAR window.
+ *
+ * The ABB bitstream shows one page of its DDR memory in BAR2 (one page
+ * of the Wishbone bus in BAR4), the page is selected in a register of
+ * BAR0. PagedWindow takes 64 bit device addresses, splits accesses at
+ * page boundaries and only writes the page register when the page
+ * actually changes, tracking the current page in a shadow copy.
+ *
+ * batch() takes a list of scattered accesses and performs them grouped
+ * by page, starting with the page already selected, so every page is
+ * selected at most once. Accesses to the same page keep their order.
+ *
+ * The page register exists once per device: use a single PagedWindow
+ * per window BAR and share it between threads, every access takes the
+ * window lock. If anything else writes the page register, call
+ * invalidate() before the next access.
+ *
+ * Addresses and lengths must be multiples of 4 bytes.
+ *
+ *******************************************************************/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "PciDevice.h"
+
+namespace pciDriver {
+
+class PagedWindow {
+public:
+	/* One access of a batch */
+	struct access {
+		uint64_t addr;			/* device address */
+		void *buf;				/* host buffer */
+		uint32_t length;		/* bytes, multiple of 4 */
+		bool write;				/* host to device */
+	};
+
+	/* Window BAR 2 (DDR) or 4 (Wishbone). A page_size of 0 uses the BAR size. */
+	PagedWindow(PciDevice& dev, unsigned int bar = 2, unsigned long page_size = 0);
+	~PagedWindow();
+
+	void write(uint64_t addr, const void *src, size_t len);
+	void read(void *dst, uint64_t addr, size_t len);
+	void copy(uint64_t dst, uint64_t src, size_t len);
+	void write32(uint64_t addr, uint32_t val);
+	uint32_t read32(uint64_t addr);
+
+	void batch(access *list, unsigned int n);
+
+	void invalidate();
+
+	inline unsigned long getPageSize() { return page_size; }
+	inline unsigned long getSwitches() { return switches; }
+	inline unsigned long getAccesses() { return accesses; }
+	inline void resetStats() { switches = accesses = 0; }
+
+protected:
+	/* Part of an access inside a single page */
+	struct piece {
+		uint32_t page;
+		uint32_t offset;
+		uint32_t length;
+		uint8_t *buf;
+		bool write;
+		uint64_t key;			/* selected page first, then by page and batch order */
+	};
+
+	PciDevice *device;
+	unsigned int bar;
+	unsigned long page_size;
+	volatile uint32_t *bar0;
+	volatile uint8_t *window;
+	volatile uint32_t *page_reg;
+
+	pthread_mutex_t lock;
+	int64_t current;			/* shadow of the page register, -1 unknown */
+	unsigned long switches;
+	unsigned long accesses;
+
+	void select(uint32_t page);
+	void transfer(uint64_t addr, uint8_t *buf, size_t len, bool write);
+	void check(uint64_t addr, size_t len);
+	unsigned int split(const access& a, piece *p, unsigned int seq);
+
+	static int compare(const void *a, const void *b);
+};
+
+}
+
+#endif /*PD_PAGEDWINDOW_H_*/
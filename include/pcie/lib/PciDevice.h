@@ -31,13 +31,17 @@
  *******************************************************************/
 
 #include <pthread.h>
+#include <stdint.h>
 #include "Pcidefs.h"
+#include "BarCopy.h"
 
 namespace pciDriver {
 
 // Forward references
 class KernelMemory;
 class UserMemory;
+class HybridTransfer;
+class DmaArena;
 	
 class PciDevice {
 private:
@@ -50,7 +54,60 @@ protected:
 	int device;
 	char name[PCIDEV_NAME_MAX];
 	pthread_mutex_t mmap_mutex;
+
+public:
+	/* Caching of a BAR mapping, see mapBAR() */
+	enum cache_mode {
+		CACHE_DEFAULT = 0,	/* as set up by the BIOS (MTRRs) */
+		CACHE_UC = 1,		/* uncached */
+		CACHE_WC = 2,		/* write-combining, prefetchable BARs only */
+		CACHE_WT = 3		/* write-through, prefetchable BARs only */
+	};
+
+	/* PCIe transport settings, sizes in bytes */
+	struct transport {
+		unsigned int mrrs;				/* max read request size */
+		unsigned int mps;				/* max payload size */
+		unsigned int mps_supported;		/* largest MPS the device supports */
+		unsigned int parent_mps;		/* MPS of the upstream port, 0 if none */
+		bool relaxed_ordering;
+		bool no_snoop;
+	};
+
+protected:
+	/* Board info, read once by open() */
+	unsigned short bus;
+	unsigned short slot;
+	unsigned long bar_start[6];
+	unsigned long bar_length[6];
+	unsigned int abi_version;		/* PCIDRIVER_ABI_VERSION of the driver */
+
+	/* Mappings handed out by mapBAR(), one per BAR and requested caching,
+	 * shared and refcounted. Protected by mmap_mutex, unmapped on close(). */
+	struct bar_mapping {
+		void *mem;
+		unsigned int refs;
+		cache_mode effective;
+	};
+	bar_mapping bar_maps[6][4];
+
+	/* Reference on the WC mapping of a BAR taken by barWrite()/barRead() */
+	void *bar_io[6];
+	BarCopy::kernel copy_kernel;
+
+	/* Path selection of write()/read(), created on first use */
+	HybridTransfer *hybrid;
+	unsigned int transfer_bar;
+
+	/* Backing store of DmaAllocator, created on first use */
+	DmaArena *arena;
+	unsigned long arena_size;
+
+	volatile unsigned char *getBARmapping(unsigned int bar, unsigned long offset, unsigned long len);
+	transport tune(unsigned int set, const transport& t);
 public:
+	static const unsigned long DEFAULT_ARENA_SIZE = (4 << 20);
+
 	PciDevice(int number);
 	~PciDevice();
 	
@@ -58,27 +115,58 @@ public:
 	void close();
 
 	int getHandle();
+	inline int getNumber() { return device; }
 	unsigned short getBus();
 	unsigned short getSlot();
 
-	KernelMemory& allocKernelMemory( unsigned int size );
-	UserMemory& mapUserMemory( void *mem, unsigned int size, bool merged );
-	inline UserMemory& mapUserMemory( void *mem, unsigned int size ) 
+	inline unsigned int getABIVersion() { return abi_version; }
+
+	KernelMemory& allocKernelMemory( uint64_t size );
+	KernelMemory& allocKernelMemory( uint64_t size, int node, bool contiguous = false );
+	KernelMemory& allocKernelMemory( uint64_t size, const char *name, bool persist );
+	KernelMemory& attachKernelMemory( const char *name );
+	UserMemory& mapUserMemory( void *mem, uint64_t size, bool merged );
+	inline UserMemory& mapUserMemory( void *mem, uint64_t size ) 
 		{ return mapUserMemory(mem,size,true); }
 
 	inline void mmap_lock() { pthread_mutex_lock( &mmap_mutex ); }
 	inline void mmap_unlock() { pthread_mutex_unlock( &mmap_mutex ); }
 	
 	void waitForInterrupt(unsigned int int_id);
+	bool waitForInterrupt(unsigned int int_id, unsigned int timeout);
 	void clearInterruptQueue(unsigned int int_id);
+	bool armInterrupt(unsigned int int_id);
 	
 	unsigned int getBARsize(unsigned int bar);
-	void *mapBAR(unsigned int bar);
+	inline void *mapBAR(unsigned int bar) { return mapBAR(bar, CACHE_DEFAULT); }
+	void *mapBAR(unsigned int bar, cache_mode mode, cache_mode *effective = NULL);
 	void unmapBAR(unsigned int bar, void *ptr);
+
+	void barWrite(unsigned int bar, unsigned long offset, const void *src, unsigned long len);
+	void barRead(unsigned int bar, unsigned long offset, void *dst, unsigned long len);
+	void setCopyKernel(BarCopy::kernel k);
+	inline BarCopy::kernel getCopyKernel() { return copy_kernel; }
+
+	void write(uint64_t devaddr, const void *src, uint64_t len);
+	void read(void *dst, uint64_t devaddr, uint64_t len);
+	HybridTransfer& getHybridTransfer();
+	void setTransferBAR(unsigned int bar);
+	inline unsigned int getTransferBAR() { return transfer_bar; }
+
+	DmaArena& getDmaArena();
+	void setDmaArenaSize(unsigned long size);
+	inline unsigned long getDmaArenaSize() { return arena_size; }
 	
+	transport getTransport();
+	void setMaxReadRequestSize(unsigned int bytes);
+	void setMaxPayloadSize(unsigned int bytes);
+	void setRelaxedOrdering(bool on);
+	void setNoSnoop(bool on);
+
 	unsigned char readConfigByte(unsigned int addr);
 	unsigned short readConfigWord(unsigned int addr);
 	unsigned int readConfigDWord(unsigned int addr);
+	unsigned int readConfigRange(unsigned int addr, void *buf, unsigned int len);
 	
 	void writeConfigByte(unsigned int addr, unsigned char val);
 	void writeConfigWord(unsigned int addr, unsigned short val);
@@ -0,0 +1,136 @@
+#ifndef PD_REGISTER_H_
+#define PD_REGISTER_H_
+
+/********************************************************************
+ *
+ * Typed access to device registers in a mapped BAR.
+ *
+ * Registers and bit fields are described at compile time, as types:
+ *
+ *   typedef Register<0x1C, RW> SDRAM_PG;
+ *   typedef Field<GSR, 7, 1> DDR_RDY;
+ *
+ *   SDRAM_PG::write(bar0, page);
+ *   while (!DDR_RDY::read(bar0)) ;
+ *
+ * Every access is a single volatile dword access at a constant offset
+ * from the BAR base, so it inlines to one load or store. Writes are
+ * ordered after earlier stores to host memory (descriptors, buffers),
+ * reads before later loads, which is what a doorbell or a status check
+ * needs. Writing a read-only register or reading a write-only one does
+ * not compile.
+ *
+ * RegisterBlock writes a run of adjacent registers with 64 bit stores
+ * where the alignment allows. Only use it on registers the bitstream
+ * accepts as 64 bit writes.
+ *
+ * Register maps of a bitstream are generated from a text description,
+ * see tools/regmap.
+ *
+ *******************************************************************/
+
+#include <stdint.h>
+
+namespace pciDriver {
+
+namespace regs {
+
+enum access_t {
+	RO,		/* read-only */
+	WO,		/* write-only */
+	RW		/* read-write */
+};
+
+/* Orders MMIO against accesses to normal memory */
+static inline void write_barrier() { __atomic_thread_fence(__ATOMIC_RELEASE); }
+static inline void read_barrier() { __atomic_thread_fence(__ATOMIC_ACQUIRE); }
+
+template <uint32_t Offset>
+static inline volatile uint32_t *at(volatile void *base)
+{
+	return reinterpret_cast<volatile uint32_t *>(static_cast<volatile uint8_t *>(base) + Offset);
+}
+
+template <uint32_t Offset, access_t Access = RW>
+struct Register {
+	static_assert((Offset & 0x3) == 0, "registers are dword aligned");
+
+	static constexpr uint32_t offset = Offset;
+	static constexpr access_t access = Access;
+
+	static inline uint32_t read(volatile void *base)
+	{
+		static_assert(Access != WO, "register is write-only");
+		uint32_t v = *at<Offset>(base);
+		read_barrier();
+		return v;
+	}
+
+	static inline void write(volatile void *base, uint32_t v)
+	{
+		static_assert(Access != RO, "register is read-only");
+		write_barrier();
+		*at<Offset>(base) = v;
+	}
+};
+
+template <class Reg, unsigned int Shift, unsigned int Width>
+struct Field {
+	static_assert((Width > 0) && (Shift + Width <= 32), "field does not fit in the register");
+
+	typedef Reg reg;
+
+	static constexpr uint32_t shift = Shift;
+	static constexpr uint32_t mask =
+		((Width == 32) ? 0xFFFFFFFFu : ((1u << Width) - 1)) << Shift;
+
+	/* Bits of a register value for the field value v */
+	static constexpr uint32_t value(uint32_t v) { return (v << Shift) & mask; }
+
+	/* Field value out of a register value */
+	static constexpr uint32_t get(uint32_t reg) { return (reg & mask) >> Shift; }
+
+	static inline uint32_t read(volatile void *base) { return get(Reg::read(base)); }
+
+	/* Read-modify-write, leaves the other fields of the register alone */
+	static inline void write(volatile void *base, uint32_t v)
+		{ Reg::write(base, (Reg::read(base) & ~mask) | value(v)); }
+};
+
+template <uint32_t Offset, unsigned int Count, access_t Access = RW>
+struct RegisterBlock {
+	static_assert((Offset & 0x3) == 0, "registers are dword aligned");
+	static_assert(Access != RO, "block is read-only");
+
+	static constexpr uint32_t offset = Offset;
+	static constexpr unsigned int count = Count;
+
+	/* Writes v[0] to the first register, v[Count - 1] to the last one, in
+	 * ascending address order */
+	static inline void write(volatile void *base, const uint32_t (&v)[Count])
+	{
+		unsigned int i = 0;
+
+		write_barrier();
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) && defined(__LP64__)
+		volatile uint64_t *q;
+
+		if (Offset & 0x4)
+			*at<Offset>(base) = v[i++];
+
+		q = reinterpret_cast<volatile uint64_t *>(at<Offset>(base) + i);
+		for (; i + 1 < Count; i += 2)
+			*q++ = ((uint64_t)v[i + 1] << 32) | v[i];
+#endif
+
+		for (; i < Count; i++)
+			at<Offset>(base)[i] = v[i];
+	}
+};
+
+}
+
+}
+
+#endif /*PD_REGISTER_H_*/
@@ -0,0 +1,110 @@
+#ifndef PD_SHADOWREGISTERS_H_
+#define PD_SHADOWREGISTERS_H_
+
+/********************************************************************
+ *
+ * Host-side copies of device registers only the host changes.
+ *
+ * Reading a BAR register is a non-posted PCIe transaction that stalls
+ * the core for about a microsecond, and a read-modify-write of a
+ * control register pays it every time. Registers tracked here keep the
+ * last value written by the host: reads and read-modify-writes are
+ * served from that copy, writes go to the device and the copy.
+ *
+ * Only track registers nothing but this host code changes: write-only
+ * registers (with their reset value) and host-owned control registers.
+ * Status registers, registers the hardware updates and registers the
+ * driver writes, such as INT_ENABLE which its interrupt handler changes,
+ * must stay untracked: the shadow would go stale and the next write would
+ * put the old bits back. Accesses to untracked offsets go to the device
+ * unchanged.
+ *
+ *   ShadowRegisters sh(dev);
+ *   sh.track<abb::SDRAM_PG>();
+ *   sh.write<abb::SDRAM_PG>(page);
+ *   page = sh.read<abb::SDRAM_PG>();	// no MMIO read
+ *
+ * In builds without NDEBUG, setVerify(true) reads every tracked
+ * register back from the device as well and counts mismatches.
+ *
+ *******************************************************************/
+
+#include <stdint.h>
+#include <pthread.h>
+#include "PciDevice.h"
+#include "Register.h"
+
+namespace pciDriver {
+
+class ShadowRegisters {
+public:
+	struct stats {
+		unsigned long shadow_reads;	/* reads served from the shadow, MMIO reads avoided */
+		unsigned long mmio_reads;	/* reads that went to the device */
+		unsigned long writes;
+		unsigned long mismatches;	/* verify reads that differed from the shadow */
+	};
+
+	ShadowRegisters(PciDevice& dev, unsigned int bar = 0);
+	~ShadowRegisters();
+
+	void track(uint32_t offset);
+	void track(uint32_t offset, regs::access_t access, uint32_t value);
+	void untrack(uint32_t offset);
+	bool isTracked(uint32_t offset);
+
+	uint32_t read(uint32_t offset);
+	void write(uint32_t offset, uint32_t value);
+	void modify(uint32_t offset, uint32_t mask, uint32_t bits);
+
+	/* Typed access with the register and field types of Register.h */
+	template <class Reg> void track()
+	{
+		static_assert(Reg::access == regs::RW, "needs an initial value, or is owned by the device");
+		track(Reg::offset);
+	}
+	template <class Reg> void track(uint32_t value)
+	{
+		static_assert(Reg::access != regs::RO, "read-only registers are owned by the device");
+		track(Reg::offset, Reg::access, value);
+	}
+	template <class Reg> uint32_t read() { return read(Reg::offset); }
+	template <class Reg> void write(uint32_t value)
+	{
+		static_assert(Reg::access != regs::RO, "register is read-only");
+		write(Reg::offset, value);
+	}
+	template <class Field> uint32_t get() { return Field::get(read(Field::reg::offset)); }
+	template <class Field> void set(uint32_t v)
+		{ modify(Field::reg::offset, Field::mask, Field::value(v)); }
+
+	bool setVerify(bool on);
+	inline const stats& getStats() { return st; }
+	void resetStats();
+
+protected:
+	enum state {
+		UNTRACKED = 0,
+		TRACKED,			/* host-owned, readable */
+		TRACKED_WO			/* write-only, never read from the device */
+	};
+
+	PciDevice *device;
+	unsigned int bar;
+	volatile uint32_t *base;
+	unsigned int count;			/* dwords in the BAR */
+
+	uint32_t *value;
+	uint8_t *flags;
+	pthread_mutex_t lock;		/* keeps shadow and device in step */
+	bool verify;
+	stats st;
+
+	void checkOffset(uint32_t offset);
+	uint32_t readShadow(unsigned int i);
+	void writeDevice(unsigned int i, uint32_t v);
+};
+
+}
+
+#endif /*PD_SHADOWREGISTERS_H_*/
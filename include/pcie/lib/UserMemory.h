@@ -28,19 +28,19 @@ class UserMemory {
 	friend class PciDevice;
 private:
 	struct sg_entry {
-		unsigned long addr;
-		unsigned long size;
+		uint64_t addr;
+		uint64_t size;
 	};
 	
 protected:
 	unsigned long vma;
-	unsigned long size;
+	uint64_t size;
 	int handle_id;
 	PciDevice *device;
 	int nents;
 	struct sg_entry *sg;
 
-	UserMemory(PciDevice& device, void *mem, unsigned int size, bool merged );
+	UserMemory(PciDevice& device, void *mem, uint64_t size, bool merged );
 public:
 	~UserMemory();
 	
@@ -51,10 +51,15 @@ public:
 	};
 	
 	void sync(sync_dir dir);
+	void sync(sync_dir dir, uint64_t offset, uint64_t len);
+	bool isMapped(uint64_t offset, uint64_t len);
+
+	inline void *getBuffer() { return reinterpret_cast<void *>(vma); }
+	inline uint64_t getSize() { return size; }
 
 	inline unsigned int getSGcount() { return nents; }	
-	inline unsigned long getSGentryAddress(unsigned int entry ) { return sg[entry].addr; }
-	inline unsigned long getSGentrySize(unsigned int entry ) { return sg[entry].size; }
+	inline uint64_t getSGentryAddress(unsigned int entry ) { return sg[entry].addr; }
+	inline uint64_t getSGentrySize(unsigned int entry ) { return sg[entry].size; }
 	
 };
 
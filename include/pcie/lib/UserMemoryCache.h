@@ -0,0 +1,143 @@
+#ifndef PD_USERMEMORYCACHE_H_
+#define PD_USERMEMORYCACHE_H_
+
+/********************************************************************
+ *
+ * Cache of UserMemory registrations, for code that hands the same
+ * application buffers to the device again and again.
+ *
+ * Mapping user memory pins the pages, builds the scatter/gather list
+ * and creates a sysfs file in the driver, and deleting the UserMemory
+ * undoes all of it. The cache keeps registrations after release and
+ * returns them again for any range they contain, like the memory
+ * region cache of an RDMA stack. A miss registers the requested range
+ * merged with the idle registrations it overlaps.
+ *
+ * Idle registrations are evicted least recently used first when the
+ * pinned bytes exceed the cap. Registrations in use are never evicted,
+ * so the cap can be exceeded while they are held; a single request
+ * larger than the cap is registered without caching.
+ *
+ * The memory behind an address can change while it is registered:
+ * munmap() and mmap() again, free() of large malloc blocks, mremap(),
+ * MADV_DONTNEED. The pinned pages then no longer back the buffer, so
+ * every hit is checked with the driver (UMEM_CHECK) against the pages
+ * currently mapped at the requested range; a mismatch drops the entry
+ * and registers again. A hit costs that ioctl and a page table walk of
+ * the requested range, but no pinning, SG list or sysfs file. Drivers
+ * before ABI version 8 cannot check, there every acquire registers
+ * without caching. invalidate() unpins a range before it is unmapped.
+ *
+ *   UserMemoryCache cache(dev);
+ *   {
+ *       UserMemoryCache::Registration r = cache.acquire(buf, len);
+ *       ... r.get().getSGentryAddress(0), r.getOffset() ...
+ *   }   // stays registered
+ *
+ * Registrations must not outlive their cache, the cache must not
+ * outlive the opened device. Thread-safe.
+ *
+ *******************************************************************/
+
+#include <stdint.h>
+#include <pthread.h>
+#include "PciDevice.h"
+#include "UserMemory.h"
+
+namespace pciDriver {
+
+class UserMemoryCache {
+public:
+	static const uint64_t DEFAULT_MAX_PINNED = (256 << 20);
+
+	struct stats {
+		unsigned long hits;				/* served by a cached registration */
+		unsigned long misses;			/* new registrations */
+		unsigned long uncached;			/* larger than the cap, or no UMEM_CHECK */
+		unsigned long evictions;		/* dropped for the cap or by flush() */
+		unsigned long invalidations;	/* dropped because the memory went away or by invalidate() */
+		unsigned long entries;
+		uint64_t pinned_bytes;
+	};
+
+protected:
+	struct entry {
+		entry *next;			/* LRU order, most recent first */
+		entry *prev;
+		UserMemory *um;
+		uint64_t start;
+		uint64_t end;
+		unsigned int refs;
+		bool stale;
+	};
+
+public:
+	/* A registration containing the requested range, kept by the cache
+	 * when it goes out of scope */
+	class Registration {
+		friend class UserMemoryCache;
+	public:
+		Registration() : cache(NULL), e(NULL), um(NULL), offset(0) {}
+		Registration(Registration&& other);
+		Registration& operator=(Registration&& other);
+		~Registration() { release(); }
+
+		void release();
+
+		inline UserMemory& get() { return *um; }
+		/* Where the requested range starts inside get() */
+		inline unsigned long getOffset() { return offset; }
+		inline bool isValid() { return (um != NULL); }
+
+	private:
+		UserMemoryCache *cache;
+		entry *e;				/* NULL if not cached */
+		UserMemory *um;
+		unsigned long offset;
+
+		Registration(UserMemoryCache *c, entry *en, UserMemory *u, unsigned long o)
+			: cache(c), e(en), um(u), offset(o) {}
+		Registration(const Registration&);
+		Registration& operator=(const Registration&);
+	};
+
+	UserMemoryCache(PciDevice& dev, uint64_t max_pinned = DEFAULT_MAX_PINNED);
+	~UserMemoryCache();
+
+	Registration acquire(void *mem, uint64_t size);
+
+	void invalidate(void *mem, uint64_t size);
+	void setMaxPinned(uint64_t max_pinned);
+	inline uint64_t getMaxPinned() { return max_pinned; }
+	void flush();
+
+	stats getStats();
+
+protected:
+	PciDevice *device;
+	uint64_t max_pinned;
+
+	entry *head;
+	entry *tail;
+	unsigned long entries;
+	uint64_t pinned_bytes;
+
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long uncached;
+	unsigned long evictions;
+	unsigned long invalidations;
+
+	pthread_mutex_t lock;
+
+	void link(entry *e);
+	void unlink(entry *e);
+	void remove(entry *e);
+	void drop(entry *e);
+	void evict();
+	void release(entry *e, UserMemory *um);
+};
+
+}
+
+#endif /*PD_USERMEMORYCACHE_H_*/
@@ -21,6 +21,7 @@
  *******************************************************************/
 
 #include <pthread.h>
+#include <stdint.h>
 #include "Pcidefs.h"
 
 /* Both APIs are in a single header */
@@ -33,36 +34,54 @@ extern "C" {
 #endif
 
 /* Data types */
+typedef struct {
+	void *mem;					/* start of the mmap, NULL if not mapped */
+	unsigned int refs;			/* pd_mapBAR calls not yet unmapped */
+	unsigned int effective;		/* PD_CACHE_* mode the mapping got */
+} pd_barmap_t;
+
 typedef struct {
 	int handle;					/* PCI device handle */
 	int device;					/* Device ID number */
 	char name[PCIDEV_NAME_MAX];	/* Device Name (node) used */
-	pthread_mutex_t mmap_mutex;	/* Mmap mutex used by the device */
+	pthread_mutex_t mmap_mutex;	/* Mmap mutex used by the device, also protects bar_map */
+	unsigned int id;			/* Board info, read by pd_open */
+	unsigned long bar_start[6];
+	unsigned long bar_length[6];
+	pd_barmap_t bar_map[6][4];	/* Shared mappings per BAR and PD_CACHE_* mode */
+	unsigned int abi_version;	/* PCIDRIVER_ABI_VERSION of the driver, read by pd_open */
 } pd_device_t;
 
 /* All Data types are redefined in the C API, even if they match the native driver interface */
 typedef struct {
-	unsigned long pa;
-	unsigned long size;
+	uint64_t pa;
+	uint64_t size;
 	void *mem;
 	int handle_id;
 	pd_device_t *pci_handle;
+	int node;					/* NUMA node, -1 if the driver does not tell */
 } pd_kmem_t;
 
 typedef struct {
-	unsigned long addr;
-	unsigned long size;
+	uint64_t addr;
+	uint64_t size;
 } pd_umem_sgentry_t;
 
 typedef struct {
-	unsigned long vma;
-	unsigned long size;
+	uint64_t vma;
+	uint64_t size;
 	int handle_id;
 	int nents;
 	pd_umem_sgentry_t *sg;
 	pd_device_t *pci_handle;
 } pd_umem_t;
 
+/* Caching of a BAR mapping */
+#define PD_CACHE_DEFAULT	0
+#define PD_CACHE_UC			1
+#define PD_CACHE_WC			2
+#define PD_CACHE_WT			3
+
 /* Direction of a Sync operation */
 #define PD_DIR_BIDIRECTIONAL	0
 #define	PD_DIR_TODEVICE			1
@@ -70,32 +89,38 @@ typedef struct {
 
 int pd_open( int dev, pd_device_t *pci_handle, char *dev_entry  );
 int pd_close( pd_device_t *pci_handle );
+unsigned int pd_getABIVersion( pd_device_t *pci_handle );
 
 /* Kernel Memory Functions */
-void *pd_allocKernelMemory( pd_device_t *pci_handle, unsigned int size, pd_kmem_t *kmem_handle );
+void *pd_allocKernelMemory( pd_device_t *pci_handle, uint64_t size, pd_kmem_t *kmem_handle );
 int pd_freeKernelMemory( pd_kmem_t *kmem_handle );
 
 /* User Memory Functions */
-int pd_mapUserMemory( pd_device_t *pci_handle, void *mem, unsigned int size, pd_umem_t *umem_handle );
+int pd_mapUserMemory( pd_device_t *pci_handle, void *mem, uint64_t size, pd_umem_t *umem_handle );
 int pd_unmapUserMemory( pd_umem_t *umem_handle );
 
 /* Sync Functions */
 int pd_syncKernelMemory( pd_kmem_t *kmem_handle, int dir );
+int pd_syncKernelMemoryRange( pd_kmem_t *kmem_handle, int dir, uint64_t offset, uint64_t size );
 int pd_syncUserMemory( pd_umem_t *umem_handle, int dir );
 
 /* Interrupt Function */
 int pd_waitForInterrupt(pd_device_t *pci_handle , unsigned int int_id );
+int pd_waitForInterruptTimeout(pd_device_t *pci_handle , unsigned int int_id, unsigned int timeout );
 int pd_clearInterruptQueue(pd_device_t *pci_handle , unsigned int int_id );
+int pd_armInterrupt(pd_device_t *pci_handle , unsigned int int_id );
 
 /* PCI Functions */
 int pd_getID( pd_device_t *pci_handle );
 int pd_getBARsize( pd_device_t *pci_handle, unsigned int bar );
 void *pd_mapBAR( pd_device_t *pci_handle, unsigned int bar );
+void *pd_mapBARcache( pd_device_t *pci_handle, unsigned int bar, unsigned int mode, unsigned int *effective );
 int pd_unmapBAR( pd_device_t *pci_handle, unsigned int bar, void *ptr );
 
 unsigned char pd_readConfigByte( pd_device_t *pci_handle, unsigned int addr );
 unsigned short pd_readConfigWord( pd_device_t *pci_handle, unsigned int addr );
 unsigned int pd_readConfigDWord( pd_device_t *pci_handle, unsigned int addr );
+int pd_readConfigRange( pd_device_t *pci_handle, unsigned int addr, void *buf, unsigned int len );
 
 int pd_writeConfigByte( pd_device_t *pci_handle, unsigned int addr, unsigned char val );
 int pd_writeConfigWord( pd_device_t *pci_handle, unsigned int addr, unsigned short val );
@@ -113,7 +138,20 @@ int pd_writeConfigDWord( pd_device_t *pci_handle, unsigned int addr, unsigned in
 #include "Exception.h"
 #include "PciDevice.h"
 #include "KernelMemory.h"
+#include "KernelMemoryPool.h"
+#include "DmaArena.h"
+#include "DmaAllocator.h"
 #include "UserMemory.h"
+#include "UserMemoryCache.h"
+#include "BarCopy.h"
+#include "DmaEngine.h"
+#include "DmaPipeline.h"
+#include "HybridTransfer.h"
+#include "DmaQueue.h"
+#include "PagedWindow.h"
+#include "ShadowRegisters.h"
+#include "ConfigSpace.h"
+#include "MmioTrace.h"
 
 #include "pciDriver_compat.h"
 
@@ -105,7 +105,7 @@ class MemoryPageList {
    *      @param buffer Pointer which contains the virtual address of the buffer
    *      @param size   The buffer size in byte
    */
-  MemoryPageList(int handle, unsigned int *buffer, unsigned int size);
+  MemoryPageList(int handle, unsigned int *buffer, unsigned long size);
 
   /** Lock AND build up the list of buffer pages. 
    *      @param handle The device driver handle
@@ -113,7 +113,7 @@ class MemoryPageList {
    *      @param size   The buffer size in byte
    *      @return True on success, else false
    */
-  bool LockBuffer(int handle, unsigned int *buffer, unsigned int size);
+  bool LockBuffer(int handle, unsigned int *buffer, unsigned long size);
 
   /** Unlock the buffer
    *      @return True on success, else false
@@ -134,10 +134,10 @@ class MemoryPageList {
           @param index The number of the buffer page
 	  @return The physical address or 0 if the pagelist is not in use
   */
-  unsigned int GetPhysicalAddress(unsigned int index);
+  unsigned long GetPhysicalAddress(unsigned int index);
 
   /// Access to the physical addresses of the pages.
-  unsigned int operator[] (unsigned int index);
+  unsigned long operator[] (unsigned int index);
 
   /// Get the offset in the first page
   unsigned int GetFirstPageOffset(void);
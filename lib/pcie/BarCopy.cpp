@@ -0,0 +1,256 @@
+/**
+ *
+ * @file BarCopy.cpp
+ * @brief Runtime dispatched copy kernels for BAR access.
+ *
+ */
+
+#include "BarCopy.h"
+#include "Exception.h"
+
+#include <stdint.h>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PD_HAVE_X86 1
+#endif
+
+using namespace pciDriver;
+
+/* Unaligned host-side dword, the BAR side is always aligned */
+static inline uint32_t load32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void store32(uint8_t *p, uint32_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static void write_dword(volatile void *dst, const void *src, size_t len)
+{
+	volatile uint32_t *d = static_cast<volatile uint32_t *>(dst);
+	const uint8_t *s = static_cast<const uint8_t *>(src);
+
+	for (; len > 0; len -= 4, s += 4)
+		*d++ = load32(s);
+}
+
+static void read_dword(void *dst, const volatile void *src, size_t len)
+{
+	const volatile uint32_t *s = static_cast<const volatile uint32_t *>(src);
+	uint8_t *d = static_cast<uint8_t *>(dst);
+
+	for (; len > 0; len -= 4, d += 4)
+		store32(d, *s++);
+}
+
+#ifdef PD_HAVE_X86
+
+/*
+ * Every kernel copies dwords until the BAR address is aligned to its
+ * vector size, then full vectors, then the remaining dwords.
+ */
+#define BAR_WRITE_KERNEL(name, width, type, loadu, stream)						\
+static void name(volatile void *dst, const void *src, size_t len)				\
+{																				\
+	uint8_t *d = (uint8_t *)(dst);												\
+	const uint8_t *s = static_cast<const uint8_t *>(src);						\
+	size_t head = ((width) - ((uintptr_t)d & ((width) - 1))) & ((width) - 1);	\
+																				\
+	if (head > len)																\
+		head = len;																\
+	write_dword(d, s, head);													\
+	d += head; s += head; len -= head;											\
+																				\
+	for (; len >= (width); len -= (width), d += (width), s += (width))			\
+		stream((type *)d, loadu((const type *)s));								\
+																				\
+	write_dword(d, s, len);														\
+	_mm_sfence();																\
+}
+
+#define BAR_READ_KERNEL(name, width, type, load, storeu)						\
+static void name(void *dst, const volatile void *src, size_t len)				\
+{																				\
+	uint8_t *d = static_cast<uint8_t *>(dst);									\
+	const uint8_t *s = (const uint8_t *)(src);									\
+	size_t head = ((width) - ((uintptr_t)s & ((width) - 1))) & ((width) - 1);	\
+																				\
+	if (head > len)																\
+		head = len;																\
+	read_dword(d, s, head);														\
+	d += head; s += head; len -= head;											\
+																				\
+	for (; len >= (width); len -= (width), d += (width), s += (width))			\
+		storeu((type *)d, load((const type *)s));								\
+																				\
+	read_dword(d, s, len);														\
+}
+
+static inline __attribute__((always_inline, target("avx512f"))) __m512i load512(const __m512i *p)
+	{ return _mm512_load_si512(p); }
+static inline __attribute__((always_inline, target("avx512f"))) __m512i loadu512(const __m512i *p)
+	{ return _mm512_loadu_si512(p); }
+static inline __attribute__((always_inline, target("avx512f"))) void storeu512(__m512i *p, __m512i v)
+	{ _mm512_storeu_si512(p, v); }
+static inline __attribute__((always_inline, target("avx512f"))) void stream512(__m512i *p, __m512i v)
+	{ _mm512_stream_si512(p, v); }
+
+__attribute__((target("sse2")))
+BAR_WRITE_KERNEL(write_sse2, 16, __m128i, _mm_loadu_si128, _mm_stream_si128)
+__attribute__((target("sse2")))
+BAR_READ_KERNEL(read_sse2, 16, __m128i, _mm_load_si128, _mm_storeu_si128)
+
+__attribute__((target("avx2")))
+BAR_WRITE_KERNEL(write_avx2, 32, __m256i, _mm256_loadu_si256, _mm256_stream_si256)
+__attribute__((target("avx2")))
+BAR_READ_KERNEL(read_avx2, 32, __m256i, _mm256_load_si256, _mm256_storeu_si256)
+
+__attribute__((target("avx512f")))
+BAR_WRITE_KERNEL(write_avx512, 64, __m512i, loadu512, stream512)
+__attribute__((target("avx512f")))
+BAR_READ_KERNEL(read_avx512, 64, __m512i, load512, storeu512)
+
+#endif
+
+/**
+ *
+ * Checks whether the CPU can run a kernel.
+ *
+ */
+bool BarCopy::isSupported(kernel k)
+{
+	switch (k) {
+	case KERNEL_AUTO:
+	case KERNEL_MEMCPY:
+	case KERNEL_DWORD:
+		return true;
+#ifdef PD_HAVE_X86
+	case KERNEL_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case KERNEL_AVX2:
+		return __builtin_cpu_supports("avx2");
+	case KERNEL_AVX512:
+		return __builtin_cpu_supports("avx512f");
+#endif
+	default:
+		return false;
+	}
+}
+
+/**
+ *
+ * Gets the widest kernel the CPU supports.
+ *
+ */
+BarCopy::kernel BarCopy::getBest()
+{
+	static kernel best = KERNEL_AUTO;
+
+	if (best == KERNEL_AUTO) {
+		if (isSupported(KERNEL_AVX512))
+			best = KERNEL_AVX512;
+		else if (isSupported(KERNEL_AVX2))
+			best = KERNEL_AVX2;
+		else if (isSupported(KERNEL_SSE2))
+			best = KERNEL_SSE2;
+		else
+			best = KERNEL_DWORD;
+	}
+
+	return best;
+}
+
+const char *BarCopy::getName(kernel k)
+{
+	static const char *names[] = { "auto", "memcpy", "dword", "sse2", "avx2", "avx512" };
+
+	if ((unsigned int)k >= KERNELS)
+		return "unknown";
+
+	return names[k];
+}
+
+/**
+ *
+ * Copies from host memory to a mapped BAR.
+ *
+ * @param dst Destination inside the mapped BAR, 4 byte aligned
+ * @param src Source buffer, any alignment
+ * @param len Number of bytes, multiple of 4
+ * @param k Kernel to use
+ *
+ */
+void BarCopy::write(volatile void *dst, const void *src, size_t len, kernel k)
+{
+	if ((((uintptr_t)dst | len) & 0x3) || !isSupported(k))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	if (k == KERNEL_AUTO)
+		k = getBest();
+
+	switch (k) {
+	case KERNEL_MEMCPY:
+		memcpy(const_cast<void *>(dst), src, len);
+		break;
+#ifdef PD_HAVE_X86
+	case KERNEL_SSE2:
+		write_sse2(dst, src, len);
+		break;
+	case KERNEL_AVX2:
+		write_avx2(dst, src, len);
+		break;
+	case KERNEL_AVX512:
+		write_avx512(dst, src, len);
+		break;
+#endif
+	default:
+		write_dword(dst, src, len);
+		break;
+	}
+}
+
+/**
+ *
+ * Copies from a mapped BAR to host memory.
+ *
+ * @param dst Destination buffer, any alignment
+ * @param src Source inside the mapped BAR, 4 byte aligned
+ * @param len Number of bytes, multiple of 4
+ * @param k Kernel to use
+ *
+ */
+void BarCopy::read(void *dst, const volatile void *src, size_t len, kernel k)
+{
+	if ((((uintptr_t)src | len) & 0x3) || !isSupported(k))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	if (k == KERNEL_AUTO)
+		k = getBest();
+
+	switch (k) {
+	case KERNEL_MEMCPY:
+		memcpy(dst, const_cast<const void *>(src), len);
+		break;
+#ifdef PD_HAVE_X86
+	case KERNEL_SSE2:
+		read_sse2(dst, src, len);
+		break;
+	case KERNEL_AVX2:
+		read_avx2(dst, src, len);
+		break;
+	case KERNEL_AVX512:
+		read_avx512(dst, src, len);
+		break;
+#endif
+	default:
+		read_dword(dst, src, len);
+		break;
+	}
+}
@@ -0,0 +1,255 @@
+/**
+ *
+ * @file ConfigSpace.cpp
+ * @brief Snapshot of the PCI configuration space with a capability index.
+ *
+ */
+
+#include "ConfigSpace.h"
+#include "Exception.h"
+
+#include <cstring>
+
+using namespace pciDriver;
+
+/* Registers of the PCIe capability, relative to its offset */
+#define PCIE_DEVCAP		0x04
+#define PCIE_DEVCTL		0x08
+#define PCIE_LNKCAP		0x0C
+#define PCIE_LNKSTA		0x12
+
+/* Registers of the AER capability */
+#define AER_UNCOR_STATUS	0x04
+#define AER_COR_STATUS		0x10
+
+/**
+ *
+ * Constructor of a ConfigSpace, takes the first snapshot.
+ *
+ * @param dev Opened PCI device
+ *
+ */
+ConfigSpace::ConfigSpace(PciDevice& dev)
+{
+	device = &dev;
+	refresh();
+}
+
+/**
+ *
+ * Reads the config space again and rebuilds the capability index.
+ *
+ */
+void ConfigSpace::refresh()
+{
+	memset(data, 0xFF, sizeof(data));
+	size = device->readConfigRange(0, data, SIZE);
+	if (size < LEGACY_SIZE)
+		throw Exception(Exception::INTERNAL_ERROR);
+
+	parse();
+}
+
+/**
+ *
+ * Walks both capability lists. Only the first instance of an ID is
+ * indexed, loops in broken lists end after the longest possible list.
+ *
+ */
+void ConfigSpace::parse()
+{
+	unsigned int off, id, n;
+	uint32_t hdr;
+
+	memset(cap, 0, sizeof(cap));
+	memset(ext_cap, 0, sizeof(ext_cap));
+
+	/* Status register: capability list present */
+	if (readWord(0x06) & 0x10) {
+		off = readByte(0x34) & ~0x3;
+		for (n = 0; (off >= 0x40) && (off < LEGACY_SIZE) && (n < 48); n++) {
+			id = readByte(off);
+			if (cap[id] == 0)
+				cap[id] = off;
+			off = readByte(off + 1) & ~0x3;
+		}
+	}
+
+	/* Extended capabilities start at 0x100 in PCIe devices */
+	if ((size <= LEGACY_SIZE) || !isExpress())
+		return;
+
+	off = LEGACY_SIZE;
+	for (n = 0; (off >= LEGACY_SIZE) && (off < size) && (n < (SIZE - LEGACY_SIZE) / 8); n++) {
+		hdr = readDWord(off);
+		if ((hdr == 0) || (hdr == 0xFFFFFFFF))
+			break;
+		id = hdr & 0xFFFF;
+		if ((id < 64) && (ext_cap[id] == 0))
+			ext_cap[id] = off;
+		off = (hdr >> 20) & ~0x3;
+	}
+}
+
+uint8_t ConfigSpace::readByte(unsigned int addr)
+{
+	if (addr >= size)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	return data[addr];
+}
+
+uint16_t ConfigSpace::readWord(unsigned int addr)
+{
+	if ((addr & 0x1) || (addr + 2 > size))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	/* Config space is little endian */
+	return data[addr] | (data[addr + 1] << 8);
+}
+
+uint32_t ConfigSpace::readDWord(unsigned int addr)
+{
+	if ((addr & 0x3) || (addr + 4 > size))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	return readWord(addr) | ((uint32_t)readWord(addr + 2) << 16);
+}
+
+unsigned int ConfigSpace::findCapability(unsigned int id)
+{
+	return (id < 256) ? cap[id] : 0;
+}
+
+unsigned int ConfigSpace::findExtCapability(unsigned int id)
+{
+	return (id < 64) ? ext_cap[id] : 0;
+}
+
+/* Offset of a register of the PCIe capability, 0 if there is none */
+unsigned int ConfigSpace::pcie(unsigned int reg)
+{
+	unsigned int off = findCapability(CAP_PCIE);
+
+	return (off != 0) ? off + reg : 0;
+}
+
+unsigned int ConfigSpace::getLinkSpeed()
+{
+	unsigned int off = pcie(PCIE_LNKSTA);
+
+	return (off != 0) ? (readWord(off) & 0xF) : 0;
+}
+
+unsigned int ConfigSpace::getLinkWidth()
+{
+	unsigned int off = pcie(PCIE_LNKSTA);
+
+	return (off != 0) ? ((readWord(off) >> 4) & 0x3F) : 0;
+}
+
+unsigned int ConfigSpace::getMaxLinkSpeed()
+{
+	unsigned int off = pcie(PCIE_LNKCAP);
+
+	return (off != 0) ? (readDWord(off) & 0xF) : 0;
+}
+
+unsigned int ConfigSpace::getMaxLinkWidth()
+{
+	unsigned int off = pcie(PCIE_LNKCAP);
+
+	return (off != 0) ? ((readDWord(off) >> 4) & 0x3F) : 0;
+}
+
+/**
+ *
+ * Gets the transfer rate of one lane for a link speed value.
+ *
+ * @returns GT/s, 0 for unknown speeds
+ *
+ */
+double ConfigSpace::getTransferRate(unsigned int speed)
+{
+	static const double rates[] = { 0.0, 2.5, 5.0, 8.0, 16.0, 32.0, 64.0 };
+
+	return (speed < sizeof(rates) / sizeof(rates[0])) ? rates[speed] : 0.0;
+}
+
+unsigned int ConfigSpace::getMaxPayloadSize()
+{
+	unsigned int off = pcie(PCIE_DEVCTL);
+
+	return (off != 0) ? (128 << ((readWord(off) >> 5) & 0x7)) : 0;
+}
+
+unsigned int ConfigSpace::getMaxReadRequestSize()
+{
+	unsigned int off = pcie(PCIE_DEVCTL);
+
+	return (off != 0) ? (128 << ((readWord(off) >> 12) & 0x7)) : 0;
+}
+
+unsigned int ConfigSpace::getMaxPayloadSupported()
+{
+	unsigned int off = pcie(PCIE_DEVCAP);
+
+	return (off != 0) ? (128 << (readDWord(off) & 0x7)) : 0;
+}
+
+/**
+ *
+ * Gets the raw data rate of the link: transfer rate times lanes, less
+ * 8b/10b (up to 5 GT/s) or 128b/130b encoding.
+ *
+ * @returns bytes per second, 0 if the device is not PCIe
+ *
+ */
+double ConfigSpace::getLinkBandwidth()
+{
+	unsigned int speed = getLinkSpeed();
+	double rate = getTransferRate(speed) * 1e9;
+	double encoding = (speed <= 2) ? (8.0 / 10.0) : (128.0 / 130.0);
+
+	return rate * encoding * getLinkWidth() / 8.0;
+}
+
+/**
+ *
+ * Gets the highest payload rate of one direction of the link, with every
+ * TLP carrying the configured max payload size. Ignores DLLP traffic, so
+ * real transfers stay somewhat below.
+ *
+ * @returns bytes per second, 0 if the device is not PCIe
+ *
+ */
+double ConfigSpace::getMaxThroughput()
+{
+	double mps = getMaxPayloadSize();
+
+	if (mps == 0)
+		return 0.0;
+
+	return getLinkBandwidth() * mps / (mps + TLP_OVERHEAD);
+}
+
+unsigned int ConfigSpace::getMSIXTableSize()
+{
+	unsigned int off = findCapability(CAP_MSIX);
+
+	return (off != 0) ? ((readWord(off + 2) & 0x7FF) + 1) : 0;
+}
+
+uint32_t ConfigSpace::getAERUncorrectable()
+{
+	unsigned int off = findExtCapability(EXT_CAP_AER);
+
+	return (off != 0) ? readDWord(off + AER_UNCOR_STATUS) : 0;
+}
+
+uint32_t ConfigSpace::getAERCorrectable()
+{
+	unsigned int off = findExtCapability(EXT_CAP_AER);
+
+	return (off != 0) ? readDWord(off + AER_COR_STATUS) : 0;
+}
@@ -0,0 +1,390 @@
+/**
+ *
+ * @file DmaArena.cpp
+ * @brief Buddy allocator for small DMA buffers inside one registration.
+ *
+ */
+
+#include "DmaArena.h"
+#include "Exception.h"
+
+#include <cstdlib>
+#include <cstring>
+
+using namespace pciDriver;
+
+static inline unsigned int ctz(uint64_t v)
+{
+	return (v == 0) ? 64 : __builtin_ctzll(v);
+}
+
+/**
+ *
+ * Constructor of a DmaArena on a new KernelMemory of the given size,
+ * which the arena frees again.
+ *
+ * @param dev Opened PCI device
+ * @param size Size of the region in bytes
+ * @param min_shift log2 of the smallest block
+ *
+ */
+DmaArena::DmaArena(PciDevice& dev, unsigned long size, unsigned int min_shift)
+{
+	if ((size == 0) || (size > 0xFFFFFFFFUL))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	kmem = &dev.allocKernelMemory(size);
+	umem = NULL;
+	owned = true;
+
+	try {
+		init(min_shift);
+	} catch (Exception& e) {
+		delete kmem;
+		throw;
+	}
+}
+
+/**
+ *
+ * Constructor of a DmaArena on an existing KernelMemory. The buffer must
+ * outlive the arena.
+ *
+ */
+DmaArena::DmaArena(KernelMemory& km, unsigned int min_shift)
+{
+	kmem = &km;
+	umem = NULL;
+	owned = false;
+
+	init(min_shift);
+}
+
+/**
+ *
+ * Constructor of a DmaArena on mapped user memory. The mapping must
+ * outlive the arena.
+ *
+ */
+DmaArena::DmaArena(UserMemory& um, unsigned int min_shift)
+{
+	kmem = NULL;
+	umem = &um;
+	owned = false;
+
+	init(min_shift);
+}
+
+/**
+ *
+ * Destructor of DmaArena. Outstanding blocks become invalid.
+ *
+ */
+DmaArena::~DmaArena()
+{
+	release();
+	pthread_mutex_destroy(&lock);
+
+	if (owned)
+		delete kmem;
+}
+
+void DmaArena::release()
+{
+	::free(segs);
+	::free(state);
+	::free(next);
+	::free(prev);
+}
+
+/**
+ *
+ * Builds the segment table and the free lists. Blocks are aligned to
+ * their size relative to the start of the arena, so the largest block
+ * must divide every offset where the bus addresses jump.
+ *
+ */
+void DmaArena::init(unsigned int min_shift)
+{
+	unsigned long o, len;
+	unsigned int i, k;
+
+	segs = NULL;
+	state = NULL;
+	next = prev = NULL;
+
+	if (kmem != NULL) {
+		base = static_cast<uint8_t *>(kmem->getBuffer());
+		size = kmem->getSize();
+		nsegs = 1;
+	} else {
+		base = static_cast<uint8_t *>(umem->getBuffer());
+		size = umem->getSize();
+		nsegs = umem->getSGcount();
+	}
+
+	if ((min_shift < 2) || (min_shift >= MAX_SHIFT) || (nsegs == 0) ||
+			(size < (1UL << min_shift)) || ((size >> min_shift) >= NONE))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	this->min_shift = min_shift;
+
+	segs = static_cast<segment *>(malloc(nsegs * sizeof(segment)));
+	if (segs == NULL)
+		throw Exception(Exception::ALLOC_FAILED);
+
+	/* Largest block: fits in the region, divides every segment boundary */
+	for (max_shift = min_shift; (max_shift < MAX_SHIFT - 1) && ((2UL << max_shift) <= size); max_shift++)
+		;
+
+	if (kmem != NULL) {
+		segs[0].offset = 0;
+		segs[0].bus = kmem->getPhysicalAddress();
+	} else {
+		for (i = 0, o = 0; i < nsegs; i++) {
+			segs[i].offset = o;
+			segs[i].bus = umem->getSGentryAddress(i);
+			len = umem->getSGentrySize(i);
+			o += len;
+			if ((i + 1 < nsegs) && (ctz(o) < max_shift))
+				max_shift = ctz(o);
+		}
+	}
+
+	if (max_shift < min_shift) {
+		release();
+		throw Exception(Exception::INVALID_ARGUMENT);
+	}
+
+	units = size >> min_shift;
+	state = static_cast<uint8_t *>(calloc(units, sizeof(uint8_t)));
+	next = static_cast<uint32_t *>(malloc(units * sizeof(uint32_t)));
+	prev = static_cast<uint32_t *>(malloc(units * sizeof(uint32_t)));
+	if ((state == NULL) || (next == NULL) || (prev == NULL)) {
+		release();
+		throw Exception(Exception::ALLOC_FAILED);
+	}
+
+	for (k = 0; k <= MAX_SHIFT; k++)
+		free_list[k] = NONE;
+
+	/* Cover the region with the largest aligned blocks that fit */
+	for (o = 0; o + (1UL << min_shift) <= size; o += (1UL << k)) {
+		for (k = max_shift; k > min_shift; k--)
+			if (((o & ((1UL << k) - 1)) == 0) && (o + (1UL << k) <= size))
+				break;
+		pushFree(o >> min_shift, k);
+	}
+
+	used = 0;
+	blocks = 0;
+	pthread_mutex_init(&lock, NULL);
+}
+
+void DmaArena::pushFree(uint32_t u, unsigned int shift)
+{
+	state[u] = UNIT_FREE | shift;
+	prev[u] = NONE;
+	next[u] = free_list[shift];
+	if (next[u] != NONE)
+		prev[next[u]] = u;
+	free_list[shift] = u;
+}
+
+void DmaArena::removeFree(uint32_t u, unsigned int shift)
+{
+	if (prev[u] != NONE)
+		next[prev[u]] = next[u];
+	else
+		free_list[shift] = next[u];
+	if (next[u] != NONE)
+		prev[next[u]] = prev[u];
+	state[u] = UNIT_NONE;
+}
+
+uint64_t DmaArena::segmentAddress(unsigned long offset)
+{
+	unsigned int lo = 0, hi = nsegs, mid;
+
+	/* Last segment starting at or before offset */
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (segs[mid].offset <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return segs[lo].bus + (offset - segs[lo].offset);
+}
+
+/**
+ *
+ * Allocates a block.
+ *
+ * @param size Bytes needed, rounded up to a power of two of at least
+ *        the minimum block size
+ * @returns the block
+ *
+ */
+DmaArena::block DmaArena::alloc(unsigned long size)
+{
+	block b;
+	unsigned int k, j;
+	uint32_t u;
+
+	if ((size == 0) || (size > (1UL << max_shift)))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	for (k = min_shift; (1UL << k) < size; k++)
+		;
+
+	pthread_mutex_lock(&lock);
+
+	for (j = k; (j <= max_shift) && (free_list[j] == NONE); j++)
+		;
+	if (j > max_shift) {
+		pthread_mutex_unlock(&lock);
+		throw Exception(Exception::ALLOC_FAILED);
+	}
+
+	u = free_list[j];
+	removeFree(u, j);
+
+	/* Split, keeping the lower half */
+	while (j > k) {
+		j--;
+		pushFree(u + (1U << (j - min_shift)), j);
+	}
+
+	state[u] = UNIT_USED | k;
+	used += (1UL << k);
+	blocks++;
+
+	pthread_mutex_unlock(&lock);
+
+	b.offset = (unsigned long)u << min_shift;
+	b.size = 1UL << k;
+	b.ptr = base + b.offset;
+	b.bus = segmentAddress(b.offset);
+
+	return b;
+}
+
+/**
+ *
+ * Returns a block to the arena, merging it with its free buddies.
+ *
+ */
+void DmaArena::free(const block& b)
+{
+	unsigned long u = b.offset >> min_shift;
+
+	pthread_mutex_lock(&lock);
+
+	if ((b.offset & ((1UL << min_shift) - 1)) || (u >= units) ||
+			!(state[u] & UNIT_USED) || ((1UL << (state[u] & UNIT_SHIFT)) != b.size)) {
+		pthread_mutex_unlock(&lock);
+		throw Exception(Exception::INVALID_ARGUMENT);
+	}
+
+	freeUnit(u);
+
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ *
+ * Returns a block to the arena by its CPU address.
+ *
+ */
+void DmaArena::free(void *ptr)
+{
+	unsigned long offset = getOffset(ptr);
+	unsigned long u = offset >> min_shift;
+
+	pthread_mutex_lock(&lock);
+
+	if ((offset & ((1UL << min_shift) - 1)) || (u >= units) || !(state[u] & UNIT_USED)) {
+		pthread_mutex_unlock(&lock);
+		throw Exception(Exception::INVALID_ARGUMENT);
+	}
+
+	freeUnit(u);
+
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ *
+ * Frees the allocated block starting at unit u and merges it with its
+ * free buddies. Called with the lock held.
+ *
+ */
+void DmaArena::freeUnit(unsigned long u)
+{
+	unsigned int k = state[u] & UNIT_SHIFT;
+	uint32_t buddy;
+
+	state[u] = UNIT_NONE;
+	used -= (1UL << k);
+	blocks--;
+
+	while (k < max_shift) {
+		buddy = u ^ (1UL << (k - min_shift));
+		if ((buddy >= units) || (state[buddy] != (UNIT_FREE | k)))
+			break;
+		removeFree(buddy, k);
+		if (buddy < u)
+			u = buddy;
+		k++;
+	}
+
+	pushFree(u, k);
+}
+
+unsigned long DmaArena::getOffset(const void *ptr)
+{
+	if (!contains(ptr))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	return static_cast<const uint8_t *>(ptr) - base;
+}
+
+/**
+ *
+ * Gets the bus address of any byte of the region.
+ *
+ */
+uint64_t DmaArena::getBusAddress(const void *ptr)
+{
+	return segmentAddress(getOffset(ptr));
+}
+
+/**
+ *
+ * Syncs a block through the registration of the arena.
+ *
+ */
+void DmaArena::sync(const block& b, KernelMemory::sync_dir dir)
+{
+	if (kmem != NULL)
+		kmem->sync(dir, b.offset, b.size);
+	else
+		umem->sync(static_cast<UserMemory::sync_dir>(dir), b.offset, b.size);
+}
+
+/**
+ *
+ * Syncs any range of the region, e.g. the used part of a block.
+ *
+ */
+void DmaArena::sync(const void *ptr, unsigned long len, KernelMemory::sync_dir dir)
+{
+	unsigned long offset = getOffset(ptr);
+
+	if (kmem != NULL)
+		kmem->sync(dir, offset, len);
+	else
+		umem->sync(static_cast<UserMemory::sync_dir>(dir), offset, len);
+}
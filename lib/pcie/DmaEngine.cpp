@@ -0,0 +1,446 @@
+/**
+ *
+ * @file DmaEngine.cpp
+ * @brief Access to a channel of the ABB DMA engine.
+ *
+ */
+
+#include "DmaEngine.h"
+#include "Exception.h"
+#include "KernelMemory.h"
+#include "MmioTrace.h"
+
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <x86intrin.h>
+#include <cpuid.h>
+#define PD_HAVE_X86 1
+#endif
+
+using namespace pciDriver;
+
+/* Register accesses in BAR0, seen by MmioTrace */
+static inline void reg_write(PciDevice *dev, volatile uint32_t *bar0, volatile uint32_t *r, uint32_t v)
+{
+	*r = v;
+	MmioTrace::write32(dev->getNumber(), 0, (r - bar0) << 2, v);
+}
+
+static inline uint32_t reg_read(PciDevice *dev, volatile uint32_t *bar0, volatile uint32_t *r)
+{
+	uint32_t v = *r;
+
+	MmioTrace::read32(dev->getNumber(), 0, (r - bar0) << 2, v);
+	return v;
+}
+
+/**
+ *
+ * Constructor of a DmaEngine. Maps BAR0 of the device and selects the
+ * register block of the requested channel.
+ *
+ * @param dev Opened PCI device
+ * @param dir Which channel to use
+ *
+ */
+DmaEngine::DmaEngine(PciDevice& dev, direction dir)
+{
+	this->device = &dev;
+	this->dir = dir;
+	this->status = 0;
+	this->wb_mem = NULL;
+	this->wb = NULL;
+	this->strategy = WAIT_SPIN;
+	this->timeout = DEFAULT_TIMEOUT;
+	this->spin = DEFAULT_SPIN;
+	resetWaitStats();
+
+	bar0 = static_cast<volatile uint32_t *>(dev.mapBAR(0));
+	regs = bar0 + (((dir == TO_DEVICE) ? BASE_DMA_DOWN : BASE_DMA_UP) >> 2);
+	wb_regs = bar0 + (((dir == TO_DEVICE) ? WB_ADDR_DOWN : WB_ADDR_UP) >> 2);
+}
+
+/**
+ *
+ * Destructor of DmaEngine, unmaps BAR0.
+ *
+ */
+DmaEngine::~DmaEngine()
+{
+	disableWriteback();
+	device->unmapBAR(0, const_cast<uint32_t *>(bar0));
+}
+
+/**
+ *
+ * Asks the engine to write the status word of finished transfers into a
+ * coherent page in host memory, so completion can be polled without
+ * reading BAR0. The bitstream has no register telling whether it
+ * implements writeback, so only call this for one that does; on other
+ * bitstreams the write lands in an undefined BAR0 offset.
+ *
+ */
+void DmaEngine::enableWriteback()
+{
+	uint64_t pa;
+
+	if (wb != NULL)
+		return;
+
+	wb_mem = &device->allocKernelMemory(getpagesize());
+	pa = wb_mem->getPhysicalAddress();
+
+	wb = static_cast<volatile uint32_t *>(wb_mem->getBuffer());
+	*wb = 0;
+
+	reg_write(device, bar0, &wb_regs[0], (pa >> 32));
+	reg_write(device, bar0, &wb_regs[1], pa);
+}
+
+/**
+ *
+ * Switches back to polling the status register in BAR0.
+ *
+ */
+void DmaEngine::disableWriteback()
+{
+	if (wb_mem == NULL)
+		return;
+
+	reg_write(device, bar0, &wb_regs[0], 0);
+	reg_write(device, bar0, &wb_regs[1], 0);
+
+	wb = NULL;
+	delete wb_mem;
+	wb_mem = NULL;
+}
+
+/**
+ *
+ * Resets the channel, aborting any transfer in progress.
+ *
+ */
+void DmaEngine::reset()
+{
+	reg_write(device, bar0, &regs[BDA_CONTROL], CTRL_VALID | CTRL_RESET);
+}
+
+/**
+ *
+ * Writes a descriptor to the channel and starts the transfer.
+ *
+ * @param ha Host (bus) address of the buffer
+ * @param pa Address inside the device BAR
+ * @param length Transfer length in bytes
+ * @param bar Device BAR the transfer targets
+ * @param next Bus address of the next descriptor, 0 if this is the last one
+ *
+ */
+void DmaEngine::start(uint64_t ha, uint64_t pa, uint32_t length, unsigned int bar, uint64_t next)
+{
+	uint32_t control;
+
+	if ((length == 0) || (length > MAX_LENGTH))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	control = CTRL_VALID | CTRL_AINC | (bar << CTRL_BAR_SHIFT);
+	if (next == 0)
+		control |= CTRL_LAST;
+
+	reset();
+
+	/* Drop interrupts of earlier transfers, which completed while spinning,
+	 * and arm the channel interrupt for this one. The driver owns the
+	 * enable register, which its interrupt handler changes too. */
+	if ((strategy == WAIT_INTERRUPT) && !device->armInterrupt((dir == TO_DEVICE) ? IRQ_DOWN : IRQ_UP))
+		device->clearInterruptQueue((dir == TO_DEVICE) ? IRQ_DOWN : IRQ_UP);
+
+	/* Clear the completion word before the engine can write it */
+	if (wb != NULL)
+		*wb = 0;
+
+	reg_write(device, bar0, &regs[BDA_PA_H], (pa >> 32));
+	reg_write(device, bar0, &regs[BDA_PA_L], pa);
+	reg_write(device, bar0, &regs[BDA_HA_H], (ha >> 32));
+	reg_write(device, bar0, &regs[BDA_HA_L], ha);
+	reg_write(device, bar0, &regs[BDA_NEXT_H], (next >> 32));
+	reg_write(device, bar0, &regs[BDA_NEXT_L], next);
+	reg_write(device, bar0, &regs[BDA_LENGTH], length);
+	MmioTrace::submit(device->getNumber(), bar, (regs - bar0) << 2, length);
+	reg_write(device, bar0, &regs[BDA_CONTROL], control);	// control is written at the end, starts DMA
+}
+
+/**
+ *
+ * Checks the channel status once, from the writeback word if enabled,
+ * otherwise from the status register.
+ *
+ * @returns true if the transfer has finished.
+ *
+ */
+bool DmaEngine::poll()
+{
+	status = (wb != NULL) ? *wb : reg_read(device, bar0, &regs[BDA_STATUS]);
+
+	if (status & STAT_DONE)
+		return true;
+
+	if (status & STAT_TIMEOUT)
+		throw Exception(Exception::DMA_TIMEOUT);
+
+	return false;
+}
+
+static inline uint64_t clock_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static inline void cpu_relax()
+{
+#ifdef PD_HAVE_X86
+	_mm_pause();
+#endif
+}
+
+/* Polls between two deadline checks, reading the clock costs more than a poll */
+#define DEADLINE_CHECK 64
+
+/**
+ *
+ * Selects how wait() waits for completion. UMWAIT needs the writeback word
+ * and CPU support, without either it falls back to WAIT_PAUSE.
+ *
+ */
+void DmaEngine::setWaitStrategy(wait_strategy s)
+{
+	if ((unsigned int)s >= WAIT_STRATEGIES)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	strategy = s;
+}
+
+void DmaEngine::resetWaitStats()
+{
+	memset(stats, 0, sizeof(stats));
+}
+
+const char *DmaEngine::getWaitStrategyName(wait_strategy s)
+{
+	static const char *names[] = { "spin", "pause", "yield", "irq", "umwait" };
+
+	if ((unsigned int)s >= WAIT_STRATEGIES)
+		return "unknown";
+
+	return names[s];
+}
+
+/**
+ *
+ * Checks whether the CPU implements UMONITOR/UMWAIT (WAITPKG).
+ *
+ */
+bool DmaEngine::hasUmwait()
+{
+#ifdef PD_HAVE_X86
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+
+	return (ecx & (1 << 5)) != 0;
+#else
+	return false;
+#endif
+}
+
+bool DmaEngine::waitSpin(uint64_t deadline, unsigned long& polls)
+{
+	for (;;) {
+		polls++;
+		if (poll())
+			return true;
+		if (((polls % DEADLINE_CHECK) == 0) && (clock_ns(CLOCK_MONOTONIC) > deadline))
+			return false;
+	}
+}
+
+bool DmaEngine::waitPause(uint64_t deadline, unsigned long& polls)
+{
+	unsigned int i, backoff = 1;
+
+	for (;;) {
+		polls++;
+		if (poll())
+			return true;
+		if (((polls % DEADLINE_CHECK) == 0) && (clock_ns(CLOCK_MONOTONIC) > deadline))
+			return false;
+
+		for (i = 0; i < backoff; i++)
+			cpu_relax();
+		if (backoff < 64)
+			backoff <<= 1;
+	}
+}
+
+bool DmaEngine::waitYield(uint64_t deadline, unsigned long& polls)
+{
+	uint64_t spin_end = clock_ns(CLOCK_MONOTONIC) + spin * 1000;
+
+	for (;;) {
+		polls++;
+		if (poll())
+			return true;
+		if ((polls % DEADLINE_CHECK) == 0) {
+			uint64_t now = clock_ns(CLOCK_MONOTONIC);
+
+			if (now > deadline)
+				return false;
+			if (now > spin_end)
+				break;
+		}
+		cpu_relax();
+	}
+
+	for (;;) {
+		sched_yield();
+		polls++;
+		if (poll())
+			return true;
+		if (clock_ns(CLOCK_MONOTONIC) > deadline)
+			return false;
+	}
+}
+
+bool DmaEngine::waitInterrupt(uint64_t deadline, unsigned long& polls)
+{
+	unsigned int irq = (dir == TO_DEVICE) ? IRQ_DOWN : IRQ_UP;
+	uint64_t now, spin_end;
+	unsigned long left;
+
+	/* Short transfers finish before a sleep would pay off */
+	spin_end = clock_ns(CLOCK_MONOTONIC) + spin * 1000;
+	for (;;) {
+		polls++;
+		if (poll())
+			return true;
+		if (((polls % DEADLINE_CHECK) == 0) && (clock_ns(CLOCK_MONOTONIC) > spin_end))
+			break;
+		cpu_relax();
+	}
+
+	/* Sleep in slices, an interrupt lost before the sleep only costs one slice */
+	for (;;) {
+		now = clock_ns(CLOCK_MONOTONIC);
+		if (now > deadline)
+			return false;
+
+		left = (deadline - now) / 1000;
+		device->waitForInterrupt(irq, (left > 1000) ? 1000 : (left + 1));
+
+		polls++;
+		if (poll())
+			return true;
+	}
+}
+
+#ifdef PD_HAVE_X86
+__attribute__((target("waitpkg")))
+static inline void umwait_on(volatile uint32_t *addr, uint32_t old, uint64_t limit)
+{
+	_umonitor(const_cast<uint32_t *>(addr));
+	/* Re-check after arming the monitor, the write may have just happened */
+	if (*addr == old)
+		_umwait(0, limit);	/* C0.2, the deeper of the two states */
+}
+#endif
+
+bool DmaEngine::waitUmwait(uint64_t deadline, unsigned long& polls)
+{
+#ifdef PD_HAVE_X86
+	uint32_t old;
+
+	for (;;) {
+		polls++;
+		if (poll())
+			return true;
+		if (clock_ns(CLOCK_MONOTONIC) > deadline)
+			return false;
+
+		/* Wake up at least every ~100k cycles to check the deadline */
+		old = status;
+		umwait_on(wb, old, __rdtsc() + 100000);
+	}
+#else
+	return waitPause(deadline, polls);
+#endif
+}
+
+/**
+ *
+ * Waits until the current transfer finishes, using the selected strategy.
+ * Resets the channel and throws DMA_TIMEOUT if the transfer does not
+ * finish within the timeout.
+ *
+ */
+void DmaEngine::wait()
+{
+	wait_strategy s = strategy;
+	uint64_t start, cpu_start, elapsed, deadline;
+	unsigned long polls = 0;
+	bool done;
+
+	if ((s == WAIT_UMWAIT) && ((wb == NULL) || !hasUmwait()))
+		s = WAIT_PAUSE;
+
+	start = clock_ns(CLOCK_MONOTONIC);
+	cpu_start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	deadline = start + (uint64_t)timeout * 1000;
+
+	try {
+		switch (s) {
+		case WAIT_PAUSE:
+			done = waitPause(deadline, polls);
+			break;
+		case WAIT_YIELD:
+			done = waitYield(deadline, polls);
+			break;
+		case WAIT_INTERRUPT:
+			done = waitInterrupt(deadline, polls);
+			break;
+		case WAIT_UMWAIT:
+			done = waitUmwait(deadline, polls);
+			break;
+		default:
+			done = waitSpin(deadline, polls);
+			break;
+		}
+	} catch (Exception& e) {
+		stats[s].timeouts++;
+		stats[s].polls += polls;
+		throw;
+	}
+
+	elapsed = clock_ns(CLOCK_MONOTONIC) - start;
+	stats[s].polls += polls;
+	stats[s].total_ns += elapsed;
+	stats[s].cpu_ns += clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+	if (elapsed > stats[s].max_ns)
+		stats[s].max_ns = elapsed;
+
+	if (!done) {
+		stats[s].timeouts++;
+		reset();
+		throw Exception(Exception::DMA_TIMEOUT);
+	}
+
+	stats[s].waits++;
+}
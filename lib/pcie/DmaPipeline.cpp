@@ -0,0 +1,362 @@
+/**
+ *
+ * @file DmaPipeline.cpp
+ * @brief Splits large transfers into engine-sized chunks and overlaps
+ * host-side preparation of a chunk with the DMA of the previous one.
+ *
+ */
+
+#include "DmaPipeline.h"
+#include "Exception.h"
+#include "KernelMemory.h"
+#include "UserMemory.h"
+
+#include <cstring>
+
+using namespace pciDriver;
+
+/**
+ *
+ * Constructor of a DmaPipeline. Staging buffers are allocated on first use.
+ *
+ * @param dev Opened PCI device
+ * @param bar Device BAR targeted by the transfers
+ * @param m Whether to copy through staging buffers or DMA directly from user memory
+ *
+ */
+DmaPipeline::DmaPipeline(PciDevice& dev, unsigned int bar, mode m)
+	: ds(dev, DmaEngine::TO_DEVICE), us(dev, DmaEngine::FROM_DEVICE)
+{
+	this->device = &dev;
+	this->bar = bar;
+	this->m = m;
+	this->chunk_size = DEFAULT_CHUNK_SIZE;
+	this->depth = DEFAULT_DEPTH;
+	this->stage = NULL;
+	this->nstage = 0;
+	this->busy = false;
+}
+
+/**
+ *
+ * Destructor of DmaPipeline, releases the staging buffers.
+ *
+ */
+DmaPipeline::~DmaPipeline()
+{
+	freeStaging();
+}
+
+/**
+ *
+ * Sets the size of a single chunk. Must be a non-zero multiple of 4 bytes
+ * and fit in the length register of the engine.
+ *
+ */
+void DmaPipeline::setChunkSize(unsigned long size)
+{
+	if ((size == 0) || (size > DmaEngine::MAX_LENGTH) || (size & 0x3))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	if (size != chunk_size)
+		freeStaging();
+
+	chunk_size = size;
+}
+
+/**
+ *
+ * Sets the number of staging buffers. At least two are needed to overlap
+ * copying with DMA.
+ *
+ */
+void DmaPipeline::setDepth(unsigned int depth)
+{
+	if (depth < 2)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	if (depth != this->depth)
+		freeStaging();
+
+	this->depth = depth;
+}
+
+/**
+ *
+ * Enables completion writeback on both channels, see
+ * DmaEngine::enableWriteback for when this is safe.
+ *
+ */
+void DmaPipeline::enableWriteback()
+{
+	ds.enableWriteback();
+	us.enableWriteback();
+}
+
+/**
+ *
+ * Selects how both channels wait for the completion of a chunk.
+ *
+ */
+void DmaPipeline::setWaitStrategy(DmaEngine::wait_strategy s)
+{
+	ds.setWaitStrategy(s);
+	us.setWaitStrategy(s);
+}
+
+void DmaPipeline::allocStaging()
+{
+	if (stage != NULL)
+		return;
+
+	stage = new KernelMemory*[depth];
+	try {
+		for (nstage = 0; nstage < depth; nstage++)
+			stage[nstage] = &device->allocKernelMemory(chunk_size);
+	} catch (Exception& e) {
+		freeStaging();
+		throw;
+	}
+}
+
+void DmaPipeline::freeStaging()
+{
+	unsigned int i;
+
+	if (stage == NULL)
+		return;
+
+	for (i = 0; i < nstage; i++)
+		delete stage[i];
+	delete [] stage;
+
+	stage = NULL;
+	nstage = 0;
+}
+
+/**
+ *
+ * Waits for the transfer in flight, if any, and starts the next one.
+ *
+ */
+void DmaPipeline::kick(DmaEngine& engine, uint64_t ha, uint64_t pa, unsigned long len)
+{
+	if (busy)
+		engine.wait();
+
+	busy = false;
+	engine.start(ha, pa, len, bar);
+	busy = true;
+}
+
+/**
+ *
+ * Waits for the transfer in flight, if any.
+ *
+ */
+void DmaPipeline::finish(DmaEngine& engine)
+{
+	if (busy)
+		engine.wait();
+
+	busy = false;
+}
+
+/**
+ *
+ * Queues every scatter/gather entry of a pinned window.
+ *
+ */
+void DmaPipeline::kickSG(DmaEngine& engine, UserMemory *um, uint64_t pa)
+{
+	unsigned int i;
+	unsigned long addr, size, n;
+
+	for (i = 0; i < um->getSGcount(); i++) {
+		addr = um->getSGentryAddress(i);
+		size = um->getSGentrySize(i);
+
+		for (; size > 0; size -= n, addr += n, pa += n) {
+			n = (size > DmaEngine::MAX_LENGTH) ? DmaEngine::MAX_LENGTH : size;
+			kick(engine, addr, pa, n);
+		}
+	}
+}
+
+/**
+ *
+ * Writes a host buffer of any size to the device.
+ *
+ * @param devaddr Destination address inside the BAR
+ * @param src Source buffer
+ * @param len Number of bytes to transfer
+ *
+ */
+void DmaPipeline::write(uint64_t devaddr, const void *src, uint64_t len)
+{
+	const unsigned char *ptr = static_cast<const unsigned char *>(src);
+
+	if (len == 0)
+		return;
+
+	busy = false;
+	try {
+		if (m == ZERO_COPY)
+			writeZeroCopy(devaddr, const_cast<unsigned char *>(ptr), len);
+		else
+			writeStaged(devaddr, ptr, len);
+	} catch (Exception& e) {
+		ds.reset();
+		busy = false;
+		throw;
+	}
+}
+
+/**
+ *
+ * Reads a device range of any size into a host buffer.
+ *
+ * @param dst Destination buffer
+ * @param devaddr Source address inside the BAR
+ * @param len Number of bytes to transfer
+ *
+ */
+void DmaPipeline::read(void *dst, uint64_t devaddr, uint64_t len)
+{
+	unsigned char *ptr = static_cast<unsigned char *>(dst);
+
+	if (len == 0)
+		return;
+
+	busy = false;
+	try {
+		if (m == ZERO_COPY)
+			readZeroCopy(ptr, devaddr, len);
+		else
+			readStaged(ptr, devaddr, len);
+	} catch (Exception& e) {
+		us.reset();
+		busy = false;
+		throw;
+	}
+}
+
+void DmaPipeline::writeStaged(uint64_t devaddr, const unsigned char *src, uint64_t len)
+{
+	KernelMemory *km;
+	uint64_t off;
+	unsigned long n;
+	unsigned int i;
+
+	allocStaging();
+
+	/* Staging buffer i % nstage last held chunk i - nstage, which is done
+	 * because kick() only returns after the chunk before it completed. */
+	for (off = 0, i = 0; off < len; off += n, i++) {
+		n = ((len - off) > chunk_size) ? chunk_size : (len - off);
+		km = stage[i % nstage];
+
+		memcpy(km->getBuffer(), src + off, n);
+		km->sync(KernelMemory::TO_DEVICE);
+
+		kick(ds, km->getPhysicalAddress(), devaddr + off, n);
+	}
+
+	finish(ds);
+}
+
+void DmaPipeline::readStaged(unsigned char *dst, uint64_t devaddr, uint64_t len)
+{
+	KernelMemory *km;
+	uint64_t off;
+	unsigned long n, next;
+	unsigned int i;
+
+	allocStaging();
+
+	n = (len > chunk_size) ? chunk_size : len;
+	kick(us, stage[0]->getPhysicalAddress(), devaddr, n);
+
+	for (off = 0, i = 0; off < len; off += n, i++) {
+		n = ((len - off) > chunk_size) ? chunk_size : (len - off);
+
+		/* Start the next chunk before copying out the current one */
+		if ((off + n) < len) {
+			next = ((len - off - n) > chunk_size) ? chunk_size : (len - off - n);
+			kick(us, stage[(i + 1) % nstage]->getPhysicalAddress(), devaddr + off + n, next);
+		} else {
+			finish(us);
+		}
+
+		km = stage[i % nstage];
+		km->sync(KernelMemory::FROM_DEVICE);
+		memcpy(dst + off, km->getBuffer(), n);
+	}
+}
+
+void DmaPipeline::writeZeroCopy(uint64_t devaddr, unsigned char *src, uint64_t len)
+{
+	UserMemory *prev = NULL, *cur = NULL;
+	uint64_t off;
+	unsigned long n;
+
+	try {
+		for (off = 0; off < len; off += n) {
+			n = ((len - off) > chunk_size) ? chunk_size : (len - off);
+
+			/* Pinning the next window overlaps with the DMA of the previous one */
+			cur = &device->mapUserMemory(src + off, n);
+			cur->sync(UserMemory::TO_DEVICE);
+			kickSG(ds, cur, devaddr + off);
+
+			/* The first kick waited for the last entry of the previous window */
+			delete prev;
+			prev = cur;
+			cur = NULL;
+		}
+
+		finish(ds);
+	} catch (Exception& e) {
+		ds.reset();
+		busy = false;
+		delete cur;
+		delete prev;
+		throw;
+	}
+
+	delete prev;
+}
+
+void DmaPipeline::readZeroCopy(unsigned char *dst, uint64_t devaddr, uint64_t len)
+{
+	UserMemory *prev = NULL, *cur = NULL;
+	uint64_t off;
+	unsigned long n;
+
+	try {
+		for (off = 0; off < len; off += n) {
+			n = ((len - off) > chunk_size) ? chunk_size : (len - off);
+
+			cur = &device->mapUserMemory(dst + off, n);
+			kickSG(us, cur, devaddr + off);
+
+			if (prev != NULL) {
+				prev->sync(UserMemory::FROM_DEVICE);
+				delete prev;
+			}
+			prev = cur;
+			cur = NULL;
+		}
+
+		finish(us);
+		prev->sync(UserMemory::FROM_DEVICE);
+	} catch (Exception& e) {
+		us.reset();
+		busy = false;
+		delete cur;
+		delete prev;
+		throw;
+	}
+
+	delete prev;
+}
@@ -0,0 +1,455 @@
+/**
+ *
+ * @file DmaQueue.cpp
+ * @brief Lock-free multi-producer submission of DMA requests, batched
+ * into descriptor chains by a single submitter thread.
+ *
+ */
+
+#include "DmaQueue.h"
+#include "Exception.h"
+#include "KernelMemory.h"
+
+#include <cstring>
+#include <time.h>
+
+using namespace pciDriver;
+
+static inline uint64_t clock_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/**
+ *
+ * Constructor of a DmaQueue. Allocates the descriptor ring and starts the
+ * submitter thread.
+ *
+ * @param dev Opened PCI device
+ * @param dir Channel the queue feeds
+ * @param bar Device BAR targeted by the requests
+ * @param max_batch Maximum number of requests chained into one DMA
+ *
+ */
+DmaQueue::DmaQueue(PciDevice& dev, DmaEngine::direction dir, unsigned int bar,
+	unsigned int max_batch)
+	: engine(dev, dir)
+{
+	if (max_batch == 0)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	this->device = &dev;
+	this->bar = bar;
+	this->max_batch = max_batch;
+	this->chunk_size = DEFAULT_CHUNK_SIZE;
+	this->bulk_budget = DEFAULT_BULK_BUDGET;
+	this->batches = 0;
+	this->completed = 0;
+	this->idle = 0;
+	this->stop = 0;
+	this->bulk_cur = NULL;
+	this->bulk_off = 0;
+	resetStats();
+
+	memset(stub, 0, sizeof(stub));
+	for (int i = 0; i < PRIORITIES; i++) {
+		head[i] = &stub[i];
+		tail[i] = &stub[i];
+	}
+
+	ring = &dev.allocKernelMemory(2 * max_batch * sizeof(descriptor));
+	desc = static_cast<descriptor *>(ring->getBuffer());
+	memset(desc, 0, 2 * max_batch * sizeof(descriptor));
+
+	pthread_mutex_init(&idle_mutex, NULL);
+	pthread_cond_init(&idle_cond, NULL);
+
+	if (pthread_create(&thread, NULL, &DmaQueue::submitter, this) != 0) {
+		pthread_cond_destroy(&idle_cond);
+		pthread_mutex_destroy(&idle_mutex);
+		delete ring;
+		throw Exception(Exception::INTERNAL_ERROR);
+	}
+}
+
+/**
+ *
+ * Destructor of DmaQueue. Requests already submitted are completed before
+ * the submitter thread exits.
+ *
+ */
+DmaQueue::~DmaQueue()
+{
+	__atomic_store_n(&stop, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&idle_mutex);
+	pthread_cond_signal(&idle_cond);
+	pthread_mutex_unlock(&idle_mutex);
+
+	pthread_join(thread, NULL);
+
+	pthread_cond_destroy(&idle_cond);
+	pthread_mutex_destroy(&idle_mutex);
+	delete ring;
+}
+
+/**
+ *
+ * Sets the largest piece of a BULK request put into one descriptor.
+ * Must be a non-zero multiple of 4 bytes.
+ *
+ */
+void DmaQueue::setChunkSize(uint32_t size)
+{
+	if ((size == 0) || (size > DmaEngine::MAX_LENGTH) || (size & 0x3))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	chunk_size = size;
+}
+
+/**
+ *
+ * Sets how many BULK bytes a single chain may carry. Bounds the time a
+ * HIGH request waits behind bulk traffic, at the cost of more chains.
+ *
+ */
+void DmaQueue::setBulkBudget(uint32_t bytes)
+{
+	if (bytes == 0)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	bulk_budget = bytes;
+}
+
+void DmaQueue::resetStats()
+{
+	memset(stats, 0, sizeof(stats));
+}
+
+/**
+ *
+ * Queues a request. Safe to call from any number of threads at once, and
+ * does not block. The request must stay valid until its callback ran.
+ *
+ * @param req Request to transfer
+ * @param prio Priority class of the request
+ *
+ */
+void DmaQueue::submit(request *req, priority prio)
+{
+	class_stats *st;
+	unsigned long depth, max;
+
+	if ((req->length == 0) || (req->length > DmaEngine::MAX_LENGTH) || (req->length & 0x3))
+		throw Exception(Exception::INVALID_ARGUMENT);
+	if ((unsigned int)prio >= PRIORITIES)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	st = &stats[prio];
+	__atomic_add_fetch(&st->submitted, 1, __ATOMIC_RELAXED);
+	depth = __atomic_add_fetch(&st->depth, 1, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&st->max_depth, __ATOMIC_RELAXED);
+	while ((depth > max) && !__atomic_compare_exchange_n(&st->max_depth, &max, depth,
+			true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	req->result = 0;
+	req->prio = prio;
+	req->submit_ns = clock_ns();
+	push(prio, req);
+
+	/* Only an idle submitter needs the lock, busy ones find the request */
+	if (__atomic_load_n(&idle, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&idle_mutex);
+		pthread_cond_signal(&idle_cond);
+		pthread_mutex_unlock(&idle_mutex);
+	}
+}
+
+void DmaQueue::push(priority prio, request *req)
+{
+	request *prev;
+
+	req->next = NULL;
+	prev = __atomic_exchange_n(&head[prio], req, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&prev->next, req, __ATOMIC_RELEASE);
+}
+
+/**
+ *
+ * Takes the oldest request off the list. Only the submitter calls this.
+ *
+ * @returns NULL if the list is empty, or if a producer has swapped the
+ * head but not linked its request yet.
+ *
+ */
+DmaQueue::request *DmaQueue::pop(priority prio)
+{
+	request *t = tail[prio];
+	request *n = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE);
+
+	if (t == &stub[prio]) {
+		if (n == NULL)
+			return NULL;
+		tail[prio] = n;
+		t = n;
+		n = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (n == NULL) {
+		if (t != __atomic_load_n(&head[prio], __ATOMIC_SEQ_CST))
+			return NULL;
+
+		/* t is the last request, put the stub behind it so it can be taken */
+		push(prio, &stub[prio]);
+
+		n = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE);
+		if (n == NULL)
+			return NULL;
+	}
+
+	tail[prio] = n;
+	__atomic_sub_fetch(&stats[prio].depth, 1, __ATOMIC_RELAXED);
+	return t;
+}
+
+/**
+ *
+ * Checks whether any request is waiting, or a BULK request is half done.
+ *
+ */
+bool DmaQueue::pending()
+{
+	int i;
+
+	if (bulk_cur != NULL)
+		return true;
+
+	for (i = 0; i < PRIORITIES; i++)
+		if ((tail[i] != &stub[i]) || (__atomic_load_n(&head[i], __ATOMIC_SEQ_CST) != &stub[i]))
+			return true;
+
+	return false;
+}
+
+/**
+ *
+ * Takes the next chain off the queues: every HIGH request that fits,
+ * then BULK chunks up to the per-chain budget.
+ *
+ * @returns the number of descriptors in the chain.
+ *
+ */
+unsigned int DmaQueue::collect(slot *batch)
+{
+	unsigned int n = 0;
+	uint32_t budget = bulk_budget, len;
+	request *req;
+
+	while ((n < max_batch) && ((req = pop(HIGH)) != NULL)) {
+		batch[n].req = req;
+		batch[n].offset = 0;
+		batch[n].length = req->length;
+		batch[n].last = true;
+		n++;
+	}
+
+	while ((n < max_batch) && (budget > 0)) {
+		if (bulk_cur == NULL) {
+			if ((bulk_cur = pop(BULK)) == NULL)
+				break;
+			bulk_off = 0;
+		}
+
+		len = bulk_cur->length - bulk_off;
+		if (len > chunk_size)
+			len = chunk_size;
+
+		batch[n].req = bulk_cur;
+		batch[n].offset = bulk_off;
+		batch[n].length = len;
+		batch[n].last = ((bulk_off + len) == bulk_cur->length);
+		n++;
+
+		bulk_off += len;
+		if (bulk_off == bulk_cur->length)
+			bulk_cur = NULL;
+		budget = (len < budget) ? (budget - len) : 0;
+	}
+
+	return n;
+}
+
+/**
+ *
+ * Writes the descriptor chain of a batch into one half of the ring.
+ *
+ */
+void DmaQueue::build(unsigned int half, slot *batch, unsigned int n)
+{
+	descriptor *d = desc + (half * max_batch);
+	uint64_t base = ring->getPhysicalAddress() + (half * max_batch * sizeof(descriptor));
+	uint64_t next, pa, ha;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		next = (i + 1 < n) ? base + ((i + 1) * sizeof(descriptor)) : 0;
+
+		pa = batch[i].req->pa + batch[i].offset;
+		ha = batch[i].req->ha + batch[i].offset;
+
+		d[i].pa_h = (pa >> 32);
+		d[i].pa_l = pa;
+		d[i].ha_h = (ha >> 32);
+		d[i].ha_l = ha;
+		d[i].next_h = (next >> 32);
+		d[i].next_l = next;
+		d[i].length = batch[i].length;
+		d[i].control = DmaEngine::CTRL_VALID | DmaEngine::CTRL_AINC |
+			(bar << DmaEngine::CTRL_BAR_SHIFT) | ((next == 0) ? DmaEngine::CTRL_LAST : 0);
+		d[i].status = 0;
+	}
+
+	ring->sync(KernelMemory::TO_DEVICE);
+}
+
+/**
+ *
+ * Starts a chain built in the ring. The first descriptor goes to the
+ * channel registers, the engine fetches the rest from host memory.
+ *
+ */
+void DmaQueue::launch(unsigned int half)
+{
+	descriptor *d = desc + (half * max_batch);
+
+	engine.start(
+		((uint64_t)d->ha_h << 32) | d->ha_l,
+		((uint64_t)d->pa_h << 32) | d->pa_l,
+		d->length, bar,
+		((uint64_t)d->next_h << 32) | d->next_l);
+
+	batches++;
+}
+
+/**
+ *
+ * Finishes the requests whose last descriptor was in the chain. A failed
+ * chunk fails the whole request.
+ *
+ */
+void DmaQueue::complete(slot *batch, unsigned int n, int result)
+{
+	uint64_t now = clock_ns(), lat;
+	class_stats *st;
+	request *req;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		req = batch[i].req;
+
+		if ((result != 0) && (req->result == 0))
+			req->result = result;
+		if (!batch[i].last)
+			continue;
+
+		req->complete_ns = now;
+		lat = now - req->submit_ns;
+
+		st = &stats[req->prio];
+		st->completed++;
+		st->total_ns += lat;
+		if (lat > st->max_ns)
+			st->max_ns = lat;
+		completed++;
+
+		/* The producer may reuse the request from here on */
+		if (req->callback != NULL)
+			req->callback(req);
+	}
+}
+
+/**
+ *
+ * Puts the submitter to sleep until a producer submits. The timed wait
+ * only guards against a missed wakeup, submit() signals idle submitters.
+ *
+ */
+void DmaQueue::sleep()
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&idle_mutex);
+	__atomic_store_n(&idle, 1, __ATOMIC_SEQ_CST);
+
+	if (!pending() && !__atomic_load_n(&stop, __ATOMIC_SEQ_CST)) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 10000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&idle_cond, &idle_mutex, &ts);
+	}
+
+	__atomic_store_n(&idle, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&idle_mutex);
+}
+
+void DmaQueue::run()
+{
+	slot *cur = new slot[max_batch];
+	slot *nxt = new slot[max_batch];
+	slot *tmp;
+	unsigned int ncur = 0, nnxt, half = 0;
+	int result;
+
+	for (;;) {
+		if (ncur == 0) {
+			ncur = collect(cur);
+			if (ncur == 0) {
+				if (__atomic_load_n(&stop, __ATOMIC_SEQ_CST))
+					break;
+				sleep();
+				continue;
+			}
+			build(half, cur, ncur);
+		}
+
+		result = 0;
+		nnxt = 0;
+		try {
+			launch(half);
+
+			/* Build the next chain while this one runs */
+			nnxt = collect(nxt);
+			if (nnxt > 0)
+				build(half ^ 1, nxt, nnxt);
+
+			engine.wait();
+		} catch (Exception& e) {
+			result = e.getType();
+			engine.reset();
+		}
+
+		complete(cur, ncur, result);
+
+		tmp = cur;
+		cur = nxt;
+		nxt = tmp;
+		ncur = nnxt;
+		half ^= 1;
+	}
+
+	delete [] cur;
+	delete [] nxt;
+}
+
+void *DmaQueue::submitter(void *arg)
+{
+	static_cast<DmaQueue *>(arg)->run();
+	return NULL;
+}
@@ -21,7 +21,9 @@ const char* Exception::descriptions[] = {
 	"Mmap failed",
 	"Alloc failed",
 	"SGmap failed",
-	"Interrupt failed"
+	"Interrupt failed",
+	"Invalid argument",
+	"DMA timeout"
 };
 
 
@@ -0,0 +1,369 @@
+/**
+ *
+ * @file HybridTransfer.cpp
+ * @brief Picks PIO, staged DMA or zero-copy DMA per transfer.
+ *
+ */
+
+#include "HybridTransfer.h"
+#include "Exception.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+using namespace pciDriver;
+
+/* Smallest size calibrate() measures */
+static const uint64_t CALIBRATION_MIN = 64;
+
+/* Every size is timed for at least this long */
+static const uint64_t CALIBRATION_NS = 2000000;
+
+static inline uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ *
+ * Constructor of a HybridTransfer. Starts with the stored calibration of
+ * the device, if there is one, or with default thresholds.
+ *
+ * @param dev Opened PCI device
+ * @param bar Device BAR targeted by the transfers
+ *
+ */
+HybridTransfer::HybridTransfer(PciDevice& dev, unsigned int bar)
+	: pipe(dev, bar)
+{
+	this->device = &dev;
+	this->bar = bar;
+	this->bar_size = dev.getBARsize(bar);
+
+	th.pio_max[DmaEngine::TO_DEVICE] = DEFAULT_PIO_WRITE;
+	th.pio_max[DmaEngine::FROM_DEVICE] = DEFAULT_PIO_READ;
+	th.zero_copy_min[DmaEngine::TO_DEVICE] = DEFAULT_ZERO_COPY;
+	th.zero_copy_min[DmaEngine::FROM_DEVICE] = DEFAULT_ZERO_COPY;
+	calibrated = false;
+	last = PATH_PIO;
+	resetStats();
+
+	load();
+}
+
+HybridTransfer::~HybridTransfer()
+{
+}
+
+const char *HybridTransfer::getPathName(path p)
+{
+	static const char *names[] = { "pio", "staged", "zero-copy" };
+
+	if ((unsigned int)p >= PATHS)
+		return "unknown";
+
+	return names[p];
+}
+
+void HybridTransfer::resetStats()
+{
+	memset(stats, 0, sizeof(stats));
+}
+
+/**
+ *
+ * Selects the path of a transfer. PIO needs the range inside the BAR,
+ * zero-copy a dword aligned host buffer.
+ *
+ */
+HybridTransfer::path HybridTransfer::choose(DmaEngine::direction dir, uint64_t devaddr, const void *buf, uint64_t len)
+{
+	if ((len <= th.pio_max[dir]) && (devaddr <= bar_size) && (len <= bar_size - devaddr))
+		return PATH_PIO;
+
+	if ((len >= th.zero_copy_min[dir]) && (((uintptr_t)buf & 0x3) == 0))
+		return PATH_ZERO_COPY;
+
+	return PATH_STAGED;
+}
+
+void HybridTransfer::run(path p, DmaEngine::direction dir, uint64_t devaddr, void *buf, uint64_t len)
+{
+	switch (p) {
+	case PATH_PIO:
+		if (dir == DmaEngine::TO_DEVICE)
+			device->barWrite(bar, devaddr, buf, len);
+		else
+			device->barRead(bar, devaddr, buf, len);
+		break;
+	default:
+		pipe.setMode((p == PATH_ZERO_COPY) ? DmaPipeline::ZERO_COPY : DmaPipeline::STAGED);
+		if (dir == DmaEngine::TO_DEVICE)
+			pipe.write(devaddr, buf, len);
+		else
+			pipe.read(buf, devaddr, len);
+		break;
+	}
+}
+
+/**
+ *
+ * Writes a host buffer to the device over the fastest path.
+ *
+ * @param devaddr Destination address inside the BAR
+ * @param src Source buffer
+ * @param len Number of bytes
+ *
+ */
+void HybridTransfer::write(uint64_t devaddr, const void *src, uint64_t len)
+{
+	uint64_t start;
+
+	if ((devaddr | len) & 0x3)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	last = choose(DmaEngine::TO_DEVICE, devaddr, src, len);
+
+	start = now_ns();
+	run(last, DmaEngine::TO_DEVICE, devaddr, const_cast<void *>(src), len);
+
+	stats[last].count++;
+	stats[last].bytes += len;
+	stats[last].ns += now_ns() - start;
+}
+
+/**
+ *
+ * Reads a device range into a host buffer over the fastest path.
+ *
+ * @param dst Destination buffer
+ * @param devaddr Source address inside the BAR
+ * @param len Number of bytes
+ *
+ */
+void HybridTransfer::read(void *dst, uint64_t devaddr, uint64_t len)
+{
+	uint64_t start;
+
+	if ((devaddr | len) & 0x3)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	last = choose(DmaEngine::FROM_DEVICE, devaddr, dst, len);
+
+	start = now_ns();
+	run(last, DmaEngine::FROM_DEVICE, devaddr, dst, len);
+
+	stats[last].count++;
+	stats[last].bytes += len;
+	stats[last].ns += now_ns() - start;
+}
+
+/**
+ *
+ * Times one path for one size.
+ *
+ * @returns nanoseconds per transfer
+ *
+ */
+double HybridTransfer::measure(path p, DmaEngine::direction dir, uint64_t devaddr, void *buf, uint64_t len)
+{
+	uint64_t start, elapsed;
+	unsigned long n = 0;
+
+	/* Warm up: pins, staging buffers, mappings */
+	run(p, dir, devaddr, buf, len);
+
+	start = now_ns();
+	do {
+		run(p, dir, devaddr, buf, len);
+		n++;
+		elapsed = now_ns() - start;
+	} while ((elapsed < CALIBRATION_NS) || (n < 3));
+
+	return (double)elapsed / n;
+}
+
+/**
+ *
+ * Measures every path for sizes from 64 bytes to max_len, in steps of 4x,
+ * and sets the thresholds where the paths cross. Overwrites the device
+ * range [devaddr, devaddr + max_len).
+ *
+ * @param devaddr Scratch area inside the BAR
+ * @param max_len Largest size to measure
+ * @param persist Store the result for the device
+ * @returns the new thresholds
+ *
+ */
+const HybridTransfer::thresholds& HybridTransfer::calibrate(uint64_t devaddr, uint64_t max_len, bool persist)
+{
+	thresholds t;
+	void *buf;
+	uint64_t len;
+	unsigned int d;
+	double pio, staged, zc;
+	bool pio_wins;
+
+	if (((devaddr | max_len) & 0x3) || (max_len < CALIBRATION_MIN))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	if (posix_memalign(&buf, 4096, max_len) != 0)
+		throw Exception(Exception::ALLOC_FAILED);
+	memset(buf, 0, max_len);
+
+	try {
+		for (d = 0; d < 2; d++) {
+			DmaEngine::direction dir = static_cast<DmaEngine::direction>(d);
+
+			t.pio_max[d] = 0;
+			t.zero_copy_min[d] = ~0ULL;
+			pio_wins = true;
+
+			for (len = CALIBRATION_MIN; len <= max_len; len <<= 2) {
+				staged = measure(PATH_STAGED, dir, devaddr, buf, len);
+				zc = measure(PATH_ZERO_COPY, dir, devaddr, buf, len);
+
+				/* PIO up to the first size where it loses */
+				if (pio_wins && (devaddr + len <= bar_size)) {
+					pio = measure(PATH_PIO, dir, devaddr, buf, len);
+					if (pio <= staged)
+						t.pio_max[d] = len;
+					else
+						pio_wins = false;
+				}
+
+				/* Zero-copy from the size on where it keeps winning */
+				if (zc < staged) {
+					if (t.zero_copy_min[d] == ~0ULL)
+						t.zero_copy_min[d] = len;
+				} else {
+					t.zero_copy_min[d] = ~0ULL;
+				}
+			}
+		}
+	} catch (Exception& e) {
+		free(buf);
+		throw;
+	}
+
+	free(buf);
+
+	th = t;
+	calibrated = true;
+
+	if (persist)
+		save();
+
+	return th;
+}
+
+/**
+ *
+ * Builds the name of the calibration file of the device.
+ *
+ * @param create Create the directory if it does not exist
+ * @returns false if no directory is configured
+ *
+ */
+bool HybridTransfer::getFileName(char *name, size_t size, bool create)
+{
+	const char *dir = getenv("PCIDRIVER_CALIBRATION_DIR");
+	const char *home = getenv("HOME");
+	char path[256];
+
+	if (dir != NULL) {
+		snprintf(path, sizeof(path), "%s", dir);
+	} else if (home != NULL) {
+		snprintf(path, sizeof(path), "%s/.cache", home);
+		if (create)
+			mkdir(path, 0755);
+		snprintf(path, sizeof(path), "%s/.cache/pcidriver", home);
+	} else {
+		return false;
+	}
+
+	if (create && (mkdir(path, 0755) != 0) && (errno != EEXIST))
+		return false;
+
+	/* Same board in the same slot, same BAR */
+	snprintf(name, size, "%s/%04x-%04x-%02x-%02x-bar%u", path,
+		device->readConfigWord(0x00), device->readConfigWord(0x02),
+		device->getBus(), device->getSlot(), bar);
+
+	return true;
+}
+
+/**
+ *
+ * Loads the stored calibration of the device.
+ *
+ * @returns false if there is none
+ *
+ */
+bool HybridTransfer::load()
+{
+	char name[320];
+	FILE *f;
+	thresholds t;
+	unsigned long long v[4];
+	int n;
+
+	if (!getFileName(name, sizeof(name), false))
+		return false;
+
+	if ((f = fopen(name, "r")) == NULL)
+		return false;
+
+	n = fscanf(f, "pio_write %llu pio_read %llu zero_copy_write %llu zero_copy_read %llu",
+		&v[0], &v[1], &v[2], &v[3]);
+	fclose(f);
+
+	if (n != 4)
+		return false;
+
+	t.pio_max[DmaEngine::TO_DEVICE] = v[0];
+	t.pio_max[DmaEngine::FROM_DEVICE] = v[1];
+	t.zero_copy_min[DmaEngine::TO_DEVICE] = v[2];
+	t.zero_copy_min[DmaEngine::FROM_DEVICE] = v[3];
+
+	th = t;
+	calibrated = true;
+
+	return true;
+}
+
+/**
+ *
+ * Stores the current thresholds for the device.
+ *
+ * @returns false if the file could not be written
+ *
+ */
+bool HybridTransfer::save()
+{
+	char name[320];
+	FILE *f;
+	bool ok;
+
+	if (!getFileName(name, sizeof(name), true))
+		return false;
+
+	if ((f = fopen(name, "w")) == NULL)
+		return false;
+
+	ok = (fprintf(f, "pio_write %llu\npio_read %llu\nzero_copy_write %llu\nzero_copy_read %llu\n",
+		(unsigned long long)th.pio_max[DmaEngine::TO_DEVICE],
+		(unsigned long long)th.pio_max[DmaEngine::FROM_DEVICE],
+		(unsigned long long)th.zero_copy_min[DmaEngine::TO_DEVICE],
+		(unsigned long long)th.zero_copy_min[DmaEngine::FROM_DEVICE]) > 0);
+
+	return (fclose(f) == 0) && ok;
+}
@@ -28,6 +28,10 @@
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <errno.h>
+#include <unistd.h>
+#include <cstring>
+#include <cstdio>
 
 using namespace pciDriver;
 
@@ -37,57 +41,304 @@ using namespace pciDriver;
  * size and mmaps it.
  *
  * @param size How much memory to allocate
+ * @param name Name to attach to the memory by later, NULL for none
+ * @param flags PERSIST to keep the memory in the driver when the object is
+ *        deleted or the process ends, requires a name; CONTIGUOUS to allow
+ *        buffers beyond the largest block of the page allocator
+ * @param node NUMA node to allocate on, NODE_DEVICE for the one of the device
  *
  */
-KernelMemory::KernelMemory(PciDevice& dev, unsigned int size)
+KernelMemory::KernelMemory(PciDevice& dev, uint64_t size, const char *name, unsigned int flags, int node)
 {
-	void *m_ptr;
-	kmem_handle_t kh;
+	bool persist = ((flags & PERSIST) != 0);
+	kmem_named_t kn;
 	int dev_handle;
+	int ret;
 	
 	dev_handle = dev.getHandle();
 
 	this->device = &dev;
 	this->size = size;
-	
+	this->persistent = persist;
+	this->name[0] = '\0';
+
+	if ((flags & ~(PERSIST | CONTIGUOUS)) || (persist && (name == NULL)) ||
+			((name != NULL) && ((name[0] == '\0') || (strlen(name) >= NAME_MAX_LEN))))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	/* The driver mmaps the buffer allocated last, so allocate under the
+	 * lock too. This is not fully safe, as a separate process can still
+	 * open the device independently. That will use a separate mutex and
+	 * the race condition can arise.
+	 * Posible fix: Do not allow the driver for mutliple openings of a device */
+	device->mmap_lock();
+
 	/* Allocate */
-	kh.size = size;
-	if (ioctl(dev_handle, PCIDRIVER_IOC_KMEM_ALLOC, &kh) != 0)
+	memset(&kn, 0, sizeof(kn));
+	kn.handle.size = size;
+	if (node != NODE_DEVICE) {
+		kn.handle.node = node;
+		flags |= PCIDRIVER_KMEM_FLAG_NODE;
+	}
+	if ((name == NULL) && (flags == 0)) {
+		ret = ioctl(dev_handle, PCIDRIVER_IOC_KMEM_ALLOC, &kn.handle);
+	} else {
+		if (name != NULL)
+			strcpy(kn.name, name);
+		kn.flags = flags;
+		ret = ioctl(dev_handle, PCIDRIVER_IOC_KMEM_ALLOC_NAMED, &kn);
+	}
+	if (ret != 0) {
+		device->mmap_unlock();
 		throw Exception(Exception::ALLOC_FAILED);
+	}
 
-	handle_id = kh.handle_id;
-	pa = kh.pa;
+	handle_id = kn.handle.handle_id;
+	pa = kn.handle.pa;
+	this->node = (device->getABIVersion() >= 5) ? kn.handle.node : -1;
+	if (name != NULL)
+		strcpy(this->name, name);
 
 	/* Mmap */
-	/* This is not fully safe, as a separate process can still open the device independently.
-	 * That will use a separate mutex and the race condition can arise.
-	 * Posible fix: Do not allow the driver for mutliple openings of a device */
+	if (!mapBuffer()) {
+		device->mmap_unlock();
+		ioctl(dev_handle, PCIDRIVER_IOC_KMEM_FREE, &kn.handle);
+		throw Exception(Exception::ALLOC_FAILED);
+	}
+
+	device->mmap_unlock();
+}
+
+/**
+ *
+ * Constructor of a KernelMemory object for named kernel memory that already
+ * exists, e.g. kept persistent by a previous process. Mmaps it without
+ * allocating.
+ *
+ * @param name Name the memory was allocated with
+ *
+ */
+KernelMemory::KernelMemory(PciDevice& dev, const char *name)
+{
+	kmem_named_t kn;
+	int dev_handle;
+
+	dev_handle = dev.getHandle();
+
+	this->device = &dev;
+
+	if ((name == NULL) || (name[0] == '\0') || (strlen(name) >= NAME_MAX_LEN))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	device->mmap_lock();
+
+	/* Attach, which makes it the buffer the driver mmaps next */
+	memset(&kn, 0, sizeof(kn));
+	strcpy(kn.name, name);
+	if (ioctl(dev_handle, PCIDRIVER_IOC_KMEM_ATTACH, &kn) != 0) {
+		device->mmap_unlock();
+		if (errno == ENOENT)
+			throw Exception(Exception::INVALID_ARGUMENT);
+		throw Exception(Exception::ALLOC_FAILED);
+	}
+
+	handle_id = kn.handle.handle_id;
+	pa = kn.handle.pa;
+	size = kn.handle.size;
+	node = (device->getABIVersion() >= 5) ? kn.handle.node : -1;
+	persistent = ((kn.flags & PCIDRIVER_KMEM_FLAG_PERSIST) != 0);
+	strcpy(this->name, name);
+
+	/* Mmap, the memory stays in the driver if that fails */
+	if (!mapBuffer()) {
+		device->mmap_unlock();
+		throw Exception(Exception::ALLOC_FAILED);
+	}
+
+	device->mmap_unlock();
+}
+
+/**
+ *
+ * Exports the kernel memory to other processes, which map the same pages
+ * with importHandle() instead of copying the data. The memory is freed
+ * when this object and every imported one are deleted, or their
+ * processes end.
+ *
+ * @param all_users Let processes of any user import it, not only the
+ *        ones of the current user
+ * @returns the key to pass to the other processes, the same for every
+ *          export of the memory
+ * @throws Exception::INTERNAL_ERROR if the memory was exported before
+ *         with another all_users, or belongs to another process
+ *
+ */
+uint64_t KernelMemory::exportHandle(bool all_users)
+{
+	kmem_export_t ke;
+
+	if (device->getABIVersion() < 4)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	memset(&ke, 0, sizeof(ke));
+	ke.handle.handle_id = handle_id;
+	ke.handle.pa = pa;
+	ke.handle.size = size;
+	ke.flags = all_users ? PCIDRIVER_KMEM_EXPORT_ALL_USERS : 0;
+
+	if (ioctl(device->getHandle(), PCIDRIVER_IOC_KMEM_EXPORT, &ke) != 0)
+		throw Exception(Exception::INTERNAL_ERROR);
+
+	return ke.key;
+}
+
+/**
+ *
+ * Maps kernel memory exported by another process. Deleting the returned
+ * object drops the import; the memory is freed once the exporter is gone
+ * too.
+ *
+ * @param key Key from exportHandle()
+ * @returns A KernelMemory object
+ * @throws Exception::INVALID_ARGUMENT if no memory is exported with the key
+ *
+ */
+KernelMemory& KernelMemory::importHandle(PciDevice& dev, uint64_t key)
+{
+	if (dev.getABIVersion() < 4)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	return *(new KernelMemory(dev, key, import_tag()));
+}
+
+/**
+ *
+ * Constructor of a KernelMemory object for memory exported by another
+ * process, see importHandle().
+ *
+ */
+KernelMemory::KernelMemory(PciDevice& dev, uint64_t key, import_tag)
+{
+	kmem_export_t ke;
+	int dev_handle;
+
+	dev_handle = dev.getHandle();
+
+	this->device = &dev;
+	this->persistent = false;
+	this->name[0] = '\0';
+
 	device->mmap_lock();
-		
+
+	/* Import, which makes it the buffer the driver mmaps next */
+	memset(&ke, 0, sizeof(ke));
+	ke.key = key;
+	if (ioctl(dev_handle, PCIDRIVER_IOC_KMEM_IMPORT, &ke) != 0) {
+		device->mmap_unlock();
+		if (errno == ENOENT)
+			throw Exception(Exception::INVALID_ARGUMENT);
+		throw Exception(Exception::ALLOC_FAILED);
+	}
+
+	handle_id = ke.handle.handle_id;
+	pa = ke.handle.pa;
+	size = ke.handle.size;
+	node = (device->getABIVersion() >= 5) ? ke.handle.node : -1;
+
+	/* Mmap, dropping the import again if that fails */
+	if (!mapBuffer()) {
+		device->mmap_unlock();
+		ioctl(dev_handle, PCIDRIVER_IOC_KMEM_FREE, &ke.handle);
+		throw Exception(Exception::ALLOC_FAILED);
+	}
+
+	device->mmap_unlock();
+}
+
+/**
+ *
+ * Checks if transparent huge pages are switched off, which keeps the
+ * driver from mapping huge pages too.
+ *
+ */
+static bool hugePagesDisabled()
+{
+	char line[128];
+	FILE *f;
+	bool disabled = false;
+
+	if ((f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r")) == NULL)
+		return true;
+	if (fgets(line, sizeof(line), f) != NULL)
+		disabled = (strstr(line, "[never]") != NULL);
+	fclose(f);
+
+	return disabled;
+}
+
+/**
+ *
+ * Mmaps the buffer the driver selected last. Called with the mmap lock held.
+ *
+ * Large buffers the driver can map with huge pages are placed on an
+ * address aligned to them, so user space gets them too.
+ *
+ */
+bool KernelMemory::mapBuffer()
+{
+	kmem_info_t ki;
+	void *m_ptr, *resv = MAP_FAILED;
+	unsigned long page = sysconf(_SC_PAGESIZE);
+	unsigned long start = 0, end, resv_len = 0;
+	int dev_handle = device->getHandle();
+
+	map_granularity = page;
+
+	memset(&ki, 0, sizeof(ki));
+	ki.handle.handle_id = handle_id;
+	ki.handle.pa = pa;
+	ki.handle.size = size;
+	if ((device->getABIVersion() >= 6) && (ioctl(dev_handle, PCIDRIVER_IOC_KMEM_INFO, &ki) == 0) &&
+			(ki.map_size > page) && !hugePagesDisabled()) {
+		/* Reserve enough to find an aligned start, the mmap replaces part of it */
+		resv_len = size + ki.map_size;
+		resv = mmap( 0, resv_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+		if (resv != MAP_FAILED)
+			start = (reinterpret_cast<unsigned long>(resv) + ki.map_size - 1) & ~(ki.map_size - 1);
+	}
+
 	if (ioctl(dev_handle, PCIDRIVER_IOC_MMAP_MODE, PCIDRIVER_MMAP_KMEM) != 0)
-		goto pd_allockm_err;
+		goto pd_mapkm_err;
 	
-	m_ptr = mmap( 0, size, PROT_WRITE | PROT_READ, MAP_SHARED, dev_handle, 0 );
+	m_ptr = mmap( reinterpret_cast<void *>(start), size, PROT_WRITE | PROT_READ,
+			MAP_SHARED | ((start != 0) ? MAP_FIXED : 0), dev_handle, 0 );
 	if ((m_ptr == MAP_FAILED) || (m_ptr == NULL))
-		goto pd_allockm_err;
+		goto pd_mapkm_err;
 
-	this->mem = m_ptr;
+	if (resv != MAP_FAILED) {
+		/* Give back what is left of the reservation on both sides */
+		end = start + ((size + page - 1) & ~(page - 1));
+		if (start > reinterpret_cast<unsigned long>(resv))
+			munmap(resv, start - reinterpret_cast<unsigned long>(resv));
+		if (reinterpret_cast<unsigned long>(resv) + resv_len > end)
+			munmap(reinterpret_cast<void *>(end), reinterpret_cast<unsigned long>(resv) + resv_len - end);
+		map_granularity = ki.map_size;
+	}
 
-	device->mmap_unlock();
+	this->mem = m_ptr;
 
-	/* Success, Object created successfully */
-	return;
+	return true;
 
-	/* On error, unlock, deallocate buffer and throw an exception */
-pd_allockm_err:
-	device->mmap_unlock();
-	ioctl(dev_handle, PCIDRIVER_IOC_KMEM_FREE, &kh);
-	throw Exception(Exception::ALLOC_FAILED);
+pd_mapkm_err:
+	if (resv != MAP_FAILED)
+		munmap(resv, resv_len);
+	return false;
 }
 
 /**
  *
- * Destructor of KernelMemory, unmaps the memory and frees it.
+ * Destructor of KernelMemory, unmaps the memory and frees it. Persistent
+ * memory is only unmapped and stays in the driver.
  *
  */
 KernelMemory::~KernelMemory()
@@ -96,6 +347,9 @@ KernelMemory::~KernelMemory()
 	
 	/* Unmap */
 	munmap(this->mem, this->size);
+
+	if (persistent)
+		return;
 	
 	/* Free buffer */
 	kh.handle_id = handle_id;
@@ -124,3 +378,36 @@ void KernelMemory::sync(sync_dir dir)
 	if (ioctl(device->getHandle(), PCIDRIVER_IOC_KMEM_SYNC, &ks) != 0)
 		throw Exception(Exception::INTERNAL_ERROR);
 }
+
+/**
+ *
+ * Syncs part of the kernel memory, e.g. a block carved out of it by a
+ * DmaArena. Syncs the whole buffer with drivers that cannot sync parts.
+ *
+ * @param offset First byte to sync
+ * @param len Number of bytes
+ *
+ */
+void KernelMemory::sync(sync_dir dir, uint64_t offset, uint64_t len)
+{
+	kmem_sync_range_t ks;
+
+	if ((len == 0) || (offset >= size) || (len > size - offset))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	ks.handle.handle_id = handle_id;
+	ks.handle.pa = pa;
+	ks.handle.size = size;
+	ks.offset = offset;
+	ks.size = len;
+	ks.dir = dir;
+
+	if (ioctl(device->getHandle(), PCIDRIVER_IOC_KMEM_SYNC_RANGE, &ks) == 0)
+		return;
+
+	/* Older drivers reject the unknown ioctl with EINVAL, the range is valid */
+	if (errno != EINVAL)
+		throw Exception(Exception::INTERNAL_ERROR);
+
+	sync(dir);
+}
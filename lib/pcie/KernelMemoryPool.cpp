@@ -0,0 +1,478 @@
+/**
+ *
+ * @file KernelMemoryPool.cpp
+ * @brief Recycles KernelMemory buffers through thread caches and lock-free free lists.
+ *
+ */
+
+#include "KernelMemoryPool.h"
+#include "Exception.h"
+
+#include <cstdlib>
+#include <cstring>
+
+using namespace pciDriver;
+
+/**
+ *
+ * Constructor of a KernelMemoryPool. Starts empty.
+ *
+ * @param dev Opened PCI device
+ * @param max_buffers Most buffers the pool keeps track of, idle or
+ *        leased. Beyond that, acquire() allocates buffers that are
+ *        freed on release.
+ *
+ */
+KernelMemoryPool::KernelMemoryPool(PciDevice& dev, unsigned int max_buffers)
+{
+	unsigned int i;
+
+	if ((max_buffers == 0) || (max_buffers >= NONE))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	slots = static_cast<slot *>(calloc(max_buffers, sizeof(slot)));
+	if (slots == NULL)
+		throw Exception(Exception::ALLOC_FAILED);
+
+	if (pthread_key_create(&key, destroyCache) != 0) {
+		free(slots);
+		throw Exception(Exception::INTERNAL_ERROR);
+	}
+
+	this->device = &dev;
+	this->max_buffers = max_buffers;
+	this->low = DEFAULT_LOW_WATERMARK;
+	this->high = DEFAULT_HIGH_WATERMARK;
+	this->idle_bytes = 0;
+	this->pooled_bytes = 0;
+	this->global_hits = 0;
+	this->allocations = 0;
+	this->unpooled = 0;
+	this->trimmed = 0;
+	this->exited_hits = 0;
+	this->caches = NULL;
+	pthread_mutex_init(&cache_lock, NULL);
+
+	for (i = 0; i < CLASSES; i++)
+		free_list[i] = NONE;
+	unused = NONE;
+	for (i = max_buffers; i > 0; i--)
+		push(&unused, i - 1);
+}
+
+/**
+ *
+ * Destructor of KernelMemoryPool, frees every buffer of the pool,
+ * including those in thread caches.
+ *
+ */
+KernelMemoryPool::~KernelMemoryPool()
+{
+	thread_cache *c, *next;
+	unsigned int i;
+
+	/* Threads exiting from now on do not call destroyCache() */
+	pthread_key_delete(key);
+
+	for (c = caches; c != NULL; c = next) {
+		next = c->next;
+		free(c);
+	}
+
+	for (i = 0; i < max_buffers; i++)
+		delete slots[i].km;
+
+	free(slots);
+	pthread_mutex_destroy(&cache_lock);
+}
+
+/**
+ *
+ * Gets the size class of a buffer size.
+ *
+ * @returns the class, -1 if the size is beyond the largest class
+ *
+ */
+int KernelMemoryPool::getClass(unsigned int size)
+{
+	int cls = 0;
+
+	while ((cls < (int)CLASSES) && ((1U << (MIN_SHIFT + cls)) < size))
+		cls++;
+
+	return (cls < (int)CLASSES) ? cls : -1;
+}
+
+/**
+ *
+ * Gets the size of the buffer acquire() hands out for a size.
+ *
+ */
+unsigned int KernelMemoryPool::getClassSize(unsigned int size)
+{
+	int cls = getClass(size);
+
+	return (cls < 0) ? size : (1U << (MIN_SHIFT + cls));
+}
+
+/* Tagged stack head: modification count in the high half, slot index in the low */
+void KernelMemoryPool::push(uint64_t *head, uint32_t i)
+{
+	uint64_t old, next;
+
+	old = __atomic_load_n(head, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&slots[i].next, (uint32_t)old, __ATOMIC_RELAXED);
+		next = (((old >> 32) + 1) << 32) | i;
+	} while (!__atomic_compare_exchange_n(head, &old, next, true,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+uint32_t KernelMemoryPool::pop(uint64_t *head)
+{
+	uint64_t old, next;
+	uint32_t i;
+
+	old = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+	do {
+		i = (uint32_t)old;
+		if (i == NONE)
+			return NONE;
+		/* May be stale if another thread popped i meanwhile, the tag
+		 * makes the exchange fail then */
+		next = (((old >> 32) + 1) << 32) | __atomic_load_n(&slots[i].next, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(head, &old, next, true,
+			__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+	return i;
+}
+
+/**
+ *
+ * Gets the cache of the calling thread, creating it on first use.
+ *
+ * @returns the cache, NULL if it cannot be allocated
+ *
+ */
+KernelMemoryPool::thread_cache *KernelMemoryPool::getCache()
+{
+	thread_cache *c = static_cast<thread_cache *>(pthread_getspecific(key));
+
+	if (c != NULL)
+		return c;
+
+	c = static_cast<thread_cache *>(calloc(1, sizeof(thread_cache)));
+	if (c == NULL)
+		return NULL;
+
+	if (pthread_setspecific(key, c) != 0) {
+		free(c);
+		return NULL;
+	}
+
+	c->pool = this;
+
+	pthread_mutex_lock(&cache_lock);
+	c->next = caches;
+	if (caches != NULL)
+		caches->prev = c;
+	caches = c;
+	pthread_mutex_unlock(&cache_lock);
+
+	return c;
+}
+
+/* Moves the buffers of a thread cache to the global lists */
+void KernelMemoryPool::flushCache(thread_cache *c)
+{
+	unsigned int cls;
+
+	for (cls = 0; cls < CLASSES; cls++)
+		while (c->count[cls] > 0)
+			putGlobal(c->slot[cls][--c->count[cls]]);
+}
+
+/**
+ *
+ * Called when a thread with a cache exits.
+ *
+ */
+void KernelMemoryPool::destroyCache(void *p)
+{
+	thread_cache *c = static_cast<thread_cache *>(p);
+	KernelMemoryPool *pool = c->pool;
+
+	pool->flushCache(c);
+
+	pthread_mutex_lock(&pool->cache_lock);
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		pool->caches = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+	pool->exited_hits += c->hits;
+	pthread_mutex_unlock(&pool->cache_lock);
+
+	free(c);
+}
+
+/**
+ *
+ * Gets a buffer of at least size bytes.
+ *
+ * @param size Requested size in bytes
+ * @returns a lease on the buffer
+ *
+ */
+KernelMemoryPool::Lease KernelMemoryPool::acquire(unsigned int size)
+{
+	thread_cache *c;
+	KernelMemory *km;
+	uint32_t i;
+	int cls;
+
+	if (size == 0)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	cls = getClass(size);
+	if (cls < 0) {
+		__atomic_fetch_add(&unpooled, 1, __ATOMIC_RELAXED);
+		return Lease(this, NONE, &device->allocKernelMemory(size), size);
+	}
+
+	c = getCache();
+	if ((c != NULL) && (c->count[cls] > 0)) {
+		i = c->slot[cls][--c->count[cls]];
+		__atomic_store_n(&c->hits, c->hits + 1, __ATOMIC_RELAXED);
+		return Lease(this, i, slots[i].km, size);
+	}
+
+	i = pop(&free_list[cls]);
+	if (i != NONE) {
+		__atomic_fetch_sub(&idle_bytes, slots[i].km->getSize(), __ATOMIC_RELAXED);
+		__atomic_fetch_add(&global_hits, 1, __ATOMIC_RELAXED);
+		return Lease(this, i, slots[i].km, size);
+	}
+
+	/* Nothing idle in this class, allocate */
+	i = pop(&unused);
+	try {
+		km = &device->allocKernelMemory(1U << (MIN_SHIFT + cls));
+	} catch (Exception& e) {
+		if (i != NONE)
+			push(&unused, i);
+		throw;
+	}
+
+	if (i == NONE) {
+		__atomic_fetch_add(&unpooled, 1, __ATOMIC_RELAXED);
+		return Lease(this, NONE, km, size);
+	}
+
+	slots[i].km = km;
+	slots[i].cls = cls;
+	__atomic_fetch_add(&pooled_bytes, km->getSize(), __ATOMIC_RELAXED);
+	__atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+
+	return Lease(this, i, km, size);
+}
+
+/**
+ *
+ * Fills the global free list of a size class, e.g. before a latency
+ * sensitive phase. Stops early when the pool has no free slots.
+ *
+ * @param size Buffer size, rounded up to its class
+ * @param count Number of buffers to add
+ *
+ */
+void KernelMemoryPool::reserve(unsigned int size, unsigned int count)
+{
+	int cls = getClass(size);
+	uint32_t i;
+
+	if ((size == 0) || (cls < 0))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	for (; count > 0; count--) {
+		if ((i = pop(&unused)) == NONE)
+			return;
+
+		try {
+			slots[i].km = &device->allocKernelMemory(1U << (MIN_SHIFT + cls));
+		} catch (Exception& e) {
+			push(&unused, i);
+			throw;
+		}
+		slots[i].cls = cls;
+		__atomic_fetch_add(&pooled_bytes, slots[i].km->getSize(), __ATOMIC_RELAXED);
+		__atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+
+		/* Not trimmed here, even beyond the high watermark */
+		__atomic_fetch_add(&idle_bytes, slots[i].km->getSize(), __ATOMIC_RELAXED);
+		push(&free_list[cls], i);
+	}
+}
+
+/**
+ *
+ * Returns a buffer to the calling thread's cache, or to the global list
+ * if the cache is full.
+ *
+ */
+void KernelMemoryPool::release(uint32_t i, KernelMemory *km)
+{
+	thread_cache *c;
+	unsigned int cls;
+
+	if (i == NONE) {
+		delete km;
+		return;
+	}
+
+	cls = slots[i].cls;
+	c = getCache();
+	if ((c != NULL) && (c->count[cls] < CACHE_SIZE)) {
+		c->slot[cls][c->count[cls]++] = i;
+		return;
+	}
+
+	putGlobal(i);
+}
+
+void KernelMemoryPool::putGlobal(uint32_t i)
+{
+	uint64_t idle;
+
+	idle = __atomic_add_fetch(&idle_bytes, slots[i].km->getSize(), __ATOMIC_RELAXED);
+	push(&free_list[slots[i].cls], i);
+
+	if (idle > __atomic_load_n(&high, __ATOMIC_RELAXED))
+		trim();
+}
+
+/**
+ *
+ * Sets when the idle buffers are trimmed: as soon as they exceed high
+ * bytes, down to low bytes.
+ *
+ */
+void KernelMemoryPool::setWatermarks(uint64_t low, uint64_t high)
+{
+	if (low > high)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	__atomic_store_n(&this->low, low, __ATOMIC_RELAXED);
+	__atomic_store_n(&this->high, high, __ATOMIC_RELAXED);
+
+	if (__atomic_load_n(&idle_bytes, __ATOMIC_RELAXED) > high)
+		trim();
+}
+
+/**
+ *
+ * Frees idle buffers of the global lists, largest classes first, until
+ * the idle bytes are at the low watermark. Buffers in thread caches are
+ * left alone.
+ *
+ */
+void KernelMemoryPool::trim()
+{
+	uint64_t target = __atomic_load_n(&low, __ATOMIC_RELAXED);
+	unsigned long size;
+	bool found = true;
+	uint32_t i;
+	int cls;
+
+	while (found && (__atomic_load_n(&idle_bytes, __ATOMIC_RELAXED) > target)) {
+		found = false;
+		for (cls = CLASSES - 1; cls >= 0; cls--) {
+			if ((i = pop(&free_list[cls])) == NONE)
+				continue;
+
+			size = slots[i].km->getSize();
+			__atomic_fetch_sub(&idle_bytes, size, __ATOMIC_RELAXED);
+			__atomic_fetch_sub(&pooled_bytes, size, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&trimmed, 1, __ATOMIC_RELAXED);
+
+			delete slots[i].km;
+			slots[i].km = NULL;
+			push(&unused, i);
+
+			found = true;
+			break;
+		}
+	}
+}
+
+/**
+ *
+ * Moves the buffers cached by the calling thread to the global lists,
+ * where other threads and trim() see them.
+ *
+ */
+void KernelMemoryPool::flush()
+{
+	thread_cache *c = static_cast<thread_cache *>(pthread_getspecific(key));
+
+	if (c != NULL)
+		flushCache(c);
+}
+
+KernelMemoryPool::stats KernelMemoryPool::getStats()
+{
+	stats s;
+	thread_cache *c;
+
+	memset(&s, 0, sizeof(s));
+
+	pthread_mutex_lock(&cache_lock);
+	s.local_hits = exited_hits;
+	for (c = caches; c != NULL; c = c->next)
+		s.local_hits += __atomic_load_n(&c->hits, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&cache_lock);
+
+	s.global_hits = __atomic_load_n(&global_hits, __ATOMIC_RELAXED);
+	s.allocations = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+	s.unpooled = __atomic_load_n(&unpooled, __ATOMIC_RELAXED);
+	s.trimmed = __atomic_load_n(&trimmed, __ATOMIC_RELAXED);
+	s.idle_bytes = __atomic_load_n(&idle_bytes, __ATOMIC_RELAXED);
+	s.pooled_bytes = __atomic_load_n(&pooled_bytes, __ATOMIC_RELAXED);
+
+	return s;
+}
+
+KernelMemoryPool::Lease::Lease(Lease&& other)
+	: pool(other.pool), slot(other.slot), km(other.km), size(other.size)
+{
+	other.km = NULL;
+}
+
+KernelMemoryPool::Lease& KernelMemoryPool::Lease::operator=(Lease&& other)
+{
+	if (this != &other) {
+		release();
+		pool = other.pool;
+		slot = other.slot;
+		km = other.km;
+		size = other.size;
+		other.km = NULL;
+	}
+
+	return *this;
+}
+
+/**
+ *
+ * Returns the buffer to the pool before the lease goes out of scope.
+ *
+ */
+void KernelMemoryPool::Lease::release()
+{
+	if (km == NULL)
+		return;
+
+	pool->release(slot, km);
+	km = NULL;
+}
@@ -0,0 +1,268 @@
+/**
+ *
+ * @file MmioTrace.cpp
+ * @brief Per-thread ring buffers of BAR accesses.
+ *
+ */
+
+#include "MmioTrace.h"
+#include "Exception.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <time.h>
+
+using namespace pciDriver;
+
+/* Ring of one thread. Only the owner writes it, head is published with
+ * release semantics so dump() sees complete events. */
+struct trace_ring {
+	trace_ring *next;
+	MmioTrace::event *ev;
+	uint64_t head;
+	uint64_t mask;
+	uint16_t thread;
+};
+
+bool MmioTrace::active = false;
+
+static trace_ring *rings = NULL;
+static unsigned int ring_size = MmioTrace::DEFAULT_RING_SIZE;
+static unsigned int threads = 0;
+static __thread trace_ring *local = NULL;
+
+static const char magic[8] = { 'P', 'D', 'T', 'R', 'A', 'C', 'E', 0 };
+
+void MmioTrace::enable()
+{
+	__atomic_store_n(&active, true, __ATOMIC_RELEASE);
+}
+
+void MmioTrace::disable()
+{
+	__atomic_store_n(&active, false, __ATOMIC_RELEASE);
+}
+
+/**
+ *
+ * Sets the number of events in the ring of each thread, rounded down to
+ * a power of two.
+ *
+ */
+void MmioTrace::setRingSize(unsigned int events)
+{
+	unsigned int n = 1;
+
+	if (events < 2)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	while ((n << 1) <= events && (n << 1) != 0)
+		n <<= 1;
+
+	__atomic_store_n(&ring_size, n, __ATOMIC_RELAXED);
+}
+
+/**
+ *
+ * Allocates the ring of the calling thread and adds it to the list.
+ * Rings stay in the list after their thread exited, so dump() still
+ * has its events.
+ *
+ */
+static trace_ring *attach()
+{
+	trace_ring *r;
+	uint64_t n = __atomic_load_n(&ring_size, __ATOMIC_RELAXED);
+
+	r = static_cast<trace_ring *>(malloc(sizeof(trace_ring)));
+	if (r == NULL)
+		return NULL;
+
+	r->ev = static_cast<MmioTrace::event *>(calloc(n, sizeof(MmioTrace::event)));
+	if (r->ev == NULL) {
+		free(r);
+		return NULL;
+	}
+
+	r->head = 0;
+	r->mask = n - 1;
+	r->thread = __atomic_fetch_add(&threads, 1, __ATOMIC_RELAXED);
+
+	r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &r->next, r, true,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	local = r;
+	return r;
+}
+
+/**
+ *
+ * Appends an event to the ring of the calling thread. Events are dropped
+ * silently if the ring cannot be allocated.
+ *
+ */
+void MmioTrace::record(type t, int dev, unsigned int bar, uint64_t offset, unsigned int width, uint64_t value)
+{
+	trace_ring *r = local;
+	struct timespec ts;
+	event *e;
+
+	if ((r == NULL) && ((r = attach()) == NULL))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	e = &r->ev[r->head & r->mask];
+	e->ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	e->value = value;
+	e->offset = offset;
+	e->device = dev;
+	e->thread = r->thread;
+	e->type = t;
+	e->bar = bar;
+	e->width = width;
+	memset(e->reserved, 0, sizeof(e->reserved));
+
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ *
+ * Drops the recorded events of all threads.
+ *
+ */
+void MmioTrace::clear()
+{
+	trace_ring *r;
+
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next)
+		__atomic_store_n(&r->head, 0, __ATOMIC_RELEASE);
+}
+
+static int compare_events(const void *a, const void *b)
+{
+	const MmioTrace::event *x = static_cast<const MmioTrace::event *>(a);
+	const MmioTrace::event *y = static_cast<const MmioTrace::event *>(b);
+
+	if (x->ns != y->ns)
+		return (x->ns < y->ns) ? -1 : 1;
+	return (int)x->thread - (int)y->thread;
+}
+
+/**
+ *
+ * Writes the events of all threads, ordered by time, to a file.
+ *
+ * @param file Name of the trace file
+ * @returns the number of events written
+ *
+ */
+uint64_t MmioTrace::dump(const char *file)
+{
+	file_header hdr;
+	trace_ring *r;
+	event *all;
+	uint64_t head, n, i, total = 0, dropped = 0;
+	FILE *f;
+	bool ok;
+
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		total += (head > r->mask) ? r->mask + 1 : head;
+	}
+
+	all = static_cast<event *>(malloc((total + 1) * sizeof(event)));
+	if (all == NULL)
+		throw Exception(Exception::ALLOC_FAILED);
+
+	/* Oldest surviving event of each ring first */
+	n = 0;
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); (r != NULL) && (n < total); r = r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		i = (head > r->mask) ? head - (r->mask + 1) : 0;
+		dropped += i;
+		for (; (i < head) && (n < total); i++)
+			all[n++] = r->ev[i & r->mask];
+	}
+
+	qsort(all, n, sizeof(event), compare_events);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, magic, sizeof(magic));
+	hdr.version = VERSION;
+	hdr.event_size = sizeof(event);
+	hdr.events = n;
+	hdr.dropped = dropped;
+	hdr.threads = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+
+	if ((f = fopen(file, "wb")) == NULL) {
+		free(all);
+		throw Exception(Exception::INTERNAL_ERROR);
+	}
+
+	ok = (fwrite(&hdr, sizeof(hdr), 1, f) == 1);
+	if (ok && (n > 0))
+		ok = (fwrite(all, sizeof(event), n, f) == n);
+	ok = (fclose(f) == 0) && ok;
+	free(all);
+
+	if (!ok)
+		throw Exception(Exception::INTERNAL_ERROR);
+
+	return n;
+}
+
+/**
+ *
+ * Reads a trace file.
+ *
+ * @param file Name of the trace file
+ * @param header Filled with the file header
+ * @returns the events, to be released with free()
+ *
+ */
+MmioTrace::event *MmioTrace::load(const char *file, file_header *header)
+{
+	event *ev;
+	FILE *f;
+	bool ok;
+
+	if ((f = fopen(file, "rb")) == NULL)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	if ((fread(header, sizeof(*header), 1, f) != 1) ||
+			(memcmp(header->magic, magic, sizeof(magic)) != 0) ||
+			(header->version != VERSION) || (header->event_size != sizeof(event))) {
+		fclose(f);
+		throw Exception(Exception::INVALID_ARGUMENT);
+	}
+
+	ev = static_cast<event *>(malloc((header->events + 1) * sizeof(event)));
+	if (ev == NULL) {
+		fclose(f);
+		throw Exception(Exception::ALLOC_FAILED);
+	}
+
+	ok = (fread(ev, sizeof(event), header->events, f) == header->events);
+	fclose(f);
+
+	if (!ok) {
+		free(ev);
+		throw Exception(Exception::INVALID_ARGUMENT);
+	}
+
+	return ev;
+}
+
+const char *MmioTrace::getTypeName(type t)
+{
+	static const char *names[] = { "read", "write", "copy-to", "copy-from", "submit" };
+
+	if ((unsigned int)t >= TYPES)
+		return "unknown";
+
+	return names[t];
+}
@@ -0,0 +1,373 @@
+/**
+ *
+ * @file PagedWindow.cpp
+ * @brief Flat addressing of device memory behind a paged BAR window.
+ *
+ */
+
+#include "PagedWindow.h"
+#include "Exception.h"
+#include "MmioTrace.h"
+#include "AbbRegisters.h"
+
+#include <cstdlib>
+
+using namespace pciDriver;
+
+/* Bounce buffer of copy() */
+static const size_t COPY_CHUNK = (64 << 10);
+
+/**
+ *
+ * Constructor of a PagedWindow, maps BAR0 and the window BAR.
+ *
+ * @param dev Opened PCI device
+ * @param bar Window BAR, 2 (DDR memory) or 4 (Wishbone bus)
+ * @param page_size Bytes per page, 0 for the size of the BAR
+ *
+ */
+PagedWindow::PagedWindow(PciDevice& dev, unsigned int bar, unsigned long page_size)
+{
+	uint32_t reg;
+
+	switch (bar) {
+	case 2:
+		reg = abb::SDRAM_PG::offset;
+		break;
+	case 4:
+		reg = abb::WB_PG::offset;
+		break;
+	default:
+		throw Exception(Exception::INVALID_BAR);
+	}
+
+	if (page_size == 0)
+		page_size = dev.getBARsize(bar);
+
+	if ((page_size == 0) || (page_size > dev.getBARsize(bar)) || (page_size & 0x3))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	this->device = &dev;
+	this->bar = bar;
+	this->page_size = page_size;
+
+	bar0 = static_cast<volatile uint32_t *>(dev.mapBAR(0));
+	try {
+		window = static_cast<volatile uint8_t *>(dev.mapBAR(bar));
+	} catch (Exception& e) {
+		dev.unmapBAR(0, const_cast<uint32_t *>(bar0));
+		throw;
+	}
+	page_reg = bar0 + (reg >> 2);
+
+	pthread_mutex_init(&lock, NULL);
+	current = -1;
+	switches = 0;
+	accesses = 0;
+}
+
+/**
+ *
+ * Destructor of PagedWindow, unmaps the BARs.
+ *
+ */
+PagedWindow::~PagedWindow()
+{
+	device->unmapBAR(bar, const_cast<uint8_t *>(window));
+	device->unmapBAR(0, const_cast<uint32_t *>(bar0));
+	pthread_mutex_destroy(&lock);
+}
+
+/**
+ *
+ * Forgets the selected page, the next access writes the page register.
+ *
+ */
+void PagedWindow::invalidate()
+{
+	pthread_mutex_lock(&lock);
+	current = -1;
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ *
+ * Selects a page unless it is the current one. Called with the lock held.
+ *
+ */
+void PagedWindow::select(uint32_t page)
+{
+	if (current == page)
+		return;
+
+	/* Earlier window stores must reach the old page, later window
+	 * accesses must see the new one */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	*page_reg = page;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	MmioTrace::write32(device->getNumber(), 0, (page_reg - bar0) << 2, page);
+
+	current = page;
+	switches++;
+}
+
+void PagedWindow::check(uint64_t addr, size_t len)
+{
+	uint64_t end = addr + len;
+
+	if ((addr | len) & 0x3)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	/* The page number has to fit in the page register */
+	if ((len > 0) && ((end < addr) || (((end - 1) / page_size) >> 32)))
+		throw Exception(Exception::INVALID_ARGUMENT);
+}
+
+/**
+ *
+ * Moves a range page by page. Called with the lock held.
+ *
+ */
+void PagedWindow::transfer(uint64_t addr, uint8_t *buf, size_t len, bool write)
+{
+	uint64_t offset;
+	size_t n;
+
+	while (len > 0) {
+		offset = addr % page_size;
+		n = page_size - offset;
+		if (n > len)
+			n = len;
+
+		select(addr / page_size);
+		if (write)
+			BarCopy::write(window + offset, buf, n, device->getCopyKernel());
+		else
+			BarCopy::read(buf, window + offset, n, device->getCopyKernel());
+		MmioTrace::copy(write, device->getNumber(), bar, offset, n);
+
+		addr += n;
+		buf += n;
+		len -= n;
+	}
+
+	accesses++;
+}
+
+/**
+ *
+ * Writes a buffer to device memory.
+ *
+ * @param addr Device address
+ * @param src Source buffer
+ * @param len Number of bytes
+ *
+ */
+void PagedWindow::write(uint64_t addr, const void *src, size_t len)
+{
+	check(addr, len);
+
+	pthread_mutex_lock(&lock);
+	try {
+		transfer(addr, static_cast<uint8_t *>(const_cast<void *>(src)), len, true);
+	} catch (Exception& e) {
+		pthread_mutex_unlock(&lock);
+		throw;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ *
+ * Reads device memory into a buffer.
+ *
+ * @param dst Destination buffer
+ * @param addr Device address
+ * @param len Number of bytes
+ *
+ */
+void PagedWindow::read(void *dst, uint64_t addr, size_t len)
+{
+	check(addr, len);
+
+	pthread_mutex_lock(&lock);
+	try {
+		transfer(addr, static_cast<uint8_t *>(dst), len, false);
+	} catch (Exception& e) {
+		pthread_mutex_unlock(&lock);
+		throw;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void PagedWindow::write32(uint64_t addr, uint32_t val)
+{
+	write(addr, &val, sizeof(val));
+}
+
+uint32_t PagedWindow::read32(uint64_t addr)
+{
+	uint32_t val;
+
+	read(&val, addr, sizeof(val));
+	return val;
+}
+
+/**
+ *
+ * Copies a range of device memory through a host bounce buffer. The
+ * ranges may overlap only if dst is below src.
+ *
+ * @param dst Destination device address
+ * @param src Source device address
+ * @param len Number of bytes
+ *
+ */
+void PagedWindow::copy(uint64_t dst, uint64_t src, size_t len)
+{
+	uint8_t *bounce;
+	size_t n;
+
+	check(dst, len);
+	check(src, len);
+
+	bounce = static_cast<uint8_t *>(malloc(COPY_CHUNK));
+	if (bounce == NULL)
+		throw Exception(Exception::ALLOC_FAILED);
+
+	pthread_mutex_lock(&lock);
+	try {
+		for (; len > 0; len -= n, dst += n, src += n) {
+			n = (len < COPY_CHUNK) ? len : COPY_CHUNK;
+			transfer(src, bounce, n, false);
+			transfer(dst, bounce, n, true);
+		}
+	} catch (Exception& e) {
+		pthread_mutex_unlock(&lock);
+		free(bounce);
+		throw;
+	}
+	pthread_mutex_unlock(&lock);
+
+	free(bounce);
+}
+
+/**
+ *
+ * Splits an access of a batch at page boundaries.
+ *
+ * @param p Receives the pieces, NULL to only count them
+ * @returns number of pieces
+ *
+ */
+unsigned int PagedWindow::split(const access& a, piece *p, unsigned int seq)
+{
+	uint64_t addr = a.addr;
+	uint8_t *buf = static_cast<uint8_t *>(a.buf);
+	uint32_t len = a.length, n;
+	unsigned int count = 0;
+
+	while (len > 0) {
+		n = page_size - (addr % page_size);
+		if (n > len)
+			n = len;
+
+		if (p != NULL) {
+			p[count].page = addr / page_size;
+			p[count].offset = addr % page_size;
+			p[count].length = n;
+			p[count].buf = buf;
+			p[count].write = a.write;
+			p[count].key = seq + count;
+		}
+
+		addr += n;
+		buf += n;
+		len -= n;
+		count++;
+	}
+
+	return count;
+}
+
+int PagedWindow::compare(const void *a, const void *b)
+{
+	uint64_t ka = static_cast<const piece *>(a)->key;
+	uint64_t kb = static_cast<const piece *>(b)->key;
+
+	return (ka < kb) ? -1 : (ka > kb);
+}
+
+/**
+ *
+ * Performs a list of scattered accesses grouped by page. Adjacent
+ * accesses in the same direction whose host buffers are adjacent as
+ * well are merged into one copy.
+ *
+ * @param list Accesses, in program order
+ * @param n Number of accesses
+ *
+ */
+void PagedWindow::batch(access *list, unsigned int n)
+{
+	piece *p;
+	unsigned long count = 0;
+	unsigned int i, j, k;
+	uint64_t rank;
+
+	for (i = 0; i < n; i++) {
+		check(list[i].addr, list[i].length);
+		count += split(list[i], NULL, 0);
+	}
+
+	/* The batch order lives in the low 31 bits of the sort key */
+	if (count >= (1UL << 31))
+		throw Exception(Exception::INVALID_ARGUMENT);
+	if (count == 0)
+		return;
+
+	p = static_cast<piece *>(malloc(count * sizeof(piece)));
+	if (p == NULL)
+		throw Exception(Exception::ALLOC_FAILED);
+
+	for (i = 0, j = 0; i < n; i++)
+		j += split(list[i], p + j, j);
+
+	pthread_mutex_lock(&lock);
+
+	/* Start with the selected page, then go up */
+	for (i = 0; i < count; i++) {
+		rank = (p[i].page == current) ? 0 : (uint64_t)p[i].page + 1;
+		p[i].key |= rank << 31;
+	}
+	qsort(p, count, sizeof(piece), compare);
+
+	try {
+		for (i = 0; i < count; i = j) {
+			/* Merge what continues in the window and in the host buffer */
+			for (j = i + 1, k = i; j < count; k = j++) {
+				if ((p[j].page != p[i].page) || (p[j].write != p[i].write) ||
+						(p[j].offset != p[k].offset + p[k].length) ||
+						(p[j].buf != p[k].buf + p[k].length))
+					break;
+				p[i].length += p[j].length;
+			}
+
+			select(p[i].page);
+			if (p[i].write)
+				BarCopy::write(window + p[i].offset, p[i].buf, p[i].length, device->getCopyKernel());
+			else
+				BarCopy::read(p[i].buf, window + p[i].offset, p[i].length, device->getCopyKernel());
+			MmioTrace::copy(p[i].write, device->getNumber(), bar, p[i].offset, p[i].length);
+		}
+	} catch (Exception& e) {
+		pthread_mutex_unlock(&lock);
+		free(p);
+		throw;
+	}
+
+	accesses += n;
+	pthread_mutex_unlock(&lock);
+
+	free(p);
+}
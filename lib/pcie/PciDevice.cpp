@@ -32,6 +32,9 @@
 #include "Exception.h"
 #include "KernelMemory.h"
 #include "UserMemory.h"
+#include "HybridTransfer.h"
+#include "DmaArena.h"
+#include "MmioTrace.h"
 
 #include <cstdio>
 #include <cstdlib>
@@ -42,6 +45,7 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <stdint.h>
 
 using namespace pciDriver;
 
@@ -57,7 +61,7 @@ PciDevice::PciDevice(int number)
 {
 	struct stat tmp_stat;
 
-	unsigned int temp;
+	unsigned int temp, mode;
 
 	device = number;
 	snprintf(name, sizeof(name), "/dev/fpga%d", number);
@@ -68,6 +72,24 @@ PciDevice::PciDevice(int number)
 	pthread_mutex_init(&mmap_mutex, NULL);
 
 	handle = -1;
+	abi_version = 0;
+
+	for (temp = 0; temp < 6; temp++) {
+		bar_start[temp] = 0;
+		bar_length[temp] = 0;
+		bar_io[temp] = NULL;
+		for (mode = 0; mode < 4; mode++) {
+			bar_maps[temp][mode].mem = NULL;
+			bar_maps[temp][mode].refs = 0;
+			bar_maps[temp][mode].effective = CACHE_DEFAULT;
+		}
+	}
+	bus = slot = 0;
+	copy_kernel = BarCopy::KERNEL_AUTO;
+	hybrid = NULL;
+	transfer_bar = 2;
+	arena = NULL;
+	arena_size = DEFAULT_ARENA_SIZE;
 
 	pagesize = getpagesize();
 
@@ -109,12 +131,15 @@ int PciDevice::getHandle()
 
 /**
  *
- * Opens the PCI device.
+ * Opens the PCI device and reads its board info, which does not change
+ * while the device is open.
  *
  */
 void PciDevice::open()
 {
 	int ret;
+	unsigned int i;
+	pci_board_info info;
 
 	/* Check if the device is already opened and exit if yes */
 	if (handle != -1)
@@ -123,16 +148,52 @@ void PciDevice::open()
 	if ((ret = ::open(name, O_RDWR)) < 0)
 		throw Exception( Exception::OPEN_FAILED );
 
+	if (ioctl(ret, PCIDRIVER_IOC_PCI_INFO, &info) != 0) {
+		::close(ret);
+		throw Exception( Exception::INTERNAL_ERROR );
+	}
+
+	bus = info.bus;
+	slot = info.slot;
+	for (i = 0; i < 6; i++) {
+		bar_start[i] = info.bar_start[i];
+		bar_length[i] = info.bar_length[i];
+	}
+
+	/* Drivers before the VERSION ioctl speak version 1 */
+	if (ioctl(ret, PCIDRIVER_IOC_VERSION, &abi_version) != 0)
+		abi_version = 1;
+
 	handle = ret;
 }
 
 /**
  *
- * Close the PCI device.
+ * Close the PCI device. Mappings still referenced are unmapped as well.
  *
  */
 void PciDevice::close()
 {
+	unsigned int i, mode;
+
+	/* Its engines still hold mappings */
+	delete hybrid;
+	hybrid = NULL;
+	delete arena;
+	arena = NULL;
+
+	mmap_lock();
+	for (i = 0; i < 6; i++) {
+		for (mode = 0; mode < 4; mode++) {
+			if (bar_maps[i][mode].mem != NULL)
+				munmap(bar_maps[i][mode].mem, bar_length[i]);
+			bar_maps[i][mode].mem = NULL;
+			bar_maps[i][mode].refs = 0;
+		}
+		bar_io[i] = NULL;
+	}
+	mmap_unlock();
+
 	// do nothing, pass silently if closing a non-opened device.
 	if (handle != -1)
 		::close(handle);
@@ -149,9 +210,101 @@ void PciDevice::close()
  * @see KernelMemory
  *
  */
-KernelMemory& PciDevice::allocKernelMemory(unsigned int size)
+KernelMemory& PciDevice::allocKernelMemory(uint64_t size)
+{
+	KernelMemory *km;
+
+	/* Version 1 drivers were never meant for more */
+	if ((size > 0xFFFFFFFFULL) && (abi_version == 1))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	km = new KernelMemory(*this, size);
+
+	return *km;
+}
+
+/**
+ *
+ * Allocates kernel memory of the specified size on a NUMA node. Memory on
+ * a node other than the one of the device is mapped for streaming DMA,
+ * so it needs KernelMemory::sync() like user memory.
+ *
+ * Contiguous memory may also come from CMA, which makes buffers of
+ * hundreds of MB possible if the kernel reserved enough; see
+ * kmem_max_contig in sysfs. It is only available on the node of the
+ * device.
+ *
+ * @param size How much memory to allocate
+ * @param node NUMA node, KernelMemory::NODE_DEVICE for the one of the device
+ * @param contiguous Allow buffers beyond the largest block of the page allocator
+ * @returns A KernelMemory object
+ *
+ */
+KernelMemory& PciDevice::allocKernelMemory(uint64_t size, int node, bool contiguous)
+{
+	KernelMemory *km;
+
+	if ((size > 0xFFFFFFFFULL) && (abi_version == 1))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	/* Choosing the node works reliably since version 9, contiguous memory
+	 * came with 7 */
+	if (((node != KernelMemory::NODE_DEVICE) && (abi_version < 9)) || (contiguous && (abi_version < 7)))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	km = new KernelMemory(*this, size, NULL, contiguous ? KernelMemory::CONTIGUOUS : 0, node);
+
+	return *km;
+}
+
+/**
+ *
+ * Allocates named kernel memory of the specified size. Persistent memory
+ * stays in the driver when the KernelMemory is deleted or the process
+ * ends, until a process attaches to it and frees it.
+ *
+ * @param size How much memory to allocate
+ * @param name Unique name of the memory, shorter than KernelMemory::NAME_MAX_LEN
+ * @param persist Keep the memory after the KernelMemory is gone
+ * @returns A KernelMemory object
+ * @see attachKernelMemory
+ *
+ */
+KernelMemory& PciDevice::allocKernelMemory(uint64_t size, const char *name, bool persist)
 {
-	KernelMemory *km = new KernelMemory(*this, size);
+	KernelMemory *km;
+
+	/* Version 1 drivers were never meant for more */
+	if ((size > 0xFFFFFFFFULL) && (abi_version == 1))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	/* Names came with version 3 */
+	if (abi_version < 3)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	km = new KernelMemory(*this, size, name, persist ? KernelMemory::PERSIST : 0);
+
+	return *km;
+}
+
+/**
+ *
+ * Attaches to named kernel memory, e.g. allocated persistent by a previous
+ * process, without allocating or clearing it.
+ *
+ * @param name Name the memory was allocated with
+ * @returns A KernelMemory object
+ * @throws Exception::INVALID_ARGUMENT if there is no memory of that name
+ *
+ */
+KernelMemory& PciDevice::attachKernelMemory(const char *name)
+{
+	KernelMemory *km;
+
+	if (abi_version < 3)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	km = new KernelMemory(*this, name);
 
 	return *km;
 }
@@ -164,9 +317,14 @@ KernelMemory& PciDevice::allocKernelMemory(unsigned int size)
  * @see UserMemory
  *
  */
-UserMemory& PciDevice::mapUserMemory(void *mem, unsigned int size, bool merged)
+UserMemory& PciDevice::mapUserMemory(void *mem, uint64_t size, bool merged)
 {
-	UserMemory *um = new UserMemory(*this, mem, size, merged);
+	UserMemory *um;
+
+	if ((size > 0xFFFFFFFFULL) && (abi_version == 1))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	um = new UserMemory(*this, mem, size, merged);
 
 	return *um;
 }
@@ -185,6 +343,33 @@ void PciDevice::waitForInterrupt(unsigned int int_id)
 		throw Exception(Exception::INTERRUPT_FAILED);
 }
 
+/**
+ *
+ * Waits for an interrupt, at most for the given time.
+ *
+ * @param timeout Timeout in microseconds
+ * @returns false if the timeout expired before the interrupt arrived
+ *
+ */
+bool PciDevice::waitForInterrupt(unsigned int int_id, unsigned int timeout)
+{
+	irq_wait_t iw;
+
+	if (handle == -1)
+		throw Exception(Exception::NOT_OPEN);
+
+	iw.source = int_id;
+	iw.timeout = timeout;
+
+	if (ioctl(handle, PCIDRIVER_IOC_WAITI_TIMEOUT, &iw) != 0) {
+		if ((errno == ETIMEDOUT) || (errno == EINTR))
+			return false;
+		throw Exception(Exception::INTERRUPT_FAILED);
+	}
+
+	return true;
+}
+
 /**
  *
  * Clears the interrupt queue.
@@ -199,6 +384,26 @@ void PciDevice::clearInterruptQueue(unsigned int int_id)
 		throw Exception(Exception::INTERNAL_ERROR);
 }
 
+/**
+ *
+ * Clears the interrupt queue and enables the interrupt source on the
+ * device. The driver disables it again when the interrupt arrives, so arm
+ * it before every operation to wait for. Needs driver ABI version 10.
+ *
+ * @returns false if the driver cannot deliver interrupts of the source
+ *
+ */
+bool PciDevice::armInterrupt(unsigned int int_id)
+{
+	if (handle == -1)
+		throw Exception( Exception::NOT_OPEN );
+
+	if (abi_version < 10)
+		return false;
+
+	return (ioctl(handle, PCIDRIVER_IOC_ARM_IRQ, int_id) == 0);
+}
+
 /**
  *
  * Gets the size of a BAR.
@@ -208,19 +413,13 @@ void PciDevice::clearInterruptQueue(unsigned int int_id)
  */
 unsigned int PciDevice::getBARsize(unsigned int bar)
 {
-	pci_board_info info;
-	unsigned int id;
-
 	if (handle == -1)
 		throw Exception( Exception::NOT_OPEN );
 
 	if (bar > 5)
 		throw Exception( Exception::INVALID_BAR );
 
-	if (ioctl(handle, PCIDRIVER_IOC_PCI_INFO, &info) != 0)
-		throw Exception( Exception::INTERNAL_ERROR );
-
-	return info.bar_length[ bar ];
+	return bar_length[ bar ];
 }
 
 /**
@@ -230,15 +429,10 @@ unsigned int PciDevice::getBARsize(unsigned int bar)
  */
 unsigned short PciDevice::getBus()
 {
-	pci_board_info info;
-
 	if (handle == -1)
 		throw Exception(Exception::NOT_OPEN);
 
-	if (ioctl(handle, PCIDRIVER_IOC_PCI_INFO, &info) != 0)
-		throw Exception(Exception::INTERNAL_ERROR);
-
-	return info.bus;
+	return bus;
 }
 
 /**
@@ -248,29 +442,30 @@ unsigned short PciDevice::getBus()
  */
 unsigned short PciDevice::getSlot()
 {
-	pci_board_info info;
-
 	if (handle == -1)
 		throw Exception(Exception::NOT_OPEN);
 
-	if (ioctl(handle, PCIDRIVER_IOC_PCI_INFO, &info) != 0)
-		throw Exception(Exception::INTERNAL_ERROR);
-
-	return info.slot;
+	return slot;
 }
 
 /**
  *
- * Map the specified BAR.
+ * Map the specified BAR. Mappings are shared: while a BAR is mapped with
+ * the requested caching, further calls return the same pointer and every
+ * call has to be matched by an unmapBAR().
  *
  * @param bar Which BAR to map (1-5).
+ * @param mode Requested caching of the mapping.
+ * @param effective If not NULL, receives the caching the mapping got. WC and
+ * WT fall back to UC on BARs that are not prefetchable.
  * @returns A pointer to the mapped bar.
  *
  */
-void *PciDevice::mapBAR(unsigned int bar)
+void *PciDevice::mapBAR(unsigned int bar, cache_mode mode, cache_mode *effective)
 {
 	void *mem;
-	pci_board_info info;
+	bar_mapping *map;
+	mmap_cache_t mcache;
 
 	if (handle == -1)
 		throw Exception(Exception::NOT_OPEN);
@@ -278,8 +473,8 @@ void *PciDevice::mapBAR(unsigned int bar)
 	if (bar > 5)
 		throw Exception(Exception::INVALID_BAR);
 
-	if (ioctl(handle, PCIDRIVER_IOC_PCI_INFO, &info) != 0)
-		return NULL;
+	if ((unsigned int)mode > CACHE_WT)
+		throw Exception(Exception::INVALID_ARGUMENT);
 
 	/* Mmap */
 	/* This is not fully safe, as a separate process can still open the device independently.
@@ -287,30 +482,61 @@ void *PciDevice::mapBAR(unsigned int bar)
 	 * Posible fix: Do not allow the driver for mutliple openings of a device */
 	mmap_lock();
 
-	if (ioctl(handle, PCIDRIVER_IOC_MMAP_MODE, PCIDRIVER_MMAP_PCI) != 0)
+	map = &bar_maps[bar][mode];
+	if (map->mem != NULL) {
+		map->refs++;
+		mem = map->mem;
+		if (effective != NULL)
+			*effective = map->effective;
+		mmap_unlock();
+		return mem;
+	}
+
+	if (ioctl(handle, PCIDRIVER_IOC_MMAP_MODE, PCIDRIVER_MMAP_PCI) != 0) {
+		mmap_unlock();
 		throw Exception(Exception::INTERNAL_ERROR);
+	}
 
-	if (ioctl( handle, PCIDRIVER_IOC_MMAP_AREA, PCIDRIVER_BAR0+bar) != 0)
+	if (ioctl( handle, PCIDRIVER_IOC_MMAP_AREA, PCIDRIVER_BAR0+bar) != 0) {
+		mmap_unlock();
 		throw Exception(Exception::INTERNAL_ERROR);
+	}
 
-	mem = mmap(0, info.bar_length[bar], PROT_WRITE | PROT_READ, MAP_SHARED, handle, 0);
+	/* Always set the mode, the driver keeps the last one per device.
+	 * Drivers without the ioctl map with the default caching. */
+	mcache.mode = mode;
+	mcache.effective = CACHE_DEFAULT;
+	if (ioctl(handle, PCIDRIVER_IOC_MMAP_CACHE, &mcache) != 0)
+		mcache.effective = CACHE_DEFAULT;
 
-	mmap_unlock();
+	mem = mmap(0, bar_length[bar], PROT_WRITE | PROT_READ, MAP_SHARED, handle, 0);
 
-	if ((mem == MAP_FAILED) || (mem == NULL))
+	if ((mem == MAP_FAILED) || (mem == NULL)) {
+		mmap_unlock();
 		throw Exception(Exception::MMAP_FAILED);
+	}
+
+	map->mem = mem;
+	map->refs = 1;
+	map->effective = static_cast<cache_mode>(mcache.effective);
+
+	mmap_unlock();
+
+	if (effective != NULL)
+		*effective = static_cast<cache_mode>(mcache.effective);
 
 	return mem;
 }
 
 /**
  *
- * Unmap the specified bar.
+ * Unmap the specified bar. The mapping goes away with the last reference.
  *
  */
 void PciDevice::unmapBAR(unsigned int bar, void *ptr)
 {
-	pci_board_info info;
+	unsigned int mode;
+	bar_mapping *map;
 
 	if (handle == -1)
 		throw Exception(Exception::NOT_OPEN);
@@ -318,10 +544,328 @@ void PciDevice::unmapBAR(unsigned int bar, void *ptr)
 	if (bar > 5)
 		throw Exception(Exception::INVALID_BAR);
 
-	if (ioctl(handle, PCIDRIVER_IOC_PCI_INFO, &info) != 0)
+	mmap_lock();
+
+	for (mode = 0; mode < 4; mode++) {
+		map = &bar_maps[bar][mode];
+		if ((map->mem == ptr) && (ptr != NULL))
+			break;
+	}
+
+	if (mode == 4) {
+		mmap_unlock();
+		throw Exception(Exception::INVALID_ARGUMENT);
+	}
+
+	if (--map->refs == 0) {
+		munmap(map->mem, bar_length[bar]);
+		map->mem = NULL;
+	}
+
+	mmap_unlock();
+}
+
+/**
+ *
+ * Gets a pointer into the WC mapping of a BAR used by barWrite()/barRead().
+ * The first call takes a reference on it, which is dropped on close().
+ *
+ */
+volatile unsigned char *PciDevice::getBARmapping(unsigned int bar, unsigned long offset, unsigned long len)
+{
+	void *mem, *expected = NULL;
+
+	if (bar > 5)
 		throw Exception(Exception::INVALID_BAR);
 
-	munmap(ptr, info.bar_length[bar]);
+	if (__atomic_load_n(&bar_io[bar], __ATOMIC_ACQUIRE) == NULL) {
+		/* Write-combining lets the non-temporal stores of the kernels merge */
+		mem = mapBAR(bar, CACHE_WC);
+
+		/* Another thread may have taken the reference meanwhile */
+		if (!__atomic_compare_exchange_n(&bar_io[bar], &expected, mem, false,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			unmapBAR(bar, mem);
+	}
+
+	if ((offset > bar_length[bar]) || (len > (bar_length[bar] - offset)))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	return static_cast<volatile unsigned char *>(bar_io[bar]) + offset;
+}
+
+/**
+ *
+ * Writes a buffer to a BAR with the selected copy kernel.
+ *
+ * @param bar BAR to write to
+ * @param offset Byte offset inside the BAR, multiple of 4
+ * @param src Source buffer
+ * @param len Number of bytes, multiple of 4
+ *
+ */
+void PciDevice::barWrite(unsigned int bar, unsigned long offset, const void *src, unsigned long len)
+{
+	if (handle == -1)
+		throw Exception(Exception::NOT_OPEN);
+
+	BarCopy::write(getBARmapping(bar, offset, len), src, len, copy_kernel);
+
+	/* Single dwords are traced with their value */
+	if (len == sizeof(uint32_t))
+		MmioTrace::write32(device, bar, offset, *static_cast<const uint32_t *>(src));
+	else
+		MmioTrace::copy(true, device, bar, offset, len);
+}
+
+/**
+ *
+ * Reads a BAR range into a buffer with the selected copy kernel.
+ *
+ * @param bar BAR to read from
+ * @param offset Byte offset inside the BAR, multiple of 4
+ * @param dst Destination buffer
+ * @param len Number of bytes, multiple of 4
+ *
+ */
+void PciDevice::barRead(unsigned int bar, unsigned long offset, void *dst, unsigned long len)
+{
+	if (handle == -1)
+		throw Exception(Exception::NOT_OPEN);
+
+	BarCopy::read(dst, getBARmapping(bar, offset, len), len, copy_kernel);
+
+	if (len == sizeof(uint32_t))
+		MmioTrace::read32(device, bar, offset, *static_cast<uint32_t *>(dst));
+	else
+		MmioTrace::copy(false, device, bar, offset, len);
+}
+
+/**
+ *
+ * Selects the copy kernel of barWrite()/barRead(). KERNEL_AUTO picks the
+ * widest one the CPU supports.
+ *
+ */
+void PciDevice::setCopyKernel(BarCopy::kernel k)
+{
+	if (!BarCopy::isSupported(k))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	copy_kernel = k;
+}
+
+/**
+ *
+ * Changes PCIe transport settings through the driver.
+ *
+ * @param set PCIDRIVER_TUNE_* flags of the settings in t to change
+ * @returns the settings in effect afterwards
+ *
+ */
+PciDevice::transport PciDevice::tune(unsigned int set, const transport& t)
+{
+	pcie_tune_t pt;
+	transport cur;
+
+	if (handle == -1)
+		throw Exception( Exception::NOT_OPEN );
+
+	pt.set = set;
+	pt.mrrs = t.mrrs;
+	pt.mps = t.mps;
+	pt.relaxed = t.relaxed_ordering;
+	pt.nosnoop = t.no_snoop;
+
+	if (ioctl(handle, PCIDRIVER_IOC_PCIE_TUNE, &pt) != 0) {
+		if (errno == EINVAL)
+			throw Exception( Exception::INVALID_ARGUMENT );
+		throw Exception( Exception::INTERNAL_ERROR );
+	}
+
+	cur.mrrs = pt.mrrs;
+	cur.mps = pt.mps;
+	cur.mps_supported = pt.mps_supported;
+	cur.parent_mps = pt.parent_mps;
+	cur.relaxed_ordering = (pt.relaxed != 0);
+	cur.no_snoop = (pt.nosnoop != 0);
+
+	return cur;
+}
+
+/**
+ *
+ * Gets the PCIe transport settings of the device. A device whose MPS
+ * differs from parent_mps is misconfigured: larger TLPs are malformed
+ * for the upstream port, smaller ones waste link bandwidth.
+ *
+ */
+PciDevice::transport PciDevice::getTransport()
+{
+	transport t = transport();
+
+	return tune(0, t);
+}
+
+/**
+ *
+ * Sets the max read request size, a power of two from 128 to 4096 bytes.
+ *
+ */
+void PciDevice::setMaxReadRequestSize(unsigned int bytes)
+{
+	transport t = transport();
+
+	t.mrrs = bytes;
+	tune(PCIDRIVER_TUNE_MRRS, t);
+}
+
+/**
+ *
+ * Sets the max payload size. Fails if the device or the upstream port
+ * does not support it.
+ *
+ */
+void PciDevice::setMaxPayloadSize(unsigned int bytes)
+{
+	transport t = transport();
+
+	t.mps = bytes;
+	tune(PCIDRIVER_TUNE_MPS, t);
+}
+
+/**
+ *
+ * Enables relaxed ordering of the device's requests. Fails below root
+ * ports known to mishandle it.
+ *
+ */
+void PciDevice::setRelaxedOrdering(bool on)
+{
+	transport t = transport();
+
+	t.relaxed_ordering = on;
+	tune(PCIDRIVER_TUNE_RELAXED, t);
+}
+
+/**
+ *
+ * Enables the no snoop attribute, the device may then skip cache
+ * coherency for buffers the host flushes itself.
+ *
+ */
+void PciDevice::setNoSnoop(bool on)
+{
+	transport t = transport();
+
+	t.no_snoop = on;
+	tune(PCIDRIVER_TUNE_NOSNOOP, t);
+}
+
+/**
+ *
+ * Gets the path selection used by write()/read(), creating it on first
+ * use. Use it to calibrate the thresholds and to read the path stats.
+ *
+ */
+HybridTransfer& PciDevice::getHybridTransfer()
+{
+	if (handle == -1)
+		throw Exception(Exception::NOT_OPEN);
+
+	if (hybrid == NULL)
+		hybrid = new HybridTransfer(*this, transfer_bar);
+
+	return *hybrid;
+}
+
+/**
+ *
+ * Selects the BAR targeted by write()/read(), BAR2 by default.
+ *
+ */
+void PciDevice::setTransferBAR(unsigned int bar)
+{
+	if (bar > 5)
+		throw Exception(Exception::INVALID_BAR);
+
+	if (bar != transfer_bar) {
+		delete hybrid;
+		hybrid = NULL;
+	}
+
+	transfer_bar = bar;
+}
+
+/**
+ *
+ * Gets the arena that DmaAllocator carves its containers from, creating
+ * it on first use. It lives until the device is closed.
+ *
+ */
+DmaArena& PciDevice::getDmaArena()
+{
+	DmaArena *a, *expected = NULL;
+
+	if (handle == -1)
+		throw Exception(Exception::NOT_OPEN);
+
+	a = __atomic_load_n(&arena, __ATOMIC_ACQUIRE);
+	if (a != NULL)
+		return *a;
+
+	/* Allocating takes the mmap lock, so race and keep the first one */
+	a = new DmaArena(*this, arena_size);
+	if (!__atomic_compare_exchange_n(&arena, &expected, a, false,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		delete a;
+		a = expected;
+	}
+
+	return *a;
+}
+
+/**
+ *
+ * Sets the size of the DmaAllocator arena, 4 MB by default. Only allowed
+ * before the arena is created.
+ *
+ */
+void PciDevice::setDmaArenaSize(unsigned long size)
+{
+	if ((size == 0) || (__atomic_load_n(&arena, __ATOMIC_ACQUIRE) != NULL))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	arena_size = size;
+}
+
+/**
+ *
+ * Writes a buffer to the transfer BAR over PIO, staged DMA or zero-copy
+ * DMA, whichever is fastest for the size.
+ *
+ * @param devaddr Destination address inside the BAR, multiple of 4
+ * @param src Source buffer
+ * @param len Number of bytes, multiple of 4
+ *
+ */
+void PciDevice::write(uint64_t devaddr, const void *src, uint64_t len)
+{
+	getHybridTransfer().write(devaddr, src, len);
+}
+
+/**
+ *
+ * Reads a range of the transfer BAR over the fastest path.
+ *
+ * @param dst Destination buffer
+ * @param devaddr Source address inside the BAR, multiple of 4
+ * @param len Number of bytes, multiple of 4
+ *
+ */
+void PciDevice::read(void *dst, uint64_t devaddr, uint64_t len)
+{
+	getHybridTransfer().read(dst, devaddr, len);
 }
 
 unsigned char PciDevice::readConfigByte(unsigned int addr)
@@ -333,7 +877,8 @@ unsigned char PciDevice::readConfigByte(unsigned int addr)
 
 	cmd.addr = addr;
 	cmd.size = PCIDRIVER_PCI_CFG_SZ_BYTE;
-	ioctl( handle, PCIDRIVER_IOC_PCI_CFG_RD, &cmd );
+	if (ioctl( handle, PCIDRIVER_IOC_PCI_CFG_RD, &cmd ) != 0)
+		throw Exception( Exception::INTERNAL_ERROR );
 
 	return cmd.val.byte;
 }
@@ -347,7 +892,8 @@ unsigned short PciDevice::readConfigWord(unsigned int addr)
 
 	cmd.addr = addr;
 	cmd.size = PCIDRIVER_PCI_CFG_SZ_WORD;
-	ioctl( handle, PCIDRIVER_IOC_PCI_CFG_RD, &cmd );
+	if (ioctl( handle, PCIDRIVER_IOC_PCI_CFG_RD, &cmd ) != 0)
+		throw Exception( Exception::INTERNAL_ERROR );
 
 	return cmd.val.word;
 }
@@ -361,11 +907,50 @@ unsigned int PciDevice::readConfigDWord(unsigned int addr)
 
 	cmd.addr = addr;
 	cmd.size = PCIDRIVER_PCI_CFG_SZ_DWORD;
-	ioctl( handle, PCIDRIVER_IOC_PCI_CFG_RD, &cmd );
+	if (ioctl( handle, PCIDRIVER_IOC_PCI_CFG_RD, &cmd ) != 0)
+		throw Exception( Exception::INTERNAL_ERROR );
 
 	return cmd.val.dword;
 }
 
+/**
+ *
+ * Reads a range of the config space in one call. Drivers without the
+ * range ioctl are read a dword at a time, up to the first 256 bytes.
+ *
+ * @param addr First byte, multiple of 4
+ * @param buf Destination buffer
+ * @param len Bytes to read, multiple of 4
+ * @returns bytes read, less than len if the config space of the device
+ * ends before
+ *
+ */
+unsigned int PciDevice::readConfigRange(unsigned int addr, void *buf, unsigned int len)
+{
+	pci_cfg_range_t range;
+	unsigned int i;
+
+	if (handle == -1)
+		throw Exception( Exception::NOT_OPEN );
+
+	if ((addr | len) & 0x3)
+		throw Exception( Exception::INVALID_ARGUMENT );
+
+	range.addr = addr;
+	range.size = len;
+	range.data = reinterpret_cast<unsigned long>(buf);
+	if (ioctl( handle, PCIDRIVER_IOC_PCI_CFG_RANGE, &range ) == 0)
+		return range.size;
+
+	if (errno != EINVAL)
+		throw Exception( Exception::INTERNAL_ERROR );
+
+	for (i = 0; (i < len) && (addr + i < 256); i += 4)
+		static_cast<uint32_t *>(buf)[i >> 2] = readConfigDWord(addr + i);
+
+	return i;
+}
+
 void PciDevice::writeConfigByte(unsigned int addr, unsigned char val)
 {
 	pci_cfg_cmd cmd;
@@ -376,7 +961,8 @@ void PciDevice::writeConfigByte(unsigned int addr, unsigned char val)
 	cmd.addr = addr;
 	cmd.size = PCIDRIVER_PCI_CFG_SZ_BYTE;
 	cmd.val.byte = val;
-	ioctl( handle, PCIDRIVER_IOC_PCI_CFG_WR, &cmd );
+	if (ioctl( handle, PCIDRIVER_IOC_PCI_CFG_WR, &cmd ) != 0)
+		throw Exception( Exception::INTERNAL_ERROR );
 
 	return;
 }
@@ -391,7 +977,8 @@ void PciDevice::writeConfigWord(unsigned int addr, unsigned short val)
 	cmd.addr = addr;
 	cmd.size = PCIDRIVER_PCI_CFG_SZ_WORD;
 	cmd.val.word = val;
-	ioctl( handle, PCIDRIVER_IOC_PCI_CFG_WR, &cmd );
+	if (ioctl( handle, PCIDRIVER_IOC_PCI_CFG_WR, &cmd ) != 0)
+		throw Exception( Exception::INTERNAL_ERROR );
 
 	return;
 }
@@ -406,7 +993,8 @@ void PciDevice::writeConfigDWord(unsigned int addr, unsigned int val)
 	cmd.addr = addr;
 	cmd.size = PCIDRIVER_PCI_CFG_SZ_DWORD;
 	cmd.val.dword = val;
-	ioctl( handle, PCIDRIVER_IOC_PCI_CFG_WR, &cmd );
+	if (ioctl( handle, PCIDRIVER_IOC_PCI_CFG_WR, &cmd ) != 0)
+		throw Exception( Exception::INTERNAL_ERROR );
 
 	return;
 }
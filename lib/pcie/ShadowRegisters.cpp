@@ -0,0 +1,255 @@
+/**
+ *
+ * @file ShadowRegisters.cpp
+ * @brief Serves reads of host-owned device registers from host memory.
+ *
+ */
+
+#include "ShadowRegisters.h"
+#include "Exception.h"
+#include "MmioTrace.h"
+
+#include <cstdlib>
+#include <cstring>
+
+using namespace pciDriver;
+
+/**
+ *
+ * Constructor of ShadowRegisters, maps the BAR. No register is tracked.
+ *
+ * @param dev Opened PCI device
+ * @param bar BAR holding the registers
+ *
+ */
+ShadowRegisters::ShadowRegisters(PciDevice& dev, unsigned int bar)
+{
+	this->device = &dev;
+	this->bar = bar;
+	this->count = dev.getBARsize(bar) / sizeof(uint32_t);
+	this->verify = false;
+
+	value = static_cast<uint32_t *>(calloc(count, sizeof(uint32_t)));
+	flags = static_cast<uint8_t *>(calloc(count, sizeof(uint8_t)));
+	if ((value == NULL) || (flags == NULL)) {
+		free(value);
+		free(flags);
+		throw Exception(Exception::ALLOC_FAILED);
+	}
+
+	try {
+		base = static_cast<volatile uint32_t *>(dev.mapBAR(bar));
+	} catch (Exception& e) {
+		free(value);
+		free(flags);
+		throw;
+	}
+
+	pthread_mutex_init(&lock, NULL);
+	resetStats();
+}
+
+/**
+ *
+ * Destructor of ShadowRegisters, unmaps the BAR.
+ *
+ */
+ShadowRegisters::~ShadowRegisters()
+{
+	device->unmapBAR(bar, const_cast<uint32_t *>(base));
+	pthread_mutex_destroy(&lock);
+	free(value);
+	free(flags);
+}
+
+void ShadowRegisters::checkOffset(uint32_t offset)
+{
+	if ((offset & 0x3) || ((offset >> 2) >= count))
+		throw Exception(Exception::INVALID_ARGUMENT);
+}
+
+/**
+ *
+ * Tracks a host-owned register, reading its current value once.
+ *
+ */
+void ShadowRegisters::track(uint32_t offset)
+{
+	unsigned int i = offset >> 2;
+
+	checkOffset(offset);
+
+	pthread_mutex_lock(&lock);
+	value[i] = base[i];
+	regs::read_barrier();
+	MmioTrace::read32(device->getNumber(), bar, offset, value[i]);
+	flags[i] = TRACKED;
+	st.mmio_reads++;
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ *
+ * Tracks a register starting from a known value, without reading it.
+ *
+ * @param access WO for registers that cannot be read back, RW otherwise
+ * @param value Current contents of the register, e.g. its reset value
+ *
+ */
+void ShadowRegisters::track(uint32_t offset, regs::access_t access, uint32_t value)
+{
+	unsigned int i = offset >> 2;
+
+	checkOffset(offset);
+	if (access == regs::RO)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	pthread_mutex_lock(&lock);
+	this->value[i] = value;
+	flags[i] = (access == regs::WO) ? TRACKED_WO : TRACKED;
+	pthread_mutex_unlock(&lock);
+}
+
+void ShadowRegisters::untrack(uint32_t offset)
+{
+	checkOffset(offset);
+
+	pthread_mutex_lock(&lock);
+	flags[offset >> 2] = UNTRACKED;
+	pthread_mutex_unlock(&lock);
+}
+
+bool ShadowRegisters::isTracked(uint32_t offset)
+{
+	checkOffset(offset);
+
+	return (flags[offset >> 2] != UNTRACKED);
+}
+
+/**
+ *
+ * Gets the shadow value of a tracked register. Called with the lock held.
+ *
+ */
+uint32_t ShadowRegisters::readShadow(unsigned int i)
+{
+	st.shadow_reads++;
+
+#ifndef NDEBUG
+	if (verify && (flags[i] == TRACKED)) {
+		uint32_t hw = base[i];
+
+		regs::read_barrier();
+		st.mmio_reads++;
+		MmioTrace::read32(device->getNumber(), bar, i << 2, hw);
+		if (hw != value[i])
+			st.mismatches++;
+	}
+#endif
+
+	return value[i];
+}
+
+/**
+ *
+ * Writes a tracked register and its shadow. Called with the lock held.
+ *
+ */
+void ShadowRegisters::writeDevice(unsigned int i, uint32_t v)
+{
+	regs::write_barrier();
+	base[i] = v;
+	value[i] = v;
+	MmioTrace::write32(device->getNumber(), bar, i << 2, v);
+	st.writes++;
+}
+
+/**
+ *
+ * Reads a register, from the shadow if it is tracked.
+ *
+ */
+uint32_t ShadowRegisters::read(uint32_t offset)
+{
+	unsigned int i = offset >> 2;
+	uint32_t v;
+
+	checkOffset(offset);
+
+	pthread_mutex_lock(&lock);
+	if (flags[i] != UNTRACKED) {
+		v = readShadow(i);
+	} else {
+		v = base[i];
+		regs::read_barrier();
+		st.mmio_reads++;
+		MmioTrace::read32(device->getNumber(), bar, offset, v);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return v;
+}
+
+/**
+ *
+ * Writes a register, updating the shadow if it is tracked.
+ *
+ */
+void ShadowRegisters::write(uint32_t offset, uint32_t v)
+{
+	checkOffset(offset);
+
+	pthread_mutex_lock(&lock);
+	writeDevice(offset >> 2, v);
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ *
+ * Read-modify-write of a register: replaces the bits in mask by those of
+ * bits. Tracked registers are not read from the device.
+ *
+ */
+void ShadowRegisters::modify(uint32_t offset, uint32_t mask, uint32_t bits)
+{
+	unsigned int i = offset >> 2;
+	uint32_t v;
+
+	checkOffset(offset);
+
+	pthread_mutex_lock(&lock);
+	if (flags[i] != UNTRACKED) {
+		v = readShadow(i);
+	} else {
+		v = base[i];
+		regs::read_barrier();
+		st.mmio_reads++;
+		MmioTrace::read32(device->getNumber(), bar, offset, v);
+	}
+	writeDevice(i, (v & ~mask) | (bits & mask));
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ *
+ * Enables reading tracked registers back from the device on every access
+ * to check the shadow. Only available in builds without NDEBUG.
+ *
+ * @returns false if verification is not compiled in.
+ *
+ */
+bool ShadowRegisters::setVerify(bool on)
+{
+#ifndef NDEBUG
+	verify = on;
+	return true;
+#else
+	verify = false;
+	return !on;
+#endif
+}
+
+void ShadowRegisters::resetStats()
+{
+	memset(&st, 0, sizeof(st));
+}
@@ -29,6 +29,7 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <errno.h>
 
 using namespace pciDriver;
 
@@ -38,7 +39,7 @@ using namespace pciDriver;
  * from kernel space.
  *
  */
-UserMemory::UserMemory(PciDevice& dev, void *mem, unsigned int size, bool merged)
+UserMemory::UserMemory(PciDevice& dev, void *mem, uint64_t size, bool merged)
 {
 	int i;
 	umem_handle_t uh;
@@ -122,3 +123,56 @@ void UserMemory::sync(sync_dir dir)
 	if (ioctl(device->getHandle(), PCIDRIVER_IOC_UMEM_SYNC, &uh) != 0)
 		throw Exception( Exception::INTERNAL_ERROR );
 }
+
+/**
+ *
+ * Syncs part of the user memory. The DMA API only syncs scatter/gather
+ * mappings as a whole, so this syncs all of it after checking the range.
+ *
+ * @param offset First byte to sync
+ * @param len Number of bytes
+ *
+ */
+void UserMemory::sync(sync_dir dir, uint64_t offset, uint64_t len)
+{
+	if ((len == 0) || (offset >= size) || (len > size - offset))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	sync(dir);
+}
+
+/**
+ *
+ * Checks that part of the user memory is still backed by the pages
+ * pinned when it was mapped. After munmap(), mremap() or MADV_DONTNEED
+ * of the range the SG list points at pages the application no longer
+ * sees. Needs driver ABI version 8.
+ *
+ * @param offset First byte to check
+ * @param len Number of bytes
+ * @returns false if the range is no longer backed by the pinned pages
+ *
+ */
+bool UserMemory::isMapped(uint64_t offset, uint64_t len)
+{
+	umem_handle_t uh;
+
+	if ((len == 0) || (offset >= size) || (len > size - offset))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	if (device->getABIVersion() < 8)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	uh.handle_id = handle_id;
+	uh.vma = vma + offset;
+	uh.size = len;
+	uh.dir = BIDIRECTIONAL;
+
+	if (ioctl(device->getHandle(), PCIDRIVER_IOC_UMEM_CHECK, &uh) == 0)
+		return true;
+
+	if (errno == ESTALE)
+		return false;
+
+	throw Exception(Exception::INTERNAL_ERROR);
+}
@@ -0,0 +1,385 @@
+/**
+ *
+ * @file UserMemoryCache.cpp
+ * @brief Keeps UserMemory registrations for reuse, evicting them LRU and when unmapped.
+ *
+ */
+
+#include "UserMemoryCache.h"
+#include "Exception.h"
+
+#include <cstdlib>
+
+using namespace pciDriver;
+
+/**
+ *
+ * Constructor of a UserMemoryCache. Starts empty.
+ *
+ * @param dev Opened PCI device
+ * @param max_pinned Most bytes the idle and used registrations may pin
+ *
+ */
+UserMemoryCache::UserMemoryCache(PciDevice& dev, uint64_t max_pinned)
+{
+	if (max_pinned == 0)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	this->device = &dev;
+	this->max_pinned = max_pinned;
+	this->head = NULL;
+	this->tail = NULL;
+	this->entries = 0;
+	this->pinned_bytes = 0;
+	this->hits = 0;
+	this->misses = 0;
+	this->uncached = 0;
+	this->evictions = 0;
+	this->invalidations = 0;
+	pthread_mutex_init(&lock, NULL);
+}
+
+/**
+ *
+ * Destructor of UserMemoryCache, deletes every registration.
+ *
+ */
+UserMemoryCache::~UserMemoryCache()
+{
+	while (head != NULL)
+		remove(head);
+
+	pthread_mutex_destroy(&lock);
+}
+
+void UserMemoryCache::link(entry *e)
+{
+	e->prev = NULL;
+	e->next = head;
+	if (head != NULL)
+		head->prev = e;
+	else
+		tail = e;
+	head = e;
+}
+
+void UserMemoryCache::unlink(entry *e)
+{
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		head = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		tail = e->prev;
+}
+
+/**
+ *
+ * Deletes an entry and its registration. Called with the lock held.
+ *
+ */
+void UserMemoryCache::remove(entry *e)
+{
+	unlink(e);
+	entries--;
+	pinned_bytes -= e->end - e->start;
+
+	try {
+		delete e->um;
+	} catch (Exception& ex) {
+		/* The pages stay pinned until the device is closed */
+	}
+
+	free(e);
+}
+
+/**
+ *
+ * Deletes idle registrations, oldest first, until the pinned bytes are
+ * below the cap. Called with the lock held.
+ *
+ */
+void UserMemoryCache::evict()
+{
+	entry *e, *prev;
+
+	for (e = tail; (e != NULL) && (pinned_bytes > max_pinned); e = prev) {
+		prev = e->prev;
+		if (e->refs > 0)
+			continue;
+		remove(e);
+		evictions++;
+	}
+}
+
+/**
+ *
+ * Marks an entry whose memory went away, deleting it unless in use.
+ * Called with the lock held.
+ *
+ */
+void UserMemoryCache::drop(entry *e)
+{
+	e->stale = true;
+	invalidations++;
+	if (e->refs == 0)
+		remove(e);
+}
+
+/**
+ *
+ * Gets a registration containing a buffer. A cached registration is only
+ * returned after the driver confirmed that the pages of the buffer are
+ * still the pinned ones.
+ *
+ * @param mem Start of the buffer
+ * @param size Size of the buffer in bytes
+ * @returns the registration and the offset of mem inside it
+ *
+ */
+UserMemoryCache::Registration UserMemoryCache::acquire(void *mem, uint64_t size)
+{
+	uint64_t start = reinterpret_cast<unsigned long>(mem);
+	uint64_t end = start + size;
+	uint64_t s, t;
+	entry *e, *next;
+	UserMemory *um;
+
+	if ((mem == NULL) || (size == 0) || (end < start))
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	/* Without UMEM_CHECK a hit could not be verified */
+	if ((size > max_pinned) || (device->getABIVersion() < 8)) {
+		pthread_mutex_lock(&lock);
+		uncached++;
+		pthread_mutex_unlock(&lock);
+		um = &device->mapUserMemory(mem, size);
+		return Registration(this, NULL, um, 0);
+	}
+
+	pthread_mutex_lock(&lock);
+
+	for (e = head; e != NULL; e = next) {
+		next = e->next;
+		if (!e->stale && (e->start <= start) && (end <= e->end)) {
+			try {
+				if (!e->um->isMapped(start - e->start, size)) {
+					drop(e);
+					continue;
+				}
+			} catch (Exception& ex) {
+				pthread_mutex_unlock(&lock);
+				throw;
+			}
+			unlink(e);
+			link(e);
+			e->refs++;
+			hits++;
+			pthread_mutex_unlock(&lock);
+			return Registration(this, e, e->um, start - e->start);
+		}
+	}
+
+	/* Grow the range over the idle registrations it overlaps and
+	 * replace them, as long as the result stays registrable */
+	s = start;
+	t = end;
+	for (e = head; e != NULL; e = e->next) {
+		if (e->stale || (e->refs > 0) || (e->end <= start) || (e->start >= end))
+			continue;
+		if (e->start < s)
+			s = e->start;
+		if (e->end > t)
+			t = e->end;
+	}
+	if ((t - s > max_pinned) || ((t - s > 0xFFFFFFFFULL) && (device->getABIVersion() == 1))) {
+		s = start;
+		t = end;
+	}
+	for (e = head; e != NULL; e = next) {
+		next = e->next;
+		if (!e->stale && (e->refs == 0) && (e->start >= s) && (e->end <= t))
+			remove(e);
+	}
+
+	e = static_cast<entry *>(malloc(sizeof(entry)));
+	if (e == NULL) {
+		pthread_mutex_unlock(&lock);
+		throw Exception(Exception::ALLOC_FAILED);
+	}
+
+	/* The merged range may cover memory unmapped since, then take just
+	 * the requested one */
+	try {
+		um = &device->mapUserMemory(reinterpret_cast<void *>(static_cast<unsigned long>(s)), t - s);
+	} catch (Exception& ex) {
+		um = NULL;
+	}
+	if ((um == NULL) && ((s != start) || (t != end))) {
+		s = start;
+		t = end;
+		try {
+			um = &device->mapUserMemory(mem, size);
+		} catch (Exception& ex) {
+			um = NULL;
+		}
+	}
+	if (um == NULL) {
+		free(e);
+		pthread_mutex_unlock(&lock);
+		throw Exception(Exception::SGMAP_FAILED);
+	}
+
+	e->um = um;
+	e->start = s;
+	e->end = t;
+	e->refs = 1;
+	e->stale = false;
+	link(e);
+	entries++;
+	pinned_bytes += t - s;
+	misses++;
+
+	evict();
+
+	pthread_mutex_unlock(&lock);
+
+	return Registration(this, e, um, start - s);
+}
+
+void UserMemoryCache::release(entry *e, UserMemory *um)
+{
+	if (e == NULL) {
+		delete um;
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+
+	e->refs--;
+	if ((e->refs == 0) && e->stale)
+		remove(e);
+	else if (e->refs == 0)
+		evict();
+
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ *
+ * Drops every registration overlapping a range, e.g. one that is about
+ * to be unmapped, so its pages are unpinned right away instead of at the
+ * next lookup or eviction. Registrations in use are deleted on release.
+ *
+ */
+void UserMemoryCache::invalidate(void *mem, uint64_t size)
+{
+	uint64_t start = reinterpret_cast<unsigned long>(mem);
+	uint64_t end = start + size;
+	entry *e, *next;
+
+	if (end < start)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	pthread_mutex_lock(&lock);
+
+	for (e = head; e != NULL; e = next) {
+		next = e->next;
+		if (e->stale || (e->end <= start) || (e->start >= end))
+			continue;
+		drop(e);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ *
+ * Sets the cap on pinned bytes, evicting idle registrations above it.
+ *
+ */
+void UserMemoryCache::setMaxPinned(uint64_t max_pinned)
+{
+	if (max_pinned == 0)
+		throw Exception(Exception::INVALID_ARGUMENT);
+
+	pthread_mutex_lock(&lock);
+	this->max_pinned = max_pinned;
+	evict();
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ *
+ * Deletes every idle registration.
+ *
+ */
+void UserMemoryCache::flush()
+{
+	entry *e, *next;
+
+	pthread_mutex_lock(&lock);
+
+	for (e = head; e != NULL; e = next) {
+		next = e->next;
+		if (e->refs > 0)
+			continue;
+		remove(e);
+		evictions++;
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+UserMemoryCache::stats UserMemoryCache::getStats()
+{
+	stats s;
+
+	pthread_mutex_lock(&lock);
+	s.hits = hits;
+	s.misses = misses;
+	s.uncached = uncached;
+	s.evictions = evictions;
+	s.invalidations = invalidations;
+	s.entries = entries;
+	s.pinned_bytes = pinned_bytes;
+	pthread_mutex_unlock(&lock);
+
+	return s;
+}
+
+UserMemoryCache::Registration::Registration(Registration&& other)
+	: cache(other.cache), e(other.e), um(other.um), offset(other.offset)
+{
+	other.um = NULL;
+}
+
+UserMemoryCache::Registration& UserMemoryCache::Registration::operator=(Registration&& other)
+{
+	if (this != &other) {
+		release();
+		cache = other.cache;
+		e = other.e;
+		um = other.um;
+		offset = other.offset;
+		other.um = NULL;
+	}
+
+	return *this;
+}
+
+/**
+ *
+ * Returns the registration to the cache before it goes out of scope.
+ *
+ */
+void UserMemoryCache::Registration::release()
+{
+	if (um == NULL)
+		return;
+
+	cache->release(e, um);
+	um = NULL;
+}
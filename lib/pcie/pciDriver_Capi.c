@@ -61,7 +61,8 @@ int pd_getpagemask() {
 
 int pd_open( int dev, pd_device_t *pci_handle, char *dev_entry )
 {
-	int ret;
+	int ret, i;
+	pci_board_info info;
 
 	/* check for null pointer */
 	if (pci_handle == NULL)
@@ -80,6 +81,23 @@ int pd_open( int dev, pd_device_t *pci_handle, char *dev_entry )
     if (ret < 0)
         return -1;
 
+    /* The board info does not change while the device is open */
+    if (ioctl( ret, PCIDRIVER_IOC_PCI_INFO, &info ) != 0) {
+        close( ret );
+        return -1;
+    }
+
+    pci_handle->id = (info.vendor_id << 16) | info.device_id;
+    for (i = 0; i < 6; i++) {
+        pci_handle->bar_start[i] = info.bar_start[i];
+        pci_handle->bar_length[i] = info.bar_length[i];
+    }
+    memset( pci_handle->bar_map, 0, sizeof( pci_handle->bar_map ) );
+
+    /* Drivers before the VERSION ioctl speak version 1 */
+    if (ioctl( ret, PCIDRIVER_IOC_VERSION, &pci_handle->abi_version ) != 0)
+        pci_handle->abi_version = 1;
+
     pci_handle->handle = ret;
 
     pthread_mutex_init( &pci_handle->mmap_mutex, NULL );
@@ -89,14 +107,31 @@ int pd_open( int dev, pd_device_t *pci_handle, char *dev_entry )
 
 int pd_close(pd_device_t *pci_handle)
 {
+	int i, mode;
+
+	/* Unmap what is still mapped */
+	for (i = 0; i < 6; i++) {
+		for (mode = 0; mode < 4; mode++) {
+			if (pci_handle->bar_map[i][mode].mem != NULL)
+				munmap( pci_handle->bar_map[i][mode].mem, pci_handle->bar_length[i] );
+			pci_handle->bar_map[i][mode].mem = NULL;
+			pci_handle->bar_map[i][mode].refs = 0;
+		}
+	}
+
 	pthread_mutex_destroy( &pci_handle->mmap_mutex );
 
 	return close( pci_handle->handle );
 }
 
+unsigned int pd_getABIVersion( pd_device_t *pci_handle )
+{
+	return pci_handle->abi_version;
+}
+
 /* Kernel Memory Functions */
 
-void *pd_allocKernelMemory( pd_device_t *pci_handle, unsigned int size, pd_kmem_t *kmem_handle )
+void *pd_allocKernelMemory( pd_device_t *pci_handle, uint64_t size, pd_kmem_t *kmem_handle )
 {
 	int ret;
 	void *mem;
@@ -106,7 +141,12 @@ void *pd_allocKernelMemory( pd_device_t *pci_handle, unsigned int size, pd_kmem_
 	if (kmem_handle == NULL)
 		return NULL;
 
+	/* Version 1 drivers were never meant for more */
+	if ((size > 0xFFFFFFFFULL) && (pci_handle->abi_version < 2))
+		return NULL;
+
 	/* Allocate */
+	memset(&kh, 0, sizeof(kh));
 	kh.size = size;
 	ret = ioctl(pci_handle->handle, PCIDRIVER_IOC_KMEM_ALLOC, &kh );
 	if (ret != 0)
@@ -116,6 +156,7 @@ void *pd_allocKernelMemory( pd_device_t *pci_handle, unsigned int size, pd_kmem_
 	kmem_handle->pa = kh.pa;
 	kmem_handle->size = size;
 	kmem_handle->pci_handle = pci_handle;
+	kmem_handle->node = (pci_handle->abi_version >= 5) ? kh.node : -1;
 
 	/* Mmap */
 	/* This is not fully safe, as a separate process can still open the device independently.
@@ -171,7 +212,7 @@ int pd_freeKernelMemory( pd_kmem_t *kmem_handle )
 }
 
 /* User Memory Functions */
-int pd_mapUserMemory( pd_device_t *pci_handle, void *mem, unsigned int size, pd_umem_t *umem_handle )
+int pd_mapUserMemory( pd_device_t *pci_handle, void *mem, uint64_t size, pd_umem_t *umem_handle )
 {
 	int ret;
 	umem_handle_t uh;
@@ -182,6 +223,8 @@ int pd_mapUserMemory( pd_device_t *pci_handle, void *mem, unsigned int size, pd_
 		return -1;
 	if (umem_handle == NULL)
 		return -1;
+	if ((size > 0xFFFFFFFFULL) && (pci_handle->abi_version < 2))
+		return -1;
 
 	uh.vma = (unsigned long)mem;
 	uh.size = size;
@@ -193,12 +236,18 @@ int pd_mapUserMemory( pd_device_t *pci_handle, void *mem, unsigned int size, pd_
 
 	umem_handle->pci_handle = pci_handle;
 	umem_handle->handle_id = uh.handle_id;
+	umem_handle->vma = uh.vma;
+	umem_handle->size = size;
 
-	/* Obtain the scatter/gather list for this memory */
+	/* Obtain the scatter/gather list for this memory, an unaligned
+	 * buffer touches one page more */
 	sgl.handle_id = uh.handle_id;
 	sgl.type = PCIDRIVER_SG_MERGED;
-	sgl.nents = (size / getpagesize()) + 1;
-	posix_memalign( (void**)&(sgl.sg), 16, sgl.nents*sizeof(umem_sgentry_t) );
+	sgl.nents = (size / getpagesize()) + 2;
+	if (posix_memalign( (void**)&(sgl.sg), 16, sgl.nents*sizeof(umem_sgentry_t) ) != 0) {
+		ioctl( pci_handle->handle, PCIDRIVER_IOC_UMEM_SGUNMAP, &uh );
+		return -1;
+	}
 
 	ret = ioctl( pci_handle->handle, PCIDRIVER_IOC_UMEM_SGGET, &sgl );
 	if (ret != 0) {
@@ -260,6 +309,33 @@ int pd_syncKernelMemory( pd_kmem_t *kmem_handle, int dir )
 	return 0;
 }
 
+int pd_syncKernelMemoryRange( pd_kmem_t *kmem_handle, int dir, uint64_t offset, uint64_t size )
+{
+	kmem_sync_range_t ks;
+
+	/* Check for null pointer and range */
+	if (kmem_handle == NULL)
+		return -1;
+	if ((size == 0) || (offset >= kmem_handle->size) || (size > kmem_handle->size - offset))
+		return -1;
+
+	ks.handle.handle_id = kmem_handle->handle_id;
+	ks.handle.pa = kmem_handle->pa;
+	ks.handle.size = kmem_handle->size;
+	ks.offset = offset;
+	ks.size = size;
+	ks.dir = dir;
+
+	if (ioctl(kmem_handle->pci_handle->handle, PCIDRIVER_IOC_KMEM_SYNC_RANGE, &ks ) == 0)
+		return 0;
+
+	/* Drivers without range sync reject the ioctl, sync everything */
+	if (errno != EINVAL)
+		return -1;
+
+	return pd_syncKernelMemory( kmem_handle, dir );
+}
+
 int pd_syncUserMemory( pd_umem_t *umem_handle, int dir )
 {
 	int ret;
@@ -299,66 +375,93 @@ int pd_waitForInterrupt(pd_device_t *pci_handle, unsigned int int_id )
 	return 0;
 }
 
-int pd_clearInterruptQueue(pd_device_t *pci_handle, unsigned int int_id )
+int pd_waitForInterruptTimeout(pd_device_t *pci_handle, unsigned int int_id, unsigned int timeout )
 {
 	int ret;
+	irq_wait_t iw;
 
 	/* Check for null pointer */
 	if (pci_handle == NULL)
 		return -1;
 
-	ret = ioctl( pci_handle->handle, PCIDRIVER_IOC_CLEAR_IOQ, int_id );
+	iw.source = int_id;
+	iw.timeout = timeout;
+
+	/* Returns -1 with errno set to ETIMEDOUT if no interrupt arrived */
+	ret = ioctl( pci_handle->handle, PCIDRIVER_IOC_WAITI_TIMEOUT, &iw );
 	if (ret != 0)
 		return -1;
 
 	return 0;
 }
 
-/* PCI Functions */
-int pd_getID( pd_device_t *pci_handle )
+int pd_clearInterruptQueue(pd_device_t *pci_handle, unsigned int int_id )
 {
 	int ret;
-	pci_board_info info;
-	unsigned int id;
 
 	/* Check for null pointer */
 	if (pci_handle == NULL)
 		return -1;
 
-	ret = ioctl( pci_handle->handle, PCIDRIVER_IOC_PCI_INFO, &info );
+	ret = ioctl( pci_handle->handle, PCIDRIVER_IOC_CLEAR_IOQ, int_id );
 	if (ret != 0)
 		return -1;
 
-	id = (info.vendor_id << 16) || (info.device_id);
-
-	return id;
+	return 0;
 }
 
-int pd_getBARsize( pd_device_t *pci_handle, unsigned int bar )
+int pd_armInterrupt(pd_device_t *pci_handle, unsigned int int_id )
 {
 	int ret;
-	pci_board_info info;
-	unsigned int id;
 
 	/* Check for null pointer */
 	if (pci_handle == NULL)
 		return -1;
 
-	if (bar > 5)
+	/* Drivers before version 10 leave the interrupt enables to the caller */
+	if (pci_handle->abi_version < 10)
 		return -1;
 
-	ret = ioctl( pci_handle->handle, PCIDRIVER_IOC_PCI_INFO, &info );
+	ret = ioctl( pci_handle->handle, PCIDRIVER_IOC_ARM_IRQ, int_id );
 	if (ret != 0)
 		return -1;
 
-	return info.bar_length[ bar ];
+	return 0;
+}
+
+/* PCI Functions */
+int pd_getID( pd_device_t *pci_handle )
+{
+	/* Check for null pointer */
+	if (pci_handle == NULL)
+		return -1;
+
+	return pci_handle->id;
+}
+
+int pd_getBARsize( pd_device_t *pci_handle, unsigned int bar )
+{
+	/* Check for null pointer */
+	if (pci_handle == NULL)
+		return -1;
+
+	if (bar > 5)
+		return -1;
+
+	return pci_handle->bar_length[ bar ];
 }
 
 void *pd_mapBAR( pd_device_t *pci_handle, unsigned int bar )
+{
+	return pd_mapBARcache( pci_handle, bar, PD_CACHE_DEFAULT, NULL );
+}
+
+void *pd_mapBARcache( pd_device_t *pci_handle, unsigned int bar, unsigned int mode, unsigned int *effective )
 {
 	int ret;
 	void *mem;
-	pci_board_info info;
+	pd_barmap_t *map;
+	mmap_cache_t mcache;
 	unsigned int offset;
 	unsigned char* ptr;
 
@@ -366,11 +469,7 @@ void *pd_mapBAR( pd_device_t *pci_handle, unsigned int bar )
 	if (pci_handle == NULL)
 		return NULL;
 
-	if (bar > 5)
-		return NULL;
-
-	ret = ioctl( pci_handle->handle, PCIDRIVER_IOC_PCI_INFO, &info );
-	if (ret != 0)
+	if ((bar > 5) || (mode > PD_CACHE_WT))
 		return NULL;
 
 	/* Mmap */
@@ -379,22 +478,52 @@ void *pd_mapBAR( pd_device_t *pci_handle, unsigned int bar )
 	 * Posible fix: Do not allow the driver for mutliple openings of a device */
 	pthread_mutex_lock( &pci_handle->mmap_mutex );
 
+	/* Share an existing mapping with the same caching */
+	map = &pci_handle->bar_map[bar][mode];
+	if (map->mem != NULL) {
+		map->refs++;
+		mem = map->mem;
+		mcache.effective = map->effective;
+		pthread_mutex_unlock( &pci_handle->mmap_mutex );
+		goto mapped;
+	}
+
 	ret = ioctl( pci_handle->handle, PCIDRIVER_IOC_MMAP_MODE, PCIDRIVER_MMAP_PCI );
-	if (ret != 0)
+	if (ret != 0) {
+		pthread_mutex_unlock( &pci_handle->mmap_mutex );
 		return NULL;
+	}
 
 	ret = ioctl( pci_handle->handle, PCIDRIVER_IOC_MMAP_AREA, PCIDRIVER_BAR0+bar );
+	if (ret != 0) {
+		pthread_mutex_unlock( &pci_handle->mmap_mutex );
+		return NULL;
+	}
+
+	/* Drivers without the ioctl map with the default caching */
+	mcache.mode = mode;
+	ret = ioctl( pci_handle->handle, PCIDRIVER_IOC_MMAP_CACHE, &mcache );
 	if (ret != 0)
+		mcache.effective = PD_CACHE_DEFAULT;
+
+	mem = mmap( 0, pci_handle->bar_length[bar], PROT_WRITE | PROT_READ, MAP_SHARED, pci_handle->handle, 0 );
+
+	if ((mem == MAP_FAILED) || (mem == NULL)) {
+		pthread_mutex_unlock( &pci_handle->mmap_mutex );
 		return NULL;
+	}
 
-	mem = mmap( 0, info.bar_length[bar], PROT_WRITE | PROT_READ, MAP_SHARED, pci_handle->handle, 0 );
+	map->mem = mem;
+	map->refs = 1;
+	map->effective = mcache.effective;
 
 	pthread_mutex_unlock( &pci_handle->mmap_mutex );
 
-	if ((mem == MAP_FAILED) || (mem == NULL))
-		return NULL;
+mapped:
+	if (effective != NULL)
+		*effective = mcache.effective;
 
-	offset = info.bar_start[bar] & pd_getpagemask();
+	offset = pci_handle->bar_start[bar] & pd_getpagemask();
 
 	// adjust pointer
 	if (offset != 0) {
@@ -408,23 +537,18 @@ void *pd_mapBAR( pd_device_t *pci_handle, unsigned int bar )
 
 int pd_unmapBAR( pd_device_t *pci_handle, unsigned int bar, void *ptr )
 {
-	int ret;
-	pci_board_info info;
-	unsigned int offset;
+	unsigned int offset, mode;
 	unsigned long tmp;
+	pd_barmap_t *map;
 
 	/* Check for null pointer */
-	if (pci_handle == NULL)
+	if ((pci_handle == NULL) || (ptr == NULL))
 		return -1;
 
 	if (bar > 5)
 		return -1;
 
-	ret = ioctl( pci_handle->handle, PCIDRIVER_IOC_PCI_INFO, &info );
-	if (ret != 0)
-		return -1;
-
-	offset = info.bar_start[bar] & pd_getpagemask();
+	offset = pci_handle->bar_start[bar] & pd_getpagemask();
 
 	// adjust pointer
 	if (offset != 0) {
@@ -433,7 +557,26 @@ int pd_unmapBAR( pd_device_t *pci_handle, unsigned int bar, void *ptr )
 		ptr = (void *)(tmp);
 	}
 
-	munmap( ptr, info.bar_length[bar] );
+	pthread_mutex_lock( &pci_handle->mmap_mutex );
+
+	for (mode = 0; mode < 4; mode++) {
+		map = &pci_handle->bar_map[bar][mode];
+		if (map->mem == ptr)
+			break;
+	}
+
+	if (mode == 4) {
+		pthread_mutex_unlock( &pci_handle->mmap_mutex );
+		return -1;
+	}
+
+	/* Unmap with the last reference */
+	if (--map->refs == 0) {
+		munmap( map->mem, pci_handle->bar_length[bar] );
+		map->mem = NULL;
+	}
+
+	pthread_mutex_unlock( &pci_handle->mmap_mutex );
 
 	/* Success */
 	return 0;
@@ -485,6 +628,26 @@ unsigned int pd_readConfigDWord( pd_device_t *pci_handle, unsigned int addr )
 }
 
 
+int pd_readConfigRange( pd_device_t *pci_handle, unsigned int addr, void *buf, unsigned int len )
+{
+	int ret;
+	pci_cfg_range_t range;
+
+	/* Check for null pointer */
+	if ((pci_handle == NULL) || (buf == NULL))
+		return -1;
+
+	range.addr = addr;
+	range.size = len;
+	range.data = (unsigned long)buf;
+	ret = ioctl( pci_handle->handle, PCIDRIVER_IOC_PCI_CFG_RANGE, &range );
+	if (ret != 0)
+		return -1;
+
+	/* Bytes read */
+	return range.size;
+}
+
 int pd_writeConfigByte( pd_device_t *pci_handle, unsigned int addr, unsigned char val )
 {
 	pci_cfg_cmd cmd;
@@ -496,7 +659,8 @@ int pd_writeConfigByte( pd_device_t *pci_handle, unsigned int addr, unsigned cha
 	cmd.addr = addr;
 	cmd.size = PCIDRIVER_PCI_CFG_SZ_BYTE;
 	cmd.val.byte = val;
-	ioctl( pci_handle->handle, PCIDRIVER_IOC_PCI_CFG_WR, &cmd );
+	if (ioctl( pci_handle->handle, PCIDRIVER_IOC_PCI_CFG_WR, &cmd ) != 0)
+		return -1;
 
 	return 0;
 }
@@ -512,7 +676,8 @@ int pd_writeConfigWord( pd_device_t *pci_handle, unsigned int addr, unsigned sho
 	cmd.addr = addr;
 	cmd.size = PCIDRIVER_PCI_CFG_SZ_WORD;
 	cmd.val.word = val;
-	ioctl( pci_handle->handle, PCIDRIVER_IOC_PCI_CFG_WR, &cmd );
+	if (ioctl( pci_handle->handle, PCIDRIVER_IOC_PCI_CFG_WR, &cmd ) != 0)
+		return -1;
 
 	return 0;
 }
@@ -528,7 +693,8 @@ int pd_writeConfigDWord( pd_device_t *pci_handle, unsigned int addr, unsigned in
 	cmd.addr = addr;
 	cmd.size = PCIDRIVER_PCI_CFG_SZ_DWORD;
 	cmd.val.dword = val;
-	ioctl( pci_handle->handle, PCIDRIVER_IOC_PCI_CFG_WR, &cmd );
+	if (ioctl( pci_handle->handle, PCIDRIVER_IOC_PCI_CFG_WR, &cmd ) != 0)
+		return -1;
 
 	return 0;
 }
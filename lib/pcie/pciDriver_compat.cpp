@@ -100,14 +100,14 @@ KMem::KMem(int handle, int order) {
 }
 
 int KMem::Alloc(int handle, int order) {
-	unsigned int size;
+	unsigned long size;
 	pciDriver::PciDevice *dev;
 	unsigned int pagesize = getpagesize();
 
 	// get the pcidevice from the handle somehow
 	dev = pciDriver_compat::PciDeviceEnumerator::getInstance()->getDevice( handle );
 	
-	size = (1 << order)*pagesize;
+	size = (1UL << order)*pagesize;
 	km = &(dev->allocKernelMemory(size));
 
 	if (km != NULL)
@@ -161,7 +161,7 @@ MemoryPageList::~MemoryPageList() {
 	um = NULL;
 }
 
-MemoryPageList::MemoryPageList(int handle, unsigned int *buffer, unsigned int size) {
+MemoryPageList::MemoryPageList(int handle, unsigned int *buffer, unsigned long size) {
 
 	pagesize = getpagesize();
 	unsigned int temp;
@@ -172,7 +172,7 @@ MemoryPageList::MemoryPageList(int handle, unsigned int *buffer, unsigned int si
 	this->LockBuffer(handle,buffer,size);
 }
 
-bool MemoryPageList::LockBuffer(int handle, unsigned int *buffer, unsigned int size) {
+bool MemoryPageList::LockBuffer(int handle, unsigned int *buffer, unsigned long size) {
 
 	pciDriver::PciDevice *dev;
 
@@ -205,13 +205,13 @@ unsigned int MemoryPageList::GetNumberOfPages(void) {
 	return um->getSGcount();
 }
 
-unsigned int MemoryPageList::GetPhysicalAddress(unsigned int index) {
+unsigned long MemoryPageList::GetPhysicalAddress(unsigned int index) {
 	/*
 	 *  NOTE: This requires the driver to be compile WITHOUT 
 	 *        the MERGE_SGENTRIES flag.
 	 */
 
-	unsigned int addr = um->getSGentryAddress(index);
+	unsigned long addr = um->getSGentryAddress(index);
 	
 	if (index == 0) {
 		addr = addr >> pageshift;
@@ -221,13 +221,13 @@ unsigned int MemoryPageList::GetPhysicalAddress(unsigned int index) {
 	return addr;
 }
 
-unsigned int MemoryPageList::operator[] (unsigned int index) {
+unsigned long MemoryPageList::operator[] (unsigned int index) {
 	/*
 	 *  NOTE: This requires the driver to be compile WITHOUT 
 	 *        the MERGE_SGENTRIES flag.
 	 */
 
-	unsigned int addr = um->getSGentryAddress(index);
+	unsigned long addr = um->getSGentryAddress(index);
 	
 	if (index == 0) {
 		addr = addr >> pageshift;
@@ -244,8 +244,8 @@ unsigned int MemoryPageList::GetFirstPageOffset(void) {
 	 */
 	// FIXME: calculate page offset
 
-	unsigned int pg_addr = um->getSGentryAddress(0);
-	unsigned int pg_start = pg_addr;
+	unsigned long pg_addr = um->getSGentryAddress(0);
+	unsigned long pg_start = pg_addr;
 	pg_start = pg_start >> pageshift;
 	pg_start = pg_start << pageshift;
 	
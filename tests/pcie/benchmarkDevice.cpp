@@ -1,4 +1,5 @@
 #include "lib/pciDriver.h"
+#include "lib/AbbRegisters.h"
 #include <iostream>
 #include <iomanip>
 #include <limits>
@@ -6,9 +7,13 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cmath>
+#include <vector>
+#include <algorithm>
 #include <unistd.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <boost/timer/timer.hpp>
 
 
@@ -56,27 +61,149 @@ public:
 };
 
 
-void testDevice(int i);
+/* Payload rate the link allows, bytes per second; 0 if unknown */
+static double link_throughput = 0;
+
+/* The bitstream implements completion writeback, there is no way to detect it */
+static bool writeback = false;
+
+void testDevice(int i, int strategy, bool sweep, size_t dma_top_size);
+void testLink(pciDriver::PciDevice *dev);
+void testMRRSSweep(pciDriver::PciDevice *dev, size_t total_size);
 void testDirectIO(pciDriver::PciDevice *dev, size_t total_size);
-void testDMA(pciDriver::PciDevice *dev, size_t total_size);
+void testDirectIOKernels(pciDriver::PciDevice *dev, uint32_t *buf,
+		const size_t buf_size, const size_t test_len);
+void testDMA(pciDriver::PciDevice *dev, size_t total_size, size_t top_size);
 void testDMAKernelMemory(uint32_t *bar0, uint32_t *bar2,
 		pciDriver::KernelMemory *km, const size_t buf_size,
 		const size_t test_len);
+void testDMAPipeline(pciDriver::PciDevice *dev, size_t total_size);
+void testDMACompletion(pciDriver::PciDevice *dev, unsigned long count);
+void testDMACompletionMode(pciDriver::DmaEngine *engine,
+		pciDriver::KernelMemory *km, unsigned long count);
+void testDMAPipelineMode(pciDriver::DmaPipeline *pipe, uint8_t *buf,
+		const size_t buf_size, const size_t test_len);
+void testDMAWait(pciDriver::PciDevice *dev, unsigned long count, int strategy);
+void testDMAWaitStrategy(pciDriver::DmaEngine *engine, pciDriver::KernelMemory *km,
+		unsigned long count, pciDriver::DmaEngine::wait_strategy s);
+void testDMAQueue(pciDriver::PciDevice *dev, unsigned long count);
+double testDMAQueueProducers(pciDriver::PciDevice *dev, unsigned int nthreads,
+		unsigned long count, bool use_queue, double *batch);
+void testDMAPriority(pciDriver::PciDevice *dev, unsigned long count);
+void testDMAPriorityMode(pciDriver::PciDevice *dev, unsigned long count,
+		bool bulk_load, pciDriver::DmaQueue::priority prio);
+void testPagedWindow(pciDriver::PciDevice *dev, unsigned long count);
+void testShadowRegisters(pciDriver::PciDevice *dev, unsigned long count);
+void testHybridTransfer(pciDriver::PciDevice *dev, unsigned long count);
+void testMmioTrace(pciDriver::PciDevice *dev, unsigned long count);
+void testKernelMemoryPool(pciDriver::PciDevice *dev, unsigned long count);
+double testKernelMemoryPoolThreads(pciDriver::PciDevice *dev, unsigned int nthreads,
+		unsigned long count, pciDriver::KernelMemoryPool *pool);
+void testDmaArena(pciDriver::PciDevice *dev, unsigned long count);
+void testDmaAllocator(pciDriver::PciDevice *dev, unsigned long count);
+void testUserMemoryCache(pciDriver::PciDevice *dev, unsigned long count);
+void testPersistentKernelMemory(pciDriver::PciDevice *dev, unsigned long count);
+void testNumaKernelMemory(pciDriver::PciDevice *dev, unsigned long count);
+void testHugeKernelMemory(pciDriver::PciDevice *dev, unsigned long count);
+
+/* State of one producer thread in the submission queue test */
+struct Producer {
+	pciDriver::PciDevice *dev;
+	pciDriver::DmaQueue *queue;			// NULL: serialize on the mutex instead
+	pciDriver::DmaEngine *engine;
+	pthread_mutex_t *lock;
+	pciDriver::KernelMemory *km;
+	pciDriver::DmaQueue::request reqs[16];
+	unsigned long count;
+	unsigned long done;
+	pthread_t thread;
+};
 
 
-int main()
+void usage(const char *prog)
+{
+	std::cout << "Usage: " << prog << " [-w spin|pause|yield|irq|umwait] [-b] [-r] [-t file] [-m MB]" << std::endl;
+	std::cout << "  -w  completion wait strategy to benchmark (default: all)" << std::endl;
+	std::cout << "  -b  the bitstream implements completion writeback, benchmark it too" << std::endl;
+	std::cout << "  -r  only sweep the max read request size and report DMA throughput" << std::endl;
+	std::cout << "  -t  trace the BAR accesses of the run into file, see replayTrace" << std::endl;
+	std::cout << "  -m  largest DMA buffer of the DMA test in MB, below 4096 (default: 4)," << std::endl;
+	std::cout << "      larger ones are contiguous allocations, see kmem_max_contig in sysfs" << std::endl;
+}
+
+int main(int argc, char **argv)
 {
-	testDevice(0);
+	int opt, strategy = -1;
+	bool sweep = false;
+	const char *trace = NULL;
+	size_t dma_top_size = (4 << 20);
+	unsigned long mb;
+	unsigned int s;
+	char *end;
+
+	while ((opt = getopt(argc, argv, "w:brt:m:h")) != -1) {
+		switch (opt) {
+		case 'm':
+			/* The DMA length register is 32 bits wide */
+			mb = strtoul(optarg, &end, 10);
+			if ((*end != '\0') || (mb == 0) || (mb >= 4096)) {
+				usage(argv[0]);
+				return 1;
+			}
+			dma_top_size = mb << 20;
+			break;
+		case 'b':
+			writeback = true;
+			break;
+		case 't':
+			trace = optarg;
+			break;
+		case 'r':
+			sweep = true;
+			break;
+		case 'w':
+			for (s = 0; s < pciDriver::DmaEngine::WAIT_STRATEGIES; s++)
+				if (strcmp(optarg, pciDriver::DmaEngine::getWaitStrategyName(
+						(pciDriver::DmaEngine::wait_strategy)s)) == 0)
+					strategy = s;
+			if (strategy < 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return (opt == 'h') ? 0 : 1;
+		}
+	}
+
+	if (trace != NULL)
+		pciDriver::MmioTrace::enable();
+
+	testDevice(0, strategy, sweep, dma_top_size);
+
+	if (trace != NULL) {
+		pciDriver::MmioTrace::disable();
+		try {
+			std::cout << "\nTraced " << pciDriver::MmioTrace::dump(trace) <<
+				" BAR accesses into " << trace << std::endl;
+		} catch (pciDriver::Exception& e) {
+			std::cout << "Writing the trace failed: " << e.toString() << std::endl;
+			return 1;
+		}
+	}
 
 	return 0;
 }
 
-void testDevice(int i)
+void testDevice(int i, int strategy, bool sweep, size_t dma_top_size)
 {
 	pciDriver::PciDevice *dev;
 	//Total transfer data count for each test
 	const unsigned int dma_total_size = std::numeric_limits<unsigned int>::max();
 	const unsigned int dio_total_size = pow(10,9);
+	//Number of small transfers for completion latency test
+	const unsigned long dma_completion_count = 100000;
 
 	try {
 		std::cout << "Trying device " << i << " ... ";
@@ -86,8 +213,32 @@ void testDevice(int i)
 		// Open device
 		dev->open();
 
+		testLink(dev);
+		if (sweep) {
+			testMRRSSweep(dev, dma_total_size / 4);
+			dev->close();
+			delete dev;
+			return;
+		}
+
 		testDirectIO(dev, dio_total_size);
-		testDMA(dev, dma_total_size);
+		testDMA(dev, dma_total_size, dma_top_size);
+		testDMAPipeline(dev, dma_total_size);
+		testDMACompletion(dev, dma_completion_count);
+		testDMAWait(dev, dma_completion_count, strategy);
+		testDMAQueue(dev, dma_completion_count);
+		testDMAPriority(dev, dma_completion_count / 10);
+		testPagedWindow(dev, dma_completion_count);
+		testShadowRegisters(dev, dma_completion_count);
+		testHybridTransfer(dev, dma_completion_count / 10);
+		testMmioTrace(dev, dma_completion_count);
+		testKernelMemoryPool(dev, dma_completion_count / 10);
+		testDmaArena(dev, dma_completion_count / 10);
+		testDmaAllocator(dev, dma_completion_count / 10);
+		testUserMemoryCache(dev, dma_completion_count / 10);
+		testPersistentKernelMemory(dev, dma_completion_count / 100);
+		testNumaKernelMemory(dev, dma_completion_count / 100);
+		testHugeKernelMemory(dev, dma_completion_count / 10000);
 
 		// Close device
 		dev->close();
@@ -101,6 +252,32 @@ void testDevice(int i)
 
 }
 
+void testLink(pciDriver::PciDevice *dev)
+{
+	try {
+		pciDriver::ConfigSpace cfg(*dev);
+
+		std::cout << "\n### PCIe link ###" << std::endl;
+		if (!cfg.isExpress()) {
+			std::cout << "Not a PCIe device" << std::endl;
+			return;
+		}
+
+		std::cout << "Link: " << pciDriver::ConfigSpace::getTransferRate(cfg.getLinkSpeed()) <<
+			" GT/s x" << cfg.getLinkWidth() << " (capable of " <<
+			pciDriver::ConfigSpace::getTransferRate(cfg.getMaxLinkSpeed()) << " GT/s x" <<
+			cfg.getMaxLinkWidth() << ")" << std::endl;
+		std::cout << "Max payload: " << cfg.getMaxPayloadSize() << " bytes, max read request: " <<
+			cfg.getMaxReadRequestSize() << " bytes" << std::endl;
+
+		link_throughput = cfg.getMaxThroughput();
+		std::cout << "Theoretical throughput: " << std::fixed << std::setprecision(2) <<
+			link_throughput / pow(2, 20) << " [MB/s] per direction" << std::endl;
+	} catch(pciDriver::Exception& e) {
+		std::cout << "Exception: " << e.toString() << std::endl;
+	}
+}
+
 void testDirectIO(pciDriver::PciDevice *dev,
 		size_t total_size)
 {
@@ -155,6 +332,8 @@ void testDirectIO(pciDriver::PciDevice *dev,
 		std::cout << "Read speed: " << std::fixed <<
 			(bytes_sent/t_diff)/pow(2,20) << " [MB/s]" << std::endl;
 
+		testDirectIOKernels(dev, buf, bar2size, total_size / 10);
+
 		delete[] buf;
 		dev->unmapBAR(2,bar2);
 
@@ -163,14 +342,64 @@ void testDirectIO(pciDriver::PciDevice *dev,
 	}
 }
 
+void testDirectIOKernels(
+		pciDriver::PciDevice *dev,
+		uint32_t *buf,
+		const size_t buf_size,
+		const size_t test_len)
+{
+	using boost::timer::cpu_timer;
+	using pciDriver::BarCopy;
+
+	const unsigned int bar_no = 2;
+	cpu_timer timer;
+	double wr, rd, wr_base = 0, rd_base = 0;
+	size_t bytes_sent;
+	unsigned int k;
+
+	std::cout << "[Copy kernels, " << test_len/(1 << 20) << " MBytes each]" << std::endl;
+	std::cout << "Kernel     write [MB/s]  speedup   read [MB/s]  speedup" << std::endl;
+
+	for (k = BarCopy::KERNEL_MEMCPY; k < BarCopy::KERNELS; k++) {
+		if (!BarCopy::isSupported((BarCopy::kernel)k))
+			continue;
+		dev->setCopyKernel((BarCopy::kernel)k);
+
+		timer.start();
+		for (bytes_sent = 0; bytes_sent < test_len; bytes_sent += buf_size)
+			dev->barWrite(bar_no, 0, buf, buf_size);
+		timer.stop();
+		wr = (bytes_sent/(timer.elapsed().wall/1000000000.0))/pow(2,20);
+
+		timer.start();
+		for (bytes_sent = 0; bytes_sent < test_len; bytes_sent += buf_size)
+			dev->barRead(bar_no, 0, buf, buf_size);
+		timer.stop();
+		rd = (bytes_sent/(timer.elapsed().wall/1000000000.0))/pow(2,20);
+
+		if (k == BarCopy::KERNEL_MEMCPY) {
+			wr_base = wr;
+			rd_base = rd;
+		}
+
+		std::cout << std::left << std::setw(8) << BarCopy::getName((BarCopy::kernel)k) <<
+			std::right << std::fixed << std::setprecision(2) <<
+			std::setw(15) << wr << std::setw(8) << wr/wr_base << "x" <<
+			std::setw(14) << rd << std::setw(8) << rd/rd_base << "x" << std::endl;
+	}
+
+	dev->setCopyKernel(BarCopy::KERNEL_AUTO);
+}
+
 void testDMA(pciDriver::PciDevice *dev,
-		size_t total_size)
+		size_t total_size, size_t top_size)
 {
 	pciDriver::KernelMemory *km;
 	uint32_t *bar0, *bar2;
 	//buffer sizes for DMA transactions
 	const size_t base_size = pow(2, 10); //1KByte
-	const size_t top_size = pow(2, 22);; //4MBytes
+	//largest buffer the page allocator gives, beyond that ask for CMA
+	const size_t buddy_size = pow(2, 22); //4MBytes
 
 	try {
 		// Map BARs
@@ -184,7 +413,16 @@ void testDMA(pciDriver::PciDevice *dev,
 			const unsigned int dma_length = buffer_size/pow(2, 10);
 			std::cout << "## DMA length: " << dma_length << " KB" << std::endl;
 			// Create buffers
-			km = &dev->allocKernelMemory(buffer_size);
+			if (buffer_size <= buddy_size) {
+				km = &dev->allocKernelMemory(buffer_size);
+			} else {
+				try {
+					km = &dev->allocKernelMemory(buffer_size, pciDriver::KernelMemory::NODE_DEVICE, true);
+				} catch(pciDriver::Exception& e) {
+					std::cout << "No contiguous buffer of " << dma_length << " KB, stopping" << std::endl;
+					break;
+				}
+			}
 
 			// Test DDR SDRAM memory
 			testDMAKernelMemory(bar0, bar2, km, buffer_size, total_size);
@@ -252,7 +490,11 @@ void testDMAKernelMemory(
 	std::cout << "Write time: " << std::fixed << std::setprecision(2) <<
 		format(times, 2, "%w") << " seconds" << std::endl;
 	std::cout << "Write speed: " << std::fixed << std::setprecision(2) <<
-		(bytes_sent/t_diff)/pow(2,20) << " [MB/s]" << std::endl;
+		(bytes_sent/t_diff)/pow(2,20) << " [MB/s]";
+	if (link_throughput > 0)
+		std::cout << " (" << std::setprecision(1) <<
+			100.0 * (bytes_sent/t_diff) / link_throughput << "% of link)";
+	std::cout << std::endl;
 
 	std::cout << "[Read test]" << std::endl;
 	timer.start();
@@ -269,6 +511,1433 @@ void testDMAKernelMemory(
 	std::cout << "Read time: " << std::fixed << std::setprecision(2) <<
 		format(times, 2, "%w") << " seconds" << std::endl;
 	std::cout << "Read speed: " << std::fixed << std::setprecision(2) <<
-		(bytes_sent/t_diff)/pow(2,20) << " [MB/s]\n" << std::endl;
+		(bytes_sent/t_diff)/pow(2,20) << " [MB/s]";
+	if (link_throughput > 0)
+		std::cout << " (" << std::setprecision(1) <<
+			100.0 * (bytes_sent/t_diff) / link_throughput << "% of link)";
+	std::cout << "\n" << std::endl;
+}
+
+
+void testDMAPipeline(pciDriver::PciDevice *dev,
+		size_t total_size)
+{
+	pciDriver::DmaPipeline *pipe;
+	uint8_t *buf;
+	//host buffer moved with a single call, split by the pipeline
+	size_t buf_size = pow(2, 28); //256MBytes
+	const unsigned int bar_no = 2;
+
+	try {
+		std::cout << "\n### Starting DMA pipeline test ###" << std::endl;
+		const unsigned int size2mbyte = total_size/pow(2, 20);
+		std::cout << "Total transfer size: " << size2mbyte << " MBytes" << std::endl;
+
+		//each call covers the BAR from offset 0, do not run past its end
+		if (dev->getBARsize(bar_no) < buf_size)
+			buf_size = dev->getBARsize(bar_no);
+		std::cout << "Buffer size: " << buf_size/pow(2, 20) << " MBytes" << std::endl;
+
+		if ((buf_size == 0) || (posix_memalign((void **)&buf, getpagesize(), buf_size) != 0))
+			return;
+		memset(buf, 0, buf_size);
+
+		pipe = new pciDriver::DmaPipeline(*dev, bar_no);
+
+		for (unsigned int depth = 2; depth <= 3; depth++) {
+			pipe->setMode(pciDriver::DmaPipeline::STAGED);
+			pipe->setDepth(depth);
+			std::cout << "## Staged, chunk: " << pipe->getChunkSize()/pow(2, 10) <<
+				" KB, depth: " << depth << std::endl;
+			testDMAPipelineMode(pipe, buf, buf_size, total_size);
+		}
+
+		pipe->setMode(pciDriver::DmaPipeline::ZERO_COPY);
+		std::cout << "## Zero copy, chunk: " << pipe->getChunkSize()/pow(2, 10) <<
+			" KB" << std::endl;
+		testDMAPipelineMode(pipe, buf, buf_size, total_size);
+
+		delete pipe;
+		free(buf);
+
+	} catch(pciDriver::Exception& e) {
+		std::cout << "Exception: " << e.toString() << std::endl;
+	}
+}
+
+void testDMAPipelineMode(
+		pciDriver::DmaPipeline *pipe,
+		uint8_t *buf,
+		const size_t buf_size,
+		const size_t test_len)
+{
+	using boost::timer::cpu_timer;
+	using boost::timer::cpu_times;
+
+	cpu_timer timer;
+	cpu_times times;
+	double t_diff;
+	size_t bytes_sent;
+
+	std::cout << "[Write test]" << std::endl;
+	timer.start();
+	for(bytes_sent = 0; bytes_sent < test_len; bytes_sent += buf_size) {
+		pipe->write(0x0, buf, buf_size);
+	}
+	timer.stop();
+
+	times = timer.elapsed();
+	t_diff = times.wall/1000000000.0;
+	std::cout << "Write time: " << std::fixed << std::setprecision(2) <<
+		format(times, 2, "%w") << " seconds" << std::endl;
+	std::cout << "Write speed: " << std::fixed << std::setprecision(2) <<
+		(bytes_sent/t_diff)/pow(2,20) << " [MB/s]";
+	if (link_throughput > 0)
+		std::cout << " (" << std::setprecision(1) <<
+			100.0 * (bytes_sent/t_diff) / link_throughput << "% of link)";
+	std::cout << std::endl;
+
+	std::cout << "[Read test]" << std::endl;
+	timer.start();
+	for(bytes_sent = 0; bytes_sent < test_len; bytes_sent += buf_size) {
+		pipe->read(buf, 0x0, buf_size);
+	}
+	timer.stop();
+
+	times = timer.elapsed();
+	t_diff = times.wall/1000000000.0;
+	std::cout << "Read time: " << std::fixed << std::setprecision(2) <<
+		format(times, 2, "%w") << " seconds" << std::endl;
+	std::cout << "Read speed: " << std::fixed << std::setprecision(2) <<
+		(bytes_sent/t_diff)/pow(2,20) << " [MB/s]";
+	if (link_throughput > 0)
+		std::cout << " (" << std::setprecision(1) <<
+			100.0 * (bytes_sent/t_diff) / link_throughput << "% of link)";
+	std::cout << "\n" << std::endl;
+}
+
+void testDMACompletion(pciDriver::PciDevice *dev,
+		unsigned long count)
+{
+	pciDriver::KernelMemory *km;
+	pciDriver::DmaEngine *engine;
+	const size_t buf_size = 4096;
+
+	try {
+		std::cout << "\n### Starting DMA completion test ###" << std::endl;
+		std::cout << "Transfers: " << count << " x " << buf_size << " bytes" << std::endl;
+
+		km = &dev->allocKernelMemory(buf_size);
+		engine = new pciDriver::DmaEngine(*dev, pciDriver::DmaEngine::TO_DEVICE);
+
+		std::cout << "[BAR status polling]" << std::endl;
+		testDMACompletionMode(engine, km, count);
+
+		std::cout << "[Host memory writeback polling]" << std::endl;
+		if (writeback) {
+			engine->enableWriteback();
+			testDMACompletionMode(engine, km, count);
+		} else
+			std::cout << "Writeback not enabled, see -b, skipping" << std::endl;
+
+		delete engine;
+		delete km;
+
+	} catch(pciDriver::Exception& e) {
+		std::cout << "Exception: " << e.toString() << std::endl;
+	}
+}
+
+void testDMACompletionMode(
+		pciDriver::DmaEngine *engine,
+		pciDriver::KernelMemory *km,
+		unsigned long count)
+{
+	using boost::timer::cpu_timer;
+	using boost::timer::cpu_times;
+
+	const unsigned int bar_no = 2;
+	cpu_timer timer;
+	cpu_times times;
+	unsigned long i, polls;
+
+	polls = 0;
+	timer.start();
+	for (i = 0; i < count; i++) {
+		engine->start(km->getPhysicalAddress(), 0x0, km->getSize(), bar_no);
+		do {
+			polls++;
+		} while (!engine->poll());
+	}
+	timer.stop();
+
+	times = timer.elapsed();
+	std::cout << "Latency: " << std::fixed << std::setprecision(2) <<
+		(times.wall/1000.0)/count << " [us/transfer]" << std::endl;
+	std::cout << "CPU time: " << format(times, 2, "%u user, %s system, %p%") << std::endl;
+	std::cout << "Polls: " << std::setprecision(1) <<
+		(double)polls/count << " [per transfer]\n" << std::endl;
+}
+
+void testDMAWait(pciDriver::PciDevice *dev,
+		unsigned long count, int strategy)
+{
+	pciDriver::KernelMemory *km;
+	pciDriver::DmaEngine *engine;
+	const size_t buf_size = 4096;
+	unsigned int s;
+
+	try {
+		std::cout << "\n### Starting DMA wait strategy test ###" << std::endl;
+		std::cout << "Transfers: " << count << " x " << buf_size << " bytes" << std::endl;
+
+		km = &dev->allocKernelMemory(buf_size);
+		engine = new pciDriver::DmaEngine(*dev, pciDriver::DmaEngine::TO_DEVICE);
+
+		if (writeback)
+			engine->enableWriteback();
+
+		if (!writeback)
+			std::cout << "Writeback not enabled, see -b, umwait falls back to pause" << std::endl;
+		else if (!pciDriver::DmaEngine::hasUmwait())
+			std::cout << "CPU has no UMWAIT, umwait falls back to pause" << std::endl;
+
+		for (s = 0; s < pciDriver::DmaEngine::WAIT_STRATEGIES; s++) {
+			if ((strategy >= 0) && (s != (unsigned int)strategy))
+				continue;
+			testDMAWaitStrategy(engine, km, count, (pciDriver::DmaEngine::wait_strategy)s);
+		}
+
+		delete engine;
+		delete km;
+
+	} catch(pciDriver::Exception& e) {
+		std::cout << "Exception: " << e.toString() << std::endl;
+	}
+}
+
+void testDMAWaitStrategy(
+		pciDriver::DmaEngine *engine,
+		pciDriver::KernelMemory *km,
+		unsigned long count,
+		pciDriver::DmaEngine::wait_strategy s)
+{
+	const unsigned int bar_no = 2;
+	unsigned long i;
+	unsigned int used;
+
+	engine->setWaitStrategy(s);
+	engine->resetWaitStats();
+
+	try {
+		for (i = 0; i < count; i++)
+			engine->transfer(km->getPhysicalAddress(), 0x0, km->getSize(), bar_no);
+	} catch(pciDriver::Exception& e) {
+		std::cout << "Exception: " << e.toString() << std::endl;
+	}
+
+	/* Statistics are kept under the strategy actually used */
+	for (used = 0; used < pciDriver::DmaEngine::WAIT_STRATEGIES; used++) {
+		const pciDriver::DmaEngine::wait_stats& st =
+			engine->getWaitStats((pciDriver::DmaEngine::wait_strategy)used);
+		unsigned long n = st.waits + st.timeouts;
+
+		if (n == 0)
+			continue;
+
+		std::cout << "[" << pciDriver::DmaEngine::getWaitStrategyName(s);
+		if (used != (unsigned int)s)
+			std::cout << " -> " << pciDriver::DmaEngine::getWaitStrategyName(
+				(pciDriver::DmaEngine::wait_strategy)used);
+		std::cout << "]" << std::endl;
+		std::cout << std::fixed << std::setprecision(2);
+		std::cout << "Latency: " << (st.total_ns/1000.0)/n << " avg, " <<
+			st.max_ns/1000.0 << " max [us]" << std::endl;
+		std::cout << "CPU: " << 100.0*st.cpu_ns/(st.total_ns ? st.total_ns : 1) <<
+			"% of wait time" << std::endl;
+		std::cout << "Polls: " << std::setprecision(1) << (double)st.polls/n <<
+			" [per transfer], timeouts: " << st.timeouts << "\n" << std::endl;
+	}
+}
+
+static void producerDone(pciDriver::DmaQueue::request *req)
+{
+	__atomic_add_fetch(&static_cast<Producer *>(req->arg)->done, 1, __ATOMIC_RELEASE);
+}
+
+static void *producerThread(void *arg)
+{
+	Producer *p = static_cast<Producer *>(arg);
+	const unsigned int bar_no = 2;
+	const unsigned long inflight = sizeof(p->reqs)/sizeof(p->reqs[0]);
+	pciDriver::DmaQueue::request *req;
+	unsigned long sent;
+
+	if (p->queue == NULL) {
+		// Baseline: every transfer holds the lock across the MMIO writes and the wait
+		for (sent = 0; sent < p->count; sent++) {
+			pthread_mutex_lock(p->lock);
+			try {
+				p->engine->transfer(p->km->getPhysicalAddress(), 0x0, p->km->getSize(), bar_no);
+			} catch(pciDriver::Exception& e) {
+				pthread_mutex_unlock(p->lock);
+				std::cout << "Exception: " << e.toString() << std::endl;
+				break;
+			}
+			pthread_mutex_unlock(p->lock);
+		}
+		p->done = sent;
+		return NULL;
+	}
+
+	// Requests complete in submission order, so slot sent % inflight is
+	// free once more than sent - inflight requests are done
+	for (sent = 0; sent < p->count; sent++) {
+		while ((sent - __atomic_load_n(&p->done, __ATOMIC_ACQUIRE)) >= inflight)
+			sched_yield();
+
+		req = &p->reqs[sent % inflight];
+		req->ha = p->km->getPhysicalAddress();
+		req->pa = 0x0;
+		req->length = p->km->getSize();
+		req->callback = producerDone;
+		req->arg = p;
+		p->queue->submit(req);
+	}
+
+	while (__atomic_load_n(&p->done, __ATOMIC_ACQUIRE) < p->count)
+		sched_yield();
+
+	return NULL;
+}
+
+void testDMAQueue(pciDriver::PciDevice *dev,
+		unsigned long count)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int n, max_threads = (ncpu > 8) ? 8 : ((ncpu < 1) ? 1 : ncpu);
+	double rate_queue, rate_mutex, batch;
+
+	std::cout << "\n### Starting DMA submission queue test ###" << std::endl;
+	std::cout << "Transfers: " << count << " x 4096 bytes per test, split among producers" << std::endl;
+	std::cout << "Threads  queue [transfers/s]  avg batch  mutex [transfers/s]" << std::endl;
+
+	try {
+		for (n = 1; n <= max_threads; n++) {
+			rate_queue = testDMAQueueProducers(dev, n, count, true, &batch);
+			rate_mutex = testDMAQueueProducers(dev, n, count, false, NULL);
+
+			std::cout << std::setw(7) << n << "  " << std::fixed << std::setprecision(0) <<
+				std::setw(21) << rate_queue << "  " << std::setprecision(1) <<
+				std::setw(9) << batch << "  " << std::setprecision(0) <<
+				std::setw(19) << rate_mutex << std::endl;
+		}
+	} catch(pciDriver::Exception& e) {
+		std::cout << "Exception: " << e.toString() << std::endl;
+	}
+}
+
+double testDMAQueueProducers(
+		pciDriver::PciDevice *dev,
+		unsigned int nthreads,
+		unsigned long count,
+		bool use_queue,
+		double *batch)
+{
+	using boost::timer::cpu_timer;
+
+	pciDriver::DmaQueue *queue = NULL;
+	pciDriver::DmaEngine *engine = NULL;
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	Producer *p = new Producer[nthreads];
+	unsigned int i, started = 0;
+	cpu_timer timer;
+	double rate;
+
+	try {
+		if (use_queue)
+			queue = new pciDriver::DmaQueue(*dev, pciDriver::DmaEngine::TO_DEVICE, 2);
+		else
+			engine = new pciDriver::DmaEngine(*dev, pciDriver::DmaEngine::TO_DEVICE);
+
+		for (i = 0; i < nthreads; i++) {
+			p[i].dev = dev;
+			p[i].queue = queue;
+			p[i].engine = engine;
+			p[i].lock = &lock;
+			p[i].km = NULL;
+			p[i].count = count / nthreads;
+			p[i].done = 0;
+		}
+		for (i = 0; i < nthreads; i++)
+			p[i].km = &dev->allocKernelMemory(4096);
+
+		timer.start();
+		for (started = 0; started < nthreads; started++)
+			if (pthread_create(&p[started].thread, NULL, producerThread, &p[started]) != 0)
+				throw pciDriver::Exception(pciDriver::Exception::INTERNAL_ERROR);
+		for (i = 0; i < started; i++)
+			pthread_join(p[i].thread, NULL);
+		timer.stop();
+
+		rate = ((count / nthreads) * nthreads) / (timer.elapsed().wall / 1000000000.0);
+		if (batch != NULL)
+			*batch = (double)queue->getCompleted() / queue->getBatches();
+
+	} catch(pciDriver::Exception& e) {
+		for (i = 0; i < started; i++)
+			pthread_join(p[i].thread, NULL);
+		for (i = 0; i < nthreads; i++)
+			delete p[i].km;
+		delete queue;
+		delete engine;
+		delete [] p;
+		throw;
+	}
+
+	for (i = 0; i < nthreads; i++)
+		delete p[i].km;
+	delete queue;
+	delete engine;
+	delete [] p;
+
+	return rate;
+}
+
+/* Bulk load generator for the priority test */
+struct BulkLoad {
+	pciDriver::DmaQueue *queue;
+	pciDriver::KernelMemory *km;
+	pciDriver::DmaQueue::request reqs[2];
+	unsigned long done;
+	int stop;
+};
+
+static void bulkDone(pciDriver::DmaQueue::request *req)
+{
+	__atomic_add_fetch(&static_cast<BulkLoad *>(req->arg)->done, 1, __ATOMIC_RELEASE);
+}
+
+static void *bulkThread(void *arg)
+{
+	BulkLoad *b = static_cast<BulkLoad *>(arg);
+	pciDriver::DmaQueue::request *req;
+	unsigned long sent;
+
+	// Keep two 4 MB requests queued at all times
+	for (sent = 0; !__atomic_load_n(&b->stop, __ATOMIC_ACQUIRE); sent++) {
+		while ((sent - __atomic_load_n(&b->done, __ATOMIC_ACQUIRE)) >= 2)
+			sched_yield();
+
+		req = &b->reqs[sent % 2];
+		req->ha = b->km->getPhysicalAddress();
+		req->pa = 0x0;
+		req->length = b->km->getSize();
+		req->callback = bulkDone;
+		req->arg = b;
+		b->queue->submit(req, pciDriver::DmaQueue::BULK);
+	}
+
+	while (__atomic_load_n(&b->done, __ATOMIC_ACQUIRE) < sent)
+		sched_yield();
+
+	return NULL;
+}
+
+static void smallDone(pciDriver::DmaQueue::request *req)
+{
+	__atomic_store_n(static_cast<int *>(req->arg), 1, __ATOMIC_RELEASE);
 }
 
+void testDMAPriority(pciDriver::PciDevice *dev,
+		unsigned long count)
+{
+	std::cout << "\n### Starting DMA priority test ###" << std::endl;
+	std::cout << "Transfers: " << count << " x 256 bytes, 4 MB bulk transfers as load" << std::endl;
+	std::cout << "                     p50       p99     p99.9       max [us]" << std::endl;
+
+	try {
+		testDMAPriorityMode(dev, count, false, pciDriver::DmaQueue::HIGH);
+		testDMAPriorityMode(dev, count, true, pciDriver::DmaQueue::BULK);
+		testDMAPriorityMode(dev, count, true, pciDriver::DmaQueue::HIGH);
+	} catch(pciDriver::Exception& e) {
+		std::cout << "Exception: " << e.toString() << std::endl;
+	}
+}
+
+void testDMAPriorityMode(
+		pciDriver::PciDevice *dev,
+		unsigned long count,
+		bool bulk_load,
+		pciDriver::DmaQueue::priority prio)
+{
+	// The small transfers land behind the bulk ones in the BAR
+	const uint64_t small_pa = (4 << 20);
+	pciDriver::DmaQueue queue(*dev, pciDriver::DmaEngine::TO_DEVICE, 2);
+	pciDriver::KernelMemory *small = NULL;
+	pciDriver::DmaQueue::request req;
+	std::vector<double> lat;
+	BulkLoad bulk;
+	pthread_t thread;
+	unsigned long i;
+	volatile int done;
+	const char *name;
+
+	bulk.queue = &queue;
+	bulk.km = NULL;
+	bulk.done = 0;
+	bulk.stop = 0;
+
+	try {
+		small = &dev->allocKernelMemory(256);
+		if (bulk_load) {
+			bulk.km = &dev->allocKernelMemory(4 << 20);
+			if (pthread_create(&thread, NULL, bulkThread, &bulk) != 0)
+				throw pciDriver::Exception(pciDriver::Exception::INTERNAL_ERROR);
+		}
+	} catch(pciDriver::Exception& e) {
+		delete small;
+		delete bulk.km;
+		throw;
+	}
+
+	lat.reserve(count);
+	for (i = 0; i < count; i++) {
+		done = 0;
+		req.ha = small->getPhysicalAddress();
+		req.pa = small_pa;
+		req.length = small->getSize();
+		req.callback = smallDone;
+		req.arg = const_cast<int *>(&done);
+		queue.submit(&req, prio);
+
+		while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE))
+			;
+		lat.push_back((req.complete_ns - req.submit_ns) / 1000.0);
+
+		// Leave some room between control messages
+		usleep(20);
+	}
+
+	if (bulk_load) {
+		__atomic_store_n(&bulk.stop, 1, __ATOMIC_RELEASE);
+		pthread_join(thread, NULL);
+	}
+
+	std::sort(lat.begin(), lat.end());
+	if (!bulk_load)
+		name = "[idle]";
+	else if (prio == pciDriver::DmaQueue::HIGH)
+		name = "[bulk load, HIGH]";
+	else
+		name = "[bulk load, BULK]";
+
+	std::cout << std::left << std::setw(18) << name << std::right << std::fixed << std::setprecision(1) <<
+		std::setw(8) << lat[lat.size() / 2] <<
+		std::setw(10) << lat[(lat.size() * 99) / 100] <<
+		std::setw(10) << lat[(lat.size() * 999) / 1000] <<
+		std::setw(10) << lat.back() << std::endl;
+
+	for (i = 0; i < pciDriver::DmaQueue::PRIORITIES; i++) {
+		const pciDriver::DmaQueue::class_stats& st =
+			queue.getStats((pciDriver::DmaQueue::priority)i);
+
+		if (st.completed == 0)
+			continue;
+		std::cout << "  " << ((i == pciDriver::DmaQueue::HIGH) ? "HIGH" : "BULK") <<
+			": " << st.completed << " done, max depth " << st.max_depth <<
+			", avg " << std::setprecision(1) << (st.total_ns / 1000.0) / st.completed <<
+			" us, max " << st.max_ns / 1000.0 << " us" << std::endl;
+	}
+
+	delete small;
+	delete bulk.km;
+}
+
+void testPagedWindow(pciDriver::PciDevice *dev,
+		unsigned long count)
+{
+	using boost::timer::cpu_timer;
+
+	// Random dword accesses spread over the first pages of the DDR
+	const unsigned int n_pages = 16;
+	pciDriver::PagedWindow *win = NULL;
+	std::vector<pciDriver::PagedWindow::access> list(count);
+	std::vector<uint32_t> vals(count);
+	uint32_t *bar0, *bar2;
+	unsigned long i, page_size, page;
+	cpu_timer timer;
+	double t;
+
+	std::cout << "\n### Starting paged window test ###" << std::endl;
+	std::cout << "Accesses: " << count << " random dwords over " << n_pages << " pages" << std::endl;
+
+	try {
+		win = new pciDriver::PagedWindow(*dev, 2);
+		page_size = win->getPageSize();
+
+		srand(1);
+		for (i = 0; i < count; i++) {
+			list[i].addr = ((uint64_t)(rand() % n_pages) * page_size) +
+				((rand() % (page_size / 4)) * 4);
+			list[i].buf = &vals[i];
+			list[i].length = 4;
+			list[i].write = false;
+		}
+
+		// Page register written before every access, as in testDMA::testPaging
+		bar0 = static_cast<uint32_t *>(dev->mapBAR(0));
+		bar2 = static_cast<uint32_t *>(dev->mapBAR(2));
+		timer.start();
+		for (i = 0; i < count; i++) {
+			page = list[i].addr / page_size;
+			pciDriver::abb::SDRAM_PG::write(bar0, page);
+			vals[i] = bar2[(list[i].addr % page_size) / 4];
+		}
+		timer.stop();
+		dev->unmapBAR(2, bar2);
+		dev->unmapBAR(0, bar0);
+		t = timer.elapsed().wall / 1000.0;
+		std::cout << "[naive]    " << std::fixed << std::setprecision(1) <<
+			std::setw(10) << t / count << " us/access, " << count << " page switches" << std::endl;
+
+		win->invalidate();
+		win->resetStats();
+		timer.start();
+		for (i = 0; i < count; i++)
+			vals[i] = win->read32(list[i].addr);
+		timer.stop();
+		t = timer.elapsed().wall / 1000.0;
+		std::cout << "[shadowed] " << std::setw(10) << t / count << " us/access, " <<
+			win->getSwitches() << " page switches" << std::endl;
+
+		win->invalidate();
+		win->resetStats();
+		timer.start();
+		win->batch(&list[0], count);
+		timer.stop();
+		t = timer.elapsed().wall / 1000.0;
+		std::cout << "[batched]  " << std::setw(10) << t / count << " us/access, " <<
+			win->getSwitches() << " page switches" << std::endl;
+	} catch(pciDriver::Exception& e) {
+		std::cout << "Exception: " << e.toString() << std::endl;
+	}
+
+	delete win;
+}
+
+void testShadowRegisters(pciDriver::PciDevice *dev,
+		unsigned long count)
+{
+	using boost::timer::cpu_timer;
+	using pciDriver::abb::SDRAM_PG;
+
+	// Only the host writes the page register, the driver and the
+	// hardware leave it alone, so it may be shadowed
+	typedef pciDriver::regs::Field<SDRAM_PG, 0, 32> PAGE;
+
+	uint32_t *bar0;
+	uint32_t page;
+	unsigned long i;
+	cpu_timer timer;
+	double t;
+
+	std::cout << "\n### Starting shadow register test ###" << std::endl;
+	std::cout << "Read-modify-writes of SDRAM_PG: " << count << std::endl;
+
+	try {
+		pciDriver::ShadowRegisters sh(*dev);
+
+		// Rewrite the current value, so the BAR2 window stays where it is
+		bar0 = static_cast<uint32_t *>(dev->mapBAR(0));
+		page = PAGE::read(bar0);
+
+		timer.start();
+		for (i = 0; i < count; i++)
+			PAGE::write(bar0, page);
+		timer.stop();
+		dev->unmapBAR(0, bar0);
+		t = timer.elapsed().wall / 1000.0;
+		std::cout << "[MMIO]   " << std::fixed << std::setprecision(3) <<
+			std::setw(10) << t / count << " us/RMW" << std::endl;
+
+		sh.track<SDRAM_PG>();
+		sh.resetStats();
+		timer.start();
+		for (i = 0; i < count; i++)
+			sh.set<PAGE>(page);
+		timer.stop();
+		t = timer.elapsed().wall / 1000.0;
+		std::cout << "[shadow] " << std::setw(10) << t / count << " us/RMW, " <<
+			sh.getStats().shadow_reads << " MMIO reads avoided" << std::endl;
+
+		if (sh.setVerify(true)) {
+			sh.resetStats();
+			for (i = 0; i < count / 100; i++)
+				sh.set<PAGE>(page);
+			std::cout << "[verify] " << sh.getStats().mismatches << " mismatches in " <<
+				sh.getStats().shadow_reads << " reads" << std::endl;
+		}
+	} catch(pciDriver::Exception& e) {
+		std::cout << "Exception: " << e.toString() << std::endl;
+	}
+}
+
+void testMRRSSweep(pciDriver::PciDevice *dev,
+		size_t total_size)
+{
+	using boost::timer::cpu_timer;
+
+	const size_t buf_size = (4 << 20);
+	const unsigned int bar_no = 2;
+	pciDriver::PciDevice::transport orig, t;
+	pciDriver::KernelMemory *km = NULL;
+	pciDriver::DmaEngine *engine[2] = { NULL, NULL };
+	unsigned int mrrs, d;
+	bool changed = false;
+	size_t bytes_sent;
+	cpu_timer timer;
+	double rate[2];
+
+	std::cout << "\n### Starting MRRS sweep ###" << std::endl;
+
+	try {
+		orig = dev->getTransport();
+		std::cout << "MPS: " << orig.mps << " bytes (supported " << orig.mps_supported <<
+			", upstream port " << orig.parent_mps << ")";
+		if ((orig.parent_mps != 0) && (orig.mps != orig.parent_mps))
+			std::cout << " - differs from the upstream port";
+		std::cout << std::endl;
+		std::cout << "Relaxed ordering: " << (orig.relaxed_ordering ? "on" : "off") <<
+			", no snoop: " << (orig.no_snoop ? "on" : "off") << std::endl;
+		std::cout << "Total transfer size: " << total_size / (1 << 20) << " MBytes per setting" << std::endl;
+		std::cout << "   MRRS    write [MB/s]    read [MB/s]" << std::endl;
+
+		km = &dev->allocKernelMemory(buf_size);
+		engine[0] = new pciDriver::DmaEngine(*dev, pciDriver::DmaEngine::TO_DEVICE);
+		engine[1] = new pciDriver::DmaEngine(*dev, pciDriver::DmaEngine::FROM_DEVICE);
+
+		for (mrrs = 128; mrrs <= 4096; mrrs <<= 1) {
+			try {
+				changed = true;
+				dev->setMaxReadRequestSize(mrrs);
+			} catch(pciDriver::Exception& e) {
+				std::cout << std::setw(7) << mrrs << "    not accepted" << std::endl;
+				continue;
+			}
+			t = dev->getTransport();
+
+			// Writes to the device are reads of host memory, limited by MRRS
+			for (d = 0; d < 2; d++) {
+				timer.start();
+				for (bytes_sent = 0; bytes_sent < total_size; bytes_sent += buf_size)
+					engine[d]->transfer(km->getPhysicalAddress(), 0x0, buf_size, bar_no);
+				timer.stop();
+				rate[d] = (bytes_sent / (timer.elapsed().wall / 1e9)) / pow(2, 20);
+			}
+
+			std::cout << std::setw(7) << t.mrrs << std::fixed << std::setprecision(2) <<
+				std::setw(17) << rate[0] << std::setw(15) << rate[1] << std::endl;
+		}
+	} catch(pciDriver::Exception& e) {
+		std::cout << "Exception: " << e.toString() << std::endl;
+	}
+
+	// Leave the device as it was found, also when the sweep failed
+	if (changed) {
+		try {
+			dev->setMaxReadRequestSize(orig.mrrs);
+		} catch(pciDriver::Exception& e) {
+			std::cout << "Could not restore MRRS " << orig.mrrs << ": " << e.toString() << std::endl;
+		}
+	}
+
+	delete engine[0];
+	delete engine[1];
+	delete km;
+}
+
+void testHybridTransfer(pciDriver::PciDevice *dev,
+		unsigned long count)
+{
+	using pciDriver::HybridTransfer;
+	using pciDriver::DmaEngine;
+
+	const uint64_t max_len = (16 << 20);
+	uint32_t *buf = NULL;
+	unsigned long i;
+	uint64_t len;
+	unsigned int p, s1, s2;
+
+	std::cout << "\n### Starting hybrid transfer test ###" << std::endl;
+
+	try {
+		HybridTransfer& ht = dev->getHybridTransfer();
+
+		std::cout << "Calibrating up to " << (max_len >> 20) << " MB ..." << std::endl;
+		const HybridTransfer::thresholds& th = ht.calibrate(0x0, max_len);
+
+		std::cout << "PIO up to:        write " << th.pio_max[DmaEngine::TO_DEVICE] <<
+			" bytes, read " << th.pio_max[DmaEngine::FROM_DEVICE] << " bytes" << std::endl;
+		std::cout << "Zero-copy from:   write " << th.zero_copy_min[DmaEngine::TO_DEVICE] <<
+			" bytes, read " << th.zero_copy_min[DmaEngine::FROM_DEVICE] << " bytes" << std::endl;
+
+		// Sizes from 64 bytes to 16 MB, mostly small: the smaller of two
+		// uniform exponents, so every size occurs and the largest the least
+		buf = new uint32_t[max_len / sizeof(uint32_t)];
+		srand(1);
+		ht.resetStats();
+		for (i = 0; i < count; i++) {
+			s1 = rand() % 19;
+			s2 = rand() % 19;
+			len = 64ULL << ((s1 < s2) ? s1 : s2);
+			if (i & 1)
+				dev->read(buf, 0x0, len);
+			else
+				dev->write(0x0, buf, len);
+		}
+
+		std::cout << "Path             count        MB      MB/s" << std::endl;
+		for (p = 0; p < HybridTransfer::PATHS; p++) {
+			const HybridTransfer::path_stats& st = ht.getStats((HybridTransfer::path)p);
+
+			std::cout << std::left << std::setw(12) << HybridTransfer::getPathName((HybridTransfer::path)p) <<
+				std::right << std::setw(10) << st.count << std::fixed << std::setprecision(2) <<
+				std::setw(10) << st.bytes / pow(2, 20) << std::setw(10) <<
+				((st.ns > 0) ? (st.bytes / (st.ns / 1e9)) / pow(2, 20) : 0.0) << std::endl;
+		}
+	} catch(pciDriver::Exception& e) {
+		std::cout << "Exception: " << e.toString() << std::endl;
+	}
+
+	delete[] buf;
+}
+
+void testMmioTrace(pciDriver::PciDevice *dev, unsigned long count)
+{
+	using pciDriver::MmioTrace;
+
+	bool was_enabled = MmioTrace::isEnabled();
+	unsigned long i;
+	uint32_t v = 0;
+	double off_ns, on_ns;
+
+	std::cout << "\n### Starting MMIO trace overhead test ###" << std::endl;
+
+	// Tracing already collects this run, the extra events would only bury it
+	if (was_enabled) {
+		std::cout << "Skipped while tracing" << std::endl;
+		return;
+	}
+
+	try {
+		boost::timer::cpu_timer timer;
+
+		for (i = 0; i < count; i++)
+			dev->barWrite(2, 0x0, &v, sizeof(v));
+		off_ns = timer.elapsed().wall / (double)count;
+
+		MmioTrace::enable();
+		timer.start();
+		for (i = 0; i < count; i++)
+			dev->barWrite(2, 0x0, &v, sizeof(v));
+		on_ns = timer.elapsed().wall / (double)count;
+		MmioTrace::disable();
+		MmioTrace::clear();
+
+		std::cout << std::fixed << std::setprecision(1);
+		std::cout << "Tracing disabled: " << off_ns << " ns per write" << std::endl;
+		std::cout << "Tracing enabled:  " << on_ns << " ns per write" << std::endl;
+	} catch(pciDriver::Exception& e) {
+		MmioTrace::disable();
+		std::cout << "Exception: " << e.toString() << std::endl;
+	}
+}
+
+/* State of one thread in the buffer pool test */
+struct PoolWorker {
+	pciDriver::PciDevice *dev;
+	pciDriver::KernelMemoryPool *pool;	// NULL: allocate and free every buffer
+	unsigned long count;
+	unsigned long done;
+	pthread_t thread;
+};
+
+static void *poolThread(void *arg)
+{
+	PoolWorker *w = static_cast<PoolWorker *>(arg);
+	static const unsigned int sizes[] = { 4096, 65536, 16384, 262144 };
+	pciDriver::KernelMemory *km;
+	unsigned long i;
+
+	try {
+		for (i = 0; i < w->count; i++) {
+			unsigned int size = sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+
+			if (w->pool != NULL) {
+				pciDriver::KernelMemoryPool::Lease buf = w->pool->acquire(size);
+				static_cast<volatile uint32_t *>(buf.getBuffer())[0] = i;
+			} else {
+				km = &w->dev->allocKernelMemory(size);
+				static_cast<volatile uint32_t *>(km->getBuffer())[0] = i;
+				delete km;
+			}
+			w->done++;
+		}
+	} catch(pciDriver::Exception& e) {
+		std::cout << "Exception: " << e.toString() << std::endl;
+	}
+
+	return NULL;
+}
+
+void testKernelMemoryPool(pciDriver::PciDevice *dev,
+		unsigned long count)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int n, max_threads = (ncpu > 8) ? 8 : ((ncpu < 1) ? 1 : ncpu);
+	double rate_pool, rate_direct;
+
+	std::cout << "\n### Starting kernel memory pool test ###" << std::endl;
+	std::cout << "Buffers: " << count << " of 4-256 KB per test, split among threads" << std::endl;
+	std::cout << "Threads  pool [allocs/s]  direct [allocs/s]" << std::endl;
+
+	try {
+		for (n = 1; n <= max_threads; n *= 2) {
+			pciDriver::KernelMemoryPool pool(*dev);
+
+			rate_pool = testKernelMemoryPoolThreads(dev, n, count, &pool);
+			rate_direct = testKernelMemoryPoolThreads(dev, n, count, NULL);
+
+			std::cout << std::setw(7) << n << "  " << std::fixed << std::setprecision(0) <<
+				std::setw(18) << rate_pool << "  " << std::setw(17) << rate_direct << std::endl;
+
+			if (n == max_threads) {
+				pciDriver::KernelMemoryPool::stats st = pool.getStats();
+
+				std::cout << "Pool: " << st.local_hits << " thread cache hits, " <<
+					st.global_hits << " global hits, " << st.allocations << " allocations, " <<
+					st.trimmed << " trimmed" << std::endl;
+			}
+		}
+	} catch(pciDriver::Exception& e) {
+		std::cout << "Exception: " << e.toString() << std::endl;
+	}
+}
+
+double testKernelMemoryPoolThreads(
+		pciDriver::PciDevice *dev,
+		unsigned int nthreads,
+		unsigned long count,
+		pciDriver::KernelMemoryPool *pool)
+{
+	using boost::timer::cpu_timer;
+
+	PoolWorker *w = new PoolWorker[nthreads];
+	unsigned long done = 0;
+	unsigned int i, started;
+	cpu_timer timer;
+
+	for (i = 0; i < nthreads; i++) {
+		w[i].dev = dev;
+		w[i].pool = pool;
+		w[i].count = count / nthreads;
+		w[i].done = 0;
+	}
+
+	timer.start();
+	for (started = 0; started < nthreads; started++)
+		if (pthread_create(&w[started].thread, NULL, poolThread, &w[started]) != 0)
+			break;
+	for (i = 0; i < started; i++) {
+		pthread_join(w[i].thread, NULL);
+		done += w[i].done;
+	}
+	timer.stop();
+
+	delete [] w;
+
+	if (started < nthreads)
+		throw pciDriver::Exception(pciDriver::Exception::INTERNAL_ERROR);
+
+	return done / (timer.elapsed().wall / 1000000000.0);
+}
+
+void testDmaArena(pciDriver::PciDevice *dev,
+		unsigned long count)
+{
+	using boost::timer::cpu_timer;
+	using pciDriver::DmaArena;
+
+	const unsigned int msg_size = 256;
+	const unsigned int arena_size = (4 << 20);
+	DmaArena::block *blocks = NULL;
+	pciDriver::KernelMemory **kms = NULL;
+	unsigned long i, n = 0;
+	double rate_arena, rate_kmem;
+	cpu_timer timer;
+
+	std::cout << "\n### Starting DMA arena test ###" << std::endl;
+
+	try {
+		DmaArena arena(*dev, arena_size);
+		pciDriver::DmaEngine engine(*dev, pciDriver::DmaEngine::FROM_DEVICE);
+
+		if (count > arena_size / msg_size)
+			count = arena_size / msg_size;
+		blocks = new DmaArena::block[count];
+		kms = new pciDriver::KernelMemory*[count];
+
+		timer.start();
+		for (i = 0; i < count; i++)
+			blocks[i] = arena.alloc(msg_size);
+		timer.stop();
+		rate_arena = count / (timer.elapsed().wall / 1e9);
+
+		// Every block is a valid DMA target
+		for (i = 0; i < count; i += count / 16 + 1) {
+			engine.transfer(blocks[i].bus, 0x0, msg_size, 2);
+			arena.sync(blocks[i], pciDriver::KernelMemory::FROM_DEVICE);
+		}
+
+		for (i = 0; i < count; i++)
+			arena.free(blocks[i]);
+
+		timer.start();
+		for (n = 0; n < count; n++)
+			kms[n] = &dev->allocKernelMemory(msg_size);
+		timer.stop();
+		rate_kmem = count / (timer.elapsed().wall / 1e9);
+
+		std::cout << count << " buffers of " << msg_size << " bytes" << std::endl;
+		std::cout << std::fixed << std::setprecision(0);
+		std::cout << "DmaArena:     " << std::setw(10) << rate_arena << " allocs/s, " <<
+			(count * msg_size) / 1024 << " KB" << std::endl;
+		std::cout << "KernelMemory: " << std::setw(10) << rate_kmem << " allocs/s, " <<
+			(count * getpagesize()) / 1024 << " KB" << std::endl;
+	} catch(pciDriver::Exception& e) {
+		std::cout << "Exception: " << e.toString() << std::endl;
+	}
+
+	for (i = 0; i < n; i++)
+		delete kms[i];
+	delete [] kms;
+	delete [] blocks;
+}
+
+void testDmaAllocator(pciDriver::PciDevice *dev,
+		unsigned long count)
+{
+	using boost::timer::cpu_timer;
+	using pciDriver::DmaAllocator;
+	using pciDriver::KernelMemory;
+
+	const unsigned int words = (64 << 10);
+	const unsigned int size = words * sizeof(uint32_t);
+	KernelMemory *staging = NULL;
+	unsigned long i;
+	double rate_direct, rate_staged;
+	cpu_timer timer;
+
+	std::cout << "\n### Starting DMA allocator test ###" << std::endl;
+
+	try {
+		DmaAllocator<uint32_t> alloc(*dev);
+		std::vector<uint32_t, DmaAllocator<uint32_t> > v(alloc);
+		pciDriver::DmaEngine engine(*dev, pciDriver::DmaEngine::TO_DEVICE);
+
+		v.reserve(words);
+		for (i = 0; i < words; i++)
+			v.push_back(i);
+		staging = &dev->allocKernelMemory(size);
+
+		// The vector is the DMA source, no copy
+		timer.start();
+		for (i = 0; i < count; i++) {
+			alloc.sync(v.data(), v.size(), KernelMemory::TO_DEVICE);
+			engine.transfer(alloc.getBusAddress(v.data()), 0x0, size, 2);
+		}
+		timer.stop();
+		rate_direct = (double)count * size / (timer.elapsed().wall / 1e9);
+
+		// Copy into a KernelMemory buffer first
+		timer.start();
+		for (i = 0; i < count; i++) {
+			memcpy(staging->getBuffer(), v.data(), size);
+			staging->sync(KernelMemory::TO_DEVICE);
+			engine.transfer(staging->getPhysicalAddress(), 0x0, size, 2);
+		}
+		timer.stop();
+		rate_staged = (double)count * size / (timer.elapsed().wall / 1e9);
+
+		std::cout << count << " transfers of a " << size / 1024 << " KB vector" << std::endl;
+		std::cout << std::fixed << std::setprecision(1);
+		std::cout << "From the vector: " << std::setw(8) << rate_direct / 1e6 << " MB/s" << std::endl;
+		std::cout << "Staged:          " << std::setw(8) << rate_staged / 1e6 << " MB/s" << std::endl;
+		std::cout << "Arena in use:    " << dev->getDmaArena().getUsed() / 1024 << " of " <<
+			dev->getDmaArena().getSize() / 1024 << " KB" << std::endl;
+	} catch(pciDriver::Exception& e) {
+		std::cout << "Exception: " << e.toString() << std::endl;
+	} catch(std::bad_alloc& e) {
+		std::cout << "Arena too small for the vector" << std::endl;
+	}
+
+	delete staging;
+}
+
+void testUserMemoryCache(pciDriver::PciDevice *dev,
+		unsigned long count)
+{
+	using boost::timer::cpu_timer;
+	using pciDriver::UserMemoryCache;
+
+	const unsigned int nbufs = 4;
+	const unsigned int buf_size = (1 << 20);
+	const unsigned int msg_size = 4096;
+	void *bufs[nbufs];
+	unsigned long i;
+	unsigned int b;
+	double rate_map, rate_cache;
+	UserMemoryCache::stats st;
+	cpu_timer timer;
+
+	std::cout << "\n### Starting user memory registration cache test ###" << std::endl;
+
+	for (b = 0; b < nbufs; b++) {
+		bufs[b] = mmap(NULL, buf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (bufs[b] == MAP_FAILED) {
+			std::cout << "mmap failed" << std::endl;
+			while (b > 0)
+				munmap(bufs[--b], buf_size);
+			return;
+		}
+		memset(bufs[b], 0, buf_size);
+	}
+
+	try {
+		UserMemoryCache cache(*dev, 2 * buf_size);
+		pciDriver::DmaEngine engine(*dev, pciDriver::DmaEngine::FROM_DEVICE);
+
+		// Register every transfer
+		timer.start();
+		for (i = 0; i < count; i++) {
+			pciDriver::UserMemory& um = dev->mapUserMemory(
+				static_cast<char *>(bufs[i % nbufs]) + (i % 16) * msg_size, msg_size);
+			delete &um;
+		}
+		timer.stop();
+		rate_map = count / (timer.elapsed().wall / 1e9);
+
+		// Same messages through the cache, whole buffers first so the
+		// messages hit. Four buffers over a cap of two keep evicting.
+		for (b = 0; b < 2; b++)
+			cache.acquire(bufs[b], buf_size);
+		timer.start();
+		for (i = 0; i < count; i++) {
+			UserMemoryCache::Registration r = cache.acquire(
+				static_cast<char *>(bufs[(i / 64) % nbufs]) + (i % 16) * msg_size, msg_size);
+			if (i % 256 == 0) {
+				// Messages are page aligned, find the page in the SG list
+				unsigned long o = r.getOffset();
+				unsigned int n = 0;
+				while (o >= r.get().getSGentrySize(n))
+					o -= r.get().getSGentrySize(n++);
+				engine.transfer(r.get().getSGentryAddress(n) + o, 0x0, msg_size, 2);
+				r.get().sync(pciDriver::UserMemory::FROM_DEVICE);
+			}
+		}
+		timer.stop();
+		rate_cache = count / (timer.elapsed().wall / 1e9);
+
+		// New memory at the same addresses: the pinned pages are gone,
+		// so the cache must not hand out the old registrations
+		st = cache.getStats();
+		for (b = 0; b < nbufs; b++) {
+			munmap(bufs[b], buf_size);
+			if (mmap(bufs[b], buf_size, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+				bufs[b] = NULL;
+				continue;
+			}
+			memset(bufs[b], 0, buf_size);
+			cache.acquire(bufs[b], msg_size);
+		}
+
+		std::cout << count << " registrations of " << msg_size << " bytes" << std::endl;
+		std::cout << std::fixed << std::setprecision(0);
+		std::cout << "mapUserMemory:   " << std::setw(10) << rate_map << " regs/s" << std::endl;
+		std::cout << "UserMemoryCache: " << std::setw(10) << rate_cache << " regs/s" << std::endl;
+		std::cout << "Hits: " << st.hits << ", misses: " << st.misses << ", evictions: " <<
+			st.evictions << ", pinned: " << st.pinned_bytes / 1024 << " KB" << std::endl;
+		st = cache.getStats();
+		std::cout << "After remapping: " << st.invalidations << " invalidated, " <<
+			st.entries << " entries" << std::endl;
+	} catch(pciDriver::Exception& e) {
+		std::cout << "Exception: " << e.toString() << std::endl;
+	}
+
+	for (b = 0; b < nbufs; b++)
+		if (bufs[b] != NULL)
+			munmap(bufs[b], buf_size);
+}
+
+void testPersistentKernelMemory(pciDriver::PciDevice *dev,
+		unsigned long count)
+{
+	using boost::timer::cpu_timer;
+
+	const char *name = "benchmarkDevice";
+	const unsigned int buf_size = (4 << 20);
+	pciDriver::KernelMemory *km;
+	unsigned long i;
+	bool reused;
+	double us_alloc, us_attach;
+	cpu_timer timer;
+
+	std::cout << "\n### Starting persistent kernel memory test ###" << std::endl;
+
+	if (dev->getABIVersion() < 3) {
+		std::cout << "Driver has no named kernel memory" << std::endl;
+		return;
+	}
+
+	try {
+		// Kept by the driver from a previous run?
+		try {
+			km = &dev->attachKernelMemory(name);
+			reused = true;
+		} catch(pciDriver::Exception& e) {
+			if (e.getType() != pciDriver::Exception::INVALID_ARGUMENT)
+				throw;
+			km = &dev->allocKernelMemory(buf_size, name, true);
+			reused = false;
+		}
+		delete km;
+
+		// What every start pays without it
+		timer.start();
+		for (i = 0; i < count; i++) {
+			km = &dev->allocKernelMemory(buf_size);
+			delete km;
+		}
+		timer.stop();
+		us_alloc = timer.elapsed().wall / 1e3 / count;
+
+		timer.start();
+		for (i = 0; i < count; i++) {
+			km = &dev->attachKernelMemory(name);
+			delete km;
+		}
+		timer.stop();
+		us_attach = timer.elapsed().wall / 1e3 / count;
+
+		// Left in the driver for the next run
+		std::cout << "Buffer of " << buf_size / 1024 << " KB " <<
+			(reused ? "reused from a previous run" : "allocated") << std::endl;
+		std::cout << std::fixed << std::setprecision(1);
+		std::cout << "alloc + free:    " << std::setw(10) << us_alloc << " us" << std::endl;
+		std::cout << "attach + detach: " << std::setw(10) << us_attach << " us" << std::endl;
+	} catch(pciDriver::Exception& e) {
+		std::cout << "Exception: " << e.toString() << std::endl;
+	}
+}
+
+// CPUs of a NUMA node as listed in sysfs, e.g. "0-7,16-23"
+static bool nodeCpus(int node, cpu_set_t *set)
+{
+	char path[64], list[1024];
+	char *p;
+	unsigned long first, last;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	if ((f = fopen(path, "r")) == NULL)
+		return false;
+	p = fgets(list, sizeof(list), f);
+	fclose(f);
+	if (p == NULL)
+		return false;
+
+	CPU_ZERO(set);
+	while ((*p >= '0') && (*p <= '9')) {
+		first = last = strtoul(p, &p, 10);
+		if (*p == '-')
+			last = strtoul(p + 1, &p, 10);
+		for (; (first <= last) && (first < CPU_SETSIZE); first++)
+			CPU_SET(first, set);
+		if (*p == ',')
+			p++;
+	}
+
+	return (CPU_COUNT(set) > 0);
+}
+
+static double copyRate(void *dst, const void *src, unsigned int size, unsigned long count)
+{
+	using boost::timer::cpu_timer;
+
+	cpu_timer timer;
+	unsigned long i;
+
+	timer.start();
+	for (i = 0; i < count; i++)
+		memcpy(dst, src, size);
+	timer.stop();
+
+	return (double)size * count / (timer.elapsed().wall / 1e9) / (1 << 20);
+}
+
+void testNumaKernelMemory(pciDriver::PciDevice *dev,
+		unsigned long count)
+{
+	const unsigned int buf_size = (4 << 20);
+	pciDriver::KernelMemory *local = NULL, *remote = NULL;
+	cpu_set_t old_cpus, cpus;
+	bool pinned = false;
+	void *src;
+	int n;
+
+	std::cout << "\n### Starting NUMA kernel memory test ###" << std::endl;
+
+	if ((src = malloc(buf_size)) == NULL) {
+		std::cout << "malloc failed" << std::endl;
+		return;
+	}
+	memset(src, 0x5A, buf_size);
+
+	try {
+		local = &dev->allocKernelMemory(buf_size);
+		if (local->getNode() < 0) {
+			std::cout << "Driver does not report NUMA nodes" << std::endl;
+			delete local;
+			free(src);
+			return;
+		}
+
+		// Any other node that takes the allocation
+		for (n = 0; (n < 64) && (remote == NULL); n++) {
+			if (n == local->getNode())
+				continue;
+			try {
+				remote = &dev->allocKernelMemory(buf_size, n);
+			} catch(pciDriver::Exception& e) {
+			}
+		}
+
+		// Copy from the CPUs of the device node, where a driver thread would run
+		if ((sched_getaffinity(0, sizeof(old_cpus), &old_cpus) == 0) &&
+				nodeCpus(local->getNode(), &cpus))
+			pinned = (sched_setaffinity(0, sizeof(cpus), &cpus) == 0);
+
+		std::cout << "Device node: " << local->getNode() <<
+			(pinned ? ", running on its CPUs" : ", not pinned") << std::endl;
+		std::cout << std::fixed << std::setprecision(0);
+		std::cout << "memcpy to local node " << local->getNode() << ":  " << std::setw(8) <<
+			copyRate(local->getBuffer(), src, buf_size, count) << " MB/s" << std::endl;
+		if (remote != NULL)
+			std::cout << "memcpy to remote node " << remote->getNode() << ": " << std::setw(8) <<
+				copyRate(remote->getBuffer(), src, buf_size, count) << " MB/s" << std::endl;
+		else
+			std::cout << "No other node to compare with" << std::endl;
+	} catch(pciDriver::Exception& e) {
+		std::cout << "Exception: " << e.toString() << std::endl;
+	}
+
+	if (pinned)
+		sched_setaffinity(0, sizeof(old_cpus), &old_cpus);
+
+	delete remote;
+	delete local;
+	free(src);
+}
+
+// Sequential read of the whole buffer, in MB/s
+static double scanRate(const void *buf, uint64_t size, unsigned long count, uint64_t *sum)
+{
+	using boost::timer::cpu_timer;
+
+	const volatile uint64_t *p = static_cast<const volatile uint64_t *>(buf);
+	uint64_t i, n = size / sizeof(uint64_t);
+	unsigned long c;
+	cpu_timer timer;
+
+	timer.start();
+	for (c = 0; c < count; c++)
+		for (i = 0; i < n; i++)
+			*sum += p[i];
+	timer.stop();
+
+	return (double)size * count / (timer.elapsed().wall / 1e9) / (1 << 20);
+}
+
+// One read per 4 KB page, in an order that defeats the prefetcher, in Mreads/s
+static double strideRate(const void *buf, uint64_t size, unsigned long count, uint64_t *sum)
+{
+	using boost::timer::cpu_timer;
+
+	const volatile uint8_t *p = static_cast<const volatile uint8_t *>(buf);
+	uint64_t pages = size >> 12;
+	uint64_t i, k;
+	unsigned long c;
+	cpu_timer timer;
+
+	timer.start();
+	for (c = 0; c < count; c++)
+		for (i = 0, k = 0; i < pages; i++, k = (k + 4099) % pages)
+			*sum += p[k << 12];
+	timer.stop();
+
+	return (double)pages * count / (timer.elapsed().wall / 1e9) / 1e6;
+}
+
+void testHugeKernelMemory(pciDriver::PciDevice *dev,
+		unsigned long count)
+{
+	pciDriver::KernelMemory *km = NULL;
+	uint64_t size, sum = 0;
+	void *anon;
+
+	std::cout << "\n### Starting huge page kernel memory test ###" << std::endl;
+
+	if (count == 0)
+		count = 1;
+
+	// The largest buffer the driver gives, up to 1 GB
+	for (size = (1ULL << 30); (size >= (4 << 20)) && (km == NULL); size >>= 1) {
+		try {
+			km = &dev->allocKernelMemory(size);
+		} catch(pciDriver::Exception& e) {
+		}
+	}
+	if (km == NULL) {
+		std::cout << "No kernel buffer of 4 MB or more" << std::endl;
+		return;
+	}
+	size = km->getSize();
+
+	// The same scan over memory mapped with 4 KB pages, as before
+	anon = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (anon == MAP_FAILED) {
+		std::cout << "mmap failed" << std::endl;
+		delete km;
+		return;
+	}
+	madvise(anon, size, MADV_NOHUGEPAGE);
+	memset(anon, 1, size);
+	memset(km->getBuffer(), 1, size);
+
+	std::cout << "Buffer of " << size / (1 << 20) << " MB, mapped with " <<
+		km->getMapGranularity() / 1024 << " KB pages" << std::endl;
+	std::cout << std::fixed << std::setprecision(0);
+	std::cout << "Sequential, 4 KB pages:   " << std::setw(8) << scanRate(anon, size, count, &sum) << " MB/s" << std::endl;
+	std::cout << "Sequential, KernelMemory: " << std::setw(8) << scanRate(km->getBuffer(), size, count, &sum) << " MB/s" << std::endl;
+	std::cout << std::setprecision(1);
+	std::cout << "Page stride, 4 KB pages:   " << std::setw(8) << strideRate(anon, size, count, &sum) << " Mreads/s" << std::endl;
+	std::cout << "Page stride, KernelMemory: " << std::setw(8) << strideRate(km->getBuffer(), size, count, &sum) << " Mreads/s" << std::endl;
+
+	munmap(anon, size);
+	delete km;
+
+	if (sum == 0)
+		std::cout << "Buffers read back empty" << std::endl;
+}
@@ -0,0 +1,380 @@
+/*******************************************************************
+ * Prints an MMIO trace written by MmioTrace::dump(), or replays it
+ * against a board and compares the timing with the recording.
+ *
+ * Events of all threads are replayed in timestamp order by a single
+ * thread. Copies are replayed with zeroed data, the trace does not
+ * hold the contents. DMA channel registers are skipped unless -D is
+ * given: the recorded host addresses are stale, so with -D every
+ * descriptor is pointed at a scratch buffer, shortened to its size and
+ * waited for by polling the status register.
+ *
+ *******************************************************************/
+
+#include "lib/pciDriver.h"
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <unistd.h>
+#include <stdint.h>
+
+using pciDriver::MmioTrace;
+using pciDriver::DmaEngine;
+
+#define SCRATCH_SIZE (4 << 20)
+#define DMA_TIMEOUT_NS 1000000000ULL
+
+struct Stats {
+	unsigned long count;
+	uint64_t ns;
+};
+
+struct Replay {
+	pciDriver::PciDevice *dev;
+	volatile uint32_t *bar[6];
+	uint64_t bar_size[6];
+	pciDriver::KernelMemory *scratch;
+	uint8_t *copy_buf;
+	uint64_t copy_size;
+	bool dma;
+
+	Stats stats[MmioTrace::TYPES];
+	Stats dma_wait;
+	unsigned long skipped;
+	unsigned long outside;
+	unsigned long differing;
+	unsigned long clipped;
+	unsigned long dma_timeouts;
+};
+
+static inline uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void usage(const char *prog)
+{
+	std::cout << "Usage: " << prog << " [-p] [-d device] [-t] [-D] trace" << std::endl;
+	std::cout << "  -p  print the trace, do not replay it" << std::endl;
+	std::cout << "  -d  replay on /dev/fpgaN instead of the recorded device" << std::endl;
+	std::cout << "  -t  keep the recorded spacing of the events" << std::endl;
+	std::cout << "  -D  replay DMA descriptors into a scratch buffer" << std::endl;
+}
+
+void printTrace(const MmioTrace::event *ev, const MmioTrace::file_header& hdr)
+{
+	uint64_t i;
+
+	std::cout << hdr.events << " events from " << hdr.threads << " threads, " <<
+		hdr.dropped << " dropped" << std::endl;
+	std::cout << "      time [us] thr dev bar type           offset  w      value" << std::endl;
+
+	for (i = 0; i < hdr.events; i++) {
+		const MmioTrace::event& e = ev[i];
+
+		std::cout << std::dec << std::fixed << std::setprecision(3) << std::setw(15) <<
+			(e.ns - ev[0].ns) / 1e3 << std::setw(4) << e.thread << std::setw(4) << e.device <<
+			std::setw(4) << (unsigned int)e.bar << " " << std::left << std::setw(10) <<
+			MmioTrace::getTypeName((MmioTrace::type)e.type) << std::right << std::hex <<
+			std::setfill('0') << " 0x" << std::setw(8) << e.offset << std::setfill(' ') <<
+			std::dec << std::setw(2) << (unsigned int)e.width << " 0x" << std::hex <<
+			std::setfill('0') << std::setw(8) << e.value << std::setfill(' ') << std::dec << std::endl;
+	}
+}
+
+/* Offset of a register inside a DMA channel block of BAR0, -1 outside */
+static int channelRegister(const MmioTrace::event& e, uint32_t *base)
+{
+	static const uint32_t blocks[] = { DmaEngine::BASE_DMA_UP, DmaEngine::BASE_DMA_DOWN };
+	unsigned int b;
+
+	if (e.bar != 0)
+		return -1;
+
+	for (b = 0; b < 2; b++) {
+		if ((e.offset >= blocks[b]) && (e.offset <= blocks[b] + 4 * DmaEngine::BDA_STATUS)) {
+			*base = blocks[b];
+			return (e.offset - blocks[b]) >> 2;
+		}
+	}
+
+	return -1;
+}
+
+static bool isWritebackRegister(const MmioTrace::event& e)
+{
+	return (e.bar == 0) && (e.offset >= DmaEngine::WB_ADDR_UP) && (e.offset < DmaEngine::WB_ADDR_DOWN + 8);
+}
+
+static volatile uint32_t *getBAR(Replay& r, unsigned int bar)
+{
+	if (bar >= 6)
+		throw pciDriver::Exception(pciDriver::Exception::INVALID_BAR);
+
+	if (r.bar[bar] == NULL) {
+		r.bar[bar] = static_cast<volatile uint32_t *>(r.dev->mapBAR(bar));
+		r.bar_size[bar] = r.dev->getBARsize(bar);
+	}
+
+	return r.bar[bar];
+}
+
+/* Whether a dword access at offset stays inside the BAR, the trace may
+ * come from another board or be corrupt */
+static bool inBAR(Replay& r, unsigned int bar, uint64_t offset)
+{
+	getBAR(r, bar);
+	return (offset + sizeof(uint32_t) <= r.bar_size[bar]);
+}
+
+/**
+ *
+ * Writes a channel register with the descriptor redirected to the
+ * scratch buffer. The control write starts the transfer and waits for it.
+ *
+ */
+void replayDMAWrite(Replay& r, const MmioTrace::event& e, unsigned int reg, uint32_t base)
+{
+	volatile uint32_t *regs = getBAR(r, 0) + (base >> 2);
+	uint64_t pa = r.scratch->getPhysicalAddress();
+	uint64_t start, deadline;
+	uint32_t v = e.value, status;
+
+	switch (reg) {
+	case DmaEngine::BDA_HA_H:
+		v = pa >> 32;
+		break;
+	case DmaEngine::BDA_HA_L:
+		v = pa;
+		break;
+	case DmaEngine::BDA_NEXT_H:
+	case DmaEngine::BDA_NEXT_L:
+		v = 0;
+		break;
+	case DmaEngine::BDA_LENGTH:
+		if (v > SCRATCH_SIZE) {
+			v = SCRATCH_SIZE;
+			r.clipped++;
+		}
+		break;
+	case DmaEngine::BDA_CONTROL:
+		if ((v & DmaEngine::CTRL_RESET) != DmaEngine::CTRL_RESET)
+			v |= DmaEngine::CTRL_LAST;
+		break;
+	}
+
+	regs[reg] = v;
+
+	if ((reg != DmaEngine::BDA_CONTROL) || ((v & DmaEngine::CTRL_RESET) == DmaEngine::CTRL_RESET))
+		return;
+
+	start = now_ns();
+	deadline = start + DMA_TIMEOUT_NS;
+	do {
+		status = regs[DmaEngine::BDA_STATUS];
+	} while (!(status & (DmaEngine::STAT_DONE | DmaEngine::STAT_TIMEOUT)) && (now_ns() < deadline));
+
+	if (!(status & DmaEngine::STAT_DONE))
+		r.dma_timeouts++;
+
+	r.dma_wait.count++;
+	r.dma_wait.ns += now_ns() - start;
+}
+
+/**
+ *
+ * Replays one event.
+ *
+ * @returns false if the event was skipped
+ *
+ */
+bool replayEvent(Replay& r, const MmioTrace::event& e)
+{
+	uint32_t base;
+	int reg;
+
+	if (isWritebackRegister(e))
+		return false;
+
+	if (((e.type == MmioTrace::READ) || (e.type == MmioTrace::WRITE)) && !inBAR(r, e.bar, e.offset)) {
+		r.outside++;
+		return false;
+	}
+
+	reg = channelRegister(e, &base);
+	if (reg >= 0) {
+		if (!r.dma || (e.type != MmioTrace::WRITE) ||
+				!inBAR(r, 0, base + 4 * DmaEngine::BDA_STATUS))
+			return false;
+		replayDMAWrite(r, e, reg, base);
+		return true;
+	}
+
+	switch (e.type) {
+	case MmioTrace::READ:
+		if (getBAR(r, e.bar)[e.offset >> 2] != (uint32_t)e.value)
+			r.differing++;
+		return true;
+	case MmioTrace::WRITE:
+		getBAR(r, e.bar)[e.offset >> 2] = e.value;
+		return true;
+	case MmioTrace::COPY_TO:
+	case MmioTrace::COPY_FROM:
+		if (e.value > r.copy_size) {
+			free(r.copy_buf);
+			r.copy_size = e.value;
+			r.copy_buf = static_cast<uint8_t *>(calloc(1, r.copy_size));
+			if (r.copy_buf == NULL)
+				throw pciDriver::Exception(pciDriver::Exception::ALLOC_FAILED);
+		}
+		if (e.type == MmioTrace::COPY_TO)
+			r.dev->barWrite(e.bar, e.offset, r.copy_buf, e.value);
+		else
+			r.dev->barRead(e.bar, e.offset, r.copy_buf, e.value);
+		return true;
+	default:
+		/* Markers */
+		return false;
+	}
+}
+
+void replayTrace(const MmioTrace::event *ev, const MmioTrace::file_header& hdr,
+		int device, bool timed, bool dma)
+{
+	Replay r;
+	uint64_t i, start, t, target, late = 0;
+	unsigned int b, n;
+
+	memset(&r, 0, sizeof(r));
+	r.dma = dma;
+
+	if (hdr.events == 0) {
+		std::cout << "Empty trace" << std::endl;
+		return;
+	}
+
+	if (device < 0)
+		device = ev[0].device;
+
+	std::cout << "Replaying " << hdr.events << " events on device " << device <<
+		(timed ? ", timed" : "") << (dma ? ", with DMA" : "") << std::endl;
+	if (hdr.dropped > 0)
+		std::cout << "Warning: " << hdr.dropped << " events were dropped while recording" << std::endl;
+
+	try {
+		r.dev = new pciDriver::PciDevice(device);
+		r.dev->open();
+		if (dma)
+			r.scratch = &r.dev->allocKernelMemory(SCRATCH_SIZE);
+
+		start = now_ns();
+		for (i = 0; i < hdr.events; i++) {
+			if (timed) {
+				target = start + (ev[i].ns - ev[0].ns);
+				while ((t = now_ns()) < target)
+					;
+				if (t - target > late)
+					late = t - target;
+			}
+
+			t = now_ns();
+			if (!replayEvent(r, ev[i])) {
+				r.skipped++;
+				continue;
+			}
+			r.stats[ev[i].type].count++;
+			r.stats[ev[i].type].ns += now_ns() - t;
+		}
+		t = now_ns() - start;
+
+		std::cout << "Recorded:  " << std::fixed << std::setprecision(1) <<
+			(ev[hdr.events - 1].ns - ev[0].ns) / 1e3 << " us" << std::endl;
+		std::cout << "Replayed:  " << t / 1e3 << " us" << std::endl;
+		if (timed)
+			std::cout << "Max delay: " << late / 1e3 << " us" << std::endl;
+		std::cout << "Skipped:   " << r.skipped << " events, " << r.outside <<
+			" outside the BAR" << std::endl;
+		std::cout << "Reads that differ from the trace: " << r.differing << std::endl;
+
+		std::cout << "Type          count   ns/event" << std::endl;
+		for (n = 0; n < MmioTrace::TYPES; n++) {
+			if (r.stats[n].count == 0)
+				continue;
+			std::cout << std::left << std::setw(10) << MmioTrace::getTypeName((MmioTrace::type)n) <<
+				std::right << std::setw(10) << r.stats[n].count << std::setw(11) <<
+				(double)r.stats[n].ns / r.stats[n].count << std::endl;
+		}
+		if (r.dma_wait.count > 0) {
+			std::cout << "DMA transfers: " << r.dma_wait.count << ", mean completion " <<
+				(double)r.dma_wait.ns / r.dma_wait.count / 1e3 << " us, " <<
+				r.dma_timeouts << " timeouts, " << r.clipped << " shortened" << std::endl;
+		}
+	} catch (pciDriver::Exception& e) {
+		std::cout << "Exception: " << e.toString() << std::endl;
+	}
+
+	if (r.dev != NULL) {
+		delete r.scratch;
+		for (b = 0; b < 6; b++)
+			if (r.bar[b] != NULL)
+				r.dev->unmapBAR(b, const_cast<uint32_t *>(r.bar[b]));
+		r.dev->close();
+		delete r.dev;
+	}
+	free(r.copy_buf);
+}
+
+int main(int argc, char **argv)
+{
+	MmioTrace::file_header hdr;
+	MmioTrace::event *ev;
+	int opt, device = -1;
+	bool print = false, timed = false, dma = false;
+
+	while ((opt = getopt(argc, argv, "pd:tDh")) != -1) {
+		switch (opt) {
+		case 'p':
+			print = true;
+			break;
+		case 'd':
+			device = atoi(optarg);
+			break;
+		case 't':
+			timed = true;
+			break;
+		case 'D':
+			dma = true;
+			break;
+		default:
+			usage(argv[0]);
+			return (opt == 'h') ? 0 : 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	try {
+		ev = MmioTrace::load(argv[optind], &hdr);
+	} catch (pciDriver::Exception& e) {
+		std::cout << "Cannot read " << argv[optind] << ": " << e.toString() << std::endl;
+		return 1;
+	}
+
+	if (print)
+		printTrace(ev, hdr);
+	else
+		replayTrace(ev, hdr, device, timed, dma);
+
+	free(ev);
+
+	return 0;
+}
@@ -141,7 +141,7 @@ void testKernelMemory(pd_device_t *dev)
 			printf("failed\n");
 			break;
 		}
-		printf("created ( %08x - %08x ) ", km.pa, km.size ); 
+		printf("created ( %08llx - %08llx ) ", (unsigned long long)km.pa, (unsigned long long)km.size ); 
 
 		ret = pd_freeKernelMemory( &km );
 		if (ret < 0) {
@@ -200,7 +200,7 @@ void testUserMemory(pd_device_t *dev)
 	printf("   SG entries: %d\n", um.nents );
 		
 	for(i=0;i<um.nents;i++) {
-		printf("%d: %08x - %08x\n", i, um.sg[i].addr, um.sg[i].size);
+		printf("%d: %08llx - %08llx\n", i, (unsigned long long)um.sg[i].addr, (unsigned long long)um.sg[i].size);
 	}
 
 	ret = pd_unmapUserMemory( &um );
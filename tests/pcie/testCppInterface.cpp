@@ -26,6 +26,10 @@
 #include <iostream>
 #include <iomanip>
 #include <cstdlib>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdint.h>
 
 using namespace pciDriver;
 using namespace std;
@@ -33,12 +37,15 @@ using namespace std;
 #define MAX_KBUF (8*1024*1024)
 //#define MAX_KBUF (8*1024)
 #define MAX_UBUF (64*1024*1024)
+#define LARGE_UBUF (16ULL*1024*1024*1024)
 
 void testDevice( int i );
 void testPCIconfig(pciDriver::PciDevice *dev);
 void testPCImmap(pciDriver::PciDevice *dev);
 void testKernelMemory(pciDriver::PciDevice *dev);
 void testUserMemory(pciDriver::PciDevice *dev);
+void testLargeUserMemory(pciDriver::PciDevice *dev);
+void testSharedKernelMemory(pciDriver::PciDevice *dev);
 
 int main() 
 {
@@ -67,6 +74,8 @@ void testDevice( int i ) {
 	testPCImmap(device);
 	testKernelMemory(device);
 	testUserMemory(device);
+	testLargeUserMemory(device);
+	testSharedKernelMemory(device);
 
 /*
 		testMmapMode(handle);
@@ -290,3 +299,127 @@ void testUserMemory(pciDriver::PciDevice *dev)
 	
 	dev->close();
 }
+
+/* One registration beyond 4 GB, needs ABI version 2 and the RAM to pin it */
+void testLargeUserMemory(pciDriver::PciDevice *dev)
+{
+	UserMemory *um;
+	void *mem;
+	uint64_t total = 0, highest = 0, avail;
+	unsigned int i, above = 0;
+
+	dev->open();
+
+	cout << "### Testing large UMEM ###" << endl;
+	cout << " Driver ABI version " << dev->getABIVersion() << endl;
+
+	/* MAP_NORESERVE always succeeds, pinning would then push the host into
+	 * swap or the OOM killer. Leave a quarter of the buffer to spare. */
+	avail = (uint64_t)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+	if (avail < LARGE_UBUF + LARGE_UBUF / 4) {
+		cout << " skipped: " << (avail >> 30) << " GB of free memory, need " <<
+			((LARGE_UBUF + LARGE_UBUF / 4) >> 30) << " GB" << endl;
+		dev->close();
+		return;
+	}
+
+	mem = mmap(NULL, LARGE_UBUF, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED) {
+		cout << " skipped: cannot reserve " << (LARGE_UBUF >> 30) << " GB" << endl;
+		dev->close();
+		return;
+	}
+
+	try {
+		cout << " " << (LARGE_UBUF >> 30) << " GB: ";
+		um = &(dev->mapUserMemory(mem, LARGE_UBUF));
+
+		for (i = 0; i < um->getSGcount(); i++) {
+			total += um->getSGentrySize(i);
+			if (um->getSGentryAddress(i) + um->getSGentrySize(i) > highest)
+				highest = um->getSGentryAddress(i) + um->getSGentrySize(i);
+			if (um->getSGentryAddress(i) + um->getSGentrySize(i) > 0x100000000ULL)
+				above++;
+		}
+
+		cout << "mapped ( " << um->getSGcount() << " entries, " << above <<
+			" above 4 GB, highest 0x" << hex << highest - 1 << dec << " ) ";
+		if ((um->getSize() == LARGE_UBUF) && (total == LARGE_UBUF))
+			cout << "SizeTest-passed ";
+		else
+			cout << "SizeTest-failed(" << total << ") ";
+
+		delete um;
+		cout << "unmapped" << endl;
+	} catch (Exception& e) {
+		cout << "failed: " << e.toString() << endl;
+	}
+
+	munmap(mem, LARGE_UBUF);
+
+	dev->close();
+}
+
+void testSharedKernelMemory(pciDriver::PciDevice *dev)
+{
+	const unsigned int size = (1 << 20);
+	KernelMemory *km;
+	unsigned int *buf;
+	unsigned int i;
+	uint64_t key;
+	pid_t pid;
+	int status;
+
+	dev->open();
+
+	cout << "### Testing shared KMEM ###" << endl;
+	if (dev->getABIVersion() < 4) {
+		cout << "not supported by the driver" << endl;
+		dev->close();
+		return;
+	}
+
+	try {
+		km = &(dev->allocKernelMemory(size));
+		buf = static_cast<unsigned int *>(km->getBuffer());
+		for(i=0; i< (size >> 2); i++)
+			buf[i] = ~i;
+		key = km->exportHandle();
+		cout << "exported ( " << hex << km->getPhysicalAddress() << dec << " ) ";
+
+		pid = fork();
+		if (pid == 0) {
+			// Another process maps the same pages and answers in the last word
+			unsigned int err = 0;
+			try {
+				pciDriver::PciDevice other(dev->getNumber());
+				other.open();
+				KernelMemory& imp = KernelMemory::importHandle(other, key);
+				unsigned int *ibuf = static_cast<unsigned int *>(imp.getBuffer());
+				for(i=0; i< (size >> 2) - 1; i++)
+					if (ibuf[i] != ~i) err++;
+				ibuf[(size >> 2) - 1] = err;
+				delete &imp;
+				other.close();
+			} catch (Exception& e) {
+				err = 1;
+			}
+			_exit(err == 0 ? 0 : 1);
+		}
+
+		if ((pid < 0) || (waitpid(pid, &status, 0) != pid) || !WIFEXITED(status))
+			cout << "fork failed ";
+		else if ((WEXITSTATUS(status) != 0) || (buf[(size >> 2) - 1] != 0))
+			cout << "ShareTest-failed ";
+		else
+			cout << "ShareTest-passed ";
+
+		delete km;
+		cout << "deleted" << endl;
+	} catch (Exception& e) {
+		cout << "failed: " << e.toString() << endl;
+	}
+
+	dev->close();
+}
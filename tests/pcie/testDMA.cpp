@@ -28,6 +28,7 @@
  *******************************************************************/
 
 #include "lib/pciDriver.h"
+#include "lib/AbbRegisters.h"
 #include <iostream>
 #include <iomanip>
 #include <cstring>
@@ -46,11 +47,6 @@ using namespace std;
 #define KBUF_SIZE (4096)
 #define UBUF_SIZE (4096)
 
-#define REG_SDRAM_PG 0x1C
-#define REG_GSR 0x20
-#define GSR_BIT_DDR_RDY (0x1 << 7)
-#define REG_WB_PG 0x24
-
 void testDevice( int i );
 void testBARs(pciDriver::PciDevice *dev);
 void testDirectIO(pciDriver::PciDevice *dev);
@@ -268,7 +264,7 @@ void testPaging(pciDriver::PciDevice *dev)
 		cout << "### Testing paging on DDR SDRAM space ###" << endl;
 		cout << "# Writing to first " << N_PAGES << " pages" << endl;
 		for (int i = 0; i < N_PAGES; i++) {
-			bar0[REG_SDRAM_PG>>2] = i;
+			abb::SDRAM_PG::write(bar0, i);
 			for (int addr = 0; addr < N_WORDS; addr++) {
 				val = rand();
 				word_table[i][addr] = val;
@@ -279,7 +275,7 @@ void testPaging(pciDriver::PciDevice *dev)
 		cout << "# Reading from first " << N_PAGES << " pages" << endl;
 		bool err = false;
 		for (int i = 0; i < N_PAGES; i++) {
-			bar0[REG_SDRAM_PG>>2] = i;
+			abb::SDRAM_PG::write(bar0, i);
 			for (int addr = 0; addr < N_WORDS; addr++) {
 				val = bar2[addr];
 				if (val != word_table[i][addr]) {
@@ -399,11 +395,11 @@ void testDMAKernelMemory(
 
 	if (bar2 != 0) {
 		bar_no = 0x2;
-		bar0[REG_SDRAM_PG>>2] = 0;
+		abb::SDRAM_PG::write(bar0, 0);
 	}
 	else if (bar4 != 0) {
 		bar_no = 0x4;
-		bar0[REG_WB_PG >> 2] = 0;
+		abb::WB_PG::write(bar0, 0);
 	}
 
 	cout << "# Test DMA downstream" << endl;
@@ -715,7 +711,7 @@ void testDMA(pciDriver::PciDevice *dev)
 		cout << "BAR2 address: " << hex << setw(8) << bar2 << endl;
 		cout << "BAR4 address: " << hex << setw(8) << bar4 << endl;
 
-		if (bar0[REG_GSR >> 2] & GSR_BIT_DDR_RDY) {
+		if (abb::GSR::DDR_RDY::read(bar0)) {
 			cout << "## Testing DDR memory DMA" << endl;
 			testDMAKernelMemory(bar0, bar2, 0, km, BRAM_SIZE);
 		}
@@ -249,7 +249,7 @@ void testUmap(int handle) {
 		
 	printf("  Scatter/Gather list of the bigbuffer:\n");
 	for(i=0;i<sgl.nents;i++) {
-		printf("  %d: %lx - %lx\n",i, sgl.sg[i].addr, sgl.sg[i].size );
+		printf("  %d: %llx - %llx\n",i, (unsigned long long)sgl.sg[i].addr, (unsigned long long)sgl.sg[i].size );
 	}
 	
 	printf(" Testing PCIDRIVER_IOC_UMEM_SYNC ...");
@@ -0,0 +1,232 @@
+#!/usr/bin/env python3
+#
+# Generates a C++ register map header for Register.h from a text
+# description of the registers of a bitstream.
+#
+# Usage: regmap_gen.py <description> <namespace> <output header>
+#
+# See abb.regs for the description format.
+
+import re
+import sys
+
+
+class Error(Exception):
+	pass
+
+
+def number(s, lineno):
+	try:
+		return int(s, 0)
+	except ValueError:
+		raise Error("line %d: bad number '%s'" % (lineno, s))
+
+
+def ident(s, lineno):
+	if not re.match(r'^[A-Za-z_][A-Za-z0-9_]*$', s):
+		raise Error("line %d: bad name '%s'" % (lineno, s))
+	return s
+
+
+def access(words, i, lineno):
+	if i < len(words) and words[i] in ('RO', 'WO', 'RW'):
+		return words[i], i + 1
+	return 'RW', i
+
+
+class Reg:
+	def __init__(self, name, offset, acc, desc):
+		self.name = name
+		self.offset = offset
+		self.access = acc
+		self.desc = desc
+		self.fields = []
+
+
+class Layout:
+	def __init__(self, name, desc):
+		self.name = name
+		self.desc = desc
+		self.regs = []
+		self.spans = []
+
+
+def parse(path):
+	items = []			# top-level registers, consts and blocks in order
+	layouts = {}
+	layout = None
+	reg = None
+
+	for lineno, line in enumerate(open(path), 1):
+		line = line.split('#', 1)[0].strip()
+		if not line:
+			continue
+		words = line.split()
+		kw = words[0]
+
+		if kw == 'register':
+			if len(words) < 3:
+				raise Error("line %d: register NAME OFFSET [ACCESS] [description]" % lineno)
+			acc, i = access(words, 3, lineno)
+			reg = Reg(ident(words[1], lineno), number(words[2], lineno), acc, ' '.join(words[i:]))
+			if reg.offset & 3:
+				raise Error("line %d: register %s is not dword aligned" % (lineno, reg.name))
+			if layout is not None:
+				layout.regs.append(reg)
+			else:
+				items.append(('register', reg))
+
+		elif kw == 'field':
+			if reg is None or len(words) < 4:
+				raise Error("line %d: field NAME LSB WIDTH [description] after a register" % lineno)
+			lsb = number(words[2], lineno)
+			width = number(words[3], lineno)
+			if width < 1 or lsb + width > 32:
+				raise Error("line %d: field %s does not fit in 32 bits" % (lineno, words[1]))
+			reg.fields.append((ident(words[1], lineno), lsb, width, ' '.join(words[4:])))
+
+		elif kw == 'layout':
+			if layout is not None:
+				raise Error("line %d: layouts do not nest" % lineno)
+			layout = Layout(ident(words[1], lineno), ' '.join(words[2:]))
+			layouts[layout.name] = layout
+			reg = None
+
+		elif kw == 'span':
+			if layout is None or len(words) != 4:
+				raise Error("line %d: span NAME FIRST LAST inside a layout" % lineno)
+			names = [r.name for r in layout.regs]
+			if words[2] not in names or words[3] not in names:
+				raise Error("line %d: span %s names an unknown register" % (lineno, words[1]))
+			first = layout.regs[names.index(words[2])]
+			last = layout.regs[names.index(words[3])]
+			count = (last.offset - first.offset) // 4 + 1
+			if count < 1 or len([r for r in layout.regs
+					if first.offset <= r.offset <= last.offset]) != count:
+				raise Error("line %d: span %s is not a run of adjacent registers" % (lineno, words[1]))
+			layout.spans.append((ident(words[1], lineno), first.offset, count))
+
+		elif kw == 'end':
+			if layout is None:
+				raise Error("line %d: end without layout" % lineno)
+			layout = None
+			reg = None
+
+		elif kw == 'block':
+			if len(words) < 4 or words[3] not in layouts:
+				raise Error("line %d: block NAME OFFSET LAYOUT [description]" % lineno)
+			items.append(('block', (ident(words[1], lineno), number(words[2], lineno),
+				words[3], ' '.join(words[4:]))))
+			reg = None
+
+		elif kw == 'const':
+			if len(words) < 3:
+				raise Error("line %d: const NAME VALUE [description]" % lineno)
+			items.append(('const', (ident(words[1], lineno), number(words[2], lineno),
+				' '.join(words[3:]))))
+			reg = None
+
+		else:
+			raise Error("line %d: unknown keyword '%s'" % (lineno, kw))
+
+	if layout is not None:
+		raise Error("layout %s is not closed" % layout.name)
+
+	return items, layouts
+
+
+def comment(desc, indent):
+	return ['%s/* %s */' % (indent, desc)] if desc else []
+
+
+def emit_reg(reg, offset, indent):
+	out = comment(reg.desc, indent)
+	base = 'regs::Register<%s, regs::%s>' % (offset, reg.access)
+	if not reg.fields:
+		out.append('%stypedef %s %s;' % (indent, base, reg.name))
+		return out
+	out.append('%sstruct %s : %s {' % (indent, reg.name, base))
+	for name, lsb, width, desc in reg.fields:
+		line = '%s\ttypedef regs::Field<%s, %d, %d> %s;' % (indent, reg.name, lsb, width, name)
+		if desc:
+			line += '\t/* %s */' % desc
+		out.append(line)
+	out.append('%s};' % indent)
+	return out
+
+
+def generate(items, layouts, namespace, source, guard):
+	out = [
+		'#ifndef %s' % guard,
+		'#define %s' % guard,
+		'',
+		'/* Generated by tools/regmap/regmap_gen.py from %s, do not edit. */' % source,
+		'',
+		'#include "Register.h"',
+		'',
+		'namespace pciDriver {',
+		'',
+		'namespace %s {' % namespace,
+		'',
+	]
+
+	for layout in layouts.values():
+		out += comment(layout.desc, '')
+		out.append('template <uint32_t Base>')
+		out.append('struct %s {' % layout.name)
+		for reg in layout.regs:
+			out += emit_reg(reg, 'Base + 0x%02X' % reg.offset, '\t')
+		for name, first, count in layout.spans:
+			out.append('\ttypedef regs::RegisterBlock<Base + 0x%02X, %d> %s;' % (first, count, name))
+		out.append('};')
+		out.append('')
+
+	for n, (kind, item) in enumerate(items):
+		# Keep registers without a description next to the one before
+		if n > 0 and not (kind == 'register' and not item.desc and not item.fields):
+			out.append('')
+		if kind == 'register':
+			out += emit_reg(item, '0x%04X' % item.offset, '')
+		elif kind == 'block':
+			name, offset, layout, desc = item
+			out += comment(desc, '')
+			out.append('typedef %s<0x%04X> %s;' % (layout, offset, name))
+		elif kind == 'const':
+			name, value, desc = item
+			out += comment(desc, '')
+			out.append('static const uint32_t %s = 0x%X;' % (name, value))
+
+	out += [
+		'',
+		'}',
+		'',
+		'}',
+		'',
+		'#endif /*%s*/' % guard,
+		'',
+	]
+	return '\n'.join(out)
+
+
+def main():
+	if len(sys.argv) != 4:
+		sys.stderr.write("usage: %s <description> <namespace> <output header>\n" % sys.argv[0])
+		return 1
+
+	source, namespace, output = sys.argv[1:]
+	guard = 'PD_' + re.sub(r'[^A-Za-z0-9]', '_', output.split('/')[-1]).upper() + '_'
+
+	try:
+		items, layouts = parse(source)
+	except (Error, IOError) as e:
+		sys.stderr.write("%s: %s\n" % (source, e))
+		return 1
+
+	with open(output, 'w') as f:
+		f.write(generate(items, layouts, ident(namespace, 0), source.split('/')[-1], guard))
+
+	return 0
+
+
+if __name__ == '__main__':
+	sys.exit(main())